@@ -0,0 +1,251 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Input to display latency benchmark.
+
+   Each round clears the input, types an expression character by character,
+   evaluates it by typing '=' and switches the layout forth and back. The
+   characters are injected as keyboard events into the application input
+   handler, i.e. they take the same path as the events from the backend.
+
+   An event is injected from a timer callback, the latency is the time until
+   the callback runs again, which happens once the main loop handled the
+   event and redrew the widgets, minus the timer period. Redraws shorter than
+   the period are not resolved, the sample is then the time spent in the
+   event handler.
+
+   Evaluations are finished when the result is shown, i.e. the latency
+   includes the time spent in the worker thread.
+
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <widgets/gp_widgets.h>
+
+#include "bench.h"
+
+/* the main loop gets back to the timer after the redraw */
+#define BENCH_TICK_MS 1
+
+/* typed character by character */
+static const char *const exprs[] = {
+	"sin(pi/4)*2+sqrt(3)",
+	"(1+2)*(3+4)/5-6^2",
+	"pow(2,0.5)+ln(1E3)-cbrt(27)",
+	"if(atan2(1,2)<1,7.5,0)",
+	NULL
+};
+
+enum bench_kind {
+	BENCH_TYPING,
+	BENCH_EVAL,
+	BENCH_LAYOUT,
+	BENCH_CNT,
+};
+
+static const char *const kind_names[BENCH_CNT] = {
+	[BENCH_TYPING] = "typing",
+	[BENCH_EVAL] = "evaluation",
+	[BENCH_LAYOUT] = "layout switch",
+};
+
+struct samples {
+	double *ms;
+	size_t cnt;
+	size_t size;
+};
+
+static struct bench {
+	const struct bench_ops *ops;
+	unsigned int rounds;
+	unsigned int round;
+	unsigned int expr;
+	/* position in the expression, past its end evaluation and layout */
+	size_t pos;
+	gp_event ev;
+	/* the event being measured, when it was injected and handled */
+	int kind;
+	double start;
+	double handled;
+	struct samples samples[BENCH_CNT];
+} bench = {
+	.kind = -1,
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void sample_add(struct samples *self, double ms)
+{
+	if (self->cnt >= self->size) {
+		size_t size = self->size ? 2 * self->size : 1024;
+		double *tmp = realloc(self->ms, size * sizeof(double));
+
+		if (!tmp)
+			return;
+
+		self->ms = tmp;
+		self->size = size;
+	}
+
+	self->ms[self->cnt++] = ms;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double*)a, db = *(const double*)b;
+
+	return (da > db) - (da < db);
+}
+
+static double percentile(const struct samples *self, unsigned int p)
+{
+	size_t i = self->cnt * p / 100;
+
+	return self->ms[i < self->cnt ? i : self->cnt - 1];
+}
+
+static void report(void)
+{
+	unsigned int i;
+
+	printf("%-14s %8s %10s %10s %10s\n", "event", "count", "p50", "p99", "max");
+
+	for (i = 0; i < BENCH_CNT; i++) {
+		struct samples *s = &bench.samples[i];
+
+		if (!s->cnt)
+			continue;
+
+		qsort(s->ms, s->cnt, sizeof(double), cmp_double);
+
+		printf("%-14s %8zu %8.3fms %8.3fms %8.3fms\n", kind_names[i],
+		       s->cnt, percentile(s, 50), percentile(s, 99),
+		       s->ms[s->cnt - 1]);
+
+		free(s->ms);
+	}
+}
+
+static void type_chr(char c)
+{
+	memset(&bench.ev, 0, sizeof(bench.ev));
+	bench.ev.type = GP_EV_UTF;
+	bench.ev.utf.ch = c;
+
+	bench.ops->input(&bench.ev);
+}
+
+/*
+ * Injects the next event, returns non-zero when done.
+ */
+static int bench_step(void)
+{
+	const char *expr = exprs[bench.expr];
+	size_t len = strlen(expr);
+
+	if (bench.pos == 0)
+		bench.ops->reset();
+
+	if (bench.pos < len) {
+		bench.kind = BENCH_TYPING;
+		type_chr(expr[bench.pos++]);
+		return 0;
+	}
+
+	if (bench.pos == len) {
+		bench.kind = BENCH_EVAL;
+		type_chr('=');
+		bench.pos++;
+		return 0;
+	}
+
+	if (bench.pos == len + 1) {
+		bench.kind = BENCH_LAYOUT;
+		bench.ops->layout_move(1);
+		bench.pos++;
+		return 0;
+	}
+
+	if (bench.pos == len + 2) {
+		bench.kind = BENCH_LAYOUT;
+		bench.ops->layout_move(-1);
+		bench.pos++;
+		return 0;
+	}
+
+	bench.pos = 0;
+	bench.kind = -1;
+
+	if (!exprs[++bench.expr]) {
+		bench.expr = 0;
+
+		if (++bench.round >= bench.rounds)
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint32_t bench_tick(gp_timer *self)
+{
+	double now = now_ms();
+
+	/* wait for the result to be shown */
+	if (bench.kind == BENCH_EVAL && bench.ops->busy())
+		return self->period;
+
+	if (bench.kind >= 0) {
+		double redraw = now - bench.handled - self->period;
+
+		sample_add(&bench.samples[bench.kind],
+		           bench.handled - bench.start + (redraw > 0 ? redraw : 0));
+	}
+
+	bench.start = now_ms();
+
+	if (bench_step()) {
+		report();
+		gp_widgets_exit(0);
+		return 0;
+	}
+
+	bench.handled = now_ms();
+
+	return self->period;
+}
+
+static gp_timer bench_timer = {
+	.expires = 100,
+	.period = BENCH_TICK_MS,
+	.callback = bench_tick,
+	.id = "Benchmark",
+};
+
+int bench_start(const struct bench_ops *ops, unsigned int rounds)
+{
+	if (!rounds)
+		return 1;
+
+	bench.ops = ops;
+	bench.rounds = rounds;
+
+	gp_widgets_timer_ins(&bench_timer);
+
+	return 0;
+}
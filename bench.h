@@ -0,0 +1,40 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Input to display latency benchmark.
+
+   Feeds synthetic input events into the running application from a timer
+   and measures how long it takes until the main loop gets back to the timer,
+   i.e. until the event was handled and the result was redrawn. The
+   percentiles are printed and the application exits at the end.
+
+  */
+
+#ifndef BENCH_H__
+#define BENCH_H__
+
+struct gp_event;
+
+struct bench_ops {
+	/* clears the input */
+	void (*reset)(void);
+	/* handles an input event the same way as the events from the backend */
+	int (*input)(struct gp_event *ev);
+	/* switches the layout page */
+	void (*layout_move)(int where);
+	/* returns non-zero while an evaluation is in progress */
+	int (*busy)(void);
+};
+
+/*
+ * Starts the benchmark, has to be called before the main loop is entered.
+ */
+int bench_start(const struct bench_ops *ops, unsigned int rounds);
+
+#endif /* BENCH_H__ */
@@ -8,102 +8,186 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
-#include "expr.h"
-
-#define ERR(err, err_msg, err_pos) do {\
-	if ((err) != NULL) {           \
-		(err)->err = err_msg;  \
-		(err)->pos = err_pos;  \
-	}                              \
-} while (0)
-
-enum expr_elem_type {
-	EXPR_END = 0,
-	EXPR_NUM,
-	EXPR_NEG,
-	EXPR_MUL,
-	EXPR_DIV,
-	EXPR_ADD,
-	EXPR_SUB,
-	EXPR_POW,
-	EXPR_VAR,
-	EXPR_FN1,
-	EXPR_FN2,
-	EXPR_LPAR,
-	EXPR_RPAR,
-	EXPR_SEP,
-	EXPR_START,
-};
+#include "expr_priv.h"
 
-struct fn {
-	const char *name;
-	struct expr_fn fn;
-};
+/*
+ * Derivatives for automatic differentiation.
+ */
+static double d_abs(double x) { return (x > 0) - (x < 0); }
+static double d_exp2(double x) { return exp2(x) * M_LN2; }
+static double d_exp10(double x) { return exp10(x) * M_LN10; }
+static double d_ln(double x) { return 1 / x; }
+static double d_log2(double x) { return 1 / (x * M_LN2); }
+static double d_log10(double x) { return 1 / (x * M_LN10); }
+static double d_sqrt(double x) { return 0.5 / sqrt(x); }
+static double d_cbrt(double x) { double c = cbrt(x); return 1 / (3 * c * c); }
+static double d_sin(double x) { return cos(x); }
+static double d_cos(double x) { return -sin(x); }
+static double d_tan(double x) { double c = cos(x); return 1 / (c * c); }
+static double d_asin(double x) { return 1 / sqrt(1 - x * x); }
+static double d_acos(double x) { return -1 / sqrt(1 - x * x); }
+static double d_atan(double x) { return 1 / (1 + x * x); }
+static double d_sinh(double x) { return cosh(x); }
+static double d_cosh(double x) { return sinh(x); }
+static double d_tanh(double x) { double t = tanh(x); return 1 - t * t; }
+static double d_asinh(double x) { return 1 / sqrt(x * x + 1); }
+static double d_acosh(double x) { return 1 / sqrt(x * x - 1); }
+static double d_atanh(double x) { return 1 / (1 - x * x); }
+static double d_erf(double x) { return M_2_SQRTPI * exp(-x * x); }
+static double d_erfc(double x) { return -M_2_SQRTPI * exp(-x * x); }
+static double d_zero(double x) { (void)x; return 0; }
+
+static double digamma(double x)
+{
+	double res = 0, f;
+
+	if (x <= 0 && floor(x) == x)
+		return NAN;
+
+	/* reflection */
+	if (x < 0)
+		return digamma(1 - x) - M_PI / tan(M_PI * x);
+
+	/* recurrence to get into the range where asymptotic series converges */
+	while (x < 6) {
+		res -= 1 / x;
+		x += 1;
+	}
+
+	f = 1 / (x * x);
+
+	return res + log(x) - 0.5 / x -
+	       f * (1.0/12 - f * (1.0/120 - f * (1.0/252 - f * (1.0/240 - f/132))));
+}
+
+static double d_tgamma(double x) { return tgamma(x) * digamma(x); }
+
+static void d_mod(double a, double b, double *da, double *db)
+{
+	*da = 1;
+	*db = -trunc(a / b);
+}
+
+static void d_rem(double a, double b, double *da, double *db)
+{
+	*da = 1;
+	*db = -rint(a / b);
+}
+
+static void d_max(double a, double b, double *da, double *db)
+{
+	*da = a >= b;
+	*db = a < b;
+}
+
+static void d_min(double a, double b, double *da, double *db)
+{
+	*da = a <= b;
+	*db = a > b;
+}
+
+static void d_hypot(double a, double b, double *da, double *db)
+{
+	double h = hypot(a, b);
+
+	*da = a / h;
+	*db = b / h;
+}
+
+static void d_pow(double a, double b, double *da, double *db)
+{
+	*da = b * pow(a, b - 1);
+	*db = a > 0 ? pow(a, b) * log(a) : 0;
+}
+
+static void d_atan2(double y, double x, double *dy, double *dx)
+{
+	double r = x * x + y * y;
+
+	*dy = x / r;
+	*dx = -y / r;
+}
 
-static struct fn fn1[] = {
-	{"abs",    {.fn1 = fabs}},
-
-	{"exp",    {.fn1 = exp}},
-	{"exp2",   {.fn1 = exp2}},
-	{"exp10",  {.fn1 = exp10}},
-	{"ln",     {.fn1 = log}},
-	{"log",    {.fn1 = log10}},
-	{"log2",   {.fn1 = log2}},
-	{"log10",  {.fn1 = log10}},
-
-	{"sqrt",   {.fn1 = sqrt}},
-	{"cbrt",   {.fn1 = cbrt}},
-
-	{"sin",    {.fn1 = sin, .a1_in = 1}},
-	{"cos",    {.fn1 = cos, .a1_in = 1}},
-	{"tan",    {.fn1 = tan, .a1_in = 1}},
-	{"asin",   {.fn1 = asin, .a_out = 1}},
-	{"acos",   {.fn1 = acos, .a_out = 1}},
-	{"atan",   {.fn1 = atan, .a_out = 1}},
-
-	{"sinh",   {.fn1 = sinh}},
-	{"cosh",   {.fn1 = cosh}},
-	{"tanh",   {.fn1 = tanh}},
-	{"asinh",  {.fn1 = asinh}},
-	{"acosh",  {.fn1 = acosh}},
-	{"atanh",  {.fn1 = atanh}},
-
-	{"erf",    {.fn1 = erf}},
-	{"erfc",   {.fn1 = erf}},
-	{"lgamma", {.fn1 = lgamma}},
-	{"tgamma", {.fn1 = tgamma}},
-
-	{"ceil",   {.fn1 = ceil}},
-	{"floor",  {.fn1 = floor}},
-	{"trunc",  {.fn1 = trunc}},
-	{"round",  {.fn1 = round}},
+const struct fn expr_fn1[] = {
+	{"abs",    {.fn1 = fabs, .ffn1 = fabsf, .xfn1 = expr_fx_abs, .dfn1 = d_abs, .ival = EXPR_IVAL_EVEN, .iop = EXPR_INT_ABS}},
+
+	{"exp",    {.fn1 = exp, .ffn1 = expf, .xfn1 = expr_fx_exp, .dfn1 = exp, .ival = EXPR_IVAL_INC}},
+	{"exp2",   {.fn1 = exp2, .ffn1 = exp2f, .xfn1 = expr_fx_exp2, .dfn1 = d_exp2, .ival = EXPR_IVAL_INC}},
+	{"exp10",  {.fn1 = exp10, .ffn1 = exp10f, .xfn1 = expr_fx_exp10, .dfn1 = d_exp10, .ival = EXPR_IVAL_INC}},
+	{"ln",     {.fn1 = log, .ffn1 = logf, .xfn1 = expr_fx_ln, .dfn1 = d_ln, .ival = EXPR_IVAL_LOG}},
+	{"log",    {.fn1 = log10, .ffn1 = log10f, .xfn1 = expr_fx_log10, .dfn1 = d_log10, .ival = EXPR_IVAL_LOG}},
+	{"log2",   {.fn1 = log2, .ffn1 = log2f, .xfn1 = expr_fx_log2, .dfn1 = d_log2, .ival = EXPR_IVAL_LOG}},
+	{"log10",  {.fn1 = log10, .ffn1 = log10f, .xfn1 = expr_fx_log10, .dfn1 = d_log10, .ival = EXPR_IVAL_LOG}},
+
+	{"sqrt",   {.fn1 = sqrt, .ffn1 = sqrtf, .xfn1 = expr_fx_sqrt, .dfn1 = d_sqrt, .ival = EXPR_IVAL_LOG}},
+	{"cbrt",   {.fn1 = cbrt, .ffn1 = cbrtf, .xfn1 = expr_fx_cbrt, .dfn1 = d_cbrt, .ival = EXPR_IVAL_INC}},
+
+	{"sin",    {.fn1 = sin, .ffn1 = sinf, .xfn1 = expr_fx_sin, .dfn1 = d_sin, .a1_in = 1, .ival = EXPR_IVAL_SIN}},
+	{"cos",    {.fn1 = cos, .ffn1 = cosf, .xfn1 = expr_fx_cos, .dfn1 = d_cos, .a1_in = 1, .ival = EXPR_IVAL_COS}},
+	{"tan",    {.fn1 = tan, .ffn1 = tanf, .xfn1 = expr_fx_tan, .dfn1 = d_tan, .a1_in = 1, .ival = EXPR_IVAL_TAN}},
+	{"asin",   {.fn1 = asin, .ffn1 = asinf, .xfn1 = expr_fx_asin, .dfn1 = d_asin, .a_out = 1, .ival = EXPR_IVAL_ASIN}},
+	{"acos",   {.fn1 = acos, .ffn1 = acosf, .xfn1 = expr_fx_acos, .dfn1 = d_acos, .a_out = 1, .ival = EXPR_IVAL_ACOS}},
+	{"atan",   {.fn1 = atan, .ffn1 = atanf, .xfn1 = expr_fx_atan, .dfn1 = d_atan, .a_out = 1, .ival = EXPR_IVAL_INC}},
+
+	{"sinh",   {.fn1 = sinh, .ffn1 = sinhf, .xfn1 = expr_fx_sinh, .dfn1 = d_sinh, .ival = EXPR_IVAL_INC}},
+	{"cosh",   {.fn1 = cosh, .ffn1 = coshf, .xfn1 = expr_fx_cosh, .dfn1 = d_cosh, .ival = EXPR_IVAL_EVEN}},
+	{"tanh",   {.fn1 = tanh, .ffn1 = tanhf, .xfn1 = expr_fx_tanh, .dfn1 = d_tanh, .ival = EXPR_IVAL_INC}},
+	{"asinh",  {.fn1 = asinh, .ffn1 = asinhf, .xfn1 = expr_fx_asinh, .dfn1 = d_asinh, .ival = EXPR_IVAL_INC}},
+	{"acosh",  {.fn1 = acosh, .ffn1 = acoshf, .xfn1 = expr_fx_acosh, .dfn1 = d_acosh, .ival = EXPR_IVAL_ACOSH}},
+	{"atanh",  {.fn1 = atanh, .ffn1 = atanhf, .xfn1 = expr_fx_atanh, .dfn1 = d_atanh, .ival = EXPR_IVAL_ASIN}},
+
+	{"erf",    {.fn1 = erf, .ffn1 = erff, .dfn1 = d_erf, .ival = EXPR_IVAL_INC}},
+	{"erfc",   {.fn1 = erfc, .ffn1 = erfcf, .dfn1 = d_erfc, .ival = EXPR_IVAL_DEC}},
+	{"lgamma", {.fn1 = lgamma, .ffn1 = lgammaf, .dfn1 = digamma, .ival = EXPR_IVAL_GAMMA}},
+	{"tgamma", {.fn1 = tgamma, .ffn1 = tgammaf, .dfn1 = d_tgamma, .ival = EXPR_IVAL_GAMMA}},
+
+	{"ceil",   {.fn1 = ceil, .ffn1 = ceilf, .xfn1 = expr_fx_ceil, .dfn1 = d_zero, .ival = EXPR_IVAL_INC, .iop = EXPR_INT_ID}},
+	{"floor",  {.fn1 = floor, .ffn1 = floorf, .xfn1 = expr_fx_floor, .dfn1 = d_zero, .ival = EXPR_IVAL_INC, .iop = EXPR_INT_ID}},
+	{"trunc",  {.fn1 = trunc, .ffn1 = truncf, .xfn1 = expr_fx_trunc, .dfn1 = d_zero, .ival = EXPR_IVAL_INC, .iop = EXPR_INT_ID}},
+	{"round",  {.fn1 = round, .ffn1 = roundf, .xfn1 = expr_fx_round, .dfn1 = d_zero, .ival = EXPR_IVAL_INC, .iop = EXPR_INT_ID}},
 
 	{.name = NULL},
 };
 
+const unsigned int expr_fn1_cnt = sizeof(expr_fn1)/sizeof(*expr_fn1) - 1;
 
+const struct fn expr_fn2[] = {
+	{"mod",   {.fn2 = fmod, .ffn2 = fmodf, .xfn2 = expr_fx_mod, .dfn2 = d_mod, .ival = EXPR_IVAL_MOD, .iop = EXPR_INT_MOD}},
+	{"rem",   {.fn2 = remainder, .ffn2 = remainderf, .xfn2 = expr_fx_rem, .dfn2 = d_rem, .ival = EXPR_IVAL_REM, .iop = EXPR_INT_REM}},
+	{"max",   {.fn2 = fmax, .ffn2 = fmaxf, .xfn2 = expr_fx_max, .dfn2 = d_max, .ival = EXPR_IVAL_INC2, .iop = EXPR_INT_MAX}},
+	{"min",   {.fn2 = fmin, .ffn2 = fminf, .xfn2 = expr_fx_min, .dfn2 = d_min, .ival = EXPR_IVAL_INC2, .iop = EXPR_INT_MIN}},
 
-static struct fn fn2[] = {
-	{"mod",   {.fn2 = fmod}},
-	{"rem",   {.fn2 = remainder}},
-	{"max",   {.fn2 = fmax}},
-	{"min",   {.fn2 = fmin}},
-
-	{"hypot", {.fn2 = hypot}},
-	{"pow",   {.fn2 = pow}},
+	{"hypot", {.fn2 = hypot, .ffn2 = hypotf, .xfn2 = expr_fx_hypot, .dfn2 = d_hypot, .ival = EXPR_IVAL_HYPOT}},
+	{"pow",   {.fn2 = pow, .ffn2 = powf, .xfn2 = expr_fx_pow, .dfn2 = d_pow, .ival = EXPR_IVAL_POW}},
 
-	{"atan2", {.fn2 = atan2, .a_out = 1}},
+	{"atan2", {.fn2 = atan2, .ffn2 = atan2f, .xfn2 = expr_fx_atan2, .dfn2 = d_atan2, .a_out = 1, .ival = EXPR_IVAL_ATAN2}},
 
 	{.name = NULL},
 };
 
+const unsigned int expr_fn2_cnt = sizeof(expr_fn2)/sizeof(*expr_fn2) - 1;
+
+static unsigned int vars_cnt(const struct expr_var vars[])
+{
+	unsigned int i;
+
+	if (!vars)
+		return 0;
+
+	for (i = 0; vars[i].name; i++);
+
+	return i;
+}
 
-static const double *var_by_name(const struct expr_var vars[], const char *name)
+const struct expr_var *expr_var_by_name(const struct expr_var vars[],
+                                        const char *name)
 {
 	unsigned int i;
 
@@ -112,53 +196,163 @@ static const double *var_by_name(const struct expr_var vars[], const char *name)
 
 	for (i = 0; vars[i].name; i++) {
 		if (!strcmp(vars[i].name, name))
-			return &(vars[i].val);
+			return &vars[i];
 	}
 
 	return NULL;
 }
 
-static const char *var_by_ptr(const struct expr_var vars[], const void *ptr)
+/*
+ * Variables interned for the compiler, the names of long arrays are hashed
+ * and the slot of each variable is looked up once.
+ */
+#define VAR_MAP_MIN 16
+
+struct var_map {
+	const struct expr_var *vars;
+	unsigned int cnt;
+	/* variable indexes + 1, open addressing, NULL for short arrays */
+	unsigned int *table;
+	unsigned int mask;
+	/* slots + 1 indexed by the variable index, slots_buf for short arrays */
+	unsigned int *slots;
+	unsigned int slots_buf[VAR_MAP_MIN + 1];
+};
+
+static int var_map_init(struct var_map *self, const struct expr_var vars[],
+                        unsigned int cnt)
 {
-	unsigned int i;
+	unsigned int i, h, size = 2 * VAR_MAP_MIN;
 
-	for (i = 0; vars[i].name; i++) {
-		if (ptr == &(vars[i].val))
-			return vars[i].name;
+	self->vars = vars;
+	self->cnt = cnt;
+	self->table = NULL;
+	self->mask = 0;
+
+	if (cnt <= VAR_MAP_MIN) {
+		memset(self->slots_buf, 0, sizeof(self->slots_buf));
+		self->slots = self->slots_buf;
+		return 0;
 	}
 
-	return NULL;
+	self->slots = calloc(cnt + 1, sizeof(*self->slots));
+	if (!self->slots)
+		return 1;
+
+	while (size < 2 * cnt)
+		size *= 2;
+
+	self->table = calloc(size, sizeof(*self->table));
+	if (!self->table)
+		return 1;
+
+	self->mask = size - 1;
+
+	for (i = 0; i < cnt; i++) {
+		const char *name = vars[i].name;
+
+		h = expr_ident_hash(name, strlen(name)) & self->mask;
+
+		/* the first of variables with the same name is used */
+		while (self->table[h] && strcmp(vars[self->table[h] - 1].name, name))
+			h = (h + 1) & self->mask;
+
+		if (!self->table[h])
+			self->table[h] = i + 1;
+	}
+
+	return 0;
 }
 
-static struct expr_fn *fn_by_name(struct fn fns[], const char *name)
+static void var_map_free(struct var_map *self)
 {
-	unsigned int i;
+	free(self->table);
 
-	for (i = 0; fns[i].name; i++) {
-		if (!strcmp(fns[i].name, name))
-			return &fns[i].fn;
+	if (self->slots != self->slots_buf)
+		free(self->slots);
+}
+
+static int var_map_find(const struct var_map *self, const char *name,
+                        unsigned int len)
+{
+	unsigned int i, h;
+
+	if (!self->table) {
+		for (i = 0; i < self->cnt; i++) {
+			if (expr_ident_is(name, len, self->vars[i].name))
+				return i;
+		}
+
+		return -1;
 	}
 
-	return NULL;
+	h = expr_ident_hash(name, len) & self->mask;
+
+	while ((i = self->table[h])) {
+		if (expr_ident_is(name, len, self->vars[i - 1].name))
+			return i - 1;
+
+		h = (h + 1) & self->mask;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns variable slot, allocates new one if needed.
+ */
+static unsigned int var_slot(struct expr *self, struct var_map *map,
+                             unsigned int var)
+{
+	if (!map->slots[var]) {
+		self->slots[self->var_cnt] = &map->vars[var];
+		map->slots[var] = ++self->var_cnt;
+	}
+
+	return map->slots[var] - 1;
 }
 
-static const char *fn_by_ptr(struct fn fns[], const void *ptr)
+/*
+ * Returns user function slot, allocates new one if needed.
+ */
+static unsigned int ufn_slot(struct expr *self, struct expr_ufn *ufn)
 {
 	unsigned int i;
 
+	for (i = 0; i < self->ufn_cnt; i++) {
+		if (self->ufns[i] == ufn)
+			return i;
+	}
+
+	expr_ufn_ref(ufn);
+	self->ufns[self->ufn_cnt] = ufn;
+
+	return self->ufn_cnt++;
+}
+
+int expr_fn_by_name(const struct fn fns[], const char *name, unsigned int len)
+{
+	int i;
+
 	for (i = 0; fns[i].name; i++) {
-		if (fns[i].fn.ptr == ptr)
-			return fns[i].name;
+		if (expr_ident_is(name, len, fns[i].name))
+			return i;
 	}
 
-	return NULL;
+	return -1;
 }
 
 static int parse_num(const char *in, unsigned int *i, double *res,
                      struct expr_err *err)
 {
+	unsigned int len = expr_num_fast(in + *i, res);
 	char *end;
 
+	if (len) {
+		*i += len;
+		return 0;
+	}
+
 	errno = 0;
 
 	*res = strtod(in + *i, &end);
@@ -180,38 +374,178 @@ static int parse_num(const char *in, unsigned int *i, double *res,
 	return 0;
 }
 
-static int parse_ident(const char *in, unsigned int *i,
-                       char res[], unsigned int res_size,
-		       struct expr_err *err)
+/*
+ * Returns number of function parameters, zero if elem is not a function.
+ */
+static unsigned int fn_params(const struct expr_elem *elem,
+                              struct expr_ufn *const ufns[])
 {
-	unsigned int j = 0;
+	switch (elem->type) {
+	case EXPR_FN1:
+		return 1;
+	case EXPR_FN2:
+		return 2;
+	case EXPR_CALL:
+		return ufns[elem->fn]->argc;
+	case EXPR_IF:
+		return 3;
+	case EXPR_SOLVE:
+	case EXPR_INTEGRATE:
+	case EXPR_SUM:
+	case EXPR_PROD:
+		return 4;
+	default:
+		return 0;
+	}
+}
 
-	for (;;) {
-		switch (in[*i]) {
-		case 'a' ... 'z':
-		case 'A' ... 'Z':
-		case '0' ... '9':
-		case '_':
-			/* res too small */
-			if (j == res_size - 1) {
-				ERR(err, "Identifier too long", *i);
-				return 1;
-			}
+/*
+ * Moves operator from the operator stack to the output.
+ *
+ * The jumps for && || and if() are resolved here, the operator on the stack
+ * holds the position of the jump element in the output.
+ */
+static void emit_op(struct expr_elem out[], unsigned int *out_i,
+                    const struct expr_elem *op)
+{
+	unsigned int pos = *out_i;
+
+	switch (op->type) {
+	case EXPR_AND:
+	case EXPR_OR:
+		out[op->jmp].jmp = pos - op->jmp;
+		out[pos].type = op->type;
+		out[pos].jmp = 0;
+	break;
+	case EXPR_IF:
+		out[op->jmp].jmp = pos - op->jmp;
+		out[pos].type = EXPR_FI;
+		out[pos].jmp = 0;
+	break;
+	case EXPR_SOLVE:
+	case EXPR_INTEGRATE:
+		out[pos].type = op->type;
+		out[pos].jmp = pos - op->jmp;
+	break;
+	/* the body is the last parameter, RET is emitted here */
+	case EXPR_SUM:
+	case EXPR_PROD:
+		out[op->jmp].jmp = pos - op->jmp;
+		out[pos].type = EXPR_RET;
+		out[pos].jmp = 0;
+		pos = ++(*out_i);
+		out[pos].type = op->type;
+		out[pos].jmp = pos - op->jmp;
+	break;
+	default:
+		out[pos] = *op;
+	}
 
-			res[j++] = in[(*i)++];
-		break;
-		default:
-			res[j] = 0;
-			return 0;
-		}
+	(*out_i)++;
+}
+
+/*
+ * Emits IF after the condition and ELSE after the first branch.
+ */
+static int stack_if(struct expr_elem *op, unsigned int commas,
+                    struct expr_elem out[], unsigned int *out_i,
+                    unsigned int i, struct expr_err *err)
+{
+	unsigned int pos = *out_i;
+
+	switch (commas) {
+	case 1:
+		out[pos].type = EXPR_IF;
+	break;
+	case 2:
+		out[op->jmp].jmp = pos - op->jmp;
+		out[pos].type = EXPR_ELSE;
+	break;
+	default:
+		ERR(err, "Wrong number of parameters", i);
+		return 1;
+	}
+
+	op->jmp = pos;
+	(*out_i)++;
+
+	return 0;
+}
+
+/*
+ * Operators with a bound variable, i.e. op(expr, x, a, b).
+ */
+static unsigned int binder_by_name(const char *name, unsigned int len)
+{
+	if (expr_ident_is(name, len, "solve"))
+		return EXPR_SOLVE;
+
+	if (expr_ident_is(name, len, "integrate"))
+		return EXPR_INTEGRATE;
+
+	return 0;
+}
+
+/*
+ * Operators with a bound index, i.e. op(i, from, to, expr).
+ */
+static unsigned int index_op_by_name(const char *name, unsigned int len)
+{
+	if (expr_ident_is(name, len, "sum"))
+		return EXPR_SUM;
+
+	if (expr_ident_is(name, len, "prod"))
+		return EXPR_PROD;
+
+	return 0;
+}
+
+int expr_is_special(const char *name, unsigned int len)
+{
+	return expr_ident_is(name, len, "if") ||
+	       binder_by_name(name, len) ||
+	       index_op_by_name(name, len) ||
+	       expr_rand_by_name(name, len) >= 0;
+}
+
+static int index_op(unsigned int type)
+{
+	return type == EXPR_SUM || type == EXPR_PROD;
+}
+
+static int is_binder(unsigned int type)
+{
+	switch (type) {
+	case EXPR_SOLVE:
+	case EXPR_INTEGRATE:
+		return 1;
+	default:
+		return 0;
 	}
 }
 
+/*
+ * Emits RET after the body of solve() or integrate(), the operator on the
+ * stack holds the position of BIND.
+ */
+static void stack_bind(struct expr_elem *op, struct expr_elem out[],
+                       unsigned int *out_i)
+{
+	unsigned int pos = *out_i;
+
+	out[op->jmp].jmp = pos - op->jmp;
+	out[pos].type = EXPR_RET;
+	out[pos].jmp = 0;
+
+	(*out_i)++;
+}
+
 /*
  * Right parenthesis.
  */
 int stack_rpar(struct expr_elem op_stack[], unsigned int *op_i,
                struct expr_elem out[], unsigned int *out_i,
+               struct expr_ufn *const ufns[],
 	       unsigned int i, struct expr_err *err)
 {
 	for (;;) {
@@ -225,24 +559,21 @@ int stack_rpar(struct expr_elem op_stack[], unsigned int *op_i,
 		switch (op_stack[*op_i].type) {
 		case EXPR_LPAR:
 			if (*op_i > 0) {
-				switch (op_stack[*op_i - 1].type) {
-				case EXPR_FN1:
-				case EXPR_FN2:
-					if (op_stack[*op_i].f != op_stack[*op_i - 1].type - EXPR_FN1) {
+				unsigned int params = fn_params(&op_stack[*op_i - 1], ufns);
+
+				if (params) {
+					if (op_stack[*op_i].num + 1 != params) {
 						ERR(err, "Wrong number of parameters", i);
 						return 1;
 					}
 
-					out[(*out_i)++] = op_stack[--(*op_i)];
-				break;
-				default:
-				break;
+					emit_op(out, out_i, &op_stack[--(*op_i)]);
 				}
 			}
 			return 0;
 		break;
 		default:
-			out[(*out_i)++] = op_stack[*op_i];
+			emit_op(out, out_i, &op_stack[*op_i]);
 		}
 	}
 }
@@ -252,6 +583,7 @@ int stack_rpar(struct expr_elem op_stack[], unsigned int *op_i,
  */
 int stack_comma(struct expr_elem op_stack[], unsigned int *op_i,
                 struct expr_elem out[], unsigned int *out_i,
+                struct expr_ufn *const ufns[],
 		unsigned int i, struct expr_err *err)
 {
 	for (;;) {
@@ -264,33 +596,77 @@ int stack_comma(struct expr_elem op_stack[], unsigned int *op_i,
 
 		switch (op_stack[*op_i].type) {
 		case EXPR_LPAR:
-			op_stack[*op_i].f++;
+			op_stack[*op_i].num++;
 
-			if (*op_i == 0 || !(op_stack[*op_i - 1].type == EXPR_FN1 ||
-			                    op_stack[*op_i - 1].type == EXPR_FN2)) {
+			if (*op_i == 0 || !fn_params(&op_stack[*op_i - 1], ufns)) {
 				ERR(err, "Comma not as parameter separator", i);
 				return 1;
 			}
 
+			if (op_stack[*op_i - 1].type == EXPR_IF &&
+			    stack_if(&op_stack[*op_i - 1], op_stack[*op_i].num,
+			             out, out_i, i, err))
+				return 1;
+
+			if (is_binder(op_stack[*op_i - 1].type) &&
+			    op_stack[*op_i].num == 1)
+				stack_bind(&op_stack[*op_i - 1], out, out_i);
+
 			(*op_i)++;
 			return 0;
 		break;
 		default:
-			out[(*out_i)++] = op_stack[*op_i];
+			emit_op(out, out_i, &op_stack[*op_i]);
 		}
 	}
 }
 
+static int op_prec(unsigned int op)
+{
+	switch (op) {
+	case EXPR_OR:
+		return 1;
+	case EXPR_AND:
+		return 2;
+	case EXPR_EQ:
+	case EXPR_NE:
+		return 3;
+	case EXPR_LT:
+	case EXPR_LE:
+	case EXPR_GE:
+	case EXPR_GT:
+		return 4;
+	case EXPR_ADD:
+	case EXPR_SUB:
+		return 5;
+	case EXPR_MUL:
+	case EXPR_DIV:
+		return 6;
+	case EXPR_NEG:
+		return 7;
+	case EXPR_POW:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
 /*
- * Operation +, -, *, /
+ * Binary operators, the precedence is the same as in C.
+ *
+ * All operators are left associative.
  */
 void stack_op(struct expr_elem op_stack[], unsigned int *op_i,
               struct expr_elem out[], unsigned int *out_i,
 	      unsigned int op)
 {
+	int prec = op_prec(op);
+
 	while (*op_i > 0) {
-		if (op_stack[*op_i - 1].type <= op)
-			out[(*out_i)++] = op_stack[--(*op_i)];
+		int top = op_prec(op_stack[*op_i - 1].type);
+
+		if (top >= prec)
+			emit_op(out, out_i, &op_stack[--(*op_i)]);
 		else
 			break;
 	}
@@ -313,7 +689,7 @@ int op_pop(struct expr_elem op_stack[], unsigned int *op_i,
 			return 1;
 		break;
 		default:
-			out[(*out_i)++] = op_stack[*op_i];
+			emit_op(out, out_i, &op_stack[*op_i]);
 		}
 	}
 
@@ -328,6 +704,7 @@ static int is_op(unsigned int op)
 	case EXPR_MUL:
 	case EXPR_POW:
 	case EXPR_DIV:
+	case EXPR_LT ... EXPR_OR:
 	case EXPR_START:
 		return 1;
 	default:
@@ -345,6 +722,7 @@ static int check_number(unsigned int type)
 	case EXPR_MUL:
 	case EXPR_POW:
 	case EXPR_DIV:
+	case EXPR_LT ... EXPR_OR:
 	case EXPR_SEP:
 		return 0;
 	default:
@@ -352,6 +730,48 @@ static int check_number(unsigned int type)
 	}
 }
 
+/*
+ * Parses comparison and logical operators.
+ */
+static unsigned int parse_cmp(const char *str, unsigned int *i)
+{
+	unsigned int op = 0;
+
+	switch (str[*i]) {
+	case '<':
+		op = str[*i+1] == '=' ? EXPR_LE : EXPR_LT;
+	break;
+	case '>':
+		op = str[*i+1] == '=' ? EXPR_GE : EXPR_GT;
+	break;
+	case '=':
+		op = str[*i+1] == '=' ? EXPR_EQ : 0;
+	break;
+	case '!':
+		op = str[*i+1] == '=' ? EXPR_NE : 0;
+	break;
+	case '&':
+		op = str[*i+1] == '&' ? EXPR_AND : 0;
+	break;
+	case '|':
+		op = str[*i+1] == '|' ? EXPR_OR : 0;
+	break;
+	}
+
+	switch (op) {
+	case EXPR_LT:
+	case EXPR_GT:
+		*i += 1;
+	break;
+	case 0:
+	break;
+	default:
+		*i += 2;
+	}
+
+	return op;
+}
+
 static int is_num(const char c)
 {
 	switch (c) {
@@ -363,155 +783,1526 @@ static int is_num(const char c)
 	}
 }
 
-static unsigned int max_stack(struct expr *self)
+unsigned int expr_elem_stack(const struct expr *self,
+                             const struct expr_elem *elem, unsigned int *out)
 {
-	unsigned int stack = 0;
-	unsigned int max = 0;
-	unsigned int i;
-
-	for (i = 0; self->elems[i].type != EXPR_END; i++) {
-		switch (self->elems[i].type) {
-		case EXPR_NUM:
-		case EXPR_VAR:
-			stack++;
-		break;
-		case EXPR_ADD:
-		case EXPR_SUB:
-		case EXPR_MUL:
-		case EXPR_POW:
-		case EXPR_DIV:
-		case EXPR_FN2:
-			stack--;
-		break;
-		case EXPR_NEG:
-		case EXPR_FN1:
-		default:
-		break;
-		}
-
-		max = max < stack ? stack : max;
+	*out = 1;
+
+	switch (elem->type) {
+	case EXPR_NUM:
+	case EXPR_VAR:
+	case EXPR_ARG:
+	case EXPR_BVAR:
+	case EXPR_RAND:
+	case EXPR_PICK:
+	/* placeholder for the body */
+	case EXPR_RET:
+		return 0;
+	case EXPR_NEG:
+	case EXPR_FN1:
+	case EXPR_POLY:
+		return 1;
+	case EXPR_ADD:
+	case EXPR_SUB:
+	case EXPR_MUL:
+	case EXPR_DIV:
+	case EXPR_POW:
+	case EXPR_FN2:
+	case EXPR_LT ... EXPR_OR:
+		return 2;
+	case EXPR_CALL:
+		return self->ufns[elem->fn]->argc;
+	case EXPR_FI:
+	case EXPR_SOLVE ... EXPR_PROD:
+		return 3;
+	default:
+		*out = 0;
+		return 0;
 	}
-
-	return max;
 }
 
 /*
- * Returns one more for every unary plus, but who cares.
+ * Temporary arrays for up to SMALL_ELEMS elements are on the stack, the
+ * compiler does not need malloc() for them for common expressions.
  */
-static unsigned int count_elems(const char *str, struct expr_err *err)
+#define SMALL_ELEMS 32
+
+static void *small_alloc(void *buf, unsigned int cnt, size_t elem_size)
 {
-	unsigned int i = 0;
-	unsigned int count = 0;
-	char buf[42];
-	double f;
+	if (cnt <= SMALL_ELEMS)
+		return buf;
 
-	for (;;) {
-		switch (str[i]) {
-		case 'a' ... 'z':
-		case 'A' ... 'A':
-			if (parse_ident(str, &i, buf, sizeof(buf), err))
-				return 0;
-			count++;
+	return malloc(cnt * elem_size);
+}
+
+static void small_free(void *buf, void *ptr)
+{
+	if (ptr != buf)
+		free(ptr);
+}
+
+/*
+ * Open &&, || or if() while checking jumps.
+ *
+ * The body of a bound variable is a block as well, once closed by RET the
+ * block stays open until the operator that consumes the body.
+ */
+struct check_blk {
+	/* position of the element that closes the block */
+	unsigned int end;
+	/* stack depth at the start */
+	unsigned int stack;
+};
+
+unsigned int expr_check(const struct expr *self)
+{
+	const struct expr_elem *elems = self->elems;
+	unsigned int stack = 0;
+	unsigned int max = 0;
+	unsigned int i, in, out, blk_i = 0, depth = 0;
+	struct check_blk blk_buf[SMALL_ELEMS];
+	struct check_blk *blk = small_alloc(blk_buf, self->elem_cnt, sizeof(*blk));
+
+	if (!blk)
+		return 0;
+
+	for (i = 0; i < self->elem_cnt; i++) {
+		const struct expr_elem *elem = &elems[i];
+
+		switch (elem->type) {
+		case EXPR_END:
+			if (i + 1 != self->elem_cnt || blk_i)
+				goto err;
+
+			if (stack != (self->out_cnt ? self->tmp_cnt + self->out_cnt : 1))
+				goto err;
+			small_free(blk_buf, blk);
+			return max;
+		case EXPR_NUM:
+			if (elem->num >= self->num_cnt)
+				goto err;
+		break;
+		case EXPR_VAR:
+			if (elem->var >= self->var_cnt)
+				goto err;
+		break;
+		case EXPR_ARG:
+			if (elem->arg >= self->arg_cnt)
+				goto err;
+		break;
+		case EXPR_FN1:
+			if (elem->fn >= expr_fn1_cnt)
+				goto err;
+		break;
+		case EXPR_FN2:
+			if (elem->fn >= expr_fn2_cnt)
+				goto err;
+		break;
+		case EXPR_CALL:
+			if (elem->fn >= self->ufn_cnt)
+				goto err;
+		break;
+		case EXPR_RAND:
+			if (elem->fn >= EXPR_RAND_CNT)
+				goto err;
 		break;
+		/* only the shared subexpressions at the bottom of the stack */
+		case EXPR_PICK:
+			if (depth || elem->arg >= self->tmp_cnt || elem->arg >= stack)
+				goto err;
+		break;
+		case EXPR_POLY: {
+			double deg;
 
-		case '.':
-		case '0' ... '9':
-			if (parse_num(str, &i, &f, err))
-				return 0;
-			count++;
+			if (elem->num >= self->num_cnt)
+				goto err;
+
+			deg = self->nums[elem->num];
+
+			if (!(deg >= 1 && deg <= EXPR_POLY_MAX) || deg != (int)deg ||
+			    self->num_cnt - elem->num - 1 <= deg)
+				goto err;
+		} break;
+		case EXPR_NEG:
+		case EXPR_ADD:
+		case EXPR_SUB:
+		case EXPR_MUL:
+		case EXPR_POW:
+		case EXPR_DIV:
+		case EXPR_LT ... EXPR_NE:
+		case EXPR_GE:
+		case EXPR_GT:
 		break;
+		/* jumps have to land on the matching element */
+		case EXPR_ANDJ:
+		case EXPR_ORJ:
+		case EXPR_IF:
+			if (!stack || elem->jmp == 0 ||
+			    elem->jmp >= self->elem_cnt - i)
+				goto err;
 
-		case '+':
-		case '-':
-		case '/':
-		case '*':
-		case '^':
-			count++;
-			i++;
+			if (elems[i + elem->jmp].type !=
+			    (elem->type == EXPR_ANDJ ? EXPR_AND :
+			     elem->type == EXPR_ORJ ? EXPR_OR : EXPR_ELSE))
+				goto err;
+
+			blk[blk_i].end = i + elem->jmp;
+			blk[blk_i++].stack = stack;
+		break;
+		case EXPR_AND:
+		case EXPR_OR:
+			if (!blk_i || blk[--blk_i].end != i ||
+			    stack != blk[blk_i].stack + 1)
+				goto err;
 		break;
+		case EXPR_ELSE:
+			if (!blk_i || blk[blk_i - 1].end != i ||
+			    stack != blk[blk_i - 1].stack + 1)
+				goto err;
 
-		case '(':
-		case ')':
-		case ',':
-		case '\t':
-		case ' ':
-		default:
-			i++;
+			if (elem->jmp >= self->elem_cnt - i ||
+			    elems[i + elem->jmp].type != EXPR_FI)
+				goto err;
+
+			blk[blk_i - 1].end = i + elem->jmp;
+		break;
+		case EXPR_FI:
+			if (!blk_i || blk[--blk_i].end != i ||
+			    stack != blk[blk_i].stack + 2)
+				goto err;
 		break;
+		case EXPR_BVAR:
+			if (elem->arg >= depth)
+				goto err;
+		break;
+		case EXPR_BIND:
+			if (depth >= EXPR_BIND_MAX || elem->jmp == 0 ||
+			    elem->jmp >= self->elem_cnt - i ||
+			    elems[i + elem->jmp].type != EXPR_RET)
+				goto err;
 
-		case '\0':
-			return count;
+			blk[blk_i].end = i + elem->jmp;
+			blk[blk_i++].stack = stack;
+			/* the body is evaluated on its own stack */
+			stack = 0;
+			depth++;
+		break;
+		case EXPR_RET:
+			if (!blk_i || blk[blk_i - 1].end != i || stack != 1)
+				goto err;
+
+			stack = blk[blk_i - 1].stack;
+			depth--;
+		break;
+		case EXPR_SOLVE ... EXPR_PROD:
+			if (!blk_i || elem->jmp > i || blk[blk_i - 1].end >= i ||
+			    elems[i - elem->jmp].type != EXPR_BIND ||
+			    i - elem->jmp + elems[i - elem->jmp].jmp != blk[blk_i - 1].end)
+				goto err;
+
+			/* the sum() range is evaluated before the body */
+			if (elem->type == EXPR_SUM || elem->type == EXPR_PROD) {
+				if (stack != blk[--blk_i].stack + 1)
+					goto err;
+			} else {
+				if (stack != blk[--blk_i].stack + 3)
+					goto err;
+			}
+		break;
+		default:
+			goto err;
 		}
+
+		in = expr_elem_stack(self, elem, &out);
+
+		if (stack < in)
+			goto err;
+
+		stack = stack - in + out;
+
+		max = max < stack ? stack : max;
 	}
+
+err:
+	small_free(blk_buf, blk);
+	return 0;
 }
 
 /*
- * Shunting yard + correctness checking.
+ * Returns one more for every unary plus, comparison and function parameter
+ * separator, but who cares.
+ *
+ * The parameter separators and right parenthesis are counted for the IF, ELSE
+ * and FI elements.
  */
-struct expr *expr_create(const char *str,
-                         const struct expr_var vars[],
-                         struct expr_err *err)
+static unsigned int count_elems(const char *str)
 {
-	unsigned int i = 0, s;
-	char buf[42];
-	const void *ptr;
+	unsigned int i = 0;
+	unsigned int count = 0;
+	unsigned int cls;
 	double f;
 
-	unsigned int elem_cnt = count_elems(str, err);
+	for (;;) {
+		cls = expr_lex_class[(unsigned char)str[i]];
+
+		if (cls & EXPR_LEX_ALPHA) {
+			i += expr_ident_len(str + i);
+			count++;
+			continue;
+		}
+
+		if (cls & EXPR_LEX_NUM) {
+			/* invalid numbers are reported by the compiler */
+			if (parse_num(str, &i, &f, NULL))
+				i++;
+			count++;
+			continue;
+		}
+
+		if (cls & EXPR_LEX_SPACE) {
+			i += expr_space_len(str + i);
+			continue;
+		}
+
+		if (!str[i])
+			return count;
+
+		if (cls & EXPR_LEX_OP)
+			count++;
+
+		i++;
+	}
+}
+
+/*
+ * Operator stack entries that are on the C stack.
+ */
+#define OP_STACK_SMALL 256
+
+/*
+ * Shunting yard + correctness checking.
+ */
+struct expr *expr_alloc(struct expr_mem *mem,
+                        unsigned int elem_cnt, unsigned int num_cnt,
+                        unsigned int var_cnt, unsigned int ufn_cnt)
+{
+	size_t size = sizeof(struct expr) +
+	              num_cnt * sizeof(double) +
+	              var_cnt * sizeof(struct expr_var *) +
+	              ufn_cnt * sizeof(struct expr_ufn *) +
+	              elem_cnt * sizeof(struct expr_elem);
+	struct expr *self = mem ? expr_mem_alloc(mem, size) : malloc(size);
+
+	if (!self)
+		return NULL;
+
+	memset(self, 0, sizeof(*self));
+
+	self->nums = (void*)(self + 1);
+	self->slots = (void*)(self->nums + num_cnt);
+	self->ufns = (void*)(self->slots + var_cnt);
+	self->elems = (void*)(self->ufns + ufn_cnt);
+
+	if (mem) {
+		self->mem = mem;
+		self->mem_size = size;
+	}
+
+	return self;
+}
+
+static int param_by_name(const struct expr_ident params[], unsigned int param_cnt,
+                         const char *name, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < param_cnt; i++) {
+		if (params[i].len == len && !memcmp(params[i].str, name, len))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Bound variables shadow each other, the innermost has to be found first.
+ */
+static int bound_by_name(const struct expr_ident bound[], unsigned int bound_cnt,
+                         const char *name, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = bound_cnt; i-- > 0;) {
+		if (bound[i].len == len && !memcmp(bound[i].str, name, len))
+			return i;
+	}
+
+	return -1;
+}
+
+static void skip_ws(const char *str, unsigned int *i)
+{
+	*i += expr_space_len(str + *i);
+}
+
+/*
+ * The variable in op(expr, x, a, b) follows the expression, so we have to
+ * look ahead for it before the expression is compiled.
+ *
+ * The i points to the left parenthesis.
+ */
+static int parse_bound_var(const char *str, unsigned int i,
+                           struct expr_ident *name, struct expr_err *err)
+{
+	unsigned int depth = 0;
+
+	for (i++; str[i]; i++) {
+		if (str[i] == '(')
+			depth++;
+
+		if (str[i] == ')') {
+			if (!depth)
+				break;
+			depth--;
+		}
+
+		if (str[i] == ',' && !depth)
+			break;
+	}
+
+	if (str[i] != ',') {
+		ERR(err, "Expected comma", i);
+		return 1;
+	}
+
+	i++;
+	skip_ws(str, &i);
+
+	switch (str[i]) {
+	case 'a' ... 'z':
+	case 'A' ... 'Z':
+	break;
+	default:
+		ERR(err, "Variable name expected", i);
+		return 1;
+	}
+
+	name->str = str + i;
+	name->len = expr_ident_len(name->str);
+	i += name->len;
+
+	skip_ws(str, &i);
+
+	if (str[i] != ',') {
+		ERR(err, "Expected comma", i);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns index of BIND that matches the RET at end.
+ */
+static unsigned int bind_start(const struct expr *self, unsigned int end)
+{
+	unsigned int i = end, nest = 0;
+
+	for (;;) {
+		switch (self->elems[i].type) {
+		case EXPR_RET:
+			nest++;
+		break;
+		case EXPR_BIND:
+			if (!--nest)
+				return i;
+		break;
+		}
+
+		i--;
+	}
+}
+
+/*
+ * Returns index of the first element of the subexpression that ends at end.
+ */
+static unsigned int subexpr_start(const struct expr *self, unsigned int end)
+{
+	unsigned int i = end, in, out;
+	int need = 1;
+
+	for (;;) {
+		in = expr_elem_stack(self, &self->elems[i], &out);
+
+		/* the body is a single placeholder value */
+		if (self->elems[i].type == EXPR_RET)
+			i = bind_start(self, i);
+
+		need += in - out;
+
+		if (!need)
+			return i;
+
+		i--;
+	}
+}
+
+int expr_relink(struct expr_elem elems[], unsigned int elem_cnt)
+{
+	unsigned int i, j, blk_i = 0;
+	unsigned int blk_buf[SMALL_ELEMS];
+	unsigned int *blk = small_alloc(blk_buf, elem_cnt, sizeof(*blk));
+
+	if (!blk)
+		return 1;
+
+	for (i = 0; i < elem_cnt; i++) {
+		switch (elems[i].type) {
+		case EXPR_ANDJ:
+		case EXPR_ORJ:
+		case EXPR_IF:
+		case EXPR_BIND:
+			blk[blk_i++] = i;
+		break;
+		case EXPR_AND:
+		case EXPR_OR:
+		case EXPR_ELSE:
+		case EXPR_FI:
+		case EXPR_RET:
+			j = blk[--blk_i];
+			elems[j].jmp = i - j;
+
+			if (elems[i].type == EXPR_ELSE)
+				blk[blk_i++] = i;
+
+			/* the operator jumps back to the BIND */
+			if (elems[i].type == EXPR_RET)
+				blk[blk_i++] = j;
+		break;
+		case EXPR_SOLVE ... EXPR_PROD:
+			j = blk[--blk_i];
+			elems[i].jmp = i - j;
+		break;
+		}
+	}
+
+	small_free(blk_buf, blk);
+	return 0;
+}
+
+static int grow(void **arr, unsigned int *size, unsigned int cnt, size_t elem_size)
+{
+	void *tmp;
+
+	if (cnt < *size)
+		return 0;
+
+	*size = *size ? 2 * *size : 64;
+
+	tmp = realloc(*arr, *size * elem_size);
+	if (!tmp)
+		return 1;
+
+	*arr = tmp;
+	return 0;
+}
+
+/*
+ * Program being rewritten, the arrays are reallocated as needed.
+ */
+struct rewrite {
+	struct expr *e;
+	unsigned int elem_size, num_size, var_size, ufn_size;
+};
+
+static void rewrite_free(struct rewrite *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < r->e->ufn_cnt; i++)
+		expr_ufn_unref(r->e->ufns[i]);
+
+	free((void*)r->e->elems);
+	free((void*)r->e->nums);
+	free(r->e->slots);
+	free(r->e->ufns);
+}
+
+/*
+ * Appends element from the from program, remaps the indexes.
+ */
+static int rewrite_elem(struct rewrite *r, const struct expr *from,
+                        const struct expr_elem *elem)
+{
+	struct expr *e = r->e;
+	struct expr_elem *elems;
+	unsigned int i;
+
+	if (grow((void**)&e->elems, &r->elem_size, e->elem_cnt, sizeof(*elem)))
+		return 1;
+
+	elems = (void*)e->elems;
+	elems[e->elem_cnt] = *elem;
+
+	switch (elem->type) {
+	case EXPR_NUM:
+		if (grow((void**)&e->nums, &r->num_size, e->num_cnt, sizeof(double)))
+			return 1;
+		((double*)e->nums)[e->num_cnt] = from->nums[elem->num];
+		elems[e->elem_cnt].num = e->num_cnt++;
+	break;
+	case EXPR_POLY:
+		elems[e->elem_cnt].num = e->num_cnt;
+
+		/* the degree and the coefficients */
+		for (i = 0; i < expr_poly_deg(from, elem) + 2; i++) {
+			if (grow((void**)&e->nums, &r->num_size, e->num_cnt, sizeof(double)))
+				return 1;
+			((double*)e->nums)[e->num_cnt++] = from->nums[elem->num + i];
+		}
+	break;
+	case EXPR_VAR:
+		for (i = 0; i < e->var_cnt; i++) {
+			if (e->slots[i] == from->slots[elem->var])
+				break;
+		}
+
+		if (i == e->var_cnt) {
+			if (grow((void**)&e->slots, &r->var_size, e->var_cnt, sizeof(void*)))
+				return 1;
+			e->slots[e->var_cnt++] = from->slots[elem->var];
+		}
+
+		elems[e->elem_cnt].var = i;
+	break;
+	case EXPR_CALL:
+		for (i = 0; i < e->ufn_cnt; i++) {
+			if (e->ufns[i] == from->ufns[elem->fn])
+				break;
+		}
+
+		if (i == e->ufn_cnt) {
+			if (grow((void**)&e->ufns, &r->ufn_size, e->ufn_cnt, sizeof(void*)))
+				return 1;
+			expr_ufn_ref(from->ufns[elem->fn]);
+			e->ufns[e->ufn_cnt++] = from->ufns[elem->fn];
+		}
+
+		elems[e->elem_cnt].fn = i;
+	break;
+	}
+
+	e->elem_cnt++;
+
+	return 0;
+}
+
+/*
+ * Creates the rewritten program, the original program and the rewrite are
+ * freed, returns NULL on allocation failure.
+ *
+ * The original is freed first so that an arena reuses its space.
+ */
+static struct expr *rewrite_finish(struct rewrite *r, struct expr *self)
+{
+	const struct expr_var *vars = self->vars;
+	unsigned int arg_cnt = self->arg_cnt;
+	struct expr_mem *mem = self->mem;
+	struct expr *e = r->e;
+	struct expr *ret;
+	int relink = expr_relink((void*)e->elems, e->elem_cnt);
+
+	expr_destroy(self);
+
+	if (relink)
+		goto err;
+
+	ret = expr_alloc(mem, e->elem_cnt, e->num_cnt, e->var_cnt, e->ufn_cnt);
+	if (!ret)
+		goto err;
+
+	memcpy((void*)ret->elems, e->elems, e->elem_cnt * sizeof(*e->elems));
+
+	if (e->num_cnt)
+		memcpy((void*)ret->nums, e->nums, e->num_cnt * sizeof(*e->nums));
+
+	if (e->var_cnt)
+		memcpy(ret->slots, e->slots, e->var_cnt * sizeof(*e->slots));
+
+	if (e->ufn_cnt)
+		memcpy(ret->ufns, e->ufns, e->ufn_cnt * sizeof(*e->ufns));
+
+	ret->vars = vars;
+	ret->elem_cnt = e->elem_cnt;
+	ret->num_cnt = e->num_cnt;
+	ret->var_cnt = e->var_cnt;
+	ret->ufn_cnt = e->ufn_cnt;
+	ret->arg_cnt = arg_cnt;
+	ret->tmp_cnt = e->tmp_cnt;
+	ret->out_cnt = e->out_cnt;
+	ret->stack = expr_check(ret);
+
+	/* references were moved to the new program */
+	e->ufn_cnt = 0;
+	rewrite_free(r);
+
+	return ret;
+err:
+	rewrite_free(r);
+	return NULL;
+}
+
+/*
+ * Replaces the call and its already emitted arguments with the function body.
+ */
+static int inline_call(struct rewrite *r, struct expr_ufn *ufn)
+{
+	struct expr *e = r->e;
+	const struct expr *body = ufn->body;
+	unsigned int start[EXPR_UFN_PARAMS_MAX], len[EXPR_UFN_PARAMS_MAX];
+	unsigned int i, j, end = e->elem_cnt;
+	int ret = 1;
+
+	/* no arguments for a function without parameters */
+	start[0] = end;
+
+	for (i = ufn->argc; i-- > 0;) {
+		start[i] = subexpr_start(e, end - 1);
+		len[i] = end - start[i];
+		end = start[i];
+	}
+
+	unsigned int args_len = e->elem_cnt - start[0];
+	struct expr_elem args_buf[SMALL_ELEMS];
+	struct expr_elem *args = small_alloc(args_buf, args_len, sizeof(*args));
+
+	if (!args)
+		return 1;
+
+	memcpy(args, e->elems + start[0], args_len * sizeof(*args));
+
+	e->elem_cnt = start[0];
+
+	for (i = 0; body->elems[i].type != EXPR_END; i++) {
+		const struct expr_elem *elem = &body->elems[i];
+
+		if (elem->type != EXPR_ARG) {
+			if (rewrite_elem(r, body, elem))
+				goto exit;
+			continue;
+		}
+
+		/* arguments are already remapped */
+		for (j = 0; j < len[elem->arg]; j++) {
+			if (rewrite_elem(r, e, &args[start[elem->arg] - start[0] + j]))
+				goto exit;
+		}
+	}
+
+	ret = 0;
+exit:
+	small_free(args_buf, args);
+	return ret;
+}
+
+/*
+ * Returns number of elements the call would grow the program if inlined.
+ */
+static int inline_growth(const struct rewrite *r, struct expr_ufn *ufn)
+{
+	const struct expr *e = r->e;
+	const struct expr *body = ufn->body;
+	unsigned int len[EXPR_UFN_PARAMS_MAX];
+	unsigned int i, end = e->elem_cnt;
+	int growth = -1;
+
+	for (i = ufn->argc; i-- > 0;) {
+		unsigned int start = subexpr_start(e, end - 1);
+
+		len[i] = end - start;
+		end = start;
+	}
+
+	for (i = 0; body->elems[i].type != EXPR_END; i++) {
+		if (body->elems[i].type == EXPR_ARG)
+			growth += len[body->elems[i].arg] - 1;
+		else
+			growth++;
+	}
+
+	return growth;
+}
+
+/*
+ * Returns non-zero if inlining the call would duplicate or drop an argument
+ * that uses rand(), each rand() in the program is a different number.
+ */
+static int inline_dups_rand(const struct rewrite *r, struct expr_ufn *ufn)
+{
+	const struct expr *e = r->e;
+	const struct expr *body = ufn->body;
+	unsigned int uses[EXPR_UFN_PARAMS_MAX] = {};
+	unsigned int i, j, start, end = e->elem_cnt;
+
+	for (i = 0; body->elems[i].type != EXPR_END; i++) {
+		if (body->elems[i].type == EXPR_ARG)
+			uses[body->elems[i].arg]++;
+	}
+
+	for (i = ufn->argc; i-- > 0; end = start) {
+		start = subexpr_start(e, end - 1);
+
+		if (uses[i] == 1)
+			continue;
+
+		for (j = start; j < end; j++) {
+			if (e->elems[j].type == EXPR_RAND)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Small functions without bound variables are inlined, the bound variable
+ * index depends on the nesting at the call site.
+ */
+static int can_inline(const struct expr_ufn *ufn)
+{
+	const struct expr *body = ufn->body;
+	unsigned int i;
+
+	if (body->elem_cnt > EXPR_INLINE_MAX + 1)
+		return 0;
+
+	for (i = 0; i < body->elem_cnt; i++) {
+		if (body->elems[i].type == EXPR_BIND)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Inlines small user function bodies into the program.
+ */
+static struct expr *inline_calls(struct expr *self, struct expr_err *err)
+{
+	struct rewrite r = {};
+	struct expr e = *self;
+	struct expr *ret;
+	unsigned int i;
+
+	for (i = 0; i < self->ufn_cnt; i++) {
+		if (can_inline(self->ufns[i]))
+			break;
+	}
+
+	if (i == self->ufn_cnt)
+		return self;
+
+	e.elems = NULL;
+	e.nums = NULL;
+	e.slots = NULL;
+	e.ufns = NULL;
+	e.elem_cnt = e.num_cnt = e.var_cnt = e.ufn_cnt = 0;
+	r.e = &e;
+
+	for (i = 0; i < self->elem_cnt; i++) {
+		const struct expr_elem *elem = &self->elems[i];
+
+		if (elem->type == EXPR_CALL) {
+			struct expr_ufn *ufn = self->ufns[elem->fn];
+
+			if (can_inline(ufn) && !inline_dups_rand(&r, ufn) &&
+			    inline_growth(&r, ufn) <= EXPR_INLINE_MAX) {
+				if (inline_call(&r, ufn))
+					goto err;
+				continue;
+			}
+		}
+
+		if (rewrite_elem(&r, self, elem))
+			goto err;
+	}
+
+	ret = rewrite_finish(&r, self);
+	if (!ret)
+		ERR(err, "Malloc failed", 0);
+
+	return ret;
+err:
+	rewrite_free(&r);
+	expr_destroy(self);
+	ERR(err, "Malloc failed", 0);
+	return NULL;
+}
+
+/*
+ * Subexpression that is a polynomial in a single variable, parameter or bound
+ * variable with constant coefficients.
+ */
+struct poly {
+	/* elements [start, end) */
+	unsigned int start, end;
+	/* degree or -1 if not a polynomial */
+	int deg;
+	/* the variable, EXPR_END for constants */
+	struct expr_elem x;
+	/* c[i] is the coefficient of x^i */
+	double c[EXPR_POLY_MAX + 1];
+};
+
+static int poly_same_x(const struct poly *a, const struct poly *b)
+{
+	return a->x.type == EXPR_END || b->x.type == EXPR_END ||
+	       (a->x.type == b->x.type && a->x.num == b->x.num);
+}
+
+/*
+ * Returns the index of the only nonzero coefficient, 0 for zero polynomial
+ * and -1 if there is more than one.
+ */
+static int poly_monomial(const struct poly *a)
+{
+	int i, ret = 0, cnt = 0;
+
+	for (i = 0; i <= a->deg; i++) {
+		if (a->c[i]) {
+			ret = i;
+			cnt++;
+		}
+	}
+
+	return cnt > 1 ? -1 : ret;
+}
+
+static int poly_is_zero(const struct poly *a)
+{
+	int i;
+
+	for (i = 0; i <= a->deg; i++) {
+		if (a->c[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Only products with a monomial are expanded, multiplying out factored
+ * polynomials, e.g. (x-1)^10, cancels catastrophically near the roots.
+ *
+ * Each coefficient is a single product so that the sign of zero is kept for
+ * constants.
+ */
+static void poly_mul(const struct poly *a, const struct poly *b,
+                     struct poly *res)
+{
+	double c[EXPR_POLY_MAX + 1] = {};
+	const struct poly *tmp;
+	int j, k;
+
+	if (a->deg + b->deg > EXPR_POLY_MAX) {
+		res->deg = -1;
+		return;
+	}
+
+	k = poly_monomial(a);
+	if (k < 0) {
+		tmp = a;
+		a = b;
+		b = tmp;
+		k = poly_monomial(a);
+	}
+
+	if (k < 0) {
+		res->deg = -1;
+		return;
+	}
+
+	for (j = 0; j <= b->deg; j++)
+		c[k + j] = a->c[k] * b->c[j];
+
+	res->deg = a->deg + b->deg;
+	memcpy(res->c, c, sizeof(c));
+}
+
+static void poly_pow(const struct poly *a, double exp, struct poly *res)
+{
+	struct poly base = *a;
+	unsigned int i;
+
+	if (poly_monomial(a) < 0 || exp < 0 || exp > EXPR_POLY_MAX ||
+	    exp != (int)exp) {
+		res->deg = -1;
+		return;
+	}
+
+	res->deg = 0;
+	res->c[0] = 1;
+
+	for (i = 0; i < exp && res->deg >= 0; i++)
+		poly_mul(res, &base, res);
+}
+
+/*
+ * Substitutes monomial into EXPR_POLY, e.g. inlined function body.
+ */
+static void poly_compose(const struct expr *self, const struct expr_elem *elem,
+                         const struct poly *a, struct poly *res)
+{
+	const double *coefs = expr_poly_coefs(self, elem);
+	unsigned int i, deg = expr_poly_deg(self, elem);
+
+	res->deg = -1;
+
+	if (poly_monomial(a) < 0)
+		return;
+
+	res->deg = 0;
+	res->c[0] = coefs[0];
+
+	for (i = 1; i <= deg && res->deg >= 0; i++) {
+		poly_mul(res, a, res);
+		res->c[0] += coefs[i];
+	}
+}
+
+/*
+ * Computes the polynomial for the element from its operands.
+ *
+ * Constants are computed by the same operations as in expr_eval() so that
+ * the result, including the sign of zero, does not change by folding them.
+ */
+static void poly_op(const struct expr *self, const struct expr_elem *elem,
+                    const struct poly *in, unsigned int in_cnt,
+                    struct poly *res)
+{
+	int i;
+
+	res->deg = -1;
+	res->x.type = EXPR_END;
+
+	switch (elem->type) {
+	case EXPR_NUM:
+		res->deg = 0;
+		res->c[0] = self->nums[elem->num];
+		return;
+	case EXPR_VAR:
+	case EXPR_ARG:
+	case EXPR_BVAR:
+		res->deg = 1;
+		res->x = *elem;
+		res->c[0] = 0;
+		res->c[1] = 1;
+		return;
+	case EXPR_NEG:
+	case EXPR_ADD:
+	case EXPR_SUB:
+	case EXPR_MUL:
+	case EXPR_DIV:
+	case EXPR_POW:
+	case EXPR_POLY:
+	break;
+	default:
+		return;
+	}
+
+	for (i = 0; i < (int)in_cnt; i++) {
+		if (in[i].deg < 0)
+			return;
+	}
+
+	if (in_cnt == 2 && !poly_same_x(&in[0], &in[1]))
+		return;
+
+	res->x = in[0].x.type != EXPR_END ? in[0].x : in[in_cnt - 1].x;
+
+	switch (elem->type) {
+	case EXPR_NEG:
+		res->deg = in[0].deg;
+		for (i = 0; i <= res->deg; i++)
+			res->c[i] = -in[0].c[i];
+	break;
+	case EXPR_ADD:
+	case EXPR_SUB:
+		res->deg = in[0].deg > in[1].deg ? in[0].deg : in[1].deg;
+		for (i = 0; i <= res->deg; i++) {
+			double a = i <= in[0].deg ? in[0].c[i] : 0;
+			double b = i <= in[1].deg ? in[1].c[i] : 0;
+
+			res->c[i] = elem->type == EXPR_ADD ? a + b : a - b;
+		}
+	break;
+	case EXPR_MUL:
+		poly_mul(&in[0], &in[1], res);
+	break;
+	case EXPR_DIV:
+		/* x/0 is not a polynomial with finite coefficients */
+		if (in[1].deg || (in[0].deg && !in[1].c[0]))
+			return;
+
+		res->deg = in[0].deg;
+		for (i = 0; i <= res->deg; i++)
+			res->c[i] = in[0].c[i] / in[1].c[0];
+	break;
+	case EXPR_POW:
+		if (in[1].deg)
+			return;
+
+		if (!in[0].deg) {
+			res->deg = 0;
+			res->c[0] = pow(in[0].c[0], in[1].c[0]);
+			break;
+		}
+
+		poly_pow(&in[0], in[1].c[0], res);
+	break;
+	case EXPR_POLY:
+		if (!in[0].deg) {
+			res->deg = 0;
+			res->c[0] = expr_poly_eval(expr_poly_coefs(self, elem),
+			                           expr_poly_deg(self, elem),
+			                           in[0].c[0]);
+			break;
+		}
+
+		poly_compose(self, elem, &in[0], res);
+	break;
+	}
+
+	/*
+	 * Huge values are not folded, e.g. 123456789 * 987654321 would no
+	 * longer be evaluated exactly by expr_eval_int().
+	 */
+	for (i = 0; i <= res->deg; i++) {
+		if (!isfinite(res->c[i]) || fabs(res->c[i]) > EXPR_INT_EXACT) {
+			res->deg = -1;
+			return;
+		}
+	}
+
+	/* e.g. x*0 is -0 for negative x but the polynomial evaluates to +0 */
+	if (res->deg > 0 && poly_is_zero(res)) {
+		res->deg = -1;
+		return;
+	}
+
+	if (res->deg == 0)
+		res->x.type = EXPR_END;
+}
+
+/*
+ * Constants are folded into a number, polynomials are worth rewriting if
+ * shorter than the original.
+ */
+static void poly_add(struct poly *polys, unsigned int *poly_cnt,
+                     const struct poly *poly)
+{
+	unsigned int len = poly->end - poly->start;
+
+	if (poly->deg < 0 || len < 2 || (poly->deg && len < 3))
+		return;
+
+	polys[(*poly_cnt)++] = *poly;
+}
+
+/*
+ * Finds maximal polynomial subexpressions, the result is sorted by position.
+ */
+static int find_polys(const struct expr *self, struct poly *polys,
+                      unsigned int *poly_cnt)
+{
+	const struct expr_elem *elems = self->elems;
+	struct poly stack_buf[SMALL_ELEMS];
+	struct poly *stack = small_alloc(stack_buf, self->elem_cnt, sizeof(*stack));
+	unsigned int binds[EXPR_BIND_MAX];
+	unsigned int i, j, in, out, s = 0, b = 0;
+
+	if (!stack)
+		return 1;
+
+	*poly_cnt = 0;
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		const struct expr_elem *elem = &elems[i];
+		struct poly res;
+
+		switch (elem->type) {
+		case EXPR_BIND:
+			binds[b++] = i;
+			continue;
+		case EXPR_RET:
+			/* the body is consumed by the operator as a whole */
+			poly_add(polys, poly_cnt, &stack[--s]);
+			stack[s].deg = -1;
+			stack[s].start = binds[--b];
+			stack[s++].end = i + 1;
+			continue;
+		}
+
+		in = expr_elem_stack(self, elem, &out);
+
+		if (!out)
+			continue;
+
+		s -= in;
+
+		poly_op(self, elem, &stack[s], in, &res);
+
+		if (res.deg < 0) {
+			for (j = 0; j < in; j++)
+				poly_add(polys, poly_cnt, &stack[s + j]);
+		}
+
+		res.start = in ? stack[s].start : i;
+		res.end = i + 1;
+		stack[s++] = res;
+	}
+
+	if (s == 1)
+		poly_add(polys, poly_cnt, &stack[0]);
+
+	small_free(stack_buf, stack);
+
+	/* the polynomials are found when the parent is, sort them by position */
+	for (i = 1; i < *poly_cnt; i++) {
+		struct poly tmp = polys[i];
+
+		for (j = i; j > 0 && polys[j - 1].start > tmp.start; j--)
+			polys[j] = polys[j - 1];
+
+		polys[j] = tmp;
+	}
+
+	return 0;
+}
+
+static int rewrite_const(struct rewrite *r, double val)
+{
+	struct expr *e = r->e;
+
+	if (grow((void**)&e->nums, &r->num_size, e->num_cnt, sizeof(double)))
+		return 1;
+
+	((double*)e->nums)[e->num_cnt++] = val;
+
+	return 0;
+}
+
+static int rewrite_poly(struct rewrite *r, const struct expr *from,
+                        const struct poly *poly)
+{
+	struct expr *e = r->e;
+	struct expr_elem *elems;
+	unsigned int num = e->num_cnt;
+	int i;
+
+	if (poly->deg && rewrite_elem(r, from, &poly->x))
+		return 1;
+
+	if (grow((void**)&e->elems, &r->elem_size, e->elem_cnt, sizeof(*elems)))
+		return 1;
+
+	elems = (void*)e->elems;
+	elems[e->elem_cnt].type = poly->deg ? EXPR_POLY : EXPR_NUM;
+	elems[e->elem_cnt++].num = num;
+
+	if (poly->deg && rewrite_const(r, poly->deg))
+		return 1;
+
+	for (i = poly->deg; i >= 0; i--) {
+		if (rewrite_const(r, poly->c[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Rewrites polynomials to Horner's form, e.g. 3*x^3 - x^2 + 1 is evaluated
+ * as fma(fma(fma(3, x, -1), x, 0), x, 1), and folds constants.
+ */
+static struct expr *fold_polys(struct expr *self, struct expr_err *err)
+{
+	struct rewrite r = {};
+	struct expr e;
+	struct expr *ret;
+	struct poly polys_buf[SMALL_ELEMS];
+	struct poly *polys;
+	unsigned int i, p = 0, poly_cnt;
+
+	if (!self)
+		return NULL;
+
+	e = *self;
+	e.elems = NULL;
+	e.nums = NULL;
+	e.slots = NULL;
+	e.ufns = NULL;
+	e.elem_cnt = e.num_cnt = e.var_cnt = e.ufn_cnt = 0;
+	r.e = &e;
+
+	polys = small_alloc(polys_buf, self->elem_cnt, sizeof(*polys));
+	if (!polys || find_polys(self, polys, &poly_cnt))
+		goto err;
+
+	if (!poly_cnt) {
+		small_free(polys_buf, polys);
+		return self;
+	}
+
+	for (i = 0; i < self->elem_cnt; i++) {
+		if (p < poly_cnt && polys[p].start == i) {
+			if (rewrite_poly(&r, self, &polys[p]))
+				goto err;
+
+			i = polys[p++].end - 1;
+			continue;
+		}
+
+		if (rewrite_elem(&r, self, &self->elems[i]))
+			goto err;
+	}
+
+	small_free(polys_buf, polys);
+
+	ret = rewrite_finish(&r, self);
+	if (!ret)
+		ERR(err, "Malloc failed", 0);
+
+	return ret;
+err:
+	small_free(polys_buf, polys);
+	rewrite_free(&r);
+	expr_destroy(self);
+	ERR(err, "Malloc failed", 0);
+	return NULL;
+}
+
+struct expr *expr_compile(const char *str, const struct expr_var vars[],
+                          const struct expr_ident params[], unsigned int param_cnt,
+                          struct expr_mem *mem, struct expr_err *err)
+{
+	unsigned int i = 0, s, len;
+	const char *name;
+	struct expr_ufn *ufn;
+	struct var_map map;
+	unsigned int op;
+	int fn;
+	double f;
+
+	/* one more for EXPR_END */
+	unsigned int elem_cnt = count_elems(str) + 1;
+	unsigned int var_cnt = vars_cnt(vars);
+
+	/*
+	 * The constant pool and the slots are sized for the worst case.
+	 */
+	struct expr *eval = expr_alloc(mem, elem_cnt, elem_cnt, var_cnt, elem_cnt);
+
+	if (!eval) {
+		ERR(err, "Malloc failed", 0);
+		return NULL;
+	}
+
+	double *nums = (void*)eval->nums;
+	struct expr_elem *elems = (void*)eval->elems;
+
+	eval->vars = vars;
+	eval->arg_cnt = param_cnt;
+
+	/* the operator stack of long inputs does not fit the C stack */
+	size_t op_size = strlen(str) + 1;
+	struct expr_elem op_buf[OP_STACK_SMALL];
+	struct expr_elem *op_stack = op_buf;
+	unsigned int op_i = 0;
+
+	if (op_size > OP_STACK_SMALL)
+		op_stack = malloc(op_size * sizeof(*op_stack));
+
+	if (var_map_init(&map, vars, var_cnt) || !op_stack) {
+		ERR(err, "Malloc failed", 0);
+		goto err;
+	}
+
+	struct expr_ident bound[EXPR_BIND_MAX];
+	unsigned int bound_cnt = 0;
+
+	unsigned int j = 0;
+	unsigned int prev_type = EXPR_START;
+
+	for (;;) {
+		switch (str[i]) {
+
+		/* parse identifiers */
+		case 'a' ... 'z':
+		case 'A' ... 'Z':
+			s = i;
+			name = str + i;
+			len = expr_ident_len(name);
+			i += len;
+
+			if (str[i] == '(' && (fn = expr_fn_by_name(expr_fn1, name, len)) >= 0) {
+				//printf("function(1): '%s'\n", buf);
+				op_stack[op_i].type = EXPR_FN1;
+				op_stack[op_i].fn = fn;
+				op_i++;
+
+				prev_type = EXPR_FN1;
+
+				continue;
+			}
+
+			if (str[i] == '(' && (fn = expr_fn_by_name(expr_fn2, name, len)) >= 0) {
+				//printf("function(2): '%s'\n", buf);
+				op_stack[op_i].type = EXPR_FN2;
+				op_stack[op_i].fn = fn;
+				op_i++;
+
+				prev_type = EXPR_FN2;
+
+				continue;
+			}
+
+			if (str[i] == '(' && (fn = expr_rand_by_name(name, len)) >= 0) {
+				i++;
+				skip_ws(str, &i);
+
+				if (str[i] != ')') {
+					ERR(err, "Wrong number of parameters", i);
+					goto err;
+				}
+
+				i++;
+
+				if (check_number(prev_type)) {
+					ERR(err, "Operator expected", s);
+					goto err;
+				}
+
+				elems[j].type = EXPR_RAND;
+				elems[j].fn = fn;
+				j++;
+
+				prev_type = EXPR_VAR;
+
+				continue;
+			}
+
+			if (str[i] == '(' && expr_ident_is(name, len, "if")) {
+				op_stack[op_i].type = EXPR_IF;
+				op_i++;
+
+				prev_type = EXPR_IF;
+
+				continue;
+			}
+
+			if (str[i] == '(' && (op = binder_by_name(name, len))) {
+				if (bound_cnt >= EXPR_BIND_MAX) {
+					ERR(err, "Too deeply nested", s);
+					goto err;
+				}
+
+				if (parse_bound_var(str, i, &bound[bound_cnt], err))
+					goto err;
+
+				bound_cnt++;
+
+				elems[j].type = EXPR_BIND;
+				op_stack[op_i].type = op;
+				op_stack[op_i].jmp = j++;
+				op_i++;
+
+				prev_type = op;
+
+				continue;
+			}
+
+			if (str[i] == '(' && (op = index_op_by_name(name, len))) {
+				/* the index name is stored until the body starts */
+				i++;
+				skip_ws(str, &i);
+
+				switch (str[i]) {
+				case 'a' ... 'z':
+				case 'A' ... 'Z':
+				break;
+				default:
+					ERR(err, "Variable name expected", i);
+					goto err;
+				}
+
+				op_stack[op_i].type = op;
+				op_stack[op_i].jmp = i;
+				op_i++;
 
-	struct expr *eval = malloc(sizeof(struct expr) +
-	                           elem_cnt * sizeof(struct expr_elem));
+				i += expr_ident_len(str + i);
 
-	if (!eval) {
-		ERR(err, "Malloc failed", 0);
-		return NULL;
-	}
+				skip_ws(str, &i);
 
-	struct expr_elem op_stack[strlen(str)];
-	unsigned int op_i = 0;
+				if (str[i] != ',') {
+					ERR(err, "Expected comma", i);
+					goto err;
+				}
 
-	unsigned int j = 0;
-	unsigned int prev_type = EXPR_START;
+				op_stack[op_i].type = EXPR_LPAR;
+				op_stack[op_i].num = 1;
+				op_i++;
 
+				i++;
 
-	struct expr_elem *elems = eval->elems;
+				prev_type = EXPR_SEP;
 
-	for (;;) {
-		switch (str[i]) {
+				continue;
+			}
 
-		/* parse identifiers */
-		case 'a' ... 'z':
-		case 'A' ... 'Z':
-			s = i;
+			if (str[i] == '(' && (ufn = expr_ufn_by_ident(name, len))) {
+				op_stack[op_i].type = EXPR_CALL;
+				op_stack[op_i].fn = ufn_slot(eval, ufn);
+				op_i++;
 
-			if (parse_ident(str, &i, buf, sizeof(buf), err))
-				return NULL;
+				prev_type = EXPR_CALL;
 
-			if (str[i] == '(' && (ptr = fn_by_name(fn1, buf))) {
-				//printf("function(1): '%s'\n", buf);
-				op_stack[op_i].type = EXPR_FN1;
-				op_stack[op_i].fn = ptr;
-				op_i++;
+				continue;
+			}
 
-				prev_type = EXPR_FN1;
+			if ((fn = bound_by_name(bound, bound_cnt, name, len)) >= 0) {
+				elems[j].type = EXPR_BVAR;
+				elems[j].arg = fn;
+				j++;
+
+				if (check_number(prev_type)) {
+					ERR(err, "Operator expected", s);
+					goto err;
+				}
+
+				prev_type = EXPR_VAR;
 
 				continue;
 			}
 
-			if (str[i] == '(' && (ptr = fn_by_name(fn2, buf))) {
-				//printf("function(2): '%s'\n", buf);
-				op_stack[op_i].type = EXPR_FN2;
-				op_stack[op_i].fn = ptr;
-				op_i++;
+			if ((fn = param_by_name(params, param_cnt, name, len)) >= 0) {
+				elems[j].type = EXPR_ARG;
+				elems[j].arg = fn;
+				j++;
 
-				prev_type = EXPR_FN2;
+				if (check_number(prev_type)) {
+					ERR(err, "Operator expected", s);
+					goto err;
+				}
+
+				prev_type = EXPR_VAR;
 
 				continue;
 			}
 
-			if ((ptr = var_by_name(vars, buf))) {
+			if ((fn = var_map_find(&map, name, len)) >= 0) {
 				elems[j].type = EXPR_VAR;
-				elems[j].var = ptr;
+				elems[j].var = var_slot(eval, &map, fn);
 				j++;
 
 				if (check_number(prev_type)) {
@@ -542,8 +2333,9 @@ struct expr *expr_create(const char *str,
 				goto err;
 			}
 
+			nums[eval->num_cnt] = f;
 			elems[j].type  = EXPR_NUM;
-			elems[j].f = f;
+			elems[j].num = eval->num_cnt++;
 			j++;
 
 			prev_type = EXPR_VAR;
@@ -575,7 +2367,7 @@ struct expr *expr_create(const char *str,
 				if (is_num(str[i+1]))
 					goto number;
 				else {
-					stack_op(op_stack, &op_i, elems, &j, EXPR_NEG);
+					op_stack[op_i++].type = EXPR_NEG;
 					i++;
 					continue;
 				}
@@ -610,123 +2402,607 @@ struct expr *expr_create(const char *str,
 				goto err;
 			}
 
-			stack_op(op_stack, &op_i, elems, &j, EXPR_MUL);
+			stack_op(op_stack, &op_i, elems, &j, EXPR_MUL);
+
+			i++;
+
+			prev_type = EXPR_MUL;
+		break;
+		case '^':
+			if (is_op(prev_type)) {
+				ERR(err, "Unxpected opeartor", i);
+				goto err;
+			}
+
+			stack_op(op_stack, &op_i, elems, &j, EXPR_POW);
+
+			i++;
+
+			prev_type = EXPR_POW;
+		break;
+		case '<':
+		case '>':
+		case '=':
+		case '!':
+		case '&':
+		case '|':
+			s = i;
+
+			op = parse_cmp(str, &i);
+			if (!op) {
+				ERR(err, "Unexpected character", s);
+				goto err;
+			}
+
+			if (is_op(prev_type)) {
+				ERR(err, "Unxpected opeartor", s);
+				goto err;
+			}
+
+			stack_op(op_stack, &op_i, elems, &j, op);
+
+			/* short circuit jump after the left operand */
+			if (op == EXPR_AND || op == EXPR_OR) {
+				elems[j].type = op == EXPR_AND ? EXPR_ANDJ : EXPR_ORJ;
+				op_stack[op_i - 1].jmp = j++;
+			}
+
+			prev_type = op;
+		break;
+		case '(':
+			if (prev_type == EXPR_NUM || prev_type == EXPR_VAR) {
+				ERR(err, "Expected operator or function", i);
+				goto err;
+			}
+
+			op_stack[op_i].type  = EXPR_LPAR;
+			op_stack[op_i].num = 0;
+			op_i++;
+
+			i++;
+
+			prev_type = EXPR_LPAR;
+		break;
+		case ')':
+			if (is_op(prev_type)) {
+				ERR(err, "Expected number, variable or left parenthesis", i);
+				goto err;
+			}
+
+			if (prev_type == EXPR_LPAR) {
+				ERR(err, "Empty parenthesis", i);
+				goto err;
+			}
+
+			if (prev_type == EXPR_SEP) {
+				ERR(err, "Empty parenthesis", i);
+				goto err;
+			}
+
+			s = j;
+
+			if (stack_rpar(op_stack, &op_i, elems, &j, eval->ufns, i, err))
+				goto err;
+
+			/* end of the sum() body */
+			if (s != j && (elems[j - 1].type == EXPR_SUM ||
+			               elems[j - 1].type == EXPR_PROD))
+				bound_cnt--;
+
+			i++;
+
+			prev_type = EXPR_RPAR;
+		break;
+		/* argument separator */
+		case ',':
+			//printf("sep: ,\n");
+
+			if (stack_comma(op_stack, &op_i, elems, &j, eval->ufns, i, err))
+				goto err;
+
+			/* skip the bound variable, it was parsed already */
+			if (is_binder(op_stack[op_i - 2].type) &&
+			    op_stack[op_i - 1].num == 1) {
+				i++;
+				skip_ws(str, &i);
+				i += expr_ident_len(str + i);
+				skip_ws(str, &i);
+				op_stack[op_i - 1].num++;
+				bound_cnt--;
+			}
+
+			/* start of the sum() body */
+			if (index_op(op_stack[op_i - 2].type) &&
+			    op_stack[op_i - 1].num == 3) {
+				struct expr_elem *sum = &op_stack[op_i - 2];
+
+				if (bound_cnt >= EXPR_BIND_MAX) {
+					ERR(err, "Too deeply nested", i);
+					goto err;
+				}
+
+				bound[bound_cnt].str = str + sum->jmp;
+				bound[bound_cnt].len = expr_ident_len(str + sum->jmp);
+				bound_cnt++;
+
+				elems[j].type = EXPR_BIND;
+				sum->jmp = j++;
+			}
+
+			i++;
+
+			prev_type = EXPR_SEP;
+		break;
+
+		/* ignore whitespaces */
+		case '\t':
+		case ' ':
+			skip_ws(str, &i);
+		break;
+
+		case '\0':
+			switch (prev_type) {
+			case EXPR_RPAR:
+			case EXPR_NUM:
+			case EXPR_VAR:
+			break;
+			default:
+				ERR(err, "Unexpected end", i);
+				goto err;
+			}
+
+			if (op_pop(op_stack, &op_i, elems, &j, i, err))
+				goto err;
+
+			elems[j++].type = EXPR_END;
+			eval->elem_cnt = j;
+			eval->stack = expr_check(eval);
+
+			eval = fold_polys(inline_calls(eval, err), err);
+			if (eval)
+				eval->is_int = expr_int_check(eval);
+
+			goto out;
+
+		default:
+			ERR(err, "Unexpected character", i);
+				goto err;
+		}
+	}
+
+err:
+	expr_destroy(eval);
+	eval = NULL;
+out:
+	var_map_free(&map);
+	if (op_stack != op_buf)
+		free(op_stack);
+	return eval;
+}
+
+struct expr *expr_create(const char *str,
+                         const struct expr_var vars[],
+                         struct expr_err *err)
+{
+	return expr_compile(str, vars, NULL, 0, NULL, err);
+}
+
+/*
+ * Node of the expression DAG built to find the shared subexpressions.
+ *
+ * The node is the elements [start, end] of the from program applied to the
+ * values of the children. Conditionals, && and || are a single node that
+ * spans up to the closing element so that nothing is moved out of the
+ * branches. The body of a bound variable is a node without children that
+ * stands for the placeholder.
+ */
+struct cse_node {
+	const struct expr *from;
+	unsigned int start, end;
+	unsigned int child_cnt;
+	unsigned int child[EXPR_UFN_PARAMS_MAX];
+	uint32_t hash;
+	unsigned int uses;
+	/* index of the shared subexpression or -1 */
+	int tmp;
+	/* never equal to another node, e.g. uses rand() */
+	unsigned int unique:1;
+	/* the body placeholder, has to be emitted in place */
+	unsigned int is_body:1;
+};
+
+struct cse {
+	struct cse_node *nodes;
+	unsigned int node_cnt;
+	/* node indexes + 1, open addressing */
+	unsigned int *table;
+	unsigned int table_size;
+};
+
+static uint32_t hash_mix(uint32_t h, uint64_t val)
+{
+	h = (h ^ (uint32_t)val) * 16777619;
+
+	return (h ^ (uint32_t)(val >> 32)) * 16777619;
+}
+
+static uint64_t dbl_bits(double val)
+{
+	uint64_t ret;
+
+	memcpy(&ret, &val, sizeof(ret));
+
+	return ret;
+}
+
+/*
+ * Returns non-zero if the element has an operand other than an index.
+ */
+static int has_operand(unsigned int type)
+{
+	switch (type) {
+	case EXPR_FN1:
+	case EXPR_FN2:
+	case EXPR_ARG:
+	case EXPR_BVAR:
+	case EXPR_RAND:
+	case EXPR_ANDJ ... EXPR_ELSE:
+	case EXPR_BIND:
+	case EXPR_SOLVE ... EXPR_PROD:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t elem_hash(uint32_t h, const struct expr *from,
+                          const struct expr_elem *elem)
+{
+	unsigned int i;
+
+	h = hash_mix(h, elem->type);
+
+	switch (elem->type) {
+	case EXPR_NUM:
+		return hash_mix(h, dbl_bits(from->nums[elem->num]));
+	case EXPR_POLY:
+		for (i = 0; i < expr_poly_deg(from, elem) + 2; i++)
+			h = hash_mix(h, dbl_bits(from->nums[elem->num + i]));
+		return h;
+	case EXPR_VAR:
+		return hash_mix(h, (uintptr_t)from->slots[elem->var]);
+	case EXPR_CALL:
+		return hash_mix(h, (uintptr_t)from->ufns[elem->fn]);
+	default:
+		return has_operand(elem->type) ? hash_mix(h, elem->num) : h;
+	}
+}
+
+static int elem_eq(const struct expr *a, const struct expr_elem *ea,
+                   const struct expr *b, const struct expr_elem *eb)
+{
+	if (ea->type != eb->type)
+		return 0;
+
+	switch (ea->type) {
+	case EXPR_NUM:
+		return !memcmp(&a->nums[ea->num], &b->nums[eb->num], sizeof(double));
+	case EXPR_POLY:
+		if (expr_poly_deg(a, ea) != expr_poly_deg(b, eb))
+			return 0;
+
+		return !memcmp(&a->nums[ea->num], &b->nums[eb->num],
+		               (expr_poly_deg(a, ea) + 2) * sizeof(double));
+	case EXPR_VAR:
+		return a->slots[ea->var] == b->slots[eb->var];
+	case EXPR_CALL:
+		return a->ufns[ea->fn] == b->ufns[eb->fn];
+	default:
+		return !has_operand(ea->type) || ea->num == eb->num;
+	}
+}
+
+static int node_eq(const struct cse_node *a, const struct cse_node *b)
+{
+	unsigned int i;
+
+	if (a->hash != b->hash || a->end - a->start != b->end - b->start ||
+	    a->child_cnt != b->child_cnt)
+		return 0;
+
+	if (memcmp(a->child, b->child, a->child_cnt * sizeof(*a->child)))
+		return 0;
+
+	for (i = 0; i <= a->end - a->start; i++) {
+		if (!elem_eq(a->from, &a->from->elems[a->start + i],
+		             b->from, &b->from->elems[b->start + i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int node_uses_rand(const struct cse_node *node)
+{
+	const struct expr_elem *elems = node->from->elems;
+	unsigned int i;
+
+	for (i = node->start; i <= node->end; i++) {
+		if (elems[i].type == EXPR_RAND)
+			return 1;
+
+		if (elems[i].type == EXPR_CALL &&
+		    expr_uses_rand(node->from->ufns[elems[i].fn]->body))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns index of the node, of an existing one if it was added before.
+ */
+static unsigned int cse_add(struct cse *self, struct cse_node *node)
+{
+	unsigned int i, mask = self->table_size - 1;
+	uint32_t h = 2166136261u;
+
+	for (i = 0; i < node->child_cnt; i++)
+		h = hash_mix(h, node->child[i]);
+
+	for (i = node->start; i <= node->end; i++)
+		h = elem_hash(h, node->from, &node->from->elems[i]);
+
+	node->hash = h;
+	node->uses = 0;
+	node->tmp = -1;
+	node->unique = node_uses_rand(node);
+
+	self->nodes[self->node_cnt] = *node;
+
+	if (node->unique)
+		return self->node_cnt++;
+
+	for (i = h & mask; self->table[i]; i = (i + 1) & mask) {
+		if (node_eq(&self->nodes[self->table[i] - 1], node))
+			return self->table[i] - 1;
+	}
+
+	self->table[i] = ++self->node_cnt;
+
+	return self->node_cnt - 1;
+}
+
+/*
+ * Adds the program into the DAG and returns the node of the result.
+ */
+static unsigned int cse_walk(struct cse *self, const struct expr *from)
+{
+	const struct expr_elem *elems = from->elems;
+	unsigned int stack[from->stack];
+	unsigned int i, j, in, out, s = 0;
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		struct cse_node node = {
+			.from = from,
+			.start = i,
+			.end = i,
+		};
+
+		switch (elems[i].type) {
+		case EXPR_IF:
+			/* IF jumps to ELSE that jumps to FI */
+			node.end = i + elems[i].jmp;
+			node.end += elems[node.end].jmp;
+			in = 1;
+		break;
+		case EXPR_ANDJ:
+		case EXPR_ORJ:
+			node.end = i + elems[i].jmp;
+			in = 1;
+		break;
+		case EXPR_BIND:
+			node.end = i + elems[i].jmp;
+			node.is_body = 1;
+			in = 0;
+		break;
+		default:
+			in = expr_elem_stack(from, &elems[i], &out);
+		}
+
+		s -= in;
+		node.child_cnt = in;
 
-			i++;
+		for (j = 0; j < in; j++)
+			node.child[j] = stack[s + j];
 
-			prev_type = EXPR_MUL;
-		break;
-		case '^':
-			if (is_op(prev_type)) {
-				ERR(err, "Unxpected opeartor", i);
-				goto err;
-			}
+		stack[s++] = cse_add(self, &node);
+		i = node.end;
+	}
 
-			stack_op(op_stack, &op_i, elems, &j, EXPR_POW);
+	return stack[0];
+}
 
-			i++;
+/*
+ * Emits the node, shared subexpressions are picked from the stack unless
+ * the shared subexpression itself is being emitted.
+ */
+static int cse_emit(const struct cse *self, struct rewrite *r,
+                    unsigned int idx, int is_tmp)
+{
+	const struct cse_node *node = &self->nodes[idx];
+	unsigned int i;
 
-			prev_type = EXPR_POW;
-		break;
-		case '(':
-			if (prev_type == EXPR_NUM || prev_type == EXPR_VAR) {
-				ERR(err, "Expected operator or function", i);
-				goto err;
-			}
+	if (node->tmp >= 0 && !is_tmp) {
+		struct expr_elem pick = {.type = EXPR_PICK, .arg = node->tmp};
 
-			op_stack[op_i].type  = EXPR_LPAR;
-			op_stack[op_i].f = 0;
-			op_i++;
+		return rewrite_elem(r, NULL, &pick);
+	}
 
-			i++;
+	for (i = 0; i < node->child_cnt; i++) {
+		if (cse_emit(self, r, node->child[i], 0))
+			return 1;
+	}
 
-			prev_type = EXPR_LPAR;
-		break;
-		case ')':
-			if (is_op(prev_type)) {
-				ERR(err, "Expected number, variable or left parenthesis", i);
-				goto err;
-			}
+	for (i = node->start; i <= node->end; i++) {
+		if (rewrite_elem(r, node->from, &node->from->elems[i]))
+			return 1;
+	}
 
-			if (prev_type == EXPR_LPAR) {
-				ERR(err, "Empty parenthesis", i);
-				goto err;
-			}
+	return 0;
+}
 
-			if (prev_type == EXPR_SEP) {
-				ERR(err, "Empty parenthesis", i);
-				goto err;
-			}
+static int is_leaf(const struct cse_node *node)
+{
+	unsigned int type = node->from->elems[node->start].type;
 
-			if (stack_rpar(op_stack, &op_i, elems, &j, i, err))
-				goto err;
+	return node->start == node->end && (type == EXPR_NUM || type == EXPR_VAR);
+}
 
-			i++;
+struct expr *expr_create_multi(const char *const strs[],
+                               const struct expr_var vars[],
+                               struct expr_err *err)
+{
+	struct rewrite r = {};
+	struct cse cse = {};
+	struct expr e;
+	struct expr *ret;
+	struct expr_elem end = {.type = EXPR_END};
+	unsigned int i, j, cnt = 0, elem_cnt = 0;
+
+	while (strs[cnt])
+		cnt++;
+
+	if (!cnt) {
+		ERR(err, "No expressions", 0);
+		return NULL;
+	}
 
-			prev_type = EXPR_RPAR;
-		break;
-		/* argument separator */
-		case ',':
-			//printf("sep: ,\n");
+	struct expr *progs[cnt];
+	unsigned int roots[cnt];
 
-			if (stack_comma(op_stack, &op_i, elems, &j, i, err))
-				goto err;
+	for (i = 0; i < cnt; i++) {
+		progs[i] = expr_create(strs[i], vars, err);
+		if (!progs[i]) {
+			while (i-- > 0)
+				expr_destroy(progs[i]);
+			return NULL;
+		}
 
-			i++;
+		elem_cnt += progs[i]->elem_cnt;
+	}
 
-			prev_type = EXPR_SEP;
-		break;
+	e = *progs[0];
+	e.elems = NULL;
+	e.nums = NULL;
+	e.slots = NULL;
+	e.ufns = NULL;
+	e.elem_cnt = e.num_cnt = e.var_cnt = e.ufn_cnt = 0;
+	e.out_cnt = cnt;
+	r.e = &e;
+
+	cse.table_size = 64;
+	while (cse.table_size < 2 * elem_cnt)
+		cse.table_size *= 2;
+
+	cse.nodes = malloc(elem_cnt * sizeof(*cse.nodes));
+	cse.table = calloc(cse.table_size, sizeof(*cse.table));
+	if (!cse.nodes || !cse.table)
+		goto err;
+
+	for (i = 0; i < cnt; i++) {
+		roots[i] = cse_walk(&cse, progs[i]);
+		cse.nodes[roots[i]].uses++;
+	}
 
-		/* ignore whitespaces */
-		case '\t':
-		case ' ':
-			i++;
-		break;
+	for (i = 0; i < cse.node_cnt; i++) {
+		for (j = 0; j < cse.nodes[i].child_cnt; j++)
+			cse.nodes[cse.nodes[i].child[j]].uses++;
+	}
 
-		case '\0':
-			switch (prev_type) {
-			case EXPR_RPAR:
-			case EXPR_NUM:
-			case EXPR_VAR:
-			break;
-			default:
-				ERR(err, "Unexpected end", i);
-				goto err;
-			}
+	/*
+	 * Children are added before their parents, shared subexpressions are
+	 * numbered in the order they can be evaluated in.
+	 */
+	for (i = 0; i < cse.node_cnt; i++) {
+		struct cse_node *node = &cse.nodes[i];
 
-			if (op_pop(op_stack, &op_i, elems, &j, i, err))
-				goto err;
+		if (node->uses > 1 && !node->unique && !node->is_body && !is_leaf(node))
+			node->tmp = e.tmp_cnt++;
+	}
 
-			elems[j].type = EXPR_END;
-			eval->vars = vars;
-			eval->stack = max_stack(eval);
-			return eval;
+	/* shared subexpressions first, they are kept at the bottom of the stack */
+	for (i = 0; i < cse.node_cnt; i++) {
+		if (cse.nodes[i].tmp >= 0 && cse_emit(&cse, &r, i, 1))
+			goto err;
+	}
 
-		default:
-			ERR(err, "Unexpected character", i);
-				goto err;
-		}
+	for (i = 0; i < cnt; i++) {
+		if (cse_emit(&cse, &r, roots[i], 0))
+			goto err;
 	}
 
+	if (rewrite_elem(&r, NULL, &end))
+		goto err;
+
+	ret = rewrite_finish(&r, progs[0]);
+
+	for (i = 1; i < cnt; i++)
+		expr_destroy(progs[i]);
+
+	free(cse.nodes);
+	free(cse.table);
+
+	if (!ret)
+		ERR(err, "Malloc failed", 0);
+
+	return ret;
 err:
-	free(eval);
+	rewrite_free(&r);
+
+	for (i = 0; i < cnt; i++)
+		expr_destroy(progs[i]);
+
+	free(cse.nodes);
+	free(cse.table);
+	ERR(err, "Malloc failed", 0);
 	return NULL;
 }
 
 void expr_destroy(struct expr *self)
 {
+	unsigned int i;
+
+	if (self->memo) {
+		expr_memo_free(self->memo);
+		self->memo = NULL;
+	}
+
+	if (self->mem) {
+		expr_mem_free(self);
+		return;
+	}
+
+	for (i = 0; i < self->ufn_cnt; i++)
+		expr_ufn_unref(self->ufns[i]);
+
+	if (self->map)
+		munmap(self->map, self->map_size);
+
+	free(self->grad);
 	free(self);
 }
 
 void expr_dump(struct expr *self)
 {
+	const struct expr_elem *elems = self->elems;
 	unsigned int i;
 
 	printf("Variables\n"
 	       "---------\n");
 
-	for (i = 0; self->vars[i].name != NULL; i++)
-		printf("%s = %f\n", self->vars[i].name, self->vars[i].val);
+	for (i = 0; i < self->var_cnt; i++)
+		printf("%s = %f\n", self->slots[i]->name, self->slots[i]->val);
 
 	printf("\nMax Stack = %u\n", self->stack);
 
@@ -734,10 +3010,10 @@ void expr_dump(struct expr *self)
 	       "-------\n");
 
 
-	for (i = 0; self->elems[i].type != EXPR_END; i++) {
-		switch (self->elems[i].type) {
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		switch (elems[i].type) {
 		case EXPR_NUM:
-			printf("%f", self->elems[i].f);
+			printf("%f", self->nums[elems[i].num]);
 		break;
 		case EXPR_NEG:
 			printf("-(1)");
@@ -758,17 +3034,98 @@ void expr_dump(struct expr *self)
 			printf("/(2)");
 		break;
 		case EXPR_VAR:
-			printf("%s", var_by_ptr(self->vars,
-			                        self->elems[i].var));
+			printf("%s", self->slots[elems[i].var]->name);
 		break;
 		case EXPR_FN1:
-			printf("%s(1)", fn_by_ptr(fn1, self->elems[i].fn->fn1));
+			printf("%s(1)", expr_fn1[elems[i].fn].name);
 		break;
 		case EXPR_FN2:
-			printf("%s(2)", fn_by_ptr(fn2, self->elems[i].fn->fn2));
+			printf("%s(2)", expr_fn2[elems[i].fn].name);
+		break;
+		case EXPR_ARG:
+			printf("$%u", elems[i].arg);
+		break;
+		case EXPR_CALL:
+			printf("%s(%u)", self->ufns[elems[i].fn]->name,
+			       self->ufns[elems[i].fn]->argc);
+		break;
+		case EXPR_LT:
+			printf("<(2)");
+		break;
+		case EXPR_LE:
+			printf("<=(2)");
+		break;
+		case EXPR_EQ:
+			printf("==(2)");
+		break;
+		case EXPR_NE:
+			printf("!=(2)");
+		break;
+		case EXPR_GE:
+			printf(">=(2)");
+		break;
+		case EXPR_GT:
+			printf(">(2)");
+		break;
+		case EXPR_AND:
+			printf("&&(2)");
+		break;
+		case EXPR_OR:
+			printf("||(2)");
+		break;
+		case EXPR_ANDJ:
+			printf("&&[+%u]", elems[i].jmp);
+		break;
+		case EXPR_ORJ:
+			printf("||[+%u]", elems[i].jmp);
+		break;
+		case EXPR_IF:
+			printf("if[+%u]", elems[i].jmp);
+		break;
+		case EXPR_ELSE:
+			printf("else[+%u]", elems[i].jmp);
+		break;
+		case EXPR_FI:
+			printf("fi");
+		break;
+		case EXPR_BIND:
+			printf("bind[+%u]", elems[i].jmp);
+		break;
+		case EXPR_BVAR:
+			printf("@%u", elems[i].arg);
+		break;
+		case EXPR_RET:
+			printf("ret");
+		break;
+		case EXPR_SOLVE:
+			printf("solve[-%u]", elems[i].jmp);
+		break;
+		case EXPR_INTEGRATE:
+			printf("integrate[-%u]", elems[i].jmp);
+		break;
+		case EXPR_SUM:
+			printf("sum[-%u]", elems[i].jmp);
+		break;
+		case EXPR_PROD:
+			printf("prod[-%u]", elems[i].jmp);
+		break;
+		case EXPR_POLY: {
+			const double *coefs = expr_poly_coefs(self, &elems[i]);
+			unsigned int j, deg = expr_poly_deg(self, &elems[i]);
+
+			printf("poly[");
+			for (j = 0; j <= deg; j++)
+				printf("%s%f", j ? "," : "", coefs[j]);
+			printf("]");
+		} break;
+		case EXPR_RAND:
+			printf("%s(0)", expr_rand_names[elems[i].fn]);
+		break;
+		case EXPR_PICK:
+			printf("#%u", elems[i].arg);
 		break;
 		default:
-			printf("invalid type %i", self->elems[i].type);
+			printf("invalid type %i", elems[i].type);
 		}
 
 		printf(" ");
@@ -777,45 +3134,112 @@ void expr_dump(struct expr *self)
 	printf("\n");
 }
 
-static double angle_conv(double angle, struct expr_ctx *ctx)
+int expr_uses_var(const struct expr *self, const struct expr_var *var)
 {
-	switch (ctx->angle_unit) {
-	case EXPR_DEGREES:
-		return angle * M_PI / 180;
-	break;
-	case EXPR_RADIANS:
-		return angle;
-	break;
-	case EXPR_GRADIANS:
-		return angle * M_PI / 200;
-	break;
+	unsigned int i;
+
+	for (i = 0; i < self->var_cnt; i++) {
+		if (self->slots[i] == var)
+			return 1;
+	}
+
+	for (i = 0; i < self->ufn_cnt; i++) {
+		if (expr_uses_var(self->ufns[i]->body, var))
+			return 1;
 	}
 
 	return 0;
 }
 
-static double eval_fn1(struct expr_elem *fn1, double par, struct expr_ctx *ctx)
+static double eval_fn1(const struct expr_fn *fn, double par, struct expr_ctx *ctx)
 {
-	if (fn1->fn->a1_in)
-		par = angle_conv(par, ctx);
+	if (fn->a1_in)
+		par *= expr_rad_factor(ctx);
 
-	par = fn1->fn->fn1(par);
+	par = fn->fn1(par);
 
-	if (fn1->fn->a_out)
-		par = angle_conv(par, ctx);
+	if (fn->a_out)
+		par /= expr_rad_factor(ctx);
 
 	return par;
 }
 
-double expr_eval(struct expr *self, struct expr_ctx *ctx)
+static double eval_fn2(const struct expr_fn *fn, double a, double b,
+                       struct expr_ctx *ctx)
 {
-	double buf[self->stack];
+	double par = fn->fn2(a, b);
+
+	if (fn->a_out)
+		par /= expr_rad_factor(ctx);
+
+	return par;
+}
+
+static double eval(const struct expr *self, unsigned int start,
+                   const double *args, double *bound, unsigned int depth,
+                   struct expr_ctx *ctx);
+
+struct bind_body {
+	const struct expr *self;
+	unsigned int start;
+	const double *args;
+	double *bound;
+	unsigned int depth;
+	struct expr_ctx *ctx;
+};
+
+static double solve_fn(double x, void *priv)
+{
+	struct bind_body *body = priv;
+
+	body->bound[body->depth] = x;
+
+	return eval(body->self, body->start, body->args,
+	            body->bound, body->depth + 1, body->ctx);
+}
+
+static void body_fn(const double *x, double *fx, size_t n, void *priv,
+                    struct expr_ctx *ctx)
+{
+	struct bind_body *body = priv;
+
+	expr_eval_body(body->self, body->start, NULL, body->args,
+	               body->bound, body->depth, x, fx, n, ctx);
+}
+
+/*
+ * Evaluates program starting at start until END or RET on the buf stack, the
+ * bound are values of the bound variables and depth is the number of bound
+ * variables.
+ *
+ * Elements from stop on are not evaluated, the check is optimized out when
+ * the stop is UINT_MAX. Cached subresults are used if memo is set, the checks
+ * are optimized out when it's NULL.
+ */
+static inline __attribute__((always_inline))
+void eval_stack(const struct expr *self, unsigned int start, unsigned int stop,
+                const double *args, double *bound, unsigned int depth,
+                struct expr_ctx *ctx, struct expr_memo *memo, double *buf)
+{
+	const struct expr_elem *elems = self->elems;
+	const struct expr_ufn *ufn;
 	unsigned int i, s = 0;
 
-	for (i = 0; self->elems[i].type != EXPR_END; i++) {
-		switch (self->elems[i].type) {
+	for (i = start; i < stop && elems[i].type != EXPR_END &&
+	     elems[i].type != EXPR_RET; i++) {
+		if (memo) {
+			unsigned int root = expr_memo_hit(memo, i, &buf[s]);
+
+			if (root) {
+				s++;
+				i = root;
+				continue;
+			}
+		}
+
+		switch (elems[i].type) {
 		case EXPR_NUM:
-			buf[s++] = self->elems[i].f;
+			buf[s++] = self->nums[elems[i].num];
 		break;
 		case EXPR_NEG:
 			buf[s - 1] = -buf[s - 1];
@@ -841,17 +3265,256 @@ double expr_eval(struct expr *self, struct expr_ctx *ctx)
 			s--;
 		break;
 		case EXPR_VAR:
-			buf[s++] = *(self->elems[i].var);
+			buf[s++] = self->slots[elems[i].var]->val;
 		break;
 		case EXPR_FN1:
-			buf[s - 1] = eval_fn1(&self->elems[i], buf[s - 1], ctx);
+			buf[s - 1] = eval_fn1(&expr_fn1[elems[i].fn].fn, buf[s - 1], ctx);
 		break;
 		case EXPR_FN2:
-			buf[s - 2] = self->elems[i].fn->fn2(buf[s - 2], buf[s - 1]);
+			buf[s - 2] = eval_fn2(&expr_fn2[elems[i].fn].fn, buf[s - 2], buf[s - 1], ctx);
+			s--;
+		break;
+		case EXPR_ARG:
+			buf[s++] = args[elems[i].arg];
+		break;
+		case EXPR_CALL: {
+			double cbound[EXPR_BIND_MAX];
+
+			ufn = self->ufns[elems[i].fn];
+			s -= ufn->argc;
+			buf[s] = eval(ufn->body, 0, &buf[s], cbound, 0, ctx);
+			s++;
+		} break;
+		case EXPR_LT:
+			buf[s - 2] = buf[s - 2] < buf[s - 1];
+			s--;
+		break;
+		case EXPR_LE:
+			buf[s - 2] = buf[s - 2] <= buf[s - 1];
+			s--;
+		break;
+		case EXPR_EQ:
+			buf[s - 2] = buf[s - 2] == buf[s - 1];
+			s--;
+		break;
+		case EXPR_NE:
+			buf[s - 2] = buf[s - 2] != buf[s - 1];
+			s--;
+		break;
+		case EXPR_GE:
+			buf[s - 2] = buf[s - 2] >= buf[s - 1];
+			s--;
+		break;
+		case EXPR_GT:
+			buf[s - 2] = buf[s - 2] > buf[s - 1];
+			s--;
+		break;
+		case EXPR_AND:
+			buf[s - 2] = buf[s - 2] != 0 && buf[s - 1] != 0;
+			s--;
+		break;
+		case EXPR_OR:
+			buf[s - 2] = buf[s - 2] != 0 || buf[s - 1] != 0;
+			s--;
+		break;
+		case EXPR_ANDJ:
+			if (buf[s - 1] == 0) {
+				buf[s - 1] = 0;
+				i += elems[i].jmp;
+			}
+		break;
+		case EXPR_ORJ:
+			if (buf[s - 1] != 0) {
+				buf[s - 1] = 1;
+				i += elems[i].jmp;
+			}
+		break;
+		case EXPR_IF:
+			if (buf[--s] == 0)
+				i += elems[i].jmp;
+		break;
+		case EXPR_ELSE:
+			i += elems[i].jmp;
+		break;
+		case EXPR_FI:
+		break;
+		case EXPR_BIND:
+			i += elems[i].jmp;
+		break;
+		case EXPR_BVAR:
+			buf[s++] = bound[elems[i].arg];
+		break;
+		case EXPR_SOLVE: {
+			struct bind_body body = {
+				.self = self,
+				.start = i - elems[i].jmp + 1,
+				.args = args,
+				.bound = bound,
+				.depth = depth,
+				.ctx = ctx,
+			};
+
+			buf[s - 2] = expr_brent_solve(buf[s - 2], buf[s - 1],
+			                              solve_fn, &body,
+			                              expr_solve_max_evals(ctx),
+			                              &ctx->solve_evals);
 			s--;
+		} break;
+		case EXPR_INTEGRATE: {
+			struct bind_body body = {
+				.self = self,
+				.start = i - elems[i].jmp + 1,
+				.args = args,
+				.bound = bound,
+				.depth = depth,
+			};
+
+			buf[s - 2] = expr_quad(buf[s - 2], buf[s - 1],
+			                       body_fn, &body, ctx);
+			s--;
+		} break;
+		case EXPR_SUM:
+		case EXPR_PROD: {
+			struct bind_body body = {
+				.self = self,
+				.start = i - elems[i].jmp + 1,
+				.args = args,
+				.bound = bound,
+				.depth = depth,
+			};
+
+			buf[s - 2] = expr_sum(buf[s - 2], buf[s - 1],
+			                      elems[i].type == EXPR_PROD,
+			                      body_fn, &body, ctx);
+			s--;
+		} break;
+		case EXPR_POLY:
+			buf[s - 1] = expr_poly_eval(expr_poly_coefs(self, &elems[i]),
+			                            expr_poly_deg(self, &elems[i]),
+			                            buf[s - 1]);
+		break;
+		case EXPR_RAND:
+			buf[s++] = expr_rand(elems[i].fn, ctx->seed, ctx->row,
+			                     expr_rand_stream(i, args, self->arg_cnt,
+			                                      bound, depth));
+		break;
+		case EXPR_PICK:
+			buf[s] = buf[elems[i].arg];
+			s++;
 		break;
 		}
+
+		/* jumps land on the root of conditionals, && and || */
+		if (memo)
+			expr_memo_store(memo, i, &buf[s]);
 	}
+}
+
+static double eval(const struct expr *self, unsigned int start,
+                   const double *args, double *bound, unsigned int depth,
+                   struct expr_ctx *ctx)
+{
+	double buf[self->stack];
+
+	eval_stack(self, start, UINT_MAX, args, bound, depth, ctx, NULL, buf);
+
+	return buf[0];
+}
+
+static double eval_memo(struct expr *self, struct expr_ctx *ctx)
+{
+	double bound[EXPR_BIND_MAX];
+	double buf[self->stack];
+
+	expr_memo_begin(self->memo, ctx);
+	eval_stack(self, 0, UINT_MAX, NULL, bound, 0, ctx, self->memo, buf);
+	expr_memo_end(self->memo, ctx);
 
 	return buf[0];
 }
+
+/*
+ * Finds the first element that raises an exception, the exceptions raised by
+ * the elements before stop only grow with the stop.
+ */
+static unsigned int fp_locate(const struct expr *self, struct expr_ctx *ctx)
+{
+	unsigned long solve_evals = ctx->solve_evals;
+	unsigned int lo = 0, hi = self->elem_cnt - 1, mid;
+	double bound[EXPR_BIND_MAX];
+	double buf[self->stack];
+
+	while (lo + 1 < hi) {
+		mid = (lo + hi) / 2;
+
+		feclearexcept(EXPR_FE_MASK);
+		eval_stack(self, 0, mid, NULL, bound, 0, ctx, NULL, buf);
+
+		if (fetestexcept(EXPR_FE_MASK))
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	ctx->solve_evals = solve_evals;
+
+	return hi - 1;
+}
+
+static double eval_prog(struct expr *self, struct expr_ctx *ctx)
+{
+	double bound[EXPR_BIND_MAX];
+	expr_int res;
+
+	/* integers have no negative zero, zero is evaluated in floating point */
+	if (self->is_int && !ctx->skip_int && !expr_eval_int(self, ctx, &res) && res)
+		return res;
+
+#ifdef EXPR_FIXED
+	double fres;
+
+	/* and so is zero in fixed point */
+	if (!expr_eval_fixed(self, ctx, &fres) && fres)
+		return fres;
+#endif
+
+	if (self->memo && !ctx->fp_check)
+		return eval_memo(self, ctx);
+
+	return eval(self, 0, NULL, bound, 0, ctx);
+}
+
+double expr_eval(struct expr *self, struct expr_ctx *ctx)
+{
+	double res;
+
+	if (self->out_cnt)
+		return NAN;
+
+	if (!ctx->fp_check)
+		return eval_prog(self, ctx);
+
+	expr_fp_begin(ctx);
+
+	res = eval_prog(self, ctx);
+
+	if (expr_fp_end(ctx) && ctx->fp_check == EXPR_FP_LOCATE)
+		ctx->fp_elem = fp_locate(self, ctx);
+
+	return res;
+}
+
+void expr_eval_multi(struct expr *self, struct expr_ctx *ctx, double res[])
+{
+	double bound[EXPR_BIND_MAX];
+	double buf[self->stack];
+
+	expr_fp_begin(ctx);
+
+	eval_stack(self, 0, UINT_MAX, NULL, bound, 0, ctx, NULL, buf);
+
+	if (expr_fp_end(ctx) && ctx->fp_check == EXPR_FP_LOCATE)
+		ctx->fp_elem = fp_locate(self, ctx);
+
+	memcpy(res, buf + self->tmp_cnt, self->out_cnt * sizeof(double));
+}
@@ -17,6 +17,8 @@
    * (binary)
    / (binary)
    ^ (binary)
+   <, <=, ==, !=, >=, > (binary, result is 0 or 1)
+   &&, || (binary, short circuit, result is 0 or 1)
 
    Expression could contain:
 
@@ -26,6 +28,13 @@
 
    Math functions:
 
+   * Conditional if(c, a, b), only the selected branch is evaluated
+   * Root finding solve(expr, x, lo, hi), finds x in [lo, hi] such that
+     expr is zero, expr has to change sign in the interval, NaN if it does
+     not converge in solve_max_evals evaluations, see struct expr_ctx
+   * Definite integral integrate(expr, x, a, b), NaN if it does not converge
+   * Sum and product sum(i, from, to, expr), prod(i, from, to, expr) over
+     i = from, from + 1, ..., to, NaN for ranges of more than 2^53 terms
    * Math functions abs, mod, rem, max, min
    * Exponential functions exp, exp2, log, log10
    * Power functions sqrt, cbrt, hypot, pow
@@ -33,6 +42,10 @@
    * Hyperbolic functions sinh, cosh, tanh, asinh, acosh, atanh
    * Error and gamma functions erf, erfc, lgamma, tgamma
    * Nearest integer floating point operations ceil, floor, trunc, round
+   * Random numbers rand() uniform in [0, 1) and randn() with standard normal
+     distribution, see struct expr_ctx
+
+   User defined functions, see expr_ufn_define().
 
    Variable named same as any supported fuction is possible but utterly
    confusing.
@@ -43,6 +56,7 @@
 #define EXPR_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
  * NULL-terminated array of these is passed to expression compiler to define
@@ -53,6 +67,8 @@
 struct expr_var {
 	const char *name;
 	double val;
+	/* bumped by expr_var_set(), see expr_memo_enable() */
+	uint64_t version;
 };
 
 /*
@@ -69,18 +85,49 @@ struct expr_fn {
 		double (*fn2)(double f1, double f2);
 		double (*fn1)(double f);
 	};
+	/* derivatives, used for automatic differentiation */
+	union {
+		void (*dfn2)(double f1, double f2, double *d1, double *d2);
+		double (*dfn1)(double f);
+	};
+	/* single precision variant, see expr_eval_batchf() */
+	union {
+		float (*ffn2)(float f1, float f2);
+		float (*ffn1)(float f);
+	};
+	/* fixed point implementation, see expr_eval_fixed() */
+	union {
+		int (*xfn2)(int64_t a, int64_t b, int64_t *res);
+		int (*xfn1)(int64_t *x);
+	};
 	/* set if angle is input/output */
 	uint32_t a1_in:1;
 	uint32_t a2_in:1;
 	uint32_t a_out:1;
+	/* interval evaluation rule, see enum expr_ival_rule */
+	uint32_t ival:5;
+	/* integer evaluation, see enum expr_int_op */
+	uint32_t iop:3;
 };
 
+/*
+ * The compiled program is position independent, elements refer to constants,
+ * variables and functions by an index so that it could be stored into a file
+ * and mapped back into memory.
+ */
 struct expr_elem {
 	uint8_t type;
 	union {
-		double f;
-		const struct expr_fn *fn;
-		const double *var;
+		/* index into constant pool */
+		uint32_t num;
+		/* index into variable slots */
+		uint32_t var;
+		/* function ID, i.e. index into function table */
+		uint32_t fn;
+		/* user function parameter index */
+		uint32_t arg;
+		/* number of elements to skip for jumps */
+		uint32_t jmp;
 	};
 };
 
@@ -90,14 +137,124 @@ enum expr_angle_unit {
 	EXPR_GRADIANS,
 };
 
+/*
+ * Floating point exception reporting, the exception flags are cleared before
+ * and tested after each evaluation, i.e. there is no cost per operation.
+ */
+enum expr_fp_check {
+	EXPR_FP_OFF,
+	/* the raised exceptions are or-ed into fp_flags */
+	EXPR_FP_FLAGS,
+	/* the element that raised them is stored into fp_elem as well */
+	EXPR_FP_LOCATE,
+};
+
+enum expr_fp_flags {
+	/* e.g. sqrt(-1), 0/0, inf - inf */
+	EXPR_FP_INVALID = 0x01,
+	/* e.g. 1/0, log(0) */
+	EXPR_FP_DIVBYZERO = 0x02,
+	EXPR_FP_OVERFLOW = 0x04,
+	EXPR_FP_UNDERFLOW = 0x08,
+};
+
 struct expr_ctx {
 	enum expr_angle_unit angle_unit;
+	/*
+	 * Maximal number of body evaluations per solve(), 0 for default, the
+	 * solve() is NaN if it does not converge before they run out.
+	 */
+	unsigned int solve_max_evals;
+	/* incremented by the number of solve() body evaluations */
+	unsigned long solve_evals;
+	/* threads used by integrate(), sum() and prod(), 0 or 1 for none */
+	unsigned int threads;
+	/*
+	 * The rand() and randn() are functions of the seed and the row, batch
+	 * evaluation adds the index of the row in the batch to the row.
+	 */
+	uint64_t seed;
+	uint64_t row;
+	/*
+	 * Aborts integrate(), sum() and prod() once non-zero, may be set from
+	 * another thread, the result of the evaluation is undefined then.
+	 */
+	const int *cancel;
+	/*
+	 * Makes expr_eval() skip the integer evaluation, for callers that
+	 * tried expr_eval_int() already.
+	 */
+	int skip_int;
+	/*
+	 * Exception reporting, see enum expr_fp_check, done by expr_eval(),
+	 * expr_eval_multi(), expr_eval_batch(), expr_eval_batch_multi() and,
+	 * without locating, by expr_eval_batchf().
+	 *
+	 * The fp_flags are never cleared by the evaluation. The fp_elem is
+	 * set to the index into the elems array of the first element that
+	 * raised an exception, for user function calls, solve(), integrate(),
+	 * sum() and prod() the exception may come from the body. The element
+	 * is found by evaluating the program again, which is slow but done
+	 * only when an exception was raised.
+	 *
+	 * Batch evaluation evaluates both branches of conditionals and
+	 * expr_eval_batchf() the padding rows of the last block, exceptions
+	 * raised by these are reported as well.
+	 */
+	enum expr_fp_check fp_check;
+	unsigned int fp_flags;
+	unsigned int fp_elem;
 };
 
+struct expr_ufn;
+struct expr_mem;
+struct expr_memo;
+
 struct expr {
 	const struct expr_var *vars;
+
+	/* variables the gradient is computed for, see expr_derive() */
+	unsigned int grad_cnt;
+	const struct expr_var **grad;
+
 	unsigned int stack;
-	struct expr_elem elems[];
+
+	/* number of elements including the terminating EXPR_END */
+	unsigned int elem_cnt;
+	unsigned int num_cnt;
+	unsigned int var_cnt;
+	unsigned int ufn_cnt;
+	/* number of parameters for user function body */
+	unsigned int arg_cnt;
+
+	const struct expr_elem *elems;
+	/* constant pool */
+	const double *nums;
+	/* variable slots, points to the variables in the vars array */
+	const struct expr_var **slots;
+	/* user functions called from the program */
+	struct expr_ufn **ufns;
+
+	/* set if the program may be evaluated in integers */
+	unsigned int is_int;
+
+	/*
+	 * Programs created by expr_create_multi() leave the shared
+	 * subexpressions and the results on the stack.
+	 */
+	unsigned int tmp_cnt;
+	unsigned int out_cnt;
+
+	/* set if program was loaded by expr_load() */
+	void *map;
+	size_t map_size;
+
+	/* set if program was allocated from an arena or a pool */
+	struct expr_mem *mem;
+	size_t mem_size;
+
+	/* cached subresults, see expr_memo_enable() */
+	struct expr_memo *memo;
 };
 
 /*
@@ -117,14 +274,348 @@ struct expr *expr_create(const char *expr,
  */
 void expr_destroy(struct expr *self);
 
+/*
+ * Compiles a NULL-terminated array of expressions into a single program with
+ * one result per expression.
+ *
+ * Subexpressions that appear more than once, in the same or in different
+ * expressions, are evaluated only once. Branches of conditionals, && and ||
+ * are not shared, so that nothing is evaluated that would not be evaluated
+ * otherwise, and neither are subexpressions that use rand(). The rand()
+ * streams depend on the position in the program, i.e. the numbers differ from
+ * the ones of the expressions compiled separately.
+ *
+ * The program can be evaluated only by expr_eval_multi() and
+ * expr_eval_batch_multi(), it can't be saved into a file. The functions for
+ * single result programs return NaN, an empty interval or an error for it.
+ *
+ * When an expression fails to compile err is filled for the expression and
+ * NULL is returned.
+ */
+struct expr *expr_create_multi(const char *const exprs[],
+                               const struct expr_var vars[],
+                               struct expr_err *err);
+
+/*
+ * Allocation statistics of an arena or a pool.
+ */
+struct expr_mem_stats {
+	/* number of programs allocated and freed */
+	size_t allocs;
+	size_t frees;
+	/* bytes in live programs and its maximum */
+	size_t used;
+	size_t peak;
+	/* bytes allocated by malloc() */
+	size_t reserved;
+};
+
+/*
+ * Arena for short-lived programs, programs are allocated by bumping a pointer
+ * and all of them are freed at once by expr_arena_reset().
+ *
+ * The chunk_size is the size of blocks allocated by malloc(), 0 for default.
+ *
+ * Neither the arena nor the pool is thread safe.
+ */
+struct expr_arena *expr_arena_create(size_t chunk_size);
+
+/*
+ * Same as expr_create() but the program is allocated from the arena.
+ *
+ * The expr_destroy() is a no-op for such program.
+ */
+struct expr *expr_create_arena(const char *expr, const struct expr_var vars[],
+                               struct expr_arena *arena, struct expr_err *err);
+
+/*
+ * Frees all programs allocated from the arena, the memory is kept for reuse.
+ *
+ * Runs in constant time apart from releasing user functions called by the
+ * programs and the memos, see expr_memo_enable().
+ */
+void expr_arena_reset(struct expr_arena *self);
+
+void expr_arena_destroy(struct expr_arena *self);
+
+void expr_arena_stats(const struct expr_arena *self, struct expr_mem_stats *stats);
+
+/*
+ * Pool for long-lived programs, freed programs are kept in per size class
+ * free lists and reused.
+ */
+struct expr_pool *expr_pool_create(void);
+
+/*
+ * Same as expr_create() but the program is allocated from the pool, the
+ * expr_destroy() returns it to the pool.
+ */
+struct expr *expr_create_pool(const char *expr, const struct expr_var vars[],
+                              struct expr_pool *pool, struct expr_err *err);
+
+/*
+ * Frees the pool, all programs allocated from it must be destroyed before.
+ */
+void expr_pool_destroy(struct expr_pool *self);
+
+void expr_pool_stats(const struct expr_pool *self, struct expr_mem_stats *stats);
+
 /*
  * Dumps list of variables and compiled expression into stdout.
  */
 void expr_dump(struct expr *self);
 
+/*
+ * Returns non-zero if the expression, or any user function it calls, reads
+ * the variable.
+ */
+int expr_uses_var(const struct expr *self, const struct expr_var *var);
+
 /*
  * Evaluates compiled expression. Returns floating point number.
+ *
+ * Integer expressions are evaluated as in expr_eval_int() and the result is
+ * rounded only once, unless skip_int is set in the ctx. Zero results are
+ * evaluated in floating point so that the sign of zero is kept.
  */
 double expr_eval(struct expr *self, struct expr_ctx *ctx);
 
+/*
+ * Sets the variable value, the cached subresults that depend on the variable
+ * are recomputed by the next expr_eval(). Setting the value the variable
+ * already has keeps them.
+ */
+void expr_var_set(struct expr_var *var, double val);
+
+/*
+ * Enables caching of subresults in expr_eval().
+ *
+ * Subexpressions with costly operations, e.g. tgamma() or integrate(), are
+ * cached if they depend on a different set of variables than the enclosing
+ * expression, the result is cached as well. A cached value is reused until
+ * any of the variables it depends on is changed by expr_var_set(), variables
+ * modified directly are not noticed. Subexpressions that use rand() are never
+ * cached and conditionals, && and || are cached only as a whole.
+ *
+ * The cache is dropped when the angle unit or the solve_max_evals changes and
+ * when the evaluation is cancelled. It's not used when fp_check is set and
+ * solve() evaluations of cached subresults are not counted in solve_evals.
+ *
+ * The program must not be evaluated from more threads at once.
+ *
+ * Returns non-zero on allocation failure and for programs created by
+ * expr_create_multi().
+ */
+int expr_memo_enable(struct expr *self);
+
+struct expr_memo_stats {
+	/* number of cached subexpressions */
+	unsigned int points;
+	/* subresults reused and computed */
+	unsigned long hits;
+	unsigned long misses;
+};
+
+void expr_memo_stats(const struct expr *self, struct expr_memo_stats *stats);
+
+/*
+ * Evaluates program created by expr_create_multi(), the results are stored
+ * into the res array in the order of the expressions.
+ */
+void expr_eval_multi(struct expr *self, struct expr_ctx *ctx, double res[]);
+
+#ifdef __SIZEOF_INT128__
+typedef __int128 expr_int;
+#else
+typedef int64_t expr_int;
+#endif
+
+/*
+ * Evaluates compiled expression exactly in integers.
+ *
+ * Only +, -, *, ^, comparisons, conditionals, abs, mod, rem, max, min and
+ * rounding functions are supported. Division and negative powers are
+ * supported only when the result is an integer, constants and variables have
+ * to be integers not greater than 2^53 in magnitude.
+ *
+ * Returns zero and stores the result on success, non-zero if the expression
+ * is not an integer one or the result overflows, the expression has to be
+ * evaluated by expr_eval() then.
+ */
+int expr_eval_int(struct expr *self, struct expr_ctx *ctx, expr_int *res);
+
+/*
+ * Formats integer in decimal, returns buf.
+ */
+char *expr_int_str(expr_int val, char *buf, size_t size);
+
+/*
+ * Evaluates compiled expression in Q31.32 fixed point, i.e. without floating
+ * point operations apart from the conversion of the result.
+ *
+ * Returns zero and stores the result on success, non-zero if the expression
+ * calls a function without fixed point implementation, uses solve(),
+ * integrate(), sum() or prod(), if a value does not fit into the format, or
+ * if a nonzero value is below 2^-20 and would lose precision.
+ *
+ * When compiled with EXPR_FIXED defined, expr_eval() tries the fixed point
+ * evaluation first.
+ */
+int expr_eval_fixed(struct expr *self, struct expr_ctx *ctx, double *res);
+
+/*
+ * Creates a program that evaluates the value along with the gradient in a
+ * single pass using forward mode automatic differentiation.
+ *
+ * The wrt is a NULL-terminated array of variable names the gradient is
+ * computed for.
+ */
+struct expr *expr_derive(struct expr *self, const char *const wrt[],
+                         struct expr_err *err);
+
+/*
+ * Evaluates program created by expr_derive(), the gradient is stored into the
+ * grad array in the order of the wrt array.
+ */
+double expr_eval_grad(struct expr *self, struct expr_ctx *ctx, double grad[]);
+
+/*
+ * Evaluates compiled expression for n rows at once.
+ *
+ * The cols array is indexed in the same order as the vars array passed to
+ * expr_create(), if cols is NULL or cols[i] is NULL the variable value is used
+ * for all rows. Results are stored into the res array.
+ *
+ * Conditionals are evaluated without branches, i.e. both branches are
+ * evaluated and the result is selected.
+ */
+void expr_eval_batch(struct expr *self, struct expr_ctx *ctx,
+                     const double *const cols[], double *res, size_t n);
+
+/*
+ * Evaluates program created by expr_create_multi() for n rows at once, the
+ * res[i] is the result column for the i-th expression.
+ */
+void expr_eval_batch_multi(struct expr *self, struct expr_ctx *ctx,
+                           const double *const cols[], double *const res[],
+                           size_t n);
+
+/*
+ * Same as expr_eval_batch() but in single precision, i.e. with twice as many
+ * rows per SIMD instruction. Constants and variable values are rounded to
+ * float.
+ *
+ * Expressions with solve(), integrate(), sum() or prod() are evaluated in
+ * double and the results are rounded.
+ */
+void expr_eval_batchf(struct expr *self, struct expr_ctx *ctx,
+                      const float *const cols[], float *res, size_t n);
+
+/*
+ * Evaluates compiled expression for n values of var in an arithmetic
+ * progression, i.e. res[i] is the value for var = x0 + i * dx, other
+ * variables keep their values.
+ *
+ * Subexpressions that are low degree polynomials in var are computed
+ * incrementally with forward differences, subexpressions that do not depend
+ * on var are evaluated only once per block of rows. The rest is evaluated as
+ * in expr_eval_batch().
+ */
+void expr_eval_range(struct expr *self, struct expr_ctx *ctx,
+                     const struct expr_var *var, double x0, double dx,
+                     double *res, size_t n);
+
+/*
+ * Closed interval [lo, hi], empty interval is represented by NaN bounds.
+ */
+struct expr_ival {
+	double lo, hi;
+};
+
+/*
+ * Evaluates compiled expression for all variable values in a box.
+ *
+ * The ivals array is indexed in the same order as the vars array passed to
+ * expr_create(), if ivals is NULL or ivals[i] is NULL the variable value is
+ * used.
+ *
+ * The result is guaranteed to contain the value of the expression for any
+ * point in the box where the expression is defined, empty interval means that
+ * it is not defined anywhere in the box. The bounds are not necessarily
+ * tight, e.g. x - x evaluates to [lo - hi, hi - lo].
+ */
+struct expr_ival expr_eval_interval(struct expr *self, struct expr_ctx *ctx,
+                                    const struct expr_ival *const ivals[]);
+
+/*
+ * Defines a function in the form "f(x, y) = x*y + sin(x)".
+ *
+ * The function body may use the parameters, variables from the vars array and
+ * previously defined functions. Once defined the function can be called from
+ * any expression passed to expr_create(). Small functions are inlined into
+ * the caller, larger are called.
+ *
+ * Redefinition replaces the function for newly compiled expressions, already
+ * compiled expressions continue to use the old definition. The builtin
+ * functions, if(), solve(), integrate(), sum(), prod(), rand() and randn()
+ * cannot be redefined.
+ *
+ * The function registry is global and not thread safe.
+ *
+ * Returns zero on success, non-zero and fills err on a failure.
+ */
+int expr_ufn_define(const char *def, const struct expr_var vars[],
+                    struct expr_err *err);
+
+/*
+ * Removes function from the registry.
+ *
+ * Returns non-zero if function was not defined.
+ */
+int expr_ufn_undefine(const char *name);
+
+/*
+ * Compiled programs could be stored into a binary file.
+ *
+ * The variables are stored by names and bound to the vars array when the
+ * program is loaded, functions are stored by IDs.
+ */
+
+/*
+ * Serializes compiled program into a buffer.
+ *
+ * Returns number of bytes needed, if size is too small nothing is written, so
+ * that the function can be called with NULL buffer to get the size.
+ *
+ * Returns 0 for programs created by expr_create_multi().
+ */
+size_t expr_serialize(struct expr *self, void *buf, size_t size);
+
+/*
+ * Saves compiled program into a file.
+ *
+ * Returns zero on success, non-zero and sets errno on a failure, errno is
+ * EINVAL for programs created by expr_create_multi().
+ */
+int expr_save(struct expr *self, const char *path);
+
+/*
+ * Creates expression from a serialized program.
+ *
+ * The program is not copied, the buffer must not be modified or freed until
+ * the expression is destroyed.
+ */
+struct expr *expr_load_buf(const void *buf, size_t size,
+                           const struct expr_var vars[],
+                           struct expr_err *err);
+
+/*
+ * Maps a file created by expr_save() into memory and creates an expression.
+ *
+ * The file is unmapped in expr_destroy().
+ */
+struct expr *expr_load(const char *path,
+                       const struct expr_var vars[],
+                       struct expr_err *err);
+
 #endif /* EXPR_H__ */
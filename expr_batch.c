@@ -0,0 +1,623 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Batch evaluation, the program is evaluated for a block of rows at a time
+   with each element processed for the whole block in a tight loop that can
+   be vectorized by the compiler.
+
+   Jumps are ignored and the conditionals are evaluated as a select so that
+   the loops do not contain branches.
+
+   The solve() runs the Brent's method for all rows in lockstep, i.e. the
+   body is evaluated for the whole block at each iteration.
+
+   The integrate(), sum() and prod() are done for each row separately, the
+   body is evaluated in blocks for the quadrature nodes or the index range.
+
+   The rand() gets the row index from the context plus the index of the row
+   in the batch, the bodies of the bound variables inherit it from the row.
+
+  */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <string.h>
+
+#include "expr_priv.h"
+
+/* Number of rows evaluated at once */
+#define BLOCK 64
+
+static void fill(double *dst, double val, unsigned int n)
+{
+	unsigned int k;
+
+	for (k = 0; k < n; k++)
+		dst[k] = val;
+}
+
+static void eval_block(const struct expr *self, unsigned int start,
+                       const double *const vcols[], const double *const args[],
+                       const double *const bcols[], unsigned int depth,
+                       const uint64_t *rows, double *res, unsigned int n,
+                       struct expr_ctx *ctx);
+
+static void eval_solve(const struct expr *self, unsigned int start,
+                       const double *const vcols[], const double *const args[],
+                       const double *const bcols[], unsigned int depth,
+                       const uint64_t *rows, double *lo, const double *hi,
+                       unsigned int n, struct expr_ctx *ctx)
+{
+	struct expr_brent brent[n];
+	const double *sbcols[EXPR_BIND_MAX];
+	double x[BLOCK], flo[BLOCK], fhi[BLOCK];
+	unsigned int k, evals, active, max = expr_solve_max_evals(ctx);
+
+	memcpy(sbcols, bcols, depth * sizeof(*bcols));
+	sbcols[depth] = x;
+
+	memcpy(x, lo, n * sizeof(double));
+	eval_block(self, start, vcols, args, sbcols, depth + 1, rows, flo,
+	           n, ctx);
+	memcpy(x, hi, n * sizeof(double));
+	eval_block(self, start, vcols, args, sbcols, depth + 1, rows, fhi,
+	           n, ctx);
+
+	for (k = 0; k < n; k++)
+		expr_brent_init(&brent[k], lo[k], flo[k], hi[k], fhi[k]);
+
+	ctx->solve_evals += 2 * n;
+
+	for (evals = 2; evals < max; evals++) {
+		active = 0;
+
+		for (k = 0; k < n; k++) {
+			if (expr_brent_step(&brent[k]))
+				active++;
+			x[k] = brent[k].b;
+		}
+
+		if (!active)
+			break;
+
+		eval_block(self, start, vcols, args, sbcols, depth + 1, rows, flo,
+		           n, ctx);
+
+		for (k = 0; k < n; k++) {
+			if (!brent[k].done)
+				expr_brent_update(&brent[k], flo[k]);
+		}
+
+		ctx->solve_evals += active;
+	}
+
+	/* NaN where the evaluations ran out before it converged */
+	for (k = 0; k < n; k++)
+		lo[k] = expr_brent_step(&brent[k]) ? NAN : brent[k].b;
+}
+
+struct body_row {
+	const struct expr *self;
+	unsigned int start;
+	const double *vals;
+	const double *args;
+	const double *bound;
+	unsigned int depth;
+};
+
+static void row_fn(const double *x, double *fx, size_t n, void *priv,
+                   struct expr_ctx *ctx)
+{
+	struct body_row *row = priv;
+
+	expr_eval_body(row->self, row->start, row->vals, row->args,
+	               row->bound, row->depth, x, fx, n, ctx);
+}
+
+/*
+ * Evaluates integrate(), sum() or prod() for each row.
+ */
+static void eval_rows(const struct expr *self, unsigned int op,
+                      unsigned int start,
+                      const double *const vcols[], const double *const args[],
+                      const double *const bcols[], unsigned int depth,
+                      const uint64_t *rows, double *a, const double *b,
+                      unsigned int n, struct expr_ctx *ctx)
+{
+	double vals[self->var_cnt + 1];
+	double rargs[self->arg_cnt + 1];
+	double bound[EXPR_BIND_MAX];
+	struct body_row body = {
+		.self = self,
+		.start = start,
+		.vals = vals,
+		.args = rargs,
+		.bound = bound,
+		.depth = depth,
+	};
+	uint64_t row = ctx->row;
+	unsigned int i, k;
+
+	for (k = 0; k < n; k++) {
+		for (i = 0; i < self->var_cnt; i++)
+			vals[i] = vcols && vcols[i] ? vcols[i][k] : self->slots[i]->val;
+
+		for (i = 0; i < self->arg_cnt; i++)
+			rargs[i] = args[i][k];
+
+		for (i = 0; i < depth; i++)
+			bound[i] = bcols[i][k];
+
+		/* the body is evaluated for the row of the operator */
+		ctx->row = rows[k];
+
+		if (op == EXPR_INTEGRATE)
+			a[k] = expr_quad(a[k], b[k], row_fn, &body, ctx);
+		else
+			a[k] = expr_sum(a[k], b[k], op == EXPR_PROD, row_fn, &body, ctx);
+	}
+
+	ctx->row = row;
+}
+
+static void eval_rand(const struct expr *self, unsigned int pos,
+                      const double *const args[], const double *const bcols[],
+                      unsigned int depth, const uint64_t *rows,
+                      double *res, unsigned int n, struct expr_ctx *ctx)
+{
+	unsigned int i, k;
+
+	for (k = 0; k < n; k++) {
+		uint64_t stream = pos;
+
+		for (i = 0; i < self->arg_cnt; i++)
+			stream = expr_rand_mix(stream, args[i][k]);
+
+		for (i = 0; i < depth; i++)
+			stream = expr_rand_mix(stream, bcols[i][k]);
+
+		res[k] = expr_rand(self->elems[pos].fn, ctx->seed, rows[k], stream);
+	}
+}
+
+/*
+ * Evaluates program starting at start until END or RET on the buf stack, the
+ * bcols are values of the bound variables and depth is the number of bound
+ * variables.
+ *
+ * Elements from stop on are not evaluated, the check is optimized out when
+ * the stop is UINT_MAX.
+ */
+static inline __attribute__((always_inline))
+void eval_stack(const struct expr *self, unsigned int start, unsigned int stop,
+                const double *const vcols[], const double *const args[],
+                const double *const bcols[], unsigned int depth,
+                const uint64_t *rows, double buf[][BLOCK],
+                unsigned int n, struct expr_ctx *ctx)
+{
+	const struct expr_elem *elems = self->elems;
+	double rad = expr_rad_factor(ctx);
+	const struct expr_fn *fn;
+	const struct expr_ufn *ufn;
+	unsigned int i, k, s = 0;
+
+	for (i = start; i < stop && elems[i].type != EXPR_END &&
+	     elems[i].type != EXPR_RET; i++) {
+		double *a = s > 1 ? buf[s - 2] : NULL;
+		double *b = s > 0 ? buf[s - 1] : NULL;
+
+		switch (elems[i].type) {
+		case EXPR_NUM:
+			fill(buf[s++], self->nums[elems[i].num], n);
+		break;
+		case EXPR_VAR:
+			if (vcols && vcols[elems[i].var])
+				memcpy(buf[s++], vcols[elems[i].var], n * sizeof(double));
+			else
+				fill(buf[s++], self->slots[elems[i].var]->val, n);
+		break;
+		case EXPR_ARG:
+			memcpy(buf[s++], args[elems[i].arg], n * sizeof(double));
+		break;
+		case EXPR_NEG:
+			for (k = 0; k < n; k++)
+				b[k] = -b[k];
+		break;
+		case EXPR_ADD:
+			for (k = 0; k < n; k++)
+				a[k] += b[k];
+			s--;
+		break;
+		case EXPR_SUB:
+			for (k = 0; k < n; k++)
+				a[k] -= b[k];
+			s--;
+		break;
+		case EXPR_MUL:
+			for (k = 0; k < n; k++)
+				a[k] *= b[k];
+			s--;
+		break;
+		case EXPR_DIV:
+			for (k = 0; k < n; k++)
+				a[k] /= b[k];
+			s--;
+		break;
+		case EXPR_POW:
+			for (k = 0; k < n; k++)
+				a[k] = pow(a[k], b[k]);
+			s--;
+		break;
+		case EXPR_FN1:
+			fn = &expr_fn1[elems[i].fn].fn;
+
+			if (fn->a1_in) {
+				for (k = 0; k < n; k++)
+					b[k] *= rad;
+			}
+
+			for (k = 0; k < n; k++)
+				b[k] = fn->fn1(b[k]);
+
+			if (fn->a_out) {
+				for (k = 0; k < n; k++)
+					b[k] /= rad;
+			}
+		break;
+		case EXPR_FN2:
+			fn = &expr_fn2[elems[i].fn].fn;
+
+			for (k = 0; k < n; k++)
+				a[k] = fn->fn2(a[k], b[k]);
+
+			if (fn->a_out) {
+				for (k = 0; k < n; k++)
+					a[k] /= rad;
+			}
+			s--;
+		break;
+		case EXPR_CALL: {
+			ufn = self->ufns[elems[i].fn];
+			s -= ufn->argc;
+
+			const double *cargs[ufn->argc];
+
+			for (k = 0; k < ufn->argc; k++)
+				cargs[k] = buf[s + k];
+
+			const double *cbcols[EXPR_BIND_MAX];
+
+			eval_block(ufn->body, 0, NULL, cargs, cbcols, 0, rows, buf[s], n,
+			           ctx);
+			s++;
+		} break;
+		case EXPR_LT:
+			for (k = 0; k < n; k++)
+				a[k] = a[k] < b[k];
+			s--;
+		break;
+		case EXPR_LE:
+			for (k = 0; k < n; k++)
+				a[k] = a[k] <= b[k];
+			s--;
+		break;
+		case EXPR_EQ:
+			for (k = 0; k < n; k++)
+				a[k] = a[k] == b[k];
+			s--;
+		break;
+		case EXPR_NE:
+			for (k = 0; k < n; k++)
+				a[k] = a[k] != b[k];
+			s--;
+		break;
+		case EXPR_GE:
+			for (k = 0; k < n; k++)
+				a[k] = a[k] >= b[k];
+			s--;
+		break;
+		case EXPR_GT:
+			for (k = 0; k < n; k++)
+				a[k] = a[k] > b[k];
+			s--;
+		break;
+		case EXPR_AND:
+			for (k = 0; k < n; k++)
+				a[k] = (a[k] != 0) & (b[k] != 0);
+			s--;
+		break;
+		case EXPR_OR:
+			for (k = 0; k < n; k++)
+				a[k] = (a[k] != 0) | (b[k] != 0);
+			s--;
+		break;
+		case EXPR_ANDJ:
+		case EXPR_ORJ:
+		case EXPR_IF:
+		case EXPR_ELSE:
+		break;
+		case EXPR_FI: {
+			double *c = buf[s - 3];
+
+			for (k = 0; k < n; k++)
+				c[k] = c[k] != 0 ? a[k] : b[k];
+			s -= 2;
+		} break;
+		case EXPR_BIND:
+			i += elems[i].jmp;
+		break;
+		case EXPR_BVAR:
+			memcpy(buf[s++], bcols[elems[i].arg], n * sizeof(double));
+		break;
+		case EXPR_SOLVE:
+			eval_solve(self, i - elems[i].jmp + 1, vcols, args, bcols,
+			           depth, rows, a, b, n, ctx);
+			s--;
+		break;
+		case EXPR_INTEGRATE:
+		case EXPR_SUM:
+		case EXPR_PROD:
+			eval_rows(self, elems[i].type, i - elems[i].jmp + 1, vcols,
+			          args, bcols, depth, rows, a, b, n, ctx);
+			s--;
+		break;
+		case EXPR_POLY: {
+			const double *coefs = expr_poly_coefs(self, &elems[i]);
+			unsigned int j, deg = expr_poly_deg(self, &elems[i]);
+			double x[BLOCK];
+
+			/* coefficient by coefficient so that the rows are independent */
+			memcpy(x, b, n * sizeof(double));
+			fill(b, coefs[0], n);
+
+			for (j = 1; j <= deg; j++) {
+				for (k = 0; k < n; k++)
+					b[k] = fma(b[k], x[k], coefs[j]);
+			}
+		} break;
+		case EXPR_RAND:
+			eval_rand(self, i, args, bcols, depth, rows, buf[s++], n, ctx);
+		break;
+		case EXPR_PICK:
+			memcpy(buf[s], buf[elems[i].arg], n * sizeof(double));
+			s++;
+		break;
+		}
+	}
+}
+
+static void eval_block(const struct expr *self, unsigned int start,
+                       const double *const vcols[], const double *const args[],
+                       const double *const bcols[], unsigned int depth,
+                       const uint64_t *rows, double *res, unsigned int n,
+                       struct expr_ctx *ctx)
+{
+	double buf[self->stack][BLOCK];
+
+	eval_stack(self, start, UINT_MAX, vcols, args, bcols, depth, rows, buf,
+	           n, ctx);
+
+	memcpy(res, buf[0], n * sizeof(double));
+}
+
+void expr_eval_cols(const struct expr *self, const double *const vcols[],
+                    const double *const args[], double *res, size_t n,
+                    struct expr_ctx *ctx)
+{
+	const double *vc[self->var_cnt + 1];
+	const double *ac[self->arg_cnt + 1];
+	const double *bcols[EXPR_BIND_MAX];
+	uint64_t rows[BLOCK];
+	unsigned int i, k;
+	size_t off;
+
+	for (off = 0; off < n; off += BLOCK) {
+		unsigned int cnt = n - off < BLOCK ? n - off : BLOCK;
+
+		for (i = 0; i < self->var_cnt; i++)
+			vc[i] = vcols && vcols[i] ? vcols[i] + off : NULL;
+
+		for (i = 0; i < self->arg_cnt; i++)
+			ac[i] = args[i] + off;
+
+		for (k = 0; k < cnt; k++)
+			rows[k] = ctx->row + off + k;
+
+		eval_block(self, 0, vc, ac, bcols, 0, rows, res + off, cnt, ctx);
+	}
+}
+
+int expr_slot_col(const struct expr *self, unsigned int slot)
+{
+	const struct expr_var *var = self->slots[slot];
+	unsigned int vars_cnt = 0;
+
+	if (!self->vars)
+		return -1;
+
+	while (self->vars[vars_cnt].name)
+		vars_cnt++;
+
+	/* inlined functions may use variables that are not in the vars array */
+	if (var < self->vars || var >= self->vars + vars_cnt)
+		return -1;
+
+	return var - self->vars;
+}
+
+/*
+ * Finds the first element that raises an exception in the first block that
+ * raises any, see fp_locate() in expr.c.
+ */
+static void fp_locate(const struct expr *self, const double *const slot_cols[],
+                      size_t n, struct expr_ctx *ctx)
+{
+	unsigned long solve_evals = ctx->solve_evals;
+	const double *vc[self->var_cnt + 1];
+	const double *bcols[EXPR_BIND_MAX];
+	double buf[self->stack][BLOCK];
+	uint64_t rows[BLOCK];
+	unsigned int i, k, lo, hi, mid;
+	size_t off;
+
+	for (off = 0; off < n; off += BLOCK) {
+		unsigned int cnt = n - off < BLOCK ? n - off : BLOCK;
+
+		for (i = 0; i < self->var_cnt; i++)
+			vc[i] = slot_cols[i] ? slot_cols[i] + off : NULL;
+
+		for (k = 0; k < cnt; k++)
+			rows[k] = ctx->row + off + k;
+
+		feclearexcept(EXPR_FE_MASK);
+		eval_stack(self, 0, UINT_MAX, vc, NULL, bcols, 0, rows, buf, cnt,
+		           ctx);
+
+		if (!fetestexcept(EXPR_FE_MASK))
+			continue;
+
+		lo = 0;
+		hi = self->elem_cnt - 1;
+
+		while (lo + 1 < hi) {
+			mid = (lo + hi) / 2;
+
+			feclearexcept(EXPR_FE_MASK);
+			eval_stack(self, 0, mid, vc, NULL, bcols, 0, rows, buf, cnt,
+			           ctx);
+
+			if (fetestexcept(EXPR_FE_MASK))
+				hi = mid;
+			else
+				lo = mid;
+		}
+
+		ctx->fp_elem = hi - 1;
+		break;
+	}
+
+	ctx->solve_evals = solve_evals;
+}
+
+void expr_eval_batch(struct expr *self, struct expr_ctx *ctx,
+                     const double *const cols[], double *res, size_t n)
+{
+	const double *slot_cols[self->var_cnt + 1];
+	size_t k;
+	unsigned int i;
+
+	if (self->out_cnt) {
+		for (k = 0; k < n; k++)
+			res[k] = NAN;
+		return;
+	}
+
+	for (i = 0; i < self->var_cnt; i++) {
+		int col = expr_slot_col(self, i);
+
+		slot_cols[i] = cols && col >= 0 ? cols[col] : NULL;
+	}
+
+	expr_fp_begin(ctx);
+
+	expr_eval_cols(self, slot_cols, NULL, res, n, ctx);
+
+	if (expr_fp_end(ctx) && ctx->fp_check == EXPR_FP_LOCATE)
+		fp_locate(self, slot_cols, n, ctx);
+}
+
+void expr_eval_batch_multi(struct expr *self, struct expr_ctx *ctx,
+                           const double *const cols[], double *const res[],
+                           size_t n)
+{
+	const double *slot_cols[self->var_cnt + 1];
+	const double *vc[self->var_cnt + 1];
+	const double *bcols[EXPR_BIND_MAX];
+	double buf[self->stack][BLOCK];
+	uint64_t rows[BLOCK];
+	unsigned int i, k;
+	size_t off;
+
+	for (i = 0; i < self->var_cnt; i++) {
+		int col = expr_slot_col(self, i);
+
+		slot_cols[i] = cols && col >= 0 ? cols[col] : NULL;
+	}
+
+	expr_fp_begin(ctx);
+
+	for (off = 0; off < n; off += BLOCK) {
+		unsigned int cnt = n - off < BLOCK ? n - off : BLOCK;
+
+		for (i = 0; i < self->var_cnt; i++)
+			vc[i] = slot_cols[i] ? slot_cols[i] + off : NULL;
+
+		for (k = 0; k < cnt; k++)
+			rows[k] = ctx->row + off + k;
+
+		eval_stack(self, 0, UINT_MAX, vc, NULL, bcols, 0, rows, buf, cnt,
+		           ctx);
+
+		for (i = 0; i < self->out_cnt; i++)
+			memcpy(res[i] + off, buf[self->tmp_cnt + i], cnt * sizeof(double));
+	}
+
+	if (expr_fp_end(ctx) && ctx->fp_check == EXPR_FP_LOCATE)
+		fp_locate(self, slot_cols, n, ctx);
+}
+
+void expr_eval_body(const struct expr *self, unsigned int start,
+                    const double *vals, const double *args,
+                    const double *bound, unsigned int depth,
+                    const double *x, double *res, size_t n,
+                    struct expr_ctx *ctx)
+{
+	double vbuf[self->var_cnt + 1][BLOCK];
+	double abuf[self->arg_cnt + 1][BLOCK];
+	double bbuf[depth + 1][BLOCK];
+	const double *vcols[self->var_cnt + 1];
+	const double *acols[self->arg_cnt + 1];
+	const double *bcols[EXPR_BIND_MAX];
+	uint64_t rows[BLOCK];
+	unsigned int i;
+	size_t off;
+
+	/* the body is evaluated for the row of the operator */
+	for (i = 0; i < BLOCK; i++)
+		rows[i] = ctx->row;
+
+	for (i = 0; i < self->var_cnt; i++) {
+		vcols[i] = NULL;
+
+		if (vals) {
+			fill(vbuf[i], vals[i], BLOCK);
+			vcols[i] = vbuf[i];
+		}
+	}
+
+	for (i = 0; i < self->arg_cnt; i++) {
+		fill(abuf[i], args[i], BLOCK);
+		acols[i] = abuf[i];
+	}
+
+	for (i = 0; i < depth; i++) {
+		fill(bbuf[i], bound[i], BLOCK);
+		bcols[i] = bbuf[i];
+	}
+
+	for (off = 0; off < n; off += BLOCK) {
+		unsigned int cnt = n - off < BLOCK ? n - off : BLOCK;
+
+		bcols[depth] = x + off;
+
+		eval_block(self, start, vcols, acols, bcols, depth + 1, rows,
+		           res + off, cnt, ctx);
+	}
+}
@@ -0,0 +1,348 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Single precision batch evaluation, same as expr_batch.c but with floats
+   so that twice as many rows fit into a SIMD register.
+
+   The element loops always run over the whole block, the number of
+   iterations is then known at compile time and the loops are vectorized
+   without runtime checks. On x86-64 the evaluator is compiled for AVX2 and
+   AVX-512 as well and the variant is selected at runtime.
+
+   Programs with bound variables are evaluated by the double evaluator since
+   solve(), integrate(), sum() and prod() need the precision anyway.
+
+  */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "expr_priv.h"
+
+/* Number of rows evaluated at once, same size as the double block */
+#define BLOCK 128
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define SIMD_CLONES \
+	__attribute__((target_clones("default", "arch=x86-64-v3", "arch=x86-64-v4")))
+#else
+# define SIMD_CLONES
+#endif
+
+static void fill(float *dst, float val)
+{
+	unsigned int k;
+
+	for (k = 0; k < BLOCK; k++)
+		dst[k] = val;
+}
+
+/*
+ * The rows past n are computed too, ones keep most of the functions in their
+ * domain.
+ */
+static void load(float *dst, const float *src, unsigned int n)
+{
+	unsigned int k;
+
+	memcpy(dst, src, n * sizeof(float));
+
+	for (k = n; k < BLOCK; k++)
+		dst[k] = 1;
+}
+
+static void op2(unsigned int type, float *restrict a, const float *restrict b)
+{
+	unsigned int k;
+
+	switch (type) {
+	case EXPR_ADD:
+		for (k = 0; k < BLOCK; k++)
+			a[k] += b[k];
+	break;
+	case EXPR_SUB:
+		for (k = 0; k < BLOCK; k++)
+			a[k] -= b[k];
+	break;
+	case EXPR_MUL:
+		for (k = 0; k < BLOCK; k++)
+			a[k] *= b[k];
+	break;
+	case EXPR_DIV:
+		for (k = 0; k < BLOCK; k++)
+			a[k] /= b[k];
+	break;
+	case EXPR_POW:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = powf(a[k], b[k]);
+	break;
+	case EXPR_LT:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = a[k] < b[k];
+	break;
+	case EXPR_LE:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = a[k] <= b[k];
+	break;
+	case EXPR_EQ:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = a[k] == b[k];
+	break;
+	case EXPR_NE:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = a[k] != b[k];
+	break;
+	case EXPR_GE:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = a[k] >= b[k];
+	break;
+	case EXPR_GT:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = a[k] > b[k];
+	break;
+	case EXPR_AND:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = (a[k] != 0) & (b[k] != 0);
+	break;
+	case EXPR_OR:
+		for (k = 0; k < BLOCK; k++)
+			a[k] = (a[k] != 0) | (b[k] != 0);
+	break;
+	}
+}
+
+static void scale(float *a, float f)
+{
+	unsigned int k;
+
+	for (k = 0; k < BLOCK; k++)
+		a[k] *= f;
+}
+
+static void pick(float *restrict c, const float *restrict a,
+                 const float *restrict b)
+{
+	unsigned int k;
+
+	for (k = 0; k < BLOCK; k++)
+		c[k] = c[k] != 0 ? a[k] : b[k];
+}
+
+static void poly(float *restrict b, const double *coefs, unsigned int deg)
+{
+	float x[BLOCK];
+	unsigned int j, k;
+
+	/* coefficient by coefficient so that the rows are independent */
+	memcpy(x, b, sizeof(x));
+	fill(b, coefs[0]);
+
+	for (j = 1; j <= deg; j++) {
+		float c = coefs[j];
+
+		for (k = 0; k < BLOCK; k++)
+			b[k] = b[k] * x[k] + c;
+	}
+}
+
+static void eval_rand(const struct expr *self, unsigned int pos,
+                      const float *const args[], float *res, unsigned int n,
+                      struct expr_ctx *ctx)
+{
+	unsigned int i, k;
+
+	for (k = 0; k < n; k++) {
+		uint64_t stream = pos;
+
+		for (i = 0; i < self->arg_cnt; i++)
+			stream = expr_rand_mix(stream, args[i][k]);
+
+		res[k] = expr_rand(self->elems[pos].fn, ctx->seed, ctx->row + k,
+		                   stream);
+	}
+
+	for (; k < BLOCK; k++)
+		res[k] = 1;
+}
+
+SIMD_CLONES
+static void eval_block(const struct expr *self, const float *const vcols[],
+                       const float *const args[], float *res, unsigned int n,
+                       struct expr_ctx *ctx)
+{
+	const struct expr_elem *elems = self->elems;
+	float buf[self->stack][BLOCK];
+	float rad = expr_rad_factor(ctx);
+	const struct expr_fn *fn;
+	const struct expr_ufn *ufn;
+	unsigned int i, k, s = 0;
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		float *a = s > 1 ? buf[s - 2] : NULL;
+		float *b = s > 0 ? buf[s - 1] : NULL;
+
+		switch (elems[i].type) {
+		case EXPR_NUM:
+			fill(buf[s++], self->nums[elems[i].num]);
+		break;
+		case EXPR_VAR:
+			if (vcols && vcols[elems[i].var])
+				load(buf[s++], vcols[elems[i].var], n);
+			else
+				fill(buf[s++], self->slots[elems[i].var]->val);
+		break;
+		case EXPR_ARG:
+			memcpy(buf[s++], args[elems[i].arg], sizeof(*buf));
+		break;
+		case EXPR_NEG:
+			scale(b, -1);
+		break;
+		case EXPR_MUL ... EXPR_POW:
+		case EXPR_LT ... EXPR_OR:
+			op2(elems[i].type, a, b);
+			s--;
+		break;
+		case EXPR_FN1:
+			fn = &expr_fn1[elems[i].fn].fn;
+
+			if (fn->a1_in)
+				scale(b, rad);
+
+			for (k = 0; k < BLOCK; k++)
+				b[k] = fn->ffn1(b[k]);
+
+			if (fn->a_out)
+				scale(b, 1 / rad);
+		break;
+		case EXPR_FN2:
+			fn = &expr_fn2[elems[i].fn].fn;
+
+			for (k = 0; k < BLOCK; k++)
+				a[k] = fn->ffn2(a[k], b[k]);
+
+			if (fn->a_out)
+				scale(a, 1 / rad);
+			s--;
+		break;
+		case EXPR_CALL: {
+			ufn = self->ufns[elems[i].fn];
+			s -= ufn->argc;
+
+			const float *cargs[ufn->argc];
+
+			for (k = 0; k < ufn->argc; k++)
+				cargs[k] = buf[s + k];
+
+			eval_block(ufn->body, NULL, cargs, buf[s], BLOCK, ctx);
+			s++;
+		} break;
+		case EXPR_ANDJ:
+		case EXPR_ORJ:
+		case EXPR_IF:
+		case EXPR_ELSE:
+		break;
+		case EXPR_FI:
+			pick(buf[s - 3], a, b);
+			s -= 2;
+		break;
+		case EXPR_POLY:
+			poly(b, expr_poly_coefs(self, &elems[i]),
+			     expr_poly_deg(self, &elems[i]));
+		break;
+		case EXPR_RAND:
+			eval_rand(self, i, args, buf[s++], n, ctx);
+		break;
+		}
+	}
+
+	memcpy(res, buf[0], n * sizeof(float));
+}
+
+static int has_binds(const struct expr *self)
+{
+	unsigned int i;
+
+	for (i = 0; self->elems[i].type != EXPR_END; i++) {
+		switch (self->elems[i].type) {
+		case EXPR_BIND:
+			return 1;
+		case EXPR_CALL:
+			if (has_binds(self->ufns[self->elems[i].fn]->body))
+				return 1;
+		break;
+		}
+	}
+
+	return 0;
+}
+
+static void eval_double(struct expr *self, const float *const vcols[],
+                        float *res, unsigned int n, struct expr_ctx *ctx)
+{
+	double dbuf[self->var_cnt + 1][BLOCK];
+	const double *dcols[self->var_cnt + 1];
+	double dres[n];
+	unsigned int i, k;
+
+	for (i = 0; i < self->var_cnt; i++) {
+		for (k = 0; vcols[i] && k < n; k++)
+			dbuf[i][k] = vcols[i][k];
+
+		dcols[i] = vcols[i] ? dbuf[i] : NULL;
+	}
+
+	expr_eval_cols(self, dcols, NULL, dres, n, ctx);
+
+	for (k = 0; k < n; k++)
+		res[k] = dres[k];
+}
+
+void expr_eval_batchf(struct expr *self, struct expr_ctx *ctx,
+                      const float *const cols[], float *res, size_t n)
+{
+	const float *slot_cols[self->var_cnt + 1];
+	const float *vc[self->var_cnt + 1];
+	int binds = has_binds(self);
+	uint64_t row = ctx->row;
+	unsigned int i;
+	size_t off;
+
+	if (self->out_cnt) {
+		for (off = 0; off < n; off++)
+			res[off] = NAN;
+		return;
+	}
+
+	for (i = 0; i < self->var_cnt; i++) {
+		int col = expr_slot_col(self, i);
+
+		slot_cols[i] = cols && col >= 0 ? cols[col] : NULL;
+	}
+
+	expr_fp_begin(ctx);
+
+	for (off = 0; off < n; off += BLOCK) {
+		unsigned int cnt = n - off < BLOCK ? n - off : BLOCK;
+
+		for (i = 0; i < self->var_cnt; i++)
+			vc[i] = slot_cols[i] ? slot_cols[i] + off : NULL;
+
+		ctx->row = row + off;
+
+		if (binds)
+			eval_double(self, vc, res + off, cnt, ctx);
+		else
+			eval_block(self, vc, NULL, res + off, cnt, ctx);
+	}
+
+	expr_fp_end(ctx);
+
+	ctx->row = row;
+}
@@ -0,0 +1,572 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Forward mode automatic differentiation.
+
+   The program is evaluated on dual numbers, each stack element carries the
+   value along with the partial derivatives with respect to the variables in
+   the self->grad array.
+
+   The derivative of the solve() root is computed by the implicit function
+   theorem, i.e. for f(x, p) = 0 the dx/dp = - (df/dp) / (df/dx).
+
+   The derivative of integrate() is computed by the Leibniz integral rule, the
+   partial derivatives of the body are integrated one at a time.
+
+   The sum() and prod() are differentiated term by term, the derivatives of
+   the index range are zero.
+
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr_priv.h"
+
+struct expr *expr_derive(struct expr *self, const char *const wrt[],
+                         struct expr_err *err)
+{
+	unsigned int i, grad_cnt = 0;
+	struct expr *ret;
+
+	if (self->out_cnt) {
+		ERR(err, "Multiple results", 0);
+		return NULL;
+	}
+
+	while (wrt[grad_cnt])
+		grad_cnt++;
+
+	ret = expr_alloc(NULL, self->elem_cnt, self->num_cnt,
+	                 self->var_cnt, self->ufn_cnt);
+	if (!ret) {
+		ERR(err, "Malloc failed", 0);
+		return NULL;
+	}
+
+	ret->grad = malloc((grad_cnt + 1) * sizeof(struct expr_var *));
+	if (!ret->grad) {
+		free(ret);
+		ERR(err, "Malloc failed", 0);
+		return NULL;
+	}
+
+	for (i = 0; i < grad_cnt; i++) {
+		ret->grad[i] = expr_var_by_name(self->vars, wrt[i]);
+		if (!ret->grad[i]) {
+			free(ret->grad);
+			free(ret);
+			ERR(err, "Unknown variable", i);
+			return NULL;
+		}
+	}
+
+	ret->vars = self->vars;
+	ret->grad_cnt = grad_cnt;
+	ret->stack = self->stack;
+	ret->elem_cnt = self->elem_cnt;
+	ret->num_cnt = self->num_cnt;
+	ret->var_cnt = self->var_cnt;
+	ret->ufn_cnt = self->ufn_cnt;
+	ret->arg_cnt = self->arg_cnt;
+
+	memcpy((void*)ret->nums, self->nums, self->num_cnt * sizeof(double));
+	memcpy((void*)ret->elems, self->elems, self->elem_cnt * sizeof(struct expr_elem));
+
+	for (i = 0; i < self->var_cnt; i++)
+		ret->slots[i] = self->slots[i];
+
+	for (i = 0; i < self->ufn_cnt; i++) {
+		ret->ufns[i] = self->ufns[i];
+		expr_ufn_ref(ret->ufns[i]);
+	}
+
+	return ret;
+}
+
+static double eval_dual(const struct expr *self, unsigned int start,
+                        const struct expr_var *const vars[], unsigned int n,
+                        const double *args, const double *dargs,
+                        double *bound, double *dbound, unsigned int depth,
+                        double *dres, struct expr_ctx *ctx);
+
+struct bind_body {
+	const struct expr *self;
+	unsigned int start;
+	const struct expr_var *const *vars;
+	unsigned int n;
+	const double *args;
+	const double *dargs;
+	double *bound;
+	const double *dbound;
+	unsigned int depth;
+	/* index of the derivative being integrated */
+	unsigned int j;
+	struct expr_ctx *ctx;
+};
+
+static double solve_fn(double x, void *priv)
+{
+	struct bind_body *body = priv;
+
+	body->bound[body->depth] = x;
+
+	return eval_dual(body->self, body->start, body->vars, 0, body->args,
+	                 NULL, body->bound, NULL, body->depth + 1, NULL,
+	                 body->ctx);
+}
+
+/*
+ * Finds the root and stores its derivatives into dres.
+ */
+static double eval_solve(const struct expr *self, unsigned int start,
+                         const struct expr_var *const vars[], unsigned int n,
+                         const double *args, const double *dargs,
+                         double *bound, double *dbound, unsigned int depth,
+                         double lo, double hi, double *dres,
+                         struct expr_ctx *ctx)
+{
+	struct bind_body body = {
+		.self = self,
+		.start = start,
+		.vars = vars,
+		.args = args,
+		.bound = bound,
+		.depth = depth,
+		.ctx = ctx,
+	};
+	const struct expr_var *const xvars[1] = {NULL};
+	double xargs[self->arg_cnt + 1];
+	double xbound[EXPR_BIND_MAX];
+	double x, dfdx;
+	unsigned int j;
+
+	x = expr_brent_solve(lo, hi, solve_fn, &body, expr_solve_max_evals(ctx),
+	                     &ctx->solve_evals);
+
+	if (!n)
+		return x;
+
+	/* df/dp with x fixed */
+	bound[depth] = x;
+	for (j = 0; j < n; j++)
+		dbound[depth * n + j] = 0;
+
+	eval_dual(self, start, vars, n, args, dargs, bound, dbound, depth + 1,
+	          dres, ctx);
+
+	/* df/dx with everything else fixed */
+	memset(xargs, 0, sizeof(xargs));
+	memset(xbound, 0, sizeof(xbound));
+	xbound[depth] = 1;
+
+	eval_dual(self, start, xvars, 1, args, xargs, bound, xbound, depth + 1,
+	          &dfdx, ctx);
+
+	for (j = 0; j < n; j++)
+		dres[j] = -dres[j] / dfdx;
+
+	return x;
+}
+
+static void quad_fn(const double *x, double *fx, size_t cnt, void *priv,
+                    struct expr_ctx *ctx)
+{
+	struct bind_body *body = priv;
+
+	expr_eval_body(body->self, body->start, NULL, body->args,
+	               body->bound, body->depth, x, fx, cnt, ctx);
+}
+
+/*
+ * May be called from several threads, hence the copy of bound variables.
+ */
+static void quad_dfn(const double *x, double *fx, size_t cnt, void *priv,
+                     struct expr_ctx *ctx)
+{
+	struct bind_body *body = priv;
+	unsigned int n = body->n, depth = body->depth;
+	double bound[EXPR_BIND_MAX];
+	double dbound[EXPR_BIND_MAX * n];
+	double dres[n];
+	size_t k;
+
+	memcpy(bound, body->bound, depth * sizeof(double));
+	memcpy(dbound, body->dbound, depth * n * sizeof(double));
+	memset(dbound + depth * n, 0, n * sizeof(double));
+
+	for (k = 0; k < cnt; k++) {
+		bound[depth] = x[k];
+		eval_dual(body->self, body->start, body->vars, n, body->args,
+		          body->dargs, bound, dbound, depth + 1, dres, ctx);
+		fx[k] = dres[body->j];
+	}
+}
+
+/*
+ * Integrates the body and stores the derivatives into dres, dlo and dhi are
+ * derivatives of the bounds, dres may point to dlo.
+ */
+static double eval_integrate(const struct expr *self, unsigned int start,
+                             const struct expr_var *const vars[], unsigned int n,
+                             const double *args, const double *dargs,
+                             double *bound, double *dbound, unsigned int depth,
+                             double lo, double hi, const double *dlo,
+                             const double *dhi, double *dres,
+                             struct expr_ctx *ctx)
+{
+	struct bind_body body = {
+		.self = self,
+		.start = start,
+		.vars = vars,
+		.n = n,
+		.args = args,
+		.dargs = dargs,
+		.bound = bound,
+		.dbound = dbound,
+		.depth = depth,
+		.ctx = ctx,
+	};
+	double res, flo, fhi;
+	unsigned int j;
+
+	res = expr_quad(lo, hi, quad_fn, &body, ctx);
+
+	if (!n)
+		return res;
+
+	flo = solve_fn(lo, &body);
+	fhi = solve_fn(hi, &body);
+
+	for (j = 0; j < n; j++) {
+		body.j = j;
+		dres[j] = expr_quad(lo, hi, quad_dfn, &body, ctx) +
+		          fhi * dhi[j] - flo * dlo[j];
+	}
+
+	return res;
+}
+
+/*
+ * Computes sum or product of the body and stores the derivatives into dres.
+ */
+static double eval_sum(const struct expr *self, unsigned int start, int prod,
+                       const struct expr_var *const vars[], unsigned int n,
+                       const double *args, const double *dargs,
+                       double *bound, double *dbound, unsigned int depth,
+                       double from, double to, double *dres,
+                       struct expr_ctx *ctx)
+{
+	struct bind_body body = {
+		.self = self,
+		.start = start,
+		.args = args,
+		.bound = bound,
+		.depth = depth,
+	};
+	double res, f, df[n ? n : 1];
+	double i;
+	unsigned int j;
+
+	res = expr_sum(from, to, prod, quad_fn, &body, ctx);
+
+	if (!n)
+		return res;
+
+	for (j = 0; j < n; j++) {
+		dres[j] = 0;
+		dbound[depth * n + j] = 0;
+	}
+
+	f = prod;
+
+	for (i = from; i <= to; i++) {
+		bound[depth] = i;
+
+		double t = eval_dual(self, start, vars, n, args, dargs, bound,
+		                     dbound, depth + 1, df, ctx);
+
+		for (j = 0; j < n; j++)
+			dres[j] = prod ? dres[j] * t + f * df[j] : dres[j] + df[j];
+
+		f *= t;
+	}
+
+	return res;
+}
+
+/*
+ * Evaluates the program on dual numbers starting at start until END or RET.
+ *
+ * The vars are variables the derivatives are computed for, the args and dargs
+ * are values and derivatives of user function parameters, bound and dbound
+ * of the bound variables. Derivatives are stored in dres.
+ */
+static double eval_dual(const struct expr *self, unsigned int start,
+                        const struct expr_var *const vars[], unsigned int n,
+                        const double *args, const double *dargs,
+                        double *bound, double *dbound, unsigned int depth,
+                        double *dres, struct expr_ctx *ctx)
+{
+	const struct expr_elem *elems = self->elems;
+	const struct expr_fn *fn;
+	const struct expr_ufn *ufn;
+	double buf[self->stack];
+	double dbuf[self->stack][n ? n : 1];
+	double rad = expr_rad_factor(ctx);
+	double f, da, db;
+	unsigned int i, j, s = 0;
+
+	for (i = start; elems[i].type != EXPR_END && elems[i].type != EXPR_RET; i++) {
+		double *a = s > 1 ? dbuf[s - 2] : NULL;
+		double *b = s > 0 ? dbuf[s - 1] : NULL;
+
+		switch (elems[i].type) {
+		case EXPR_NUM:
+			buf[s] = self->nums[elems[i].num];
+			for (j = 0; j < n; j++)
+				dbuf[s][j] = 0;
+			s++;
+		break;
+		case EXPR_RAND:
+			buf[s] = expr_rand(elems[i].fn, ctx->seed, ctx->row,
+			                   expr_rand_stream(i, args, self->arg_cnt,
+			                                    bound, depth));
+			for (j = 0; j < n; j++)
+				dbuf[s][j] = 0;
+			s++;
+		break;
+		case EXPR_VAR: {
+			const struct expr_var *var = self->slots[elems[i].var];
+
+			buf[s] = var->val;
+			for (j = 0; j < n; j++)
+				dbuf[s][j] = vars[j] == var;
+			s++;
+		} break;
+		case EXPR_ARG:
+			buf[s] = args[elems[i].arg];
+			for (j = 0; j < n; j++)
+				dbuf[s][j] = dargs[elems[i].arg * n + j];
+			s++;
+		break;
+		case EXPR_NEG:
+			buf[s - 1] = -buf[s - 1];
+			for (j = 0; j < n; j++)
+				b[j] = -b[j];
+		break;
+		case EXPR_ADD:
+			buf[s - 2] += buf[s - 1];
+			for (j = 0; j < n; j++)
+				a[j] += b[j];
+			s--;
+		break;
+		case EXPR_SUB:
+			buf[s - 2] -= buf[s - 1];
+			for (j = 0; j < n; j++)
+				a[j] -= b[j];
+			s--;
+		break;
+		case EXPR_MUL:
+			for (j = 0; j < n; j++)
+				a[j] = a[j] * buf[s - 1] + buf[s - 2] * b[j];
+			buf[s - 2] *= buf[s - 1];
+			s--;
+		break;
+		case EXPR_DIV:
+			f = buf[s - 2] / buf[s - 1];
+			for (j = 0; j < n; j++)
+				a[j] = (a[j] - f * b[j]) / buf[s - 1];
+			buf[s - 2] = f;
+			s--;
+		break;
+		case EXPR_POW:
+			f = pow(buf[s - 2], buf[s - 1]);
+			da = buf[s - 1] * pow(buf[s - 2], buf[s - 1] - 1);
+			db = buf[s - 2] > 0 ? f * log(buf[s - 2]) : 0;
+			for (j = 0; j < n; j++)
+				a[j] = da * a[j] + db * b[j];
+			buf[s - 2] = f;
+			s--;
+		break;
+		case EXPR_FN1:
+			fn = &expr_fn1[elems[i].fn].fn;
+			f = buf[s - 1];
+			da = 1;
+
+			if (fn->a1_in) {
+				f *= rad;
+				da = rad;
+			}
+
+			da *= fn->dfn1(f);
+			f = fn->fn1(f);
+
+			if (fn->a_out) {
+				f /= rad;
+				da /= rad;
+			}
+
+			buf[s - 1] = f;
+			for (j = 0; j < n; j++)
+				b[j] *= da;
+		break;
+		case EXPR_FN2:
+			fn = &expr_fn2[elems[i].fn].fn;
+			f = fn->fn2(buf[s - 2], buf[s - 1]);
+			fn->dfn2(buf[s - 2], buf[s - 1], &da, &db);
+
+			if (fn->a_out) {
+				f /= rad;
+				da /= rad;
+				db /= rad;
+			}
+
+			buf[s - 2] = f;
+			for (j = 0; j < n; j++)
+				a[j] = da * a[j] + db * b[j];
+			s--;
+		break;
+		case EXPR_CALL: {
+			double cbound[EXPR_BIND_MAX];
+			double cdbound[EXPR_BIND_MAX * (n ? n : 1)];
+
+			ufn = self->ufns[elems[i].fn];
+			s -= ufn->argc;
+			buf[s] = eval_dual(ufn->body, 0, vars, n, &buf[s], dbuf[s],
+			                   cbound, cdbound, 0, dbuf[s], ctx);
+			s++;
+		} break;
+		case EXPR_LT:
+		case EXPR_LE:
+		case EXPR_EQ:
+		case EXPR_NE:
+		case EXPR_GE:
+		case EXPR_GT:
+		case EXPR_AND:
+		case EXPR_OR:
+			switch (elems[i].type) {
+			case EXPR_LT:
+				f = buf[s - 2] < buf[s - 1];
+			break;
+			case EXPR_LE:
+				f = buf[s - 2] <= buf[s - 1];
+			break;
+			case EXPR_EQ:
+				f = buf[s - 2] == buf[s - 1];
+			break;
+			case EXPR_NE:
+				f = buf[s - 2] != buf[s - 1];
+			break;
+			case EXPR_GE:
+				f = buf[s - 2] >= buf[s - 1];
+			break;
+			case EXPR_GT:
+				f = buf[s - 2] > buf[s - 1];
+			break;
+			case EXPR_AND:
+				f = buf[s - 2] != 0 && buf[s - 1] != 0;
+			break;
+			default:
+				f = buf[s - 2] != 0 || buf[s - 1] != 0;
+			break;
+			}
+			/* step functions, derivative is zero almost everywhere */
+			buf[s - 2] = f;
+			for (j = 0; j < n; j++)
+				a[j] = 0;
+			s--;
+		break;
+		case EXPR_ANDJ:
+			if (buf[s - 1] == 0) {
+				for (j = 0; j < n; j++)
+					b[j] = 0;
+				i += elems[i].jmp;
+			}
+		break;
+		case EXPR_ORJ:
+			if (buf[s - 1] != 0) {
+				buf[s - 1] = 1;
+				for (j = 0; j < n; j++)
+					b[j] = 0;
+				i += elems[i].jmp;
+			}
+		break;
+		case EXPR_IF:
+			if (buf[--s] == 0)
+				i += elems[i].jmp;
+		break;
+		case EXPR_ELSE:
+			i += elems[i].jmp;
+		break;
+		case EXPR_FI:
+		break;
+		case EXPR_BIND:
+			i += elems[i].jmp;
+		break;
+		case EXPR_BVAR:
+			buf[s] = bound[elems[i].arg];
+			for (j = 0; j < n; j++)
+				dbuf[s][j] = dbound[elems[i].arg * n + j];
+			s++;
+		break;
+		case EXPR_SOLVE:
+			buf[s - 2] = eval_solve(self, i - elems[i].jmp + 1, vars, n,
+			                        args, dargs, bound, dbound, depth,
+			                        buf[s - 2], buf[s - 1], a, ctx);
+			s--;
+		break;
+		case EXPR_INTEGRATE:
+			buf[s - 2] = eval_integrate(self, i - elems[i].jmp + 1, vars, n,
+			                            args, dargs, bound, dbound, depth,
+			                            buf[s - 2], buf[s - 1], a, b, a, ctx);
+			s--;
+		break;
+		case EXPR_SUM:
+		case EXPR_PROD:
+			buf[s - 2] = eval_sum(self, i - elems[i].jmp + 1,
+			                      elems[i].type == EXPR_PROD, vars, n,
+			                      args, dargs, bound, dbound, depth,
+			                      buf[s - 2], buf[s - 1], a, ctx);
+			s--;
+		break;
+		case EXPR_POLY: {
+			const double *coefs = expr_poly_coefs(self, &elems[i]);
+			unsigned int k, deg = expr_poly_deg(self, &elems[i]);
+
+			/* Horner's method for the value and the derivative */
+			f = coefs[0];
+			da = 0;
+			for (k = 1; k <= deg; k++) {
+				da = fma(da, buf[s - 1], f);
+				f = fma(f, buf[s - 1], coefs[k]);
+			}
+
+			buf[s - 1] = f;
+			for (j = 0; j < n; j++)
+				b[j] *= da;
+		} break;
+		}
+	}
+
+	if (n)
+		memcpy(dres, dbuf[0], n * sizeof(double));
+
+	return buf[0];
+}
+
+double expr_eval_grad(struct expr *self, struct expr_ctx *ctx, double grad[])
+{
+	unsigned int n = self->grad_cnt;
+	double bound[EXPR_BIND_MAX];
+	double dbound[EXPR_BIND_MAX * (n ? n : 1)];
+
+	return eval_dual(self, 0, self->grad, n, NULL, NULL,
+	                 bound, dbound, 0, grad, ctx);
+}
@@ -0,0 +1,328 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Binary file format for compiled expressions.
+
+   The file consists of a header followed by the constant pool, the program
+   elements, '\0' terminated variable names and '\0' terminated names of
+   called user functions. All data are stored in the
+   native byte order and aligned so that the file can be mapped into memory
+   and used as it is.
+
+  */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "expr_priv.h"
+
+#define EXPR_FILE_MAGIC "GPEX"
+/*
+ * Version history:
+ *
+ * 1 - initial version
+ * 2 - user function calls
+ * 3 - comparisons and conditionals
+ * 4 - bound variables and solve()
+ * 5 - integrate()
+ * 6 - sum() and prod()
+ * 7 - polynomials in Horner's form
+ * 8 - rand() and randn()
+ */
+#define EXPR_FILE_VERSION 8
+#define EXPR_FILE_BYTE_ORDER 0x0102
+
+struct expr_file_hdr {
+	char magic[4];
+	uint16_t version;
+	/* EXPR_FILE_BYTE_ORDER in the native byte order */
+	uint16_t byte_order;
+	uint32_t stack;
+	/* number of elements including EXPR_END */
+	uint32_t elem_cnt;
+	uint32_t num_cnt;
+	uint32_t var_cnt;
+	/* size of the names including the terminating '\0' */
+	uint32_t names_size;
+	uint32_t ufn_cnt;
+};
+
+_Static_assert(sizeof(struct expr_file_hdr) == 32, "Wrong header size");
+_Static_assert(sizeof(struct expr_elem) == 8, "Wrong element size");
+
+size_t expr_serialize(struct expr *self, void *buf, size_t size)
+{
+	struct expr_file_hdr hdr = {
+		.magic = EXPR_FILE_MAGIC,
+		.version = EXPR_FILE_VERSION,
+		.byte_order = EXPR_FILE_BYTE_ORDER,
+		.stack = self->stack,
+		.elem_cnt = self->elem_cnt,
+		.num_cnt = self->num_cnt,
+		.var_cnt = self->var_cnt,
+		.ufn_cnt = self->ufn_cnt,
+	};
+	unsigned int i;
+	size_t len;
+	char *ptr;
+
+	/* the file format has a single result */
+	if (self->out_cnt)
+		return 0;
+
+	for (i = 0; i < self->var_cnt; i++)
+		hdr.names_size += strlen(self->slots[i]->name) + 1;
+
+	for (i = 0; i < self->ufn_cnt; i++)
+		hdr.names_size += strlen(self->ufns[i]->name) + 1;
+
+	len = sizeof(hdr) + self->num_cnt * sizeof(double) +
+	      self->elem_cnt * sizeof(struct expr_elem) + hdr.names_size;
+
+	if (!buf || size < len)
+		return len;
+
+	ptr = buf;
+
+	memcpy(ptr, &hdr, sizeof(hdr));
+	ptr += sizeof(hdr);
+
+	memcpy(ptr, self->nums, self->num_cnt * sizeof(double));
+	ptr += self->num_cnt * sizeof(double);
+
+	/* make sure the padding is zeroed */
+	memset(ptr, 0, self->elem_cnt * sizeof(struct expr_elem));
+	for (i = 0; i < self->elem_cnt; i++) {
+		struct expr_elem *elem = (void*)(ptr + i * sizeof(*elem));
+
+		elem->type = self->elems[i].type;
+		elem->num = self->elems[i].num;
+	}
+	ptr += self->elem_cnt * sizeof(struct expr_elem);
+
+	for (i = 0; i < self->var_cnt; i++) {
+		size_t name_len = strlen(self->slots[i]->name) + 1;
+
+		memcpy(ptr, self->slots[i]->name, name_len);
+		ptr += name_len;
+	}
+
+	for (i = 0; i < self->ufn_cnt; i++) {
+		size_t name_len = strlen(self->ufns[i]->name) + 1;
+
+		memcpy(ptr, self->ufns[i]->name, name_len);
+		ptr += name_len;
+	}
+
+	return len;
+}
+
+int expr_save(struct expr *self, const char *path)
+{
+	size_t len = expr_serialize(self, NULL, 0);
+	void *buf;
+	FILE *f;
+	int ret = 0;
+
+	if (!len) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	buf = malloc(len);
+	if (!buf)
+		return 1;
+
+	expr_serialize(self, buf, len);
+
+	f = fopen(path, "w");
+	if (!f) {
+		free(buf);
+		return 1;
+	}
+
+	if (fwrite(buf, len, 1, f) != 1)
+		ret = 1;
+
+	if (fclose(f))
+		ret = 1;
+
+	free(buf);
+
+	return ret;
+}
+
+struct expr *expr_load_buf(const void *buf, size_t size,
+                           const struct expr_var vars[],
+                           struct expr_err *err)
+{
+	const struct expr_file_hdr *hdr = buf;
+	const char *ptr = buf;
+	struct expr *self;
+	size_t len;
+	unsigned int i;
+
+	if ((uintptr_t)buf % sizeof(double)) {
+		ERR(err, "Unaligned buffer", 0);
+		return NULL;
+	}
+
+	if (size < sizeof(*hdr) || memcmp(hdr->magic, EXPR_FILE_MAGIC, 4)) {
+		ERR(err, "Invalid file", 0);
+		return NULL;
+	}
+
+	if (hdr->byte_order != EXPR_FILE_BYTE_ORDER) {
+		ERR(err, "Invalid byte order", 0);
+		return NULL;
+	}
+
+	if (hdr->version < 1 || hdr->version > EXPR_FILE_VERSION) {
+		ERR(err, "Unsupported version", 0);
+		return NULL;
+	}
+
+	len = sizeof(*hdr) + (size_t)hdr->num_cnt * sizeof(double) +
+	      (size_t)hdr->elem_cnt * sizeof(struct expr_elem) + hdr->names_size;
+
+	if (size < len) {
+		ERR(err, "File truncated", 0);
+		return NULL;
+	}
+
+	if (hdr->names_size && ptr[len - 1]) {
+		ERR(err, "Invalid variable names", 0);
+		return NULL;
+	}
+
+	/* the version 1 had the field reserved */
+	uint32_t ufn_cnt = hdr->version > 1 ? hdr->ufn_cnt : 0;
+
+	self = malloc(sizeof(struct expr) +
+	              hdr->var_cnt * sizeof(struct expr_var *) +
+	              ufn_cnt * sizeof(struct expr_ufn *));
+	if (!self) {
+		ERR(err, "Malloc failed", 0);
+		return NULL;
+	}
+
+	memset(self, 0, sizeof(*self));
+
+	ptr += sizeof(*hdr);
+	self->nums = (const void*)ptr;
+	ptr += hdr->num_cnt * sizeof(double);
+	self->elems = (const void*)ptr;
+	ptr += hdr->elem_cnt * sizeof(struct expr_elem);
+
+	self->slots = (void*)(self + 1);
+	self->ufns = (void*)(self->slots + hdr->var_cnt);
+
+	for (i = 0; i < hdr->var_cnt; i++) {
+		const struct expr_var *var;
+
+		if (ptr >= (const char*)buf + len) {
+			ERR(err, "Invalid variable names", i);
+			goto err;
+		}
+
+		var = expr_var_by_name(vars, ptr);
+		if (!var) {
+			ERR(err, "Undefined variable", i);
+			goto err;
+		}
+
+		self->slots[i] = var;
+		ptr += strlen(ptr) + 1;
+	}
+
+	for (i = 0; i < ufn_cnt; i++) {
+		struct expr_ufn *ufn;
+
+		if (ptr >= (const char*)buf + len) {
+			ERR(err, "Invalid function names", i);
+			goto err;
+		}
+
+		ufn = expr_ufn_by_name(ptr);
+		if (!ufn) {
+			ERR(err, "Undefined function", i);
+			goto err;
+		}
+
+		expr_ufn_ref(ufn);
+		self->ufns[self->ufn_cnt++] = ufn;
+		ptr += strlen(ptr) + 1;
+	}
+
+	self->vars = vars;
+	self->elem_cnt = hdr->elem_cnt;
+	self->num_cnt = hdr->num_cnt;
+	self->var_cnt = hdr->var_cnt;
+
+	self->stack = expr_check(self);
+	if (!self->stack || self->stack != hdr->stack) {
+		ERR(err, "Invalid program", 0);
+		goto err;
+	}
+
+	self->is_int = expr_int_check(self);
+
+	return self;
+err:
+	expr_destroy(self);
+	return NULL;
+}
+
+struct expr *expr_load(const char *path,
+                       const struct expr_var vars[],
+                       struct expr_err *err)
+{
+	struct expr *self;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ERR(err, "Failed to open file", 0);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || st.st_size == 0) {
+		ERR(err, "Failed to stat file", 0);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		ERR(err, "Failed to map file", 0);
+		return NULL;
+	}
+
+	self = expr_load_buf(map, st.st_size, vars, err);
+	if (!self) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	self->map = map;
+	self->map_size = st.st_size;
+
+	return self;
+}
@@ -0,0 +1,1101 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Fixed point evaluation for CPUs without FPU.
+
+   Values are stored in Q31.32 format in int64_t, products and quotients are
+   computed with 128 bit intermediate results built from 32 bit halves so
+   that nothing wider than 64 bits is needed. Constants and variables are
+   converted from the double bit pattern with integer operations only.
+
+   Trigonometric functions are computed by CORDIC, exponentials and
+   logarithms by the shift-and-add algorithm with a table of ln(1 + 2^-i),
+   internally in Q3.60 so that the result is exact to a few units of the last
+   place of Q31.32.
+
+   Operations without fixed point implementation and values that do not fit
+   into the format fail the evaluation, the caller falls back to double then.
+   So do nonzero values below 2^-20, constants, variables and intermediate
+   results alike, that would have less than 12 significant bits, e.g.
+   ln(1e-9), sqrt(1e-8 * x) or acosh(1 + 1e-9) would lose precision and
+   1e-12 or exp(-30) would be silently rounded to zero.
+
+  */
+
+#include <string.h>
+
+#include "expr_priv.h"
+
+/* Fraction bits of the values */
+#define FRAC 32
+#define ONE ((int64_t)1 << FRAC)
+
+/* Fraction bits of the internal format */
+#define WFRAC 60
+#define WONE ((int64_t)1 << WFRAC)
+
+/* nonzero values below this have too few significant bits */
+#define TINY (ONE >> 20)
+
+#define CORDIC_ITER 40
+#define LN_ITER 29
+
+/* atan(2^-i) in Q3.60, further entries are 2^-i to the precision */
+static const int64_t atans[] = {
+	0xc90fdaa22168c23, 0x76b19c1586ed3da, 0x3eb6ebf25901bac,
+	0x1fd5ba9aac2f6dc, 0x0ffaaddb967ef4e, 0x07ff556eea5d893,
+	0x03ffeaab776e535, 0x01fffd555bbba97, 0x00ffffaaaaddddc,
+	0x007ffff55556eef, 0x003ffffeaaaab77, 0x001fffffd55555c,
+	0x000ffffffaaaaab, 0x0007ffffff55555, 0x0003ffffffeaaab,
+	0x0001fffffffd555, 0x0000ffffffffaab, 0x00007ffffffff55,
+	0x00003ffffffffeb, 0x00001fffffffffd,
+};
+
+#define ATANS_LEN (sizeof(atans) / sizeof(*atans))
+
+/* ln(1 + 2^-i) in Q3.60 for i = 1 ... LN_ITER */
+static const int64_t lns[LN_ITER] = {
+	0x67cc8fb2fe612fd, 0x391fef8f3534436, 0x1e27076e2af2e5f,
+	0x0f85186008b1533, 0x07e0a6c39e0cc01, 0x03f815161f807c8,
+	0x01fe02a6b106789, 0x00ff805515885e0, 0x007fe00aa6ac43a,
+	0x003ff8015515622, 0x001ffe002aa6ab1, 0x000fff800555156,
+	0x0007ffe000aaa6b, 0x0003fff80015551, 0x0001fffe0002aaa,
+	0x0000ffff8000555, 0x00007fffe0000ab, 0x00003ffff800015,
+	0x00001ffffe00003, 0x00000fffff80000, 0x000007ffffe0000,
+	0x000003fffff8000, 0x000001fffffe000, 0x000000ffffff800,
+	0x0000007fffffe00, 0x0000003ffffff80, 0x0000001ffffffe0,
+	0x0000000fffffff8, 0x00000007ffffffe,
+};
+
+/* CORDIC gain compensation prod 1/sqrt(1 + 2^-2i) */
+#define CORDIC_K INT64_C(0x9b74eda8435e5a6)
+
+#define PI_W INT64_C(0x3243f6a8885a308d)
+#define LN2_W INT64_C(0xb17217f7d1cf79b)
+#define INV_LN2_W INT64_C(0x171547652b82fe17)
+#define INV_LN10_W INT64_C(0x6f2dec549b9438d)
+#define LOG2_10_W INT64_C(0x35269e12f346e2c0)
+#define TWO_OVER_PI_W INT64_C(0xa2f9836e4e44153)
+
+/* pi/2 and ln(2) in Q31.32 and the rest of the digits in Q.64 */
+#define PI_2_HI INT64_C(0x1921fb544)
+#define PI_2_LO INT64_C(1121027178)
+#define LN2_HI INT64_C(0xb17217f8)
+#define LN2_LO INT64_C(-774932052)
+
+/* angle unit conversions, to radians in Q3.60 and back in Q7.56 */
+#define DEG_W INT64_C(0x477d1a894a74e4)
+#define GRAD_W INT64_C(0x4056fe485c9c67)
+#define RDEG INT64_C(0x394bb834c783ef71)
+#define RGRAD INT64_C(0x3fa9775716929844)
+
+static void umul128(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo)
+{
+	uint64_t al = (uint32_t)a, ah = a >> 32;
+	uint64_t bl = (uint32_t)b, bh = b >> 32;
+	uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+
+	*lo = (mid << 32) | (uint32_t)ll;
+	*hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+}
+
+static uint64_t uabs(int64_t a)
+{
+	return a < 0 ? -(uint64_t)a : (uint64_t)a;
+}
+
+static int is_tiny(int64_t a)
+{
+	return a && uabs(a) < TINY;
+}
+
+static int sign_res(uint64_t r, int neg, int64_t *res)
+{
+	if (r > INT64_MAX)
+		return 1;
+
+	*res = neg ? -(int64_t)r : (int64_t)r;
+	return 0;
+}
+
+/*
+ * Rounded a * b / 2^frac, frac is in [1, 63], fails if the product of
+ * nonzero values is less than the last place.
+ */
+static int mulq(int64_t a, int64_t b, unsigned int frac, int64_t *res)
+{
+	uint64_t hi, lo, half = (uint64_t)1 << (frac - 1);
+
+	umul128(uabs(a), uabs(b), &hi, &lo);
+
+	if (!hi && !(lo >> frac) && a && b)
+		return 1;
+
+	lo += half;
+	hi += lo < half;
+
+	if (hi >> frac)
+		return 1;
+
+	return sign_res((hi << (64 - frac)) | (lo >> frac), (a < 0) != (b < 0), res);
+}
+
+/*
+ * Rounded a * 2^frac / b, frac is in [1, 63], fails if nonzero quotient is
+ * less than the last place.
+ */
+static int divq(int64_t a, int64_t b, unsigned int frac, int64_t *res)
+{
+	uint64_t ua = uabs(a), ub = uabs(b);
+	uint64_t lo = ua << frac, r = ua >> (64 - frac), q = 0;
+	int i;
+
+	if (!b || r >= ub)
+		return 1;
+
+	for (i = 63; i >= 0; i--) {
+		r = (r << 1) | ((lo >> i) & 1);
+		q <<= 1;
+
+		if (r >= ub) {
+			r -= ub;
+			q |= 1;
+		}
+	}
+
+	if (!q && a)
+		return 1;
+
+	/* r >= ub - r without overflow */
+	if (r >= ub - r && !++q)
+		return 1;
+
+	return sign_res(q, (a < 0) != (b < 0), res);
+}
+
+static int64_t wide_mul(int64_t a, int64_t b)
+{
+	int64_t res = 0;
+
+	mulq(a, b, WFRAC, &res);
+
+	return res;
+}
+
+static int64_t from_wide(int64_t x)
+{
+	return (x + ((int64_t)1 << (WFRAC - FRAC - 1))) >> (WFRAC - FRAC);
+}
+
+/*
+ * Converts double without floating point operations, fails for values that
+ * do not fit and for nonzero values less than the last place.
+ */
+static int from_double(double val, int64_t *res)
+{
+	uint64_t bits, mant;
+	int exp, shift;
+
+	memcpy(&bits, &val, sizeof(bits));
+
+	exp = (bits >> 52) & 0x7ff;
+	mant = (bits & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1 << 52);
+
+	/* infinity and NaN */
+	if (exp == 0x7ff)
+		return 1;
+
+	shift = exp - 1075 + FRAC;
+
+	if (!exp) {
+		/* zero and denormals */
+		if (bits << 1)
+			return 1;
+		mant = 0;
+	} else if (shift < 0) {
+		if (shift < -52)
+			return 1;
+		mant = ((mant >> (-shift - 1)) + 1) >> 1;
+	} else {
+		if (shift > 10)
+			return 1;
+		mant <<= shift;
+	}
+
+	*res = bits >> 63 ? -(int64_t)mant : (int64_t)mant;
+	return 0;
+}
+
+static int64_t atan_tab(unsigned int i)
+{
+	return i < ATANS_LEN ? atans[i] : WONE >> i;
+}
+
+/*
+ * Rotates (K, 0) by angle z, |z| <= pi/2, in Q3.60.
+ */
+static void cordic_rot(int64_t z, int64_t *c, int64_t *s)
+{
+	int64_t x = CORDIC_K, y = 0, t;
+	unsigned int i;
+
+	for (i = 0; i < CORDIC_ITER; i++) {
+		t = x;
+
+		if (z >= 0) {
+			x -= y >> i;
+			y += t >> i;
+			z -= atan_tab(i);
+		} else {
+			x += y >> i;
+			y -= t >> i;
+			z += atan_tab(i);
+		}
+	}
+
+	*c = x;
+	*s = y;
+}
+
+/*
+ * Returns atan2(y, x) in Q3.60 and stores hypot(x, y) in the scale of the
+ * input.
+ */
+static int64_t cordic_vec(int64_t x, int64_t y, uint64_t *mag)
+{
+	uint64_t m = uabs(x) > uabs(y) ? uabs(x) : uabs(y);
+	int64_t z = 0, t;
+	int shift = 0;
+	unsigned int i;
+
+	if (!m) {
+		*mag = 0;
+		return 0;
+	}
+
+	/* normalize so that the vector grows up to 2^61 */
+	shift = 58 - (63 - __builtin_clzll(m));
+
+	if (shift >= 0) {
+		x = (int64_t)((uint64_t)x << shift);
+		y = (int64_t)((uint64_t)y << shift);
+	} else {
+		x >>= -shift;
+		y >>= -shift;
+	}
+
+	if (x < 0) {
+		z = y >= 0 ? PI_W : -PI_W;
+		x = -x;
+		y = -y;
+	}
+
+	for (i = 0; i < CORDIC_ITER; i++) {
+		t = x;
+
+		if (y < 0) {
+			x -= y >> i;
+			y += t >> i;
+			z -= atan_tab(i);
+		} else {
+			x += y >> i;
+			y -= t >> i;
+			z += atan_tab(i);
+		}
+	}
+
+	x = wide_mul(x, CORDIC_K);
+	*mag = shift >= 0 ? (uint64_t)x >> shift : (uint64_t)x << -shift;
+
+	return z;
+}
+
+/*
+ * Reduces x = n * pi/2 + r, |r| <= pi/4, returns n mod 4 and r in Q3.60.
+ */
+static unsigned int reduce(int64_t x, int64_t *r)
+{
+	int64_t t, n;
+
+	mulq(x, TWO_OVER_PI_W, WFRAC, &t);
+	n = (t + ONE / 2) >> FRAC;
+
+	/* the result is small, intermediate overflows cancel out */
+	t = (int64_t)((uint64_t)x - (uint64_t)n * PI_2_HI);
+	*r = t * (WONE >> FRAC) - ((n * PI_2_LO) >> (64 - WFRAC));
+
+	return n & 3;
+}
+
+
+/*
+ * Computes 2^n * exp(r), r in [0, ln 2) in Q3.60.
+ */
+static int exp_core(int64_t r, int64_t n, int64_t *res)
+{
+	int64_t y = WONE;
+	unsigned int i, shift;
+
+	/* overflow or underflow */
+	if (n > 30 || n < -FRAC - 2)
+		return 1;
+
+	for (i = 1; i <= LN_ITER; i++) {
+		if (r >= lns[i - 1]) {
+			r -= lns[i - 1];
+			y += y >> i;
+		}
+	}
+
+	/* exp(r) = 1 + r for the rest */
+	y += wide_mul(y, r);
+
+	if (n < WFRAC - FRAC) {
+		shift = WFRAC - FRAC - n;
+		if (!(y >> shift))
+			return 1;
+		*res = (y + ((int64_t)1 << (shift - 1))) >> shift;
+		return 0;
+	}
+
+	shift = n - (WFRAC - FRAC);
+
+	if (y > INT64_MAX >> shift)
+		return 1;
+
+	*res = y << shift;
+	return 0;
+}
+
+int expr_fx_exp(int64_t *x)
+{
+	int64_t t, n, r;
+
+	if (mulq(*x, INV_LN2_W, WFRAC, &t))
+		return 1;
+
+	n = t >> FRAC;
+
+	/* overflow or underflow */
+	if (n > 30 || n < -FRAC - 2)
+		return 1;
+
+	r = *x - n * LN2_HI;
+	r = r * (WONE >> FRAC) - ((n * LN2_LO) >> (64 - WFRAC));
+
+	if (r < 0) {
+		n--;
+		r += LN2_W;
+	}
+
+	if (r >= LN2_W) {
+		n++;
+		r -= LN2_W;
+	}
+
+	return exp_core(r, n, x);
+}
+
+int expr_fx_exp2(int64_t *x)
+{
+	int64_t r;
+
+	mulq(*x & (ONE - 1), LN2_W, FRAC, &r);
+
+	return exp_core(r, *x >> FRAC, x);
+}
+
+int expr_fx_exp10(int64_t *x)
+{
+	if (mulq(*x, LOG2_10_W, WFRAC, x))
+		return 1;
+
+	return expr_fx_exp2(x);
+}
+
+/*
+ * Splits x = 2^e * m, m in [1, 2), returns ln(m) in Q3.60.
+ */
+static int64_t ln_split(int64_t x, int *e)
+{
+	int msb = 63 - __builtin_clzll(x);
+	int64_t y, t, acc = 0;
+	unsigned int i;
+
+	*e = msb - FRAC;
+	y = msb <= WFRAC ? x << (WFRAC - msb) : x >> (msb - WFRAC);
+
+	/* y * prod (1 + 2^-i) = 2 */
+	for (i = 1; i <= LN_ITER; i++) {
+		t = y + (y >> i);
+
+		if (t <= 2 * WONE) {
+			y = t;
+			acc += lns[i - 1];
+		}
+	}
+
+	/* ln(2 / y) = (2 - y) / 2 for the rest */
+	acc += (2 * WONE - y) >> 1;
+
+	return LN2_W - acc;
+}
+
+int expr_fx_ln(int64_t *x)
+{
+	int64_t m;
+	int e;
+
+	if (*x <= 0)
+		return 1;
+
+	m = ln_split(*x, &e);
+	*x = from_wide(m) + e * LN2_HI + ((e * LN2_LO) >> 32);
+
+	return 0;
+}
+
+int expr_fx_log2(int64_t *x)
+{
+	int64_t m;
+	int e;
+
+	if (*x <= 0)
+		return 1;
+
+	m = ln_split(*x, &e);
+	*x = from_wide(wide_mul(m, INV_LN2_W)) + e * ONE;
+
+	return 0;
+}
+
+int expr_fx_log10(int64_t *x)
+{
+	if (expr_fx_ln(x))
+		return 1;
+
+	return mulq(*x, INV_LN10_W, WFRAC, x);
+}
+
+int expr_fx_sqrt(int64_t *x)
+{
+	uint64_t v = *x, rem = 0, root = 0;
+	int i;
+
+	if (*x < 0)
+		return 1;
+
+	/* digit by digit on x * 2^FRAC */
+	for (i = (64 + FRAC) / 2 - 1; i >= 0; i--) {
+		rem <<= 2;
+
+		if (2 * i >= FRAC)
+			rem |= (v >> (2 * i - FRAC)) & 3;
+
+		root <<= 1;
+
+		if (rem >= 2 * root + 1) {
+			rem -= 2 * root + 1;
+			root |= 1;
+		}
+	}
+
+	*x = root + (rem > root);
+	return 0;
+}
+
+int expr_fx_cbrt(int64_t *x)
+{
+	int64_t a = *x, y = uabs(a), t;
+
+	if (!a)
+		return 0;
+
+	if (expr_fx_ln(&y))
+		return 1;
+
+	y /= 3;
+	expr_fx_exp(&y);
+
+	/* one Newton step y += (a / y^2 - y) / 3 */
+	if (a < 0)
+		y = -y;
+
+	if (!divq(a, y, FRAC, &t) && !divq(t, y, FRAC, &t))
+		y += (t - y) / 3;
+
+	*x = y;
+	return 0;
+}
+
+/*
+ * The quadrant is selected by the reduction, cos(x) = sin(x + pi/2).
+ */
+static int sin_quad(int64_t *x, unsigned int shift)
+{
+	int64_t r, c, s;
+	unsigned int n = reduce(*x, &r) + shift;
+
+	cordic_rot(r, &c, &s);
+
+	switch (n & 3) {
+	case 0:
+		*x = from_wide(s);
+	break;
+	case 1:
+		*x = from_wide(c);
+	break;
+	case 2:
+		*x = -from_wide(s);
+	break;
+	default:
+		*x = -from_wide(c);
+	}
+
+	return 0;
+}
+
+int expr_fx_sin(int64_t *x)
+{
+	return sin_quad(x, 0);
+}
+
+int expr_fx_cos(int64_t *x)
+{
+	return sin_quad(x, 1);
+}
+
+int expr_fx_tan(int64_t *x)
+{
+	int64_t r, c, s;
+	unsigned int n = reduce(*x, &r);
+
+	cordic_rot(r, &c, &s);
+
+	if (n & 1)
+		return divq(-c, s, FRAC, x);
+
+	return divq(s, c, FRAC, x);
+}
+
+int expr_fx_atan2(int64_t y, int64_t x, int64_t *res)
+{
+	uint64_t mag;
+
+	*res = from_wide(cordic_vec(x, y, &mag));
+	return 0;
+}
+
+int expr_fx_hypot(int64_t a, int64_t b, int64_t *res)
+{
+	uint64_t mag;
+
+	cordic_vec(a, b, &mag);
+
+	return sign_res(mag, 0, res);
+}
+
+int expr_fx_atan(int64_t *x)
+{
+	return expr_fx_atan2(*x, ONE, x);
+}
+
+/*
+ * Computes sqrt(1 - x^2).
+ */
+static int cos_of_sin(int64_t x, int64_t *res)
+{
+	if (uabs(x) > ONE)
+		return 1;
+
+	mulq(ONE - x, ONE + x, FRAC, res);
+
+	if (is_tiny(*res))
+		return 1;
+
+	return expr_fx_sqrt(res);
+}
+
+int expr_fx_asin(int64_t *x)
+{
+	int64_t c;
+
+	if (cos_of_sin(*x, &c))
+		return 1;
+
+	return expr_fx_atan2(*x, c, x);
+}
+
+int expr_fx_acos(int64_t *x)
+{
+	int64_t c;
+
+	if (cos_of_sin(*x, &c))
+		return 1;
+
+	return expr_fx_atan2(c, *x, x);
+}
+
+/*
+ * Computes exp(|x|) and exp(-|x|).
+ */
+static int exp_pair(int64_t x, int64_t *ep, int64_t *en)
+{
+	*ep = uabs(x);
+
+	if (expr_fx_exp(ep))
+		return 1;
+
+	return divq(ONE, *ep, FRAC, en);
+}
+
+int expr_fx_sinh(int64_t *x)
+{
+	int64_t ep, en;
+
+	if (exp_pair(*x, &ep, &en))
+		return 1;
+
+	*x = *x < 0 ? (en - ep) / 2 : (ep - en) / 2;
+	return 0;
+}
+
+int expr_fx_cosh(int64_t *x)
+{
+	int64_t ep, en;
+
+	if (exp_pair(*x, &ep, &en))
+		return 1;
+
+	*x = ep / 2 + en / 2;
+	return 0;
+}
+
+int expr_fx_tanh(int64_t *x)
+{
+	int64_t t = 0;
+
+	/* (1 - t) / (1 + t) with t = exp(-2|x|), zero if it underflows */
+	if (uabs(*x) < 32 * ONE) {
+		t = -2 * (int64_t)uabs(*x);
+		if (expr_fx_exp(&t))
+			t = 0;
+	}
+
+	if (divq(ONE - t, ONE + t, FRAC, &t))
+		return 1;
+
+	*x = *x < 0 ? -t : t;
+	return 0;
+}
+
+/*
+ * Computes ln(x + sqrt(x^2 + d)), d is 1 or -1, x >= 1.
+ */
+static int ln_hyp(int64_t x, int d, int64_t *res)
+{
+	int64_t s;
+
+	/* the d is lost in rounding */
+	if (x > (ONE << 15)) {
+		*res = x;
+		if (expr_fx_ln(res))
+			return 1;
+		*res += LN2_HI;
+		return 0;
+	}
+
+	mulq(x, x, FRAC, &s);
+	s += d * ONE;
+
+	if (is_tiny(s) || expr_fx_sqrt(&s))
+		return 1;
+
+	*res = x + s;
+	return expr_fx_ln(res);
+}
+
+int expr_fx_asinh(int64_t *x)
+{
+	int64_t a = uabs(*x);
+
+	if (!a)
+		return 0;
+
+	if (ln_hyp(a, 1, &a))
+		return 1;
+
+	*x = *x < 0 ? -a : a;
+	return 0;
+}
+
+int expr_fx_acosh(int64_t *x)
+{
+	if (*x < ONE)
+		return 1;
+
+	return ln_hyp(*x, -1, x);
+}
+
+int expr_fx_atanh(int64_t *x)
+{
+	int64_t t;
+
+	if (uabs(*x) >= ONE || is_tiny(ONE - uabs(*x)))
+		return 1;
+
+	if (divq(ONE + *x, ONE - *x, FRAC, &t) || expr_fx_ln(&t))
+		return 1;
+
+	*x = t / 2;
+	return 0;
+}
+
+int expr_fx_abs(int64_t *x)
+{
+	return sign_res(uabs(*x), 0, x);
+}
+
+int expr_fx_floor(int64_t *x)
+{
+	*x &= ~(ONE - 1);
+	return 0;
+}
+
+int expr_fx_ceil(int64_t *x)
+{
+	if (!(*x & (ONE - 1)))
+		return 0;
+
+	return __builtin_add_overflow(*x & ~(ONE - 1), ONE, x);
+}
+
+int expr_fx_trunc(int64_t *x)
+{
+	if (*x < 0)
+		return expr_fx_ceil(x);
+
+	return expr_fx_floor(x);
+}
+
+int expr_fx_round(int64_t *x)
+{
+	uint64_t a = (uabs(*x) + ONE / 2) & ~(ONE - 1);
+
+	return sign_res(a, *x < 0, x);
+}
+
+int expr_fx_mod(int64_t a, int64_t b, int64_t *res)
+{
+	if (!b)
+		return 1;
+
+	*res = b == -1 ? 0 : a % b;
+	return 0;
+}
+
+/*
+ * Same as remainder(), the quotient is rounded to the nearest, ties to even.
+ */
+int expr_fx_rem(int64_t a, int64_t b, int64_t *res)
+{
+	uint64_t ar, ab = uabs(b);
+	int64_t r;
+
+	if (!b)
+		return 1;
+
+	if (ab == 1) {
+		*res = 0;
+		return 0;
+	}
+
+	r = a % b;
+	ar = uabs(r);
+
+	if (ar > ab - ar || (ar == ab - ar && ((a / b) & 1)))
+		r = r > 0 ? (int64_t)((uint64_t)r - ab) : (int64_t)((uint64_t)r + ab);
+
+	*res = r;
+	return 0;
+}
+
+int expr_fx_max(int64_t a, int64_t b, int64_t *res)
+{
+	*res = a > b ? a : b;
+	return 0;
+}
+
+int expr_fx_min(int64_t a, int64_t b, int64_t *res)
+{
+	*res = a < b ? a : b;
+	return 0;
+}
+
+static int pow_int(int64_t a, int64_t n, int64_t *res)
+{
+	uint64_t e = uabs(n);
+	int64_t r = ONE;
+
+	/* 1/a^n loses the precision of the small intermediate result */
+	if (n < 0 && divq(ONE, a, FRAC, &a))
+		return 1;
+
+	for (;;) {
+		if ((e & 1) && mulq(r, a, FRAC, &r))
+			return 1;
+
+		e >>= 1;
+
+		if (!e)
+			break;
+
+		if (mulq(a, a, FRAC, &a))
+			return 1;
+	}
+
+	*res = r;
+	return 0;
+}
+
+int expr_fx_pow(int64_t a, int64_t b, int64_t *res)
+{
+	if (!(b & (ONE - 1)))
+		return pow_int(a, b >> FRAC, res);
+
+	/* NaN for negative base, infinity for zero to a negative power */
+	if (a < 0 || (!a && b < 0))
+		return 1;
+
+	if (!a) {
+		*res = 0;
+		return 0;
+	}
+
+	/* exp(b * ln(a)) */
+	if (expr_fx_ln(&a))
+		return 1;
+
+	if (mulq(a, b, FRAC, res))
+		return 1;
+
+	return expr_fx_exp(res);
+}
+
+static int to_rad(int64_t *x, struct expr_ctx *ctx)
+{
+	switch (ctx->angle_unit) {
+	case EXPR_DEGREES:
+		return mulq(*x, DEG_W, WFRAC, x);
+	case EXPR_GRADIANS:
+		return mulq(*x, GRAD_W, WFRAC, x);
+	default:
+		return 0;
+	}
+}
+
+static int from_rad(int64_t *x, struct expr_ctx *ctx)
+{
+	switch (ctx->angle_unit) {
+	case EXPR_DEGREES:
+		return mulq(*x, RDEG, 56, x);
+	case EXPR_GRADIANS:
+		return mulq(*x, RGRAD, 56, x);
+	default:
+		return 0;
+	}
+}
+
+static int fx_fn1(const struct expr_fn *fn, int64_t *x, struct expr_ctx *ctx)
+{
+	if (!fn->xfn1)
+		return 1;
+
+	if (fn->a1_in && to_rad(x, ctx))
+		return 1;
+
+	if (fn->xfn1(x))
+		return 1;
+
+	if (fn->a_out)
+		return from_rad(x, ctx);
+
+	return 0;
+}
+
+static int fx_fn2(const struct expr_fn *fn, int64_t a, int64_t b, int64_t *res,
+                  struct expr_ctx *ctx)
+{
+	if (!fn->xfn2 || fn->xfn2(a, b, res))
+		return 1;
+
+	if (fn->a_out)
+		return from_rad(res, ctx);
+
+	return 0;
+}
+
+static int fx_poly(const double *coefs, unsigned int deg, int64_t x,
+                   int64_t *res)
+{
+	int64_t r, c;
+	unsigned int i;
+
+	if (from_double(coefs[0], &r))
+		return 1;
+
+	for (i = 1; i <= deg; i++) {
+		if (from_double(coefs[i], &c) || mulq(r, x, FRAC, &r) ||
+		    __builtin_add_overflow(r, c, &r))
+			return 1;
+	}
+
+	*res = r;
+	return 0;
+}
+
+static int eval(const struct expr *self, const int64_t *args, int64_t *res,
+                struct expr_ctx *ctx)
+{
+	const struct expr_elem *elems = self->elems;
+	const struct expr_ufn *ufn;
+	int64_t buf[self->stack];
+	unsigned int i, s = 0;
+	int ovf = 0;
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		switch (elems[i].type) {
+		case EXPR_NUM:
+			ovf = from_double(self->nums[elems[i].num], &buf[s++]);
+		break;
+		case EXPR_NEG:
+			ovf = __builtin_sub_overflow(0, buf[s - 1], &buf[s - 1]);
+		break;
+		case EXPR_ADD:
+			ovf = __builtin_add_overflow(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_SUB:
+			ovf = __builtin_sub_overflow(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_MUL:
+			ovf = mulq(buf[s - 2], buf[s - 1], FRAC, &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_DIV:
+			ovf = divq(buf[s - 2], buf[s - 1], FRAC, &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_POW:
+			ovf = expr_fx_pow(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_VAR:
+			ovf = from_double(self->slots[elems[i].var]->val, &buf[s++]);
+		break;
+		case EXPR_FN1:
+			ovf = fx_fn1(&expr_fn1[elems[i].fn].fn, &buf[s - 1], ctx);
+		break;
+		case EXPR_FN2:
+			ovf = fx_fn2(&expr_fn2[elems[i].fn].fn, buf[s - 2], buf[s - 1],
+			             &buf[s - 2], ctx);
+			s--;
+		break;
+		case EXPR_ARG:
+			buf[s++] = args[elems[i].arg];
+		break;
+		case EXPR_CALL:
+			ufn = self->ufns[elems[i].fn];
+			s -= ufn->argc;
+			ovf = eval(ufn->body, &buf[s], &buf[s], ctx);
+			s++;
+		break;
+		case EXPR_LT:
+			buf[s - 2] = (buf[s - 2] < buf[s - 1]) * ONE;
+			s--;
+		break;
+		case EXPR_LE:
+			buf[s - 2] = (buf[s - 2] <= buf[s - 1]) * ONE;
+			s--;
+		break;
+		case EXPR_EQ:
+			buf[s - 2] = (buf[s - 2] == buf[s - 1]) * ONE;
+			s--;
+		break;
+		case EXPR_NE:
+			buf[s - 2] = (buf[s - 2] != buf[s - 1]) * ONE;
+			s--;
+		break;
+		case EXPR_GE:
+			buf[s - 2] = (buf[s - 2] >= buf[s - 1]) * ONE;
+			s--;
+		break;
+		case EXPR_GT:
+			buf[s - 2] = (buf[s - 2] > buf[s - 1]) * ONE;
+			s--;
+		break;
+		case EXPR_AND:
+			buf[s - 2] = (buf[s - 2] != 0 && buf[s - 1] != 0) * ONE;
+			s--;
+		break;
+		case EXPR_OR:
+			buf[s - 2] = (buf[s - 2] != 0 || buf[s - 1] != 0) * ONE;
+			s--;
+		break;
+		case EXPR_ANDJ:
+			if (buf[s - 1] == 0)
+				i += elems[i].jmp;
+		break;
+		case EXPR_ORJ:
+			if (buf[s - 1] != 0) {
+				buf[s - 1] = ONE;
+				i += elems[i].jmp;
+			}
+		break;
+		case EXPR_IF:
+			if (buf[--s] == 0)
+				i += elems[i].jmp;
+		break;
+		case EXPR_ELSE:
+			i += elems[i].jmp;
+		break;
+		case EXPR_FI:
+		break;
+		case EXPR_POLY:
+			ovf = fx_poly(expr_poly_coefs(self, &elems[i]),
+			              expr_poly_deg(self, &elems[i]),
+			              buf[s - 1], &buf[s - 1]);
+		break;
+		default:
+			return 1;
+		}
+
+		if (ovf || (s && is_tiny(buf[s - 1])))
+			return 1;
+	}
+
+	*res = buf[0];
+	return 0;
+}
+
+int expr_eval_fixed(struct expr *self, struct expr_ctx *ctx, double *res)
+{
+	int64_t val;
+
+	if (self->out_cnt)
+		return 1;
+
+	if (eval(self, NULL, &val, ctx))
+		return 1;
+
+	*res = (double)val / ONE;
+	return 0;
+}
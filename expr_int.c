@@ -0,0 +1,381 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Exact integer evaluation.
+
+   Programs that consist only of integer constants and operations that map
+   integers to integers are flagged when compiled. These are evaluated in
+   integers with overflow checks, 128 bits wide where the compiler supports
+   it, which is exact where double is not, e.g. 123456789 * 987654321, and
+   cheaper on targets without FPU.
+
+   Division, negative powers and variable values are checked at runtime,
+   anything that does not result in an integer, as well as an overflow, fails
+   the evaluation so that the caller falls back to floating point.
+
+  */
+
+#include <stdio.h>
+
+#include "expr_priv.h"
+
+static int is_int(double val)
+{
+	return val == trunc(val) && fabs(val) <= EXPR_INT_EXACT;
+}
+
+int expr_int_check(const struct expr *self)
+{
+	const struct expr_elem *elems = self->elems;
+	const double *coefs;
+	unsigned int i, j;
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		switch (elems[i].type) {
+		case EXPR_NUM:
+			if (!is_int(self->nums[elems[i].num]))
+				return 0;
+		break;
+		case EXPR_FN1:
+			if (!expr_fn1[elems[i].fn].fn.iop)
+				return 0;
+		break;
+		case EXPR_FN2:
+			if (!expr_fn2[elems[i].fn].fn.iop)
+				return 0;
+		break;
+		case EXPR_CALL:
+			if (!self->ufns[elems[i].fn]->body->is_int)
+				return 0;
+		break;
+		case EXPR_POLY:
+			coefs = expr_poly_coefs(self, &elems[i]);
+
+			for (j = 0; j <= expr_poly_deg(self, &elems[i]); j++) {
+				if (!is_int(coefs[j]))
+					return 0;
+			}
+		break;
+		case EXPR_NEG:
+		case EXPR_MUL:
+		case EXPR_DIV:
+		case EXPR_ADD:
+		case EXPR_SUB:
+		case EXPR_POW:
+		case EXPR_VAR:
+		case EXPR_ARG:
+		case EXPR_LT ... EXPR_FI:
+		break;
+		default:
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int int_neg(expr_int a, expr_int *res)
+{
+	return __builtin_sub_overflow((expr_int)0, a, res);
+}
+
+static int int_abs(expr_int a, expr_int *res)
+{
+	if (a < 0)
+		return int_neg(a, res);
+
+	*res = a;
+	return 0;
+}
+
+static int int_div(expr_int a, expr_int b, expr_int *res)
+{
+	if (b == -1)
+		return int_neg(a, res);
+
+	if (!b || a % b)
+		return 1;
+
+	*res = a / b;
+	return 0;
+}
+
+static int int_pow(expr_int a, expr_int b, expr_int *res)
+{
+	expr_int r = 1;
+
+	if (b < 0) {
+		/* 1 / a^-b is an integer only for 1 and -1 */
+		if (a != 1 && a != -1)
+			return 1;
+
+		b = -b;
+	}
+
+	for (;;) {
+		if ((b & 1) && __builtin_mul_overflow(r, a, &r))
+			return 1;
+
+		b >>= 1;
+
+		if (!b)
+			break;
+
+		if (__builtin_mul_overflow(a, a, &a))
+			return 1;
+	}
+
+	*res = r;
+	return 0;
+}
+
+/*
+ * Same as fmod(), the result has the sign of a.
+ */
+static int int_mod(expr_int a, expr_int b, expr_int *res)
+{
+	if (!b)
+		return 1;
+
+	*res = b == -1 ? 0 : a % b;
+	return 0;
+}
+
+/*
+ * Same as remainder(), the quotient is rounded to the nearest, ties to even.
+ */
+static int int_rem(expr_int a, expr_int b, expr_int *res)
+{
+	expr_int r, ar, ab;
+
+	if (!b || int_abs(b, &ab))
+		return 1;
+
+	if (ab == 1) {
+		*res = 0;
+		return 0;
+	}
+
+	r = a % b;
+	ar = r < 0 ? -r : r;
+
+	if (ar > ab - ar || (ar == ab - ar && ((a / b) & 1)))
+		r += r > 0 ? -ab : ab;
+
+	*res = r;
+	return 0;
+}
+
+static int int_fn1(unsigned int iop, expr_int *a)
+{
+	switch (iop) {
+	case EXPR_INT_ID:
+		return 0;
+	case EXPR_INT_ABS:
+		return int_abs(*a, a);
+	}
+
+	return 1;
+}
+
+static int int_fn2(unsigned int iop, expr_int a, expr_int b, expr_int *res)
+{
+	switch (iop) {
+	case EXPR_INT_MOD:
+		return int_mod(a, b, res);
+	case EXPR_INT_REM:
+		return int_rem(a, b, res);
+	case EXPR_INT_MAX:
+		*res = a > b ? a : b;
+		return 0;
+	case EXPR_INT_MIN:
+		*res = a < b ? a : b;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int int_poly(const double *coefs, unsigned int deg, expr_int x,
+                    expr_int *res)
+{
+	expr_int r = coefs[0];
+	unsigned int i;
+
+	for (i = 1; i <= deg; i++) {
+		if (__builtin_mul_overflow(r, x, &r) ||
+		    __builtin_add_overflow(r, (expr_int)coefs[i], &r))
+			return 1;
+	}
+
+	*res = r;
+	return 0;
+}
+
+static int eval(const struct expr *self, const expr_int *args, expr_int *res)
+{
+	const struct expr_elem *elems = self->elems;
+	const struct expr_ufn *ufn;
+	expr_int buf[self->stack];
+	unsigned int i, s = 0;
+	double val;
+	int ovf = 0;
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		switch (elems[i].type) {
+		case EXPR_NUM:
+			buf[s++] = self->nums[elems[i].num];
+		break;
+		case EXPR_NEG:
+			ovf = int_neg(buf[s - 1], &buf[s - 1]);
+		break;
+		case EXPR_ADD:
+			ovf = __builtin_add_overflow(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_SUB:
+			ovf = __builtin_sub_overflow(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_MUL:
+			ovf = __builtin_mul_overflow(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_DIV:
+			ovf = int_div(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_POW:
+			ovf = int_pow(buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_VAR:
+			val = self->slots[elems[i].var]->val;
+			if (!is_int(val))
+				return 1;
+			buf[s++] = val;
+		break;
+		case EXPR_FN1:
+			ovf = int_fn1(expr_fn1[elems[i].fn].fn.iop, &buf[s - 1]);
+		break;
+		case EXPR_FN2:
+			ovf = int_fn2(expr_fn2[elems[i].fn].fn.iop,
+			              buf[s - 2], buf[s - 1], &buf[s - 2]);
+			s--;
+		break;
+		case EXPR_ARG:
+			buf[s++] = args[elems[i].arg];
+		break;
+		case EXPR_CALL:
+			ufn = self->ufns[elems[i].fn];
+			s -= ufn->argc;
+			ovf = eval(ufn->body, &buf[s], &buf[s]);
+			s++;
+		break;
+		case EXPR_LT:
+			buf[s - 2] = buf[s - 2] < buf[s - 1];
+			s--;
+		break;
+		case EXPR_LE:
+			buf[s - 2] = buf[s - 2] <= buf[s - 1];
+			s--;
+		break;
+		case EXPR_EQ:
+			buf[s - 2] = buf[s - 2] == buf[s - 1];
+			s--;
+		break;
+		case EXPR_NE:
+			buf[s - 2] = buf[s - 2] != buf[s - 1];
+			s--;
+		break;
+		case EXPR_GE:
+			buf[s - 2] = buf[s - 2] >= buf[s - 1];
+			s--;
+		break;
+		case EXPR_GT:
+			buf[s - 2] = buf[s - 2] > buf[s - 1];
+			s--;
+		break;
+		case EXPR_AND:
+			buf[s - 2] = buf[s - 2] != 0 && buf[s - 1] != 0;
+			s--;
+		break;
+		case EXPR_OR:
+			buf[s - 2] = buf[s - 2] != 0 || buf[s - 1] != 0;
+			s--;
+		break;
+		case EXPR_ANDJ:
+			if (buf[s - 1] == 0)
+				i += elems[i].jmp;
+		break;
+		case EXPR_ORJ:
+			if (buf[s - 1] != 0) {
+				buf[s - 1] = 1;
+				i += elems[i].jmp;
+			}
+		break;
+		case EXPR_IF:
+			if (buf[--s] == 0)
+				i += elems[i].jmp;
+		break;
+		case EXPR_ELSE:
+			i += elems[i].jmp;
+		break;
+		case EXPR_FI:
+		break;
+		case EXPR_POLY:
+			ovf = int_poly(expr_poly_coefs(self, &elems[i]),
+			               expr_poly_deg(self, &elems[i]),
+			               buf[s - 1], &buf[s - 1]);
+		break;
+		default:
+			return 1;
+		}
+
+		if (ovf)
+			return 1;
+	}
+
+	*res = buf[0];
+	return 0;
+}
+
+int expr_eval_int(struct expr *self, struct expr_ctx *ctx, expr_int *res)
+{
+	(void)ctx;
+
+	if (!self->is_int || self->out_cnt)
+		return 1;
+
+	return eval(self, NULL, res);
+}
+
+char *expr_int_str(expr_int val, char *buf, size_t size)
+{
+	/* 39 digits of 2^127, sign and terminating null */
+	char tmp[41];
+	unsigned int i = sizeof(tmp);
+	int neg = val < 0;
+
+	tmp[--i] = 0;
+
+	do {
+		int digit = val % 10;
+
+		tmp[--i] = '0' + (neg ? -digit : digit);
+		val /= 10;
+	} while (val);
+
+	if (neg)
+		tmp[--i] = '-';
+
+	snprintf(buf, size, "%s", tmp + i);
+
+	return buf;
+}
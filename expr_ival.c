@@ -0,0 +1,860 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Interval evaluation, each value on the stack is an interval that contains
+   all possible values of the subexpression.
+
+   The bounds of the arithmetic operations are rounded outwards by one ulp,
+   the results of the libm functions, that are not correctly rounded, are
+   widened a bit more. Functions are evaluated by the rule from the function
+   table, i.e. monotonic functions are evaluated at the interval bounds,
+   periodic functions check for extremes inside the interval, etc.
+
+   Conditionals are evaluated the same way as in the batch evaluation, both
+   branches are evaluated and the result is the union of the branches unless
+   the condition is decided.
+
+  */
+
+#include <float.h>
+
+#include "expr_priv.h"
+
+/* The libm functions are expected to be accurate to a few ulps */
+#define LIBM_ERR (16 * DBL_EPSILON)
+
+/* Minimum of the gamma function on the positive axis */
+#define GAMMA_MIN_X 1.4616321449683623
+
+static const struct expr_ival empty = {NAN, NAN};
+static const struct expr_ival whole = {-INFINITY, INFINITY};
+
+static int is_empty(struct expr_ival x)
+{
+	return isnan(x.lo) || isnan(x.hi);
+}
+
+static struct expr_ival point(double x)
+{
+	if (isnan(x))
+		return empty;
+
+	return (struct expr_ival){x, x};
+}
+
+/*
+ * Result of a correctly rounded operation, NaN bounds, e.g. from inf - inf,
+ * are replaced with infinities.
+ */
+static struct expr_ival round_out(double lo, double hi)
+{
+	lo = isnan(lo) ? -INFINITY : nextafter(lo, -INFINITY);
+	hi = isnan(hi) ? INFINITY : nextafter(hi, INFINITY);
+
+	return (struct expr_ival){lo, hi};
+}
+
+/*
+ * Result of a libm function.
+ */
+static struct expr_ival widen(double lo, double hi)
+{
+	if (isnan(lo))
+		lo = -INFINITY;
+	else if (isfinite(lo))
+		lo -= fabs(lo) * LIBM_ERR + DBL_MIN;
+
+	if (isnan(hi))
+		hi = INFINITY;
+	else if (isfinite(hi))
+		hi += fabs(hi) * LIBM_ERR + DBL_MIN;
+
+	return (struct expr_ival){lo, hi};
+}
+
+static struct expr_ival clamp(struct expr_ival x, double lo, double hi)
+{
+	x.lo = fmax(x.lo, lo);
+	x.hi = fmin(x.hi, hi);
+
+	return x;
+}
+
+static struct expr_ival hull(struct expr_ival a, struct expr_ival b)
+{
+	if (is_empty(a))
+		return b;
+
+	if (is_empty(b))
+		return a;
+
+	return (struct expr_ival){fmin(a.lo, b.lo), fmax(a.hi, b.hi)};
+}
+
+/* Magnitude and mignitude, i.e. maximal and minimal absolute value */
+static double mag(struct expr_ival x)
+{
+	return fmax(fabs(x.lo), fabs(x.hi));
+}
+
+static double mig(struct expr_ival x)
+{
+	if (x.lo > 0)
+		return x.lo;
+
+	if (x.hi < 0)
+		return -x.hi;
+
+	return 0;
+}
+
+static struct expr_ival ival_add(struct expr_ival a, struct expr_ival b)
+{
+	return round_out(a.lo + b.lo, a.hi + b.hi);
+}
+
+static struct expr_ival ival_sub(struct expr_ival a, struct expr_ival b)
+{
+	return round_out(a.lo - b.hi, a.hi - b.lo);
+}
+
+/* 0 * inf is zero, the infinity is just a bound */
+static double mul0(double a, double b)
+{
+	return (a == 0 || b == 0) ? 0 : a * b;
+}
+
+static struct expr_ival ival_mul(struct expr_ival a, struct expr_ival b)
+{
+	double p1 = mul0(a.lo, b.lo), p2 = mul0(a.lo, b.hi);
+	double p3 = mul0(a.hi, b.lo), p4 = mul0(a.hi, b.hi);
+
+	return round_out(fmin(fmin(p1, p2), fmin(p3, p4)),
+	                 fmax(fmax(p1, p2), fmax(p3, p4)));
+}
+
+static struct expr_ival ival_div(struct expr_ival a, struct expr_ival b)
+{
+	double q1, q2, q3, q4;
+
+	if (b.lo <= 0 && b.hi >= 0)
+		return whole;
+
+	q1 = a.lo / b.lo;
+	q2 = a.lo / b.hi;
+	q3 = a.hi / b.lo;
+	q4 = a.hi / b.hi;
+
+	/* inf / inf */
+	if (isnan(q1) || isnan(q2) || isnan(q3) || isnan(q4))
+		return whole;
+
+	return round_out(fmin(fmin(q1, q2), fmin(q3, q4)),
+	                 fmax(fmax(q1, q2), fmax(q3, q4)));
+}
+
+/*
+ * Returns non-zero if c + k * period is in [lo, hi] for some integer k, the
+ * answer errs on the side of yes.
+ */
+static int has_point(double lo, double hi, double c, double period)
+{
+	double tlo = (lo - c) / period;
+	double thi = (hi - c) / period;
+
+	tlo -= (fabs(tlo) + 1) * 4 * DBL_EPSILON;
+	thi += (fabs(thi) + 1) * 4 * DBL_EPSILON;
+
+	return floor(thi) >= ceil(tlo);
+}
+
+/*
+ * Sine and cosine, c is the position of the maximum.
+ */
+static struct expr_ival ival_sincos(struct expr_ival x, double (*f)(double),
+                                    double c)
+{
+	double flo, fhi;
+	struct expr_ival res;
+
+	if (!(x.hi - x.lo < 2 * M_PI))
+		return (struct expr_ival){-1, 1};
+
+	flo = f(x.lo);
+	fhi = f(x.hi);
+
+	res = widen(fmin(flo, fhi), fmax(flo, fhi));
+
+	if (has_point(x.lo, x.hi, c, 2 * M_PI))
+		res.hi = 1;
+
+	if (has_point(x.lo, x.hi, c + M_PI, 2 * M_PI))
+		res.lo = -1;
+
+	return clamp(res, -1, 1);
+}
+
+static struct expr_ival ival_tan(struct expr_ival x)
+{
+	if (!(x.hi - x.lo < M_PI) || has_point(x.lo, x.hi, M_PI_2, M_PI))
+		return whole;
+
+	return widen(tan(x.lo), tan(x.hi));
+}
+
+static struct expr_ival ival_gamma(struct expr_ival x, double (*f)(double))
+{
+	if (x.lo <= 0)
+		return whole;
+
+	if (x.hi <= GAMMA_MIN_X)
+		return widen(f(x.hi), f(x.lo));
+
+	if (x.lo >= GAMMA_MIN_X)
+		return widen(f(x.lo), f(x.hi));
+
+	return widen(f(GAMMA_MIN_X), fmax(f(x.lo), f(x.hi)));
+}
+
+/*
+ * Increasing function with domain [lo, hi].
+ */
+static struct expr_ival ival_inc(struct expr_ival x, double (*f)(double),
+                                 double lo, double hi)
+{
+	if (x.hi < lo || x.lo > hi)
+		return empty;
+
+	x = clamp(x, lo, hi);
+
+	return widen(f(x.lo), f(x.hi));
+}
+
+static struct expr_ival ival_dec(struct expr_ival x, double (*f)(double),
+                                 double lo, double hi)
+{
+	if (x.hi < lo || x.lo > hi)
+		return empty;
+
+	x = clamp(x, lo, hi);
+
+	return widen(f(x.hi), f(x.lo));
+}
+
+static struct expr_ival ival_even(struct expr_ival x, double (*f)(double))
+{
+	if (x.lo >= 0)
+		return widen(f(x.lo), f(x.hi));
+
+	if (x.hi <= 0)
+		return widen(f(x.hi), f(x.lo));
+
+	return widen(f(0), f(mag(x)));
+}
+
+static struct expr_ival ival_fn1(const struct expr_fn *fn, struct expr_ival x,
+                                 struct expr_ctx *ctx)
+{
+	struct expr_ival rad = point(expr_rad_factor(ctx));
+	struct expr_ival res;
+
+	if (is_empty(x))
+		return empty;
+
+	if (fn->a1_in)
+		x = ival_mul(x, rad);
+
+	switch (fn->ival) {
+	case EXPR_IVAL_INC:
+		res = ival_inc(x, fn->fn1, -INFINITY, INFINITY);
+	break;
+	case EXPR_IVAL_DEC:
+		res = ival_dec(x, fn->fn1, -INFINITY, INFINITY);
+	break;
+	case EXPR_IVAL_LOG:
+		res = ival_inc(x, fn->fn1, 0, INFINITY);
+	break;
+	case EXPR_IVAL_ACOSH:
+		res = ival_inc(x, fn->fn1, 1, INFINITY);
+	break;
+	case EXPR_IVAL_ASIN:
+		res = ival_inc(x, fn->fn1, -1, 1);
+	break;
+	case EXPR_IVAL_ACOS:
+		res = ival_dec(x, fn->fn1, -1, 1);
+	break;
+	case EXPR_IVAL_EVEN:
+		res = ival_even(x, fn->fn1);
+	break;
+	case EXPR_IVAL_SIN:
+		res = ival_sincos(x, fn->fn1, M_PI_2);
+	break;
+	case EXPR_IVAL_COS:
+		res = ival_sincos(x, fn->fn1, 0);
+	break;
+	case EXPR_IVAL_TAN:
+		res = ival_tan(x);
+	break;
+	case EXPR_IVAL_GAMMA:
+		res = ival_gamma(x, fn->fn1);
+	break;
+	default:
+		res = whole;
+	}
+
+	if (fn->a_out && !is_empty(res))
+		res = ival_div(res, rad);
+
+	return res;
+}
+
+/*
+ * The result of fmod() has the sign of a and is smaller than b in absolute
+ * value, if a is inside of a single period the function is increasing.
+ */
+static struct expr_ival ival_mod(struct expr_ival a, struct expr_ival b)
+{
+	double m = mag(b);
+
+	if (b.lo == b.hi && b.lo != 0 && isfinite(a.lo) && isfinite(a.hi) &&
+	    trunc(a.lo / b.lo) == trunc(a.hi / b.lo) &&
+	    (a.lo > 0 || a.hi < 0))
+		return widen(fmod(a.lo, b.lo), fmod(a.hi, b.lo));
+
+	if (a.lo >= 0)
+		return (struct expr_ival){0, fmin(a.hi, m)};
+
+	if (a.hi <= 0)
+		return (struct expr_ival){fmax(a.lo, -m), 0};
+
+	return (struct expr_ival){fmax(a.lo, -m), fmin(a.hi, m)};
+}
+
+/*
+ * The result of remainder() is in [-b/2, b/2] and equal to a if a is in
+ * that range already.
+ */
+static struct expr_ival ival_rem(struct expr_ival a, struct expr_ival b)
+{
+	double h = mag(b) / 2;
+
+	if (mig(b) / 2 > mag(a))
+		return a;
+
+	return round_out(-h, h);
+}
+
+static struct expr_ival ival_pow_int(struct expr_ival a, double n)
+{
+	double plo = pow(a.lo, n), phi = pow(a.hi, n);
+
+	if (n == 0)
+		return point(1);
+
+	/* odd powers are increasing, even decreasing, then increasing */
+	if (fmod(n, 2) != 0 || a.lo >= 0)
+		return widen(plo, phi);
+
+	if (a.hi <= 0)
+		return widen(phi, plo);
+
+	return widen(0, fmax(plo, phi));
+}
+
+/*
+ * For positive a the pow() is monotonic in both arguments so the extremes
+ * are in the corners, negative a has real results only for integer b.
+ */
+static struct expr_ival ival_pow(struct expr_ival a, struct expr_ival b)
+{
+	double p1, p2, p3, p4;
+
+	if (b.lo == b.hi && b.lo == floor(b.lo) && fabs(b.lo) < 0x1p53) {
+		if (b.lo >= 0)
+			return ival_pow_int(a, b.lo);
+
+		if (a.lo > 0 || a.hi < 0)
+			return ival_div(point(1), ival_pow_int(a, -b.lo));
+
+		return whole;
+	}
+
+	if (a.lo < 0) {
+		if (b.lo != b.hi)
+			return whole;
+
+		if (a.hi < 0)
+			return empty;
+
+		a.lo = 0;
+	}
+
+	p1 = pow(a.lo, b.lo);
+	p2 = pow(a.lo, b.hi);
+	p3 = pow(a.hi, b.lo);
+	p4 = pow(a.hi, b.hi);
+
+	return widen(fmin(fmin(p1, p2), fmin(p3, p4)),
+	             fmax(fmax(p1, p2), fmax(p3, p4)));
+}
+
+/*
+ * The angle of a box that does not touch the negative x axis, where the
+ * atan2() jumps from pi to -pi, has extremes in the corners.
+ */
+static struct expr_ival ival_atan2(struct expr_ival y, struct expr_ival x)
+{
+	double a1, a2, a3, a4;
+
+	if (x.lo <= 0 && y.lo <= 0 && y.hi >= 0)
+		return (struct expr_ival){-M_PI, M_PI};
+
+	a1 = atan2(y.lo, x.lo);
+	a2 = atan2(y.lo, x.hi);
+	a3 = atan2(y.hi, x.lo);
+	a4 = atan2(y.hi, x.hi);
+
+	return clamp(widen(fmin(fmin(a1, a2), fmin(a3, a4)),
+	                   fmax(fmax(a1, a2), fmax(a3, a4))), -M_PI, M_PI);
+}
+
+static struct expr_ival ival_fn2(const struct expr_fn *fn, struct expr_ival a,
+                                 struct expr_ival b, struct expr_ctx *ctx)
+{
+	struct expr_ival res;
+
+	if (is_empty(a) || is_empty(b))
+		return empty;
+
+	switch (fn->ival) {
+	case EXPR_IVAL_MOD:
+		res = ival_mod(a, b);
+	break;
+	case EXPR_IVAL_REM:
+		res = ival_rem(a, b);
+	break;
+	case EXPR_IVAL_INC2:
+		res.lo = fn->fn2(a.lo, b.lo);
+		res.hi = fn->fn2(a.hi, b.hi);
+	break;
+	case EXPR_IVAL_HYPOT:
+		res = widen(hypot(mig(a), mig(b)), hypot(mag(a), mag(b)));
+	break;
+	case EXPR_IVAL_POW:
+		res = ival_pow(a, b);
+	break;
+	case EXPR_IVAL_ATAN2:
+		res = ival_atan2(a, b);
+	break;
+	default:
+		res = whole;
+	}
+
+	if (fn->a_out && !is_empty(res))
+		res = ival_div(res, point(expr_rad_factor(ctx)));
+
+	return res;
+}
+
+/* Returns 1 if certainly non-zero, 0 if certainly zero, -1 if not known */
+static int truth(struct expr_ival x)
+{
+	if (x.lo > 0 || x.hi < 0)
+		return 1;
+
+	if (x.lo == 0 && x.hi == 0)
+		return 0;
+
+	return -1;
+}
+
+static struct expr_ival boolean(int val)
+{
+	if (val < 0)
+		return (struct expr_ival){0, 1};
+
+	return point(val);
+}
+
+static struct expr_ival ival_cmp(enum expr_elem_type op,
+                                 struct expr_ival a, struct expr_ival b)
+{
+	if (is_empty(a) || is_empty(b))
+		return empty;
+
+	switch (op) {
+	case EXPR_LT:
+		return boolean(a.hi < b.lo ? 1 : a.lo >= b.hi ? 0 : -1);
+	case EXPR_LE:
+		return boolean(a.hi <= b.lo ? 1 : a.lo > b.hi ? 0 : -1);
+	case EXPR_GT:
+		return boolean(a.lo > b.hi ? 1 : a.hi <= b.lo ? 0 : -1);
+	case EXPR_GE:
+		return boolean(a.lo >= b.hi ? 1 : a.hi < b.lo ? 0 : -1);
+	case EXPR_EQ:
+		if (a.lo == a.hi && b.lo == b.hi && a.lo == b.lo)
+			return point(1);
+		return boolean(a.hi < b.lo || a.lo > b.hi ? 0 : -1);
+	case EXPR_NE:
+		if (a.lo == a.hi && b.lo == b.hi && a.lo == b.lo)
+			return point(0);
+		return boolean(a.hi < b.lo || a.lo > b.hi ? 1 : -1);
+	default:
+		return whole;
+	}
+}
+
+static struct expr_ival ival_and(struct expr_ival a, struct expr_ival b)
+{
+	int ta = truth(a), tb = truth(b);
+
+	if (is_empty(a))
+		return empty;
+
+	/* the right side is not evaluated */
+	if (!ta)
+		return point(0);
+
+	if (is_empty(b))
+		return ta < 0 ? point(0) : empty;
+
+	if (!tb)
+		return point(0);
+
+	return boolean(ta > 0 && tb > 0 ? 1 : -1);
+}
+
+static struct expr_ival ival_or(struct expr_ival a, struct expr_ival b)
+{
+	int ta = truth(a), tb = truth(b);
+
+	if (is_empty(a))
+		return empty;
+
+	if (ta > 0)
+		return point(1);
+
+	if (is_empty(b))
+		return ta < 0 ? point(1) : empty;
+
+	if (tb > 0)
+		return point(1);
+
+	return boolean(!ta && !tb ? 0 : -1);
+}
+
+/*
+ * The Horner's scheme is loose when x contains zero, e.g. x^2 over [-1, 2]
+ * gives [-2, 4], the sum of the monomials has tight even powers. Both contain
+ * the range of the polynomial so the result is their intersection.
+ */
+static struct expr_ival ival_poly(const double *coefs, unsigned int deg,
+                                  struct expr_ival x)
+{
+	struct expr_ival res = point(coefs[0]);
+	struct expr_ival sum = point(0);
+	unsigned int i;
+
+	if (is_empty(x))
+		return empty;
+
+	for (i = 1; i <= deg; i++)
+		res = ival_add(ival_mul(res, x), point(coefs[i]));
+
+	for (i = 0; i <= deg; i++) {
+		if (!coefs[i])
+			continue;
+
+		sum = ival_add(sum, ival_mul(point(coefs[i]),
+		                             ival_pow_int(x, deg - i)));
+	}
+
+	res.lo = fmax(res.lo, sum.lo);
+	res.hi = fmin(res.hi, sum.hi);
+
+	return res;
+}
+
+/*
+ * Intervals for the variables, the user functions have their own variable
+ * slots so the lookup is done by the variable pointer.
+ */
+struct box {
+	const struct expr_var *vars;
+	unsigned int vars_cnt;
+	const struct expr_ival *const *ivals;
+};
+
+static struct expr_ival var_ival(const struct box *box,
+                                 const struct expr_var *var)
+{
+	if (box->ivals && var >= box->vars && var < box->vars + box->vars_cnt &&
+	    box->ivals[var - box->vars])
+		return *box->ivals[var - box->vars];
+
+	return point(var->val);
+}
+
+static struct expr_ival eval_ival(const struct expr *self, unsigned int start,
+                                  const struct box *box,
+                                  const struct expr_ival *args,
+                                  struct expr_ival *bound, unsigned int depth,
+                                  struct expr_ctx *ctx);
+
+/*
+ * The root of the body is in the [lo, hi] if there is any.
+ */
+static struct expr_ival ival_solve(const struct expr *self, unsigned int start,
+                                   const struct box *box,
+                                   const struct expr_ival *args,
+                                   struct expr_ival *bound, unsigned int depth,
+                                   struct expr_ival lo, struct expr_ival hi,
+                                   struct expr_ctx *ctx)
+{
+	struct expr_ival f;
+
+	if (is_empty(lo) || is_empty(hi))
+		return empty;
+
+	bound[depth] = hull(lo, hi);
+	f = eval_ival(self, start, box, args, bound, depth + 1, ctx);
+
+	if (is_empty(f) || f.lo > 0 || f.hi < 0)
+		return empty;
+
+	return bound[depth];
+}
+
+/*
+ * The integral over [a, b] is (b - a) times something in the range of the
+ * body.
+ */
+static struct expr_ival ival_integrate(const struct expr *self, unsigned int start,
+                                       const struct box *box,
+                                       const struct expr_ival *args,
+                                       struct expr_ival *bound, unsigned int depth,
+                                       struct expr_ival a, struct expr_ival b,
+                                       struct expr_ctx *ctx)
+{
+	struct expr_ival f;
+
+	if (is_empty(a) || is_empty(b))
+		return empty;
+
+	bound[depth] = hull(a, b);
+	f = eval_ival(self, start, box, args, bound, depth + 1, ctx);
+
+	if (is_empty(f))
+		return empty;
+
+	return ival_mul(ival_sub(b, a), f);
+}
+
+/*
+ * The sum of cnt terms in [lo, hi] is in [cnt * lo, cnt * hi], the product
+ * in [lo^cnt, hi^cnt] for non-negative terms.
+ */
+static struct expr_ival ival_sum(const struct expr *self, unsigned int start,
+                                 int prod, const struct box *box,
+                                 const struct expr_ival *args,
+                                 struct expr_ival *bound, unsigned int depth,
+                                 struct expr_ival from, struct expr_ival to,
+                                 struct expr_ctx *ctx)
+{
+	struct expr_ival f, cnt;
+	double m;
+
+	if (is_empty(from) || is_empty(to))
+		return empty;
+
+	cnt.lo = fmax(0, floor(to.lo - from.hi) + 1);
+	cnt.hi = fmax(0, floor(to.hi - from.lo) + 1);
+
+	if (cnt.hi == 0)
+		return point(prod ? 1 : 0);
+
+	bound[depth] = (struct expr_ival){from.lo, to.hi};
+	f = eval_ival(self, start, box, args, bound, depth + 1, ctx);
+
+	if (is_empty(f))
+		return empty;
+
+	if (!prod)
+		return ival_mul(cnt, f);
+
+	if (f.lo >= 0) {
+		return widen(fmin(pow(f.lo, cnt.lo), pow(f.lo, cnt.hi)),
+		             fmax(pow(f.hi, cnt.lo), pow(f.hi, cnt.hi)));
+	}
+
+	m = fmax(pow(mag(f), cnt.lo), pow(mag(f), cnt.hi));
+
+	return widen(-m, m);
+}
+
+/*
+ * Evaluates program starting at start until END or RET, the bound are
+ * intervals of the bound variables and depth is the number of bound variables.
+ */
+static struct expr_ival eval_ival(const struct expr *self, unsigned int start,
+                                  const struct box *box,
+                                  const struct expr_ival *args,
+                                  struct expr_ival *bound, unsigned int depth,
+                                  struct expr_ctx *ctx)
+{
+	const struct expr_elem *elems = self->elems;
+	struct expr_ival buf[self->stack];
+	const struct expr_ufn *ufn;
+	unsigned int i, s = 0;
+
+	for (i = start; elems[i].type != EXPR_END && elems[i].type != EXPR_RET; i++) {
+		/* the top two values for operators */
+		struct expr_ival *a = s > 1 ? &buf[s - 2] : NULL;
+		struct expr_ival *b = s > 0 ? &buf[s - 1] : NULL;
+
+		switch (elems[i].type) {
+		case EXPR_NUM:
+			buf[s++] = point(self->nums[elems[i].num]);
+		break;
+		case EXPR_VAR:
+			buf[s++] = var_ival(box, self->slots[elems[i].var]);
+		break;
+		case EXPR_ARG:
+			buf[s++] = args[elems[i].arg];
+		break;
+		case EXPR_BVAR:
+			buf[s++] = bound[elems[i].arg];
+		break;
+		case EXPR_RAND:
+			if (elems[i].fn == EXPR_RAND_NORMAL)
+				buf[s++] = whole;
+			else
+				buf[s++] = (struct expr_ival){0, 1};
+		break;
+		case EXPR_NEG:
+			*b = (struct expr_ival){-b->hi, -b->lo};
+		break;
+		case EXPR_ADD:
+		case EXPR_SUB:
+		case EXPR_MUL:
+		case EXPR_DIV:
+		case EXPR_POW:
+			if (is_empty(*a) || is_empty(*b)) {
+				*a = empty;
+			} else if (elems[i].type == EXPR_ADD) {
+				*a = ival_add(*a, *b);
+			} else if (elems[i].type == EXPR_SUB) {
+				*a = ival_sub(*a, *b);
+			} else if (elems[i].type == EXPR_MUL) {
+				*a = ival_mul(*a, *b);
+			} else if (elems[i].type == EXPR_DIV) {
+				*a = ival_div(*a, *b);
+			} else {
+				*a = ival_pow(*a, *b);
+			}
+			s--;
+		break;
+		case EXPR_FN1:
+			*b = ival_fn1(&expr_fn1[elems[i].fn].fn, *b, ctx);
+		break;
+		case EXPR_FN2:
+			*a = ival_fn2(&expr_fn2[elems[i].fn].fn, *a, *b, ctx);
+			s--;
+		break;
+		case EXPR_CALL: {
+			struct expr_ival cbound[EXPR_BIND_MAX];
+
+			ufn = self->ufns[elems[i].fn];
+			s -= ufn->argc;
+			buf[s] = eval_ival(ufn->body, 0, box, &buf[s], cbound, 0, ctx);
+			s++;
+		} break;
+		case EXPR_LT ... EXPR_NE:
+		case EXPR_GE:
+		case EXPR_GT:
+			*a = ival_cmp(elems[i].type, *a, *b);
+			s--;
+		break;
+		case EXPR_AND:
+			*a = ival_and(*a, *b);
+			s--;
+		break;
+		case EXPR_OR:
+			*a = ival_or(*a, *b);
+			s--;
+		break;
+		case EXPR_ANDJ:
+		case EXPR_ORJ:
+		case EXPR_IF:
+		case EXPR_ELSE:
+		break;
+		case EXPR_FI: {
+			struct expr_ival *c = &buf[s - 3];
+
+			switch (truth(*c)) {
+			case 1:
+				*c = *a;
+			break;
+			case 0:
+				*c = *b;
+			break;
+			default:
+				*c = is_empty(*c) ? empty : hull(*a, *b);
+			}
+			s -= 2;
+		} break;
+		case EXPR_BIND:
+			i += elems[i].jmp;
+		break;
+		case EXPR_SOLVE:
+			*a = ival_solve(self, i - elems[i].jmp + 1, box, args,
+			                bound, depth, *a, *b, ctx);
+			s--;
+		break;
+		case EXPR_INTEGRATE:
+			*a = ival_integrate(self, i - elems[i].jmp + 1, box, args,
+			                    bound, depth, *a, *b, ctx);
+			s--;
+		break;
+		case EXPR_SUM:
+		case EXPR_PROD:
+			*a = ival_sum(self, i - elems[i].jmp + 1,
+			              elems[i].type == EXPR_PROD, box, args,
+			              bound, depth, *a, *b, ctx);
+			s--;
+		break;
+		case EXPR_POLY:
+			*b = ival_poly(expr_poly_coefs(self, &elems[i]),
+			               expr_poly_deg(self, &elems[i]), *b);
+		break;
+		}
+	}
+
+	return buf[0];
+}
+
+struct expr_ival expr_eval_interval(struct expr *self, struct expr_ctx *ctx,
+                                    const struct expr_ival *const ivals[])
+{
+	struct expr_ival bound[EXPR_BIND_MAX];
+	struct box box = {
+		.vars = self->vars,
+		.ivals = ivals,
+	};
+
+	if (self->out_cnt)
+		return empty;
+
+	if (self->vars) {
+		while (self->vars[box.vars_cnt].name)
+			box.vars_cnt++;
+	}
+
+	return eval_ival(self, 0, &box, NULL, bound, 0, ctx);
+}
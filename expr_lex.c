@@ -0,0 +1,245 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Lexer helpers.
+
+   The identifier, digit and whitespace runs are scanned 16 bytes at a time
+   with the GCC vector extensions, which compile into SSE2, NEON, etc. or
+   into scalar code where there is no SIMD. The loads are aligned so that
+   they never cross a page boundary, the bytes after the terminating '\0' in
+   the last block are read but never matched.
+
+   Simple decimal numbers are converted exactly without strtod(), a number
+   with at most 15 significant digits and a power of ten exponent up to 22
+   is a single correctly rounded multiplication or division.
+
+  */
+
+#include <float.h>
+#include <string.h>
+
+#include "expr_priv.h"
+
+const uint8_t expr_lex_class[256] = {
+	['a' ... 'z'] = EXPR_LEX_ALPHA | EXPR_LEX_IDENT,
+	['A' ... 'Z'] = EXPR_LEX_ALPHA | EXPR_LEX_IDENT,
+	['0' ... '9'] = EXPR_LEX_DIGIT | EXPR_LEX_IDENT | EXPR_LEX_NUM,
+	['_'] = EXPR_LEX_IDENT,
+	['.'] = EXPR_LEX_NUM,
+	[' '] = EXPR_LEX_SPACE,
+	['\t'] = EXPR_LEX_SPACE,
+	['+'] = EXPR_LEX_OP,
+	['-'] = EXPR_LEX_OP,
+	['/'] = EXPR_LEX_OP,
+	['*'] = EXPR_LEX_OP,
+	['^'] = EXPR_LEX_OP,
+	['<'] = EXPR_LEX_OP,
+	['>'] = EXPR_LEX_OP,
+	['='] = EXPR_LEX_OP,
+	['!'] = EXPR_LEX_OP,
+	['&'] = EXPR_LEX_OP,
+	['|'] = EXPR_LEX_OP,
+	[')'] = EXPR_LEX_OP,
+	[','] = EXPR_LEX_OP,
+};
+
+typedef uint8_t lex_vec __attribute__((vector_size(16), may_alias));
+
+static const lex_vec lex_idx = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+/*
+ * Returns 0xff for the bytes in the class.
+ */
+static inline __attribute__((always_inline))
+lex_vec lex_match(lex_vec v, unsigned int cls)
+{
+	lex_vec lower = v | 0x20;
+
+	switch (cls) {
+	case EXPR_LEX_IDENT:
+		return (lex_vec)((lex_vec)(lower - 'a') < 26) |
+		       (lex_vec)((lex_vec)(v - '0') < 10) |
+		       (lex_vec)(v == '_');
+	case EXPR_LEX_DIGIT:
+		return (lex_vec)((lex_vec)(v - '0') < 10);
+	default:
+		return (lex_vec)(v == ' ') | (lex_vec)(v == '\t');
+	}
+}
+
+/*
+ * Index of the first byte not in the class, the bytes are in memory order.
+ */
+static inline unsigned int first_clear(uint64_t m)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_clzll(~m) / 8;
+#else
+	return __builtin_ctzll(~m) / 8;
+#endif
+}
+
+static inline __attribute__((always_inline))
+unsigned int run_len(const char *str, unsigned int cls)
+{
+	unsigned int off = (uintptr_t)str & 15;
+	const lex_vec *p = (const lex_vec *)(str - off);
+	/* the bytes before str are treated as matching */
+	lex_vec m = lex_match(*p, cls) | (lex_vec)(lex_idx < (uint8_t)off);
+	unsigned int len = 0;
+	uint64_t w[2];
+
+	for (;;) {
+		memcpy(w, &m, sizeof(w));
+
+		if (~w[0])
+			return len + first_clear(w[0]) - off;
+
+		if (~w[1])
+			return len + 8 + first_clear(w[1]) - off;
+
+		len += 16;
+		m = lex_match(*++p, cls);
+	}
+}
+
+__attribute__((no_sanitize_address))
+unsigned int expr_ident_len(const char *str)
+{
+	return run_len(str, EXPR_LEX_IDENT);
+}
+
+__attribute__((no_sanitize_address))
+unsigned int expr_digit_len(const char *str)
+{
+	return run_len(str, EXPR_LEX_DIGIT);
+}
+
+__attribute__((no_sanitize_address))
+unsigned int expr_space_len(const char *str)
+{
+	return run_len(str, EXPR_LEX_SPACE);
+}
+
+uint32_t expr_ident_hash(const char *str, unsigned int len)
+{
+	uint32_t h = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (uint8_t)str[i]) * 16777619u;
+
+	return h;
+}
+
+#define NUM_DIGITS_MAX 15
+#define NUM_EXP_MAX 22
+
+static const double num_pow10[NUM_EXP_MAX + 1] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Adds the digits to the mantissa, returns 1 if there is too many of them.
+ */
+static int add_digits(const char *str, unsigned int len, uint64_t *m,
+                      unsigned int *digits)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (!*m && str[i] == '0')
+			continue;
+
+		if (++(*digits) > NUM_DIGITS_MAX)
+			return 1;
+
+		*m = *m * 10 + str[i] - '0';
+	}
+
+	return 0;
+}
+
+unsigned int expr_num_fast(const char *str, double *res)
+{
+	const char *p = str;
+	unsigned int len, digits = 0, neg = 0, any;
+	uint64_t m = 0;
+	int exp = 0;
+
+	/* excess precision would round twice */
+	if (FLT_EVAL_METHOD != 0)
+		return 0;
+
+	if (*p == '+' || *p == '-')
+		neg = *p++ == '-';
+
+	/* hexadecimal */
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+		return 0;
+
+	len = expr_digit_len(p);
+	any = len;
+
+	if (add_digits(p, len, &m, &digits))
+		return 0;
+
+	p += len;
+
+	if (*p == '.') {
+		p++;
+		len = expr_digit_len(p);
+		any |= len;
+
+		if (add_digits(p, len, &m, &digits))
+			return 0;
+
+		/* each digit of the fraction is a division by ten */
+		exp -= len;
+		p += len;
+	}
+
+	if (!any)
+		return 0;
+
+	if (*p == 'e' || *p == 'E') {
+		const char *e = p + 1;
+		int e_neg = 0, e_val = 0;
+
+		if (*e == '+' || *e == '-')
+			e_neg = *e++ == '-';
+
+		len = expr_digit_len(e);
+		if (len > 4)
+			return 0;
+
+		if (len) {
+			for (p = e; p < e + len; p++)
+				e_val = e_val * 10 + *p - '0';
+
+			exp += e_neg ? -e_val : e_val;
+		}
+	}
+
+	if (!m) {
+		*res = neg ? -0.0 : 0.0;
+		return p - str;
+	}
+
+	if (exp < -NUM_EXP_MAX || exp > NUM_EXP_MAX)
+		return 0;
+
+	*res = exp < 0 ? m / num_pow10[-exp] : m * num_pow10[exp];
+
+	if (neg)
+		*res = -*res;
+
+	return p - str;
+}
@@ -0,0 +1,497 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Arena and pool allocators for compiled programs.
+
+   The program is compiled directly into a block from the arena or the pool,
+   sized for the worst case, and the arrays are compacted at the end. The
+   programs replaced by the compiler passes are freed before the next one is
+   allocated, so that the arena reuses the space.
+
+   The arena allocates from large chunks by bumping a pointer, only the last
+   program can be freed, all of them are dropped by a reset that keeps the
+   chunks for reuse. References to user functions and memos are released at
+   the reset, the programs that hold them are kept in a list.
+
+   The pool has a free list for each power of two size class, the blocks are
+   carved from slabs. Blocks larger than the biggest class are allocated by
+   malloc().
+
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr_priv.h"
+
+#define ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+#define ARENA_CHUNK_DEFAULT (64 * 1024)
+
+/* size classes from 1 << POOL_MIN_SHIFT to 1 << POOL_MAX_SHIFT */
+#define POOL_MIN_SHIFT 6
+#define POOL_MAX_SHIFT 16
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+enum expr_mem_type {
+	EXPR_MEM_ARENA,
+	EXPR_MEM_POOL,
+};
+
+struct expr_mem {
+	enum expr_mem_type type;
+	struct expr_mem_stats stats;
+};
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	char data[] __attribute__((aligned(16)));
+};
+
+struct arena_ref {
+	struct arena_ref *next;
+	struct expr *prog;
+};
+
+struct expr_arena {
+	struct expr_mem mem;
+	size_t chunk_size;
+	struct arena_chunk *first;
+	struct arena_chunk *cur;
+	size_t off;
+	/* programs that reference user functions */
+	struct arena_ref *refs;
+};
+
+struct pool_block {
+	struct pool_block *next;
+};
+
+struct pool_slab {
+	struct pool_slab *next;
+	char data[] __attribute__((aligned(16)));
+};
+
+struct expr_pool {
+	struct expr_mem mem;
+	struct pool_block *free[POOL_CLASSES];
+	struct pool_slab *slabs;
+};
+
+static void stats_alloc(struct expr_mem *mem, size_t size)
+{
+	mem->stats.allocs++;
+	mem->stats.used += size;
+
+	if (mem->stats.used > mem->stats.peak)
+		mem->stats.peak = mem->stats.used;
+}
+
+static void stats_free(struct expr_mem *mem, size_t size)
+{
+	mem->stats.frees++;
+	mem->stats.used -= size;
+}
+
+struct expr_arena *expr_arena_create(size_t chunk_size)
+{
+	struct expr_arena *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return NULL;
+
+	self->mem.type = EXPR_MEM_ARENA;
+	self->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_DEFAULT;
+
+	return self;
+}
+
+static void *arena_alloc(struct expr_arena *self, size_t size)
+{
+	struct arena_chunk *chunk;
+	void *ret;
+
+	size = ALIGN(size);
+
+	while (!self->cur || self->off + size > self->cur->size) {
+		/* reuse chunks kept by a reset */
+		if (self->cur && self->cur->next && size <= self->cur->next->size) {
+			self->cur = self->cur->next;
+			self->off = 0;
+			continue;
+		}
+
+		size_t chunk_size = size > self->chunk_size ? size : self->chunk_size;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+
+		chunk->size = chunk_size;
+
+		if (self->cur) {
+			chunk->next = self->cur->next;
+			self->cur->next = chunk;
+		} else {
+			chunk->next = self->first;
+			self->first = chunk;
+		}
+
+		self->cur = chunk;
+		self->off = 0;
+		self->mem.stats.reserved += sizeof(*chunk) + chunk_size;
+	}
+
+	ret = self->cur->data + self->off;
+	self->off += size;
+
+	return ret;
+}
+
+/*
+ * Returns the block back to the arena if it was the last one allocated.
+ */
+static void arena_shrink(struct expr_arena *self, void *ptr,
+                         size_t size, size_t new_size)
+{
+	char *end = (char*)ptr + ALIGN(size);
+
+	if (!self->cur || end != self->cur->data + self->off)
+		return;
+
+	self->off -= ALIGN(size) - ALIGN(new_size);
+}
+
+static void unref_ufns(struct expr *prog)
+{
+	unsigned int i;
+
+	for (i = 0; i < prog->ufn_cnt; i++)
+		expr_ufn_unref(prog->ufns[i]);
+
+	prog->ufn_cnt = 0;
+}
+
+static void arena_release_refs(struct expr_arena *self)
+{
+	struct arena_ref *ref;
+
+	for (ref = self->refs; ref; ref = ref->next) {
+		unref_ufns(ref->prog);
+
+		if (ref->prog->memo) {
+			expr_memo_free(ref->prog->memo);
+			ref->prog->memo = NULL;
+		}
+	}
+
+	self->refs = NULL;
+}
+
+static struct arena_ref **arena_find_ref(struct expr_arena *self,
+                                         struct expr *prog)
+{
+	struct arena_ref **ref;
+
+	for (ref = &self->refs; *ref; ref = &(*ref)->next) {
+		if ((*ref)->prog == prog)
+			break;
+	}
+
+	return ref;
+}
+
+void expr_arena_reset(struct expr_arena *self)
+{
+	arena_release_refs(self);
+
+	self->mem.stats.frees = self->mem.stats.allocs;
+	self->mem.stats.used = 0;
+
+	self->cur = self->first;
+	self->off = 0;
+}
+
+void expr_arena_destroy(struct expr_arena *self)
+{
+	struct arena_chunk *chunk, *next;
+
+	arena_release_refs(self);
+
+	for (chunk = self->first; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	free(self);
+}
+
+void expr_arena_stats(const struct expr_arena *self, struct expr_mem_stats *stats)
+{
+	*stats = self->mem.stats;
+}
+
+struct expr_pool *expr_pool_create(void)
+{
+	struct expr_pool *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return NULL;
+
+	self->mem.type = EXPR_MEM_POOL;
+
+	return self;
+}
+
+static int pool_class(size_t size)
+{
+	int cls = 0;
+
+	if (size > (size_t)1 << POOL_MAX_SHIFT)
+		return -1;
+
+	while (((size_t)1 << (cls + POOL_MIN_SHIFT)) < size)
+		cls++;
+
+	return cls;
+}
+
+static int pool_refill(struct expr_pool *self, int cls)
+{
+	size_t block = (size_t)1 << (cls + POOL_MIN_SHIFT);
+	size_t size = block > POOL_SLAB_SIZE ? block : POOL_SLAB_SIZE;
+	struct pool_slab *slab = malloc(sizeof(*slab) + size);
+	size_t off;
+
+	if (!slab)
+		return 1;
+
+	slab->next = self->slabs;
+	self->slabs = slab;
+	self->mem.stats.reserved += sizeof(*slab) + size;
+
+	for (off = 0; off + block <= size; off += block) {
+		struct pool_block *b = (void*)(slab->data + off);
+
+		b->next = self->free[cls];
+		self->free[cls] = b;
+	}
+
+	return 0;
+}
+
+static void *pool_alloc(struct expr_pool *self, size_t size)
+{
+	int cls = pool_class(size);
+	struct pool_block *b;
+
+	if (cls < 0) {
+		b = malloc(size);
+		if (b)
+			self->mem.stats.reserved += size;
+		return b;
+	}
+
+	if (!self->free[cls] && pool_refill(self, cls))
+		return NULL;
+
+	b = self->free[cls];
+	self->free[cls] = b->next;
+
+	return b;
+}
+
+static void pool_free(struct expr_pool *self, void *ptr, size_t size)
+{
+	int cls = pool_class(size);
+	struct pool_block *b = ptr;
+
+	if (cls < 0) {
+		self->mem.stats.reserved -= size;
+		free(ptr);
+		return;
+	}
+
+	b->next = self->free[cls];
+	self->free[cls] = b;
+}
+
+void expr_pool_destroy(struct expr_pool *self)
+{
+	struct pool_slab *slab, *next;
+
+	for (slab = self->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	free(self);
+}
+
+void expr_pool_stats(const struct expr_pool *self, struct expr_mem_stats *stats)
+{
+	*stats = self->mem.stats;
+}
+
+static size_t prog_size(const struct expr *self)
+{
+	return sizeof(struct expr) +
+	       self->num_cnt * sizeof(double) +
+	       self->var_cnt * sizeof(struct expr_var *) +
+	       self->ufn_cnt * sizeof(struct expr_ufn *) +
+	       self->elem_cnt * sizeof(struct expr_elem);
+}
+
+void *expr_mem_alloc(struct expr_mem *mem, size_t size)
+{
+	void *ret;
+
+	if (mem->type == EXPR_MEM_POOL)
+		ret = pool_alloc((void*)mem, size);
+	else
+		ret = arena_alloc((void*)mem, size);
+
+	if (ret)
+		stats_alloc(mem, size);
+
+	return ret;
+}
+
+static void relayout(struct expr *self)
+{
+	self->nums = (void*)(self + 1);
+	self->slots = (void*)(self->nums + self->num_cnt);
+	self->ufns = (void*)(self->slots + self->var_cnt);
+	self->elems = (void*)(self->ufns + self->ufn_cnt);
+}
+
+/*
+ * Compacts the arrays sized for the worst case by the compiler and returns
+ * the unused space, the program is moved to a smaller block of the pool.
+ */
+static struct expr *fit(struct expr *self)
+{
+	struct expr_mem *mem = self->mem;
+	size_t size = prog_size(self);
+	struct expr old = *self;
+	struct expr *ret;
+
+	if (size == self->mem_size)
+		return self;
+
+	relayout(self);
+
+	/* the arrays are moved down, each starts before the old one */
+	memmove((void*)self->nums, old.nums, self->num_cnt * sizeof(double));
+	memmove(self->slots, old.slots, self->var_cnt * sizeof(*self->slots));
+	memmove(self->ufns, old.ufns, self->ufn_cnt * sizeof(*self->ufns));
+	memmove((void*)self->elems, old.elems, self->elem_cnt * sizeof(*self->elems));
+
+	mem->stats.used -= self->mem_size - size;
+
+	if (mem->type == EXPR_MEM_ARENA) {
+		arena_shrink((void*)mem, self, self->mem_size, size);
+		self->mem_size = size;
+		return self;
+	}
+
+	if (pool_class(size) == pool_class(self->mem_size)) {
+		self->mem_size = size;
+		return self;
+	}
+
+	ret = pool_alloc((void*)mem, size);
+	if (!ret) {
+		mem->stats.used += self->mem_size - size;
+		return self;
+	}
+
+	memcpy(ret, self, size);
+	relayout(ret);
+	ret->mem_size = size;
+
+	pool_free((void*)mem, self, self->mem_size);
+
+	return ret;
+}
+
+int expr_mem_track(struct expr *self)
+{
+	struct expr_arena *arena = (void*)self->mem;
+	struct arena_ref *ref;
+
+	if (self->mem->type != EXPR_MEM_ARENA || *arena_find_ref(arena, self))
+		return 0;
+
+	ref = arena_alloc(arena, sizeof(*ref));
+	if (!ref)
+		return 1;
+
+	ref->prog = self;
+	ref->next = arena->refs;
+	arena->refs = ref;
+
+	return 0;
+}
+
+static struct expr *create(const char *str, const struct expr_var vars[],
+                           struct expr_mem *mem, struct expr_err *err)
+{
+	struct expr *self = expr_compile(str, vars, NULL, 0, mem, err);
+
+	if (!self)
+		return NULL;
+
+	self = fit(self);
+
+	if (self->ufn_cnt && expr_mem_track(self)) {
+		expr_destroy(self);
+		ERR(err, "Malloc failed", 0);
+		return NULL;
+	}
+
+	return self;
+}
+
+struct expr *expr_create_arena(const char *str, const struct expr_var vars[],
+                               struct expr_arena *arena, struct expr_err *err)
+{
+	return create(str, vars, &arena->mem, err);
+}
+
+struct expr *expr_create_pool(const char *str, const struct expr_var vars[],
+                              struct expr_pool *pool, struct expr_err *err)
+{
+	return create(str, vars, &pool->mem, err);
+}
+
+void expr_mem_free(struct expr *self)
+{
+	struct expr_mem *mem = self->mem;
+	struct expr_arena *arena = (void*)mem;
+	struct arena_ref **ref;
+
+	unref_ufns(self);
+	stats_free(mem, self->mem_size);
+
+	if (mem->type == EXPR_MEM_POOL) {
+		pool_free((void*)mem, self, self->mem_size);
+		return;
+	}
+
+	ref = arena_find_ref(arena, self);
+	if (*ref)
+		*ref = (*ref)->next;
+
+	/* the space is reused only if it's at the top, otherwise by the reset */
+	arena_shrink(arena, self, self->mem_size, 0);
+	self->mem_size = 0;
+}
@@ -0,0 +1,449 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Caching of subresults across evaluations.
+
+   Variables get their version from a global clock when set by
+   expr_var_set(), a cached value is valid while none of the variables it
+   depends on has a newer version than the clock at the time the value was
+   computed.
+
+   The cached subexpressions are picked when the cache is enabled. The program
+   is walked as a tree, conditionals, && and || and bodies of bound variables
+   are single nodes as in expr_create_multi(). A node is cached if it's pure,
+   costly enough and depends on a different set of variables than its parent,
+   i.e. changing a variable recomputes only the nodes on the path from the
+   variables to the root.
+
+   The evaluator checks the cache when it gets to the first element of a
+   cached node and skips to its root on a hit, the root stores the value
+   otherwise. The program itself is not modified.
+
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr_priv.h"
+
+/* subexpressions that cost less are recomputed */
+#define MEMO_MIN_COST 16
+
+#define MEMO_FN_COST 16
+#define MEMO_CALL_COST 32
+#define MEMO_BIND_COST 1024
+
+static uint64_t memo_clock = 1;
+
+void expr_var_set(struct expr_var *var, double val)
+{
+	if (!memcmp(&var->val, &val, sizeof(val)))
+		return;
+
+	var->val = val;
+	var->version = __atomic_add_fetch(&memo_clock, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * All variables the program and the user functions it calls read, sorted so
+ * that the index in the array is looked up by a binary search.
+ */
+struct universe {
+	const struct expr_var **vars;
+	unsigned int cnt;
+	unsigned int size;
+	/* number of uint64_t words in a set */
+	unsigned int words;
+};
+
+static int universe_add(struct universe *self, const struct expr *prog)
+{
+	unsigned int i;
+
+	for (i = 0; i < prog->var_cnt; i++) {
+		if (self->cnt >= self->size) {
+			unsigned int size = self->size ? 2 * self->size : 64;
+			const struct expr_var **tmp;
+
+			tmp = realloc(self->vars, size * sizeof(*tmp));
+			if (!tmp)
+				return 1;
+
+			self->vars = tmp;
+			self->size = size;
+		}
+
+		self->vars[self->cnt++] = prog->slots[i];
+	}
+
+	for (i = 0; i < prog->ufn_cnt; i++) {
+		if (universe_add(self, prog->ufns[i]->body))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int cmp_ptr(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t)*(const void *const*)a;
+	uintptr_t pb = (uintptr_t)*(const void *const*)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+static void universe_sort(struct universe *self)
+{
+	unsigned int i, j = 0;
+
+	qsort(self->vars, self->cnt, sizeof(*self->vars), cmp_ptr);
+
+	for (i = 0; i < self->cnt; i++) {
+		if (!j || self->vars[j - 1] != self->vars[i])
+			self->vars[j++] = self->vars[i];
+	}
+
+	self->cnt = j;
+	self->words = (j + 63) / 64;
+}
+
+static unsigned int universe_idx(const struct universe *self,
+                                 const struct expr_var *var)
+{
+	const struct expr_var **ret;
+
+	ret = bsearch(&var, self->vars, self->cnt, sizeof(*self->vars), cmp_ptr);
+
+	return ret - self->vars;
+}
+
+static void set_add_prog(const struct universe *self, uint64_t *set,
+                         const struct expr *prog)
+{
+	unsigned int i, idx;
+
+	for (i = 0; i < prog->var_cnt; i++) {
+		idx = universe_idx(self, prog->slots[i]);
+		set[idx / 64] |= (uint64_t)1 << (idx % 64);
+	}
+
+	for (i = 0; i < prog->ufn_cnt; i++)
+		set_add_prog(self, set, prog->ufns[i]->body);
+}
+
+struct node {
+	unsigned int start;
+	unsigned int root;
+	unsigned int cost;
+	unsigned int pure:1;
+	unsigned int is_body:1;
+	/* set of the variables the value depends on */
+	uint64_t *deps;
+};
+
+struct walk {
+	const struct expr *self;
+	const struct universe *u;
+	/* sets of the variables read by the user functions */
+	uint64_t *ufn_deps;
+	struct expr_memo *memo;
+	unsigned int dep_cnt;
+	unsigned int dep_size;
+};
+
+/*
+ * Adds the elements from i to end into the node.
+ */
+static void node_add_elems(struct walk *w, struct node *node,
+                           unsigned int i, unsigned int end)
+{
+	const struct expr *self = w->self;
+	const struct expr_elem *elems = self->elems;
+	unsigned int j, idx, words = w->u->words;
+
+	for (; i <= end; i++) {
+		switch (elems[i].type) {
+		case EXPR_VAR:
+			idx = universe_idx(w->u, self->slots[elems[i].var]);
+			node->deps[idx / 64] |= (uint64_t)1 << (idx % 64);
+			node->cost++;
+		break;
+		case EXPR_CALL:
+			for (j = 0; j < words; j++)
+				node->deps[j] |= w->ufn_deps[elems[i].fn * words + j];
+
+			if (expr_uses_rand(self->ufns[elems[i].fn]->body))
+				node->pure = 0;
+
+			node->cost += MEMO_CALL_COST;
+		break;
+		case EXPR_RAND:
+		case EXPR_ARG:
+		case EXPR_PICK:
+			node->pure = 0;
+		break;
+		case EXPR_FN1:
+		case EXPR_FN2:
+		case EXPR_POW:
+			node->cost += MEMO_FN_COST;
+		break;
+		case EXPR_POLY:
+			node->cost += expr_poly_deg(self, &elems[i]) + 1;
+		break;
+		case EXPR_SOLVE ... EXPR_PROD:
+			node->cost += MEMO_BIND_COST;
+		break;
+		default:
+			node->cost++;
+		}
+	}
+}
+
+static int is_cached(const struct node *node)
+{
+	return node->pure && !node->is_body && node->root > node->start &&
+	       node->cost >= MEMO_MIN_COST;
+}
+
+static int memo_add(struct walk *w, const struct node *node)
+{
+	struct expr_memo *memo = w->memo;
+	struct expr_memo_point *pt = &memo->points[memo->point_cnt];
+	unsigned int i;
+
+	pt->root = node->root;
+	pt->dep_off = w->dep_cnt;
+	pt->dep_cnt = 0;
+	pt->stamp = 0;
+
+	for (i = 0; i < w->u->cnt; i++) {
+		if (!(node->deps[i / 64] & ((uint64_t)1 << (i % 64))))
+			continue;
+
+		if (w->dep_cnt >= w->dep_size) {
+			unsigned int size = w->dep_size ? 2 * w->dep_size : 64;
+			const struct expr_var **tmp;
+
+			tmp = realloc(memo->deps, size * sizeof(*tmp));
+			if (!tmp)
+				return 1;
+
+			memo->deps = tmp;
+			w->dep_size = size;
+		}
+
+		memo->deps[w->dep_cnt++] = w->u->vars[i];
+		pt->dep_cnt++;
+	}
+
+	/* parents are added after their children, the outermost one is first */
+	pt->next = memo->first[node->start];
+	memo->first[node->start] = ++memo->point_cnt;
+	memo->last[node->root] = memo->point_cnt;
+
+	return 0;
+}
+
+static int memo_walk(struct walk *w)
+{
+	const struct expr *self = w->self;
+	const struct expr_elem *elems = self->elems;
+	unsigned int words = w->u->words;
+	uint64_t *sets = calloc((self->stack + 1) * words + 1, sizeof(uint64_t));
+	struct node stack[self->stack];
+	struct node node = {};
+	unsigned int i, j, in, out, end, s = 0;
+	int ret = 1;
+
+	if (!sets)
+		return 1;
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		/* the last set is for the node being built */
+		node.deps = sets + self->stack * words;
+		memset(node.deps, 0, words * sizeof(uint64_t));
+		node.cost = 0;
+		node.pure = 1;
+		node.is_body = 0;
+
+		switch (elems[i].type) {
+		case EXPR_IF:
+			end = i + elems[i].jmp;
+			end += elems[end].jmp;
+			in = 1;
+		break;
+		case EXPR_ANDJ:
+		case EXPR_ORJ:
+			end = i + elems[i].jmp;
+			in = 1;
+		break;
+		case EXPR_BIND:
+			end = i + elems[i].jmp;
+			node.is_body = 1;
+			in = 0;
+		break;
+		default:
+			end = i;
+			in = expr_elem_stack(self, &elems[i], &out);
+		}
+
+		node_add_elems(w, &node, i, end);
+
+		s -= in;
+		node.start = in ? stack[s].start : i;
+		node.root = end;
+
+		for (j = 0; j < in; j++) {
+			const struct node *child = &stack[s + j];
+			unsigned int k;
+
+			for (k = 0; k < words; k++)
+				node.deps[k] |= child->deps[k];
+
+			node.cost += child->cost;
+			node.pure &= child->pure;
+		}
+
+		for (j = 0; j < in; j++) {
+			const struct node *child = &stack[s + j];
+
+			if (!is_cached(child))
+				continue;
+
+			if (!memcmp(child->deps, node.deps, words * sizeof(uint64_t)))
+				continue;
+
+			if (memo_add(w, child))
+				goto err;
+		}
+
+		stack[s].start = node.start;
+		stack[s].root = node.root;
+		stack[s].cost = node.cost;
+		stack[s].pure = node.pure;
+		stack[s].is_body = node.is_body;
+		stack[s].deps = sets + s * words;
+		memcpy(stack[s].deps, node.deps, words * sizeof(uint64_t));
+		s++;
+
+		i = end;
+	}
+
+	if (is_cached(&stack[0]) && memo_add(w, &stack[0]))
+		goto err;
+
+	ret = 0;
+err:
+	free(sets);
+	return ret;
+}
+
+int expr_memo_enable(struct expr *self)
+{
+	struct universe u = {};
+	struct expr_memo *memo;
+	struct walk w = {.self = self, .u = &u};
+	unsigned int i;
+
+	if (self->memo)
+		return 0;
+
+	if (self->out_cnt || self->arg_cnt)
+		return 1;
+
+	memo = calloc(1, sizeof(*memo));
+	if (!memo)
+		return 1;
+
+	w.memo = memo;
+
+	if (universe_add(&u, self))
+		goto err;
+
+	universe_sort(&u);
+
+	memo->first = calloc(self->elem_cnt, sizeof(uint32_t));
+	memo->last = calloc(self->elem_cnt, sizeof(uint32_t));
+	/* each node is cached at most once, there are at most elem_cnt nodes */
+	memo->points = malloc(self->elem_cnt * sizeof(*memo->points));
+	w.ufn_deps = calloc(self->ufn_cnt * u.words + 1, sizeof(uint64_t));
+
+	if (!memo->first || !memo->last || !memo->points || !w.ufn_deps)
+		goto err;
+
+	for (i = 0; i < self->ufn_cnt; i++)
+		set_add_prog(&u, w.ufn_deps + i * u.words, self->ufns[i]->body);
+
+	if (memo_walk(&w))
+		goto err;
+
+	/* the arena reset frees the memo */
+	if (self->mem && expr_mem_track(self))
+		goto err;
+
+	free(w.ufn_deps);
+	free(u.vars);
+
+	self->memo = memo;
+
+	return 0;
+err:
+	free(w.ufn_deps);
+	free(u.vars);
+	expr_memo_free(memo);
+	return 1;
+}
+
+static void memo_drop(struct expr_memo *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->point_cnt; i++)
+		self->points[i].stamp = 0;
+}
+
+void expr_memo_begin(struct expr_memo *self, const struct expr_ctx *ctx)
+{
+	if (self->angle_unit != ctx->angle_unit ||
+	    self->solve_max_evals != expr_solve_max_evals(ctx)) {
+		memo_drop(self);
+		self->angle_unit = ctx->angle_unit;
+		self->solve_max_evals = expr_solve_max_evals(ctx);
+	}
+
+	self->now = __atomic_load_n(&memo_clock, __ATOMIC_RELAXED);
+}
+
+void expr_memo_end(struct expr_memo *self, const struct expr_ctx *ctx)
+{
+	/* the values computed by a cancelled evaluation are undefined */
+	if (expr_cancelled(ctx))
+		memo_drop(self);
+}
+
+void expr_memo_free(struct expr_memo *self)
+{
+	free(self->first);
+	free(self->last);
+	free(self->points);
+	free(self->deps);
+	free(self);
+}
+
+void expr_memo_stats(const struct expr *self, struct expr_memo_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (!self->memo)
+		return;
+
+	stats->points = self->memo->point_cnt;
+	stats->hits = self->memo->hits;
+	stats->misses = self->memo->misses;
+}
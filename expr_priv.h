@@ -0,0 +1,724 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Definitions shared between the expression compiler, evaluator and the
+   binary file format.
+
+  */
+
+#ifndef EXPR_PRIV_H__
+#define EXPR_PRIV_H__
+
+#include <fenv.h>
+#include <math.h>
+#include <string.h>
+#include "expr.h"
+
+#define ERR(err, err_msg, err_pos) do {\
+	if ((err) != NULL) {           \
+		(err)->err = err_msg;  \
+		(err)->pos = err_pos;  \
+	}                              \
+} while (0)
+
+/*
+ * The values are stored in the binary file format, new types must be added
+ * to the end of the list.
+ */
+enum expr_elem_type {
+	EXPR_END = 0,
+	EXPR_NUM,
+	EXPR_NEG,
+	EXPR_MUL,
+	EXPR_DIV,
+	EXPR_ADD,
+	EXPR_SUB,
+	EXPR_POW,
+	EXPR_VAR,
+	EXPR_FN1,
+	EXPR_FN2,
+	/* used only during the compilation */
+	EXPR_LPAR,
+	EXPR_RPAR,
+	EXPR_SEP,
+	EXPR_START,
+	/* user function parameter */
+	EXPR_ARG,
+	/* user function call */
+	EXPR_CALL,
+	EXPR_LT,
+	EXPR_LE,
+	EXPR_EQ,
+	EXPR_NE,
+	EXPR_GE,
+	EXPR_GT,
+	EXPR_AND,
+	EXPR_OR,
+	/*
+	 * Short circuit, jumps to the end of && or || if the result is
+	 * decided by the left operand.
+	 */
+	EXPR_ANDJ,
+	EXPR_ORJ,
+	/*
+	 * Conditional "c IF a ELSE b FI"
+	 *
+	 * IF pops the condition and jumps after ELSE if it's zero, ELSE jumps
+	 * after FI.
+	 *
+	 * When evaluated in batch IF and ELSE are no-ops and FI selects the
+	 * result from c, a and b.
+	 */
+	EXPR_IF,
+	EXPR_ELSE,
+	EXPR_FI,
+	/*
+	 * Bound variable, e.g. solve(expr, x, lo, hi).
+	 *
+	 * The body with the bound variable is stored inline as
+	 * "BIND body RET" where BIND jumps to RET, i.e. the body is skipped
+	 * when the program is evaluated. The operator that evaluates the body
+	 * holds a jump back to the BIND.
+	 *
+	 * The BVAR loads bound variable, the index is the nesting depth of the
+	 * binder.
+	 *
+	 * When checking the program the stack depth in the body starts at zero
+	 * and the RET leaves a placeholder for the body on the stack that is
+	 * consumed by the operator.
+	 */
+	EXPR_BIND,
+	EXPR_BVAR,
+	EXPR_RET,
+	/* lo hi SOLVE, finds root of the body in [lo, hi] */
+	EXPR_SOLVE,
+	/* a b INTEGRATE, integrates the body over [a, b] */
+	EXPR_INTEGRATE,
+	/*
+	 * from to BIND body RET SUM, sum and product of the body over integer
+	 * range, the range is evaluated before the body here.
+	 */
+	EXPR_SUM,
+	EXPR_PROD,
+	/*
+	 * x POLY, polynomial in x evaluated by Horner's method, the num is an
+	 * index into the constant pool where the degree is stored followed by
+	 * the coefficients starting from the highest power.
+	 */
+	EXPR_POLY,
+	/*
+	 * Random number, the fn is enum expr_rand_fn, the stream is the
+	 * position of the element, see expr_rand.c.
+	 */
+	EXPR_RAND,
+	/*
+	 * Pushes a copy of the stack element at index arg counted from the
+	 * bottom of the stack, see expr_create_multi().
+	 */
+	EXPR_PICK,
+};
+
+enum expr_rand_fn {
+	EXPR_RAND_UNIFORM,
+	EXPR_RAND_NORMAL,
+	EXPR_RAND_CNT,
+};
+
+/*
+ * Bodies up to this size are inlined into the caller.
+ */
+#define EXPR_INLINE_MAX 16
+
+#define EXPR_UFN_PARAMS_MAX 8
+
+/*
+ * Maximal degree of EXPR_POLY.
+ */
+#define EXPR_POLY_MAX 16
+
+/*
+ * Maximal nesting of bound variables.
+ */
+#define EXPR_BIND_MAX 8
+
+/*
+ * Default limit on number of the solve() body evaluations.
+ */
+#define EXPR_SOLVE_MAX_EVALS 100
+
+/*
+ * Limit on number of the integrate() body evaluations.
+ */
+#define EXPR_QUAD_MAX_EVALS (15 * 4096)
+
+/*
+ * Rules for evaluating functions over an interval.
+ */
+enum expr_ival_rule {
+	/* increasing on the whole real line */
+	EXPR_IVAL_INC,
+	/* decreasing on the whole real line */
+	EXPR_IVAL_DEC,
+	/* increasing on [0, inf] */
+	EXPR_IVAL_LOG,
+	/* increasing on [1, inf] */
+	EXPR_IVAL_ACOSH,
+	/* increasing on [-1, 1] */
+	EXPR_IVAL_ASIN,
+	/* decreasing on [-1, 1] */
+	EXPR_IVAL_ACOS,
+	/* decreasing on [-inf, 0], increasing on [0, inf] */
+	EXPR_IVAL_EVEN,
+	EXPR_IVAL_SIN,
+	EXPR_IVAL_COS,
+	EXPR_IVAL_TAN,
+	/* minimum at 1.4616..., not bounded for negative values */
+	EXPR_IVAL_GAMMA,
+	/* two argument functions */
+	EXPR_IVAL_MOD,
+	EXPR_IVAL_REM,
+	/* increasing in both arguments */
+	EXPR_IVAL_INC2,
+	EXPR_IVAL_HYPOT,
+	EXPR_IVAL_POW,
+	EXPR_IVAL_ATAN2,
+};
+
+/*
+ * Functions that can be evaluated in integers.
+ */
+enum expr_int_op {
+	EXPR_INT_NONE,
+	/* integer to itself, e.g. floor() */
+	EXPR_INT_ID,
+	EXPR_INT_ABS,
+	EXPR_INT_MOD,
+	EXPR_INT_REM,
+	EXPR_INT_MAX,
+	EXPR_INT_MIN,
+};
+
+/*
+ * Integers up to this magnitude are exactly representable in double.
+ */
+#define EXPR_INT_EXACT 0x1p53
+
+struct expr_ufn {
+	struct expr_ufn *next;
+	unsigned int refs;
+	unsigned int argc;
+	struct expr *body;
+	char name[];
+};
+
+struct fn {
+	const char *name;
+	struct expr_fn fn;
+};
+
+/*
+ * The index into the function table is the function ID stored in the compiled
+ * program. New functions must be added to the end of the tables, otherwise
+ * saved programs would call wrong functions.
+ */
+extern const struct fn expr_fn1[];
+extern const struct fn expr_fn2[];
+
+extern const unsigned int expr_fn1_cnt;
+extern const unsigned int expr_fn2_cnt;
+
+const struct expr_var *expr_var_by_name(const struct expr_var vars[],
+                                        const char *name);
+
+int expr_fn_by_name(const struct fn fns[], const char *name, unsigned int len);
+
+/*
+ * Returns non-zero for names parsed specially, i.e. if(), solve(),
+ * integrate(), sum(), prod() and the random functions.
+ */
+int expr_is_special(const char *name, unsigned int len);
+
+/*
+ * Identifier in the source string, not terminated.
+ */
+struct expr_ident {
+	const char *str;
+	unsigned int len;
+};
+
+static inline int expr_ident_is(const char *str, unsigned int len,
+                                const char *name)
+{
+	return !strncmp(name, str, len) && !name[len];
+}
+
+/*
+ * Character classes for the lexer, EXPR_LEX_NUM starts a number and
+ * EXPR_LEX_OP are operators that end up in the program.
+ */
+enum expr_lex_class {
+	EXPR_LEX_ALPHA = 0x01,
+	EXPR_LEX_DIGIT = 0x02,
+	EXPR_LEX_IDENT = 0x04,
+	EXPR_LEX_NUM = 0x08,
+	EXPR_LEX_SPACE = 0x10,
+	EXPR_LEX_OP = 0x20,
+};
+
+extern const uint8_t expr_lex_class[256];
+
+/*
+ * Return length of the identifier, digit and whitespace run at str.
+ */
+unsigned int expr_ident_len(const char *str);
+unsigned int expr_digit_len(const char *str);
+unsigned int expr_space_len(const char *str);
+
+uint32_t expr_ident_hash(const char *str, unsigned int len);
+
+/*
+ * Parses a simple decimal number exactly, returns the length or 0 if the
+ * number has to be parsed by strtod().
+ */
+unsigned int expr_num_fast(const char *str, double *res);
+
+/*
+ * Allocates expression with all the arrays in a single block, from an arena
+ * or a pool if mem is set, by malloc() otherwise.
+ */
+struct expr *expr_alloc(struct expr_mem *mem,
+                        unsigned int elem_cnt, unsigned int num_cnt,
+                        unsigned int var_cnt, unsigned int ufn_cnt);
+
+/*
+ * Allocates a block from an arena or a pool.
+ */
+void *expr_mem_alloc(struct expr_mem *mem, size_t size);
+
+/*
+ * Frees program allocated from an arena or a pool.
+ */
+void expr_mem_free(struct expr *self);
+
+/*
+ * Makes sure that the user function references and the memo of a program
+ * allocated from an arena are released by the reset.
+ */
+int expr_mem_track(struct expr *self);
+
+/*
+ * Compiles an expression, params are names of user function parameters.
+ *
+ * The program is allocated from mem if set, the arrays are sized for the
+ * worst case.
+ */
+struct expr *expr_compile(const char *str, const struct expr_var vars[],
+                          const struct expr_ident params[], unsigned int param_cnt,
+                          struct expr_mem *mem, struct expr_err *err);
+
+/*
+ * Returns number of stack elements consumed by the element and stores the
+ * number of produced elements into out.
+ *
+ * The counts are for batch evaluation, i.e. conditional is evaluated as a
+ * select from three values.
+ */
+unsigned int expr_elem_stack(const struct expr *self,
+                             const struct expr_elem *elem, unsigned int *out);
+
+/*
+ * Checks that the program is well formed and all indexes are in range.
+ *
+ * Returns maximal stack depth or 0 if program is invalid.
+ */
+unsigned int expr_check(const struct expr *self);
+
+/*
+ * Returns factor to convert angle to radians.
+ */
+static inline double expr_rad_factor(const struct expr_ctx *ctx)
+{
+	switch (ctx->angle_unit) {
+	case EXPR_DEGREES:
+		return M_PI / 180;
+	case EXPR_GRADIANS:
+		return M_PI / 200;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Brent's root finding method split into steps so that it could be driven by
+ * both scalar and batch evaluation.
+ */
+struct expr_brent {
+	double a, b, c;
+	double fa, fb, fc;
+	double d, e;
+	double tol;
+	int done;
+};
+
+/*
+ * Initializes the solver with function values at the interval ends.
+ *
+ * If the root is not bracketed the result is NaN.
+ */
+void expr_brent_init(struct expr_brent *self, double lo, double flo,
+                     double hi, double fhi);
+
+/*
+ * Computes next point to evaluate the function at, the point is stored in
+ * self->b.
+ *
+ * Returns zero when the solver converged, the root is stored in self->b.
+ */
+int expr_brent_step(struct expr_brent *self);
+
+/*
+ * Passes function value at self->b after expr_brent_step().
+ */
+void expr_brent_update(struct expr_brent *self, double fb);
+
+/*
+ * Finds root of f in [lo, hi] with at most max_evals function evaluations,
+ * the number of evaluations is added to evals. Returns NaN if it does not
+ * converge in max_evals evaluations.
+ */
+double expr_brent_solve(double lo, double hi,
+                        double (*f)(double x, void *priv), void *priv,
+                        unsigned int max_evals, unsigned long *evals);
+
+/*
+ * Integrates f over [a, b] with adaptive Gauss-Kronrod quadrature.
+ *
+ * The f is called with arrays of n nodes, possibly from several threads at
+ * once if ctx->threads is set, each thread gets its own copy of the ctx.
+ */
+double expr_quad(double a, double b,
+                 void (*f)(const double *x, double *fx, size_t n,
+                           void *priv, struct expr_ctx *ctx),
+                 void *priv, struct expr_ctx *ctx);
+
+/*
+ * Computes sum or product of f over from, from + 1, ..., to.
+ *
+ * Returns NaN for more than 2^53 terms, the indexes are not exact anymore.
+ *
+ * The f is called the same way as in expr_quad().
+ */
+double expr_sum(double from, double to, int prod,
+                void (*f)(const double *x, double *fx, size_t n,
+                          void *priv, struct expr_ctx *ctx),
+                void *priv, struct expr_ctx *ctx);
+
+/*
+ * Evaluates body of a bound variable for n values x of the variable.
+ *
+ * The vals are values for the variable slots, if NULL the values are taken
+ * from the variables. The args and bound are values of the function
+ * parameters and outer bound variables that are the same for all x.
+ */
+void expr_eval_body(const struct expr *self, unsigned int start,
+                    const double *vals, const double *args,
+                    const double *bound, unsigned int depth,
+                    const double *x, double *res, size_t n,
+                    struct expr_ctx *ctx);
+
+/*
+ * Evaluates the program for n rows, vcols are indexed by variable slots and
+ * args by parameters, NULL vcols or vcols[i] means that the variable value is
+ * used for all rows.
+ */
+void expr_eval_cols(const struct expr *self, const double *const vcols[],
+                    const double *const args[], double *res, size_t n,
+                    struct expr_ctx *ctx);
+
+/*
+ * Returns index of the variable in the slot into the vars array, -1 if the
+ * variable is not in the array.
+ */
+int expr_slot_col(const struct expr *self, unsigned int slot);
+
+/*
+ * Recomputes jumps after the program was rewritten.
+ *
+ * Returns non-zero on allocation failure.
+ */
+int expr_relink(struct expr_elem elems[], unsigned int elem_cnt);
+
+/*
+ * Fixed point implementations of the functions, see expr_fixed.c.
+ *
+ * The values are in Q31.32, non-zero is returned if the result is not defined
+ * or does not fit.
+ */
+int expr_fx_abs(int64_t *x);
+int expr_fx_exp(int64_t *x);
+int expr_fx_exp2(int64_t *x);
+int expr_fx_exp10(int64_t *x);
+int expr_fx_ln(int64_t *x);
+int expr_fx_log2(int64_t *x);
+int expr_fx_log10(int64_t *x);
+int expr_fx_sqrt(int64_t *x);
+int expr_fx_cbrt(int64_t *x);
+int expr_fx_sin(int64_t *x);
+int expr_fx_cos(int64_t *x);
+int expr_fx_tan(int64_t *x);
+int expr_fx_asin(int64_t *x);
+int expr_fx_acos(int64_t *x);
+int expr_fx_atan(int64_t *x);
+int expr_fx_sinh(int64_t *x);
+int expr_fx_cosh(int64_t *x);
+int expr_fx_tanh(int64_t *x);
+int expr_fx_asinh(int64_t *x);
+int expr_fx_acosh(int64_t *x);
+int expr_fx_atanh(int64_t *x);
+int expr_fx_ceil(int64_t *x);
+int expr_fx_floor(int64_t *x);
+int expr_fx_trunc(int64_t *x);
+int expr_fx_round(int64_t *x);
+
+int expr_fx_mod(int64_t a, int64_t b, int64_t *res);
+int expr_fx_rem(int64_t a, int64_t b, int64_t *res);
+int expr_fx_max(int64_t a, int64_t b, int64_t *res);
+int expr_fx_min(int64_t a, int64_t b, int64_t *res);
+int expr_fx_hypot(int64_t a, int64_t b, int64_t *res);
+int expr_fx_pow(int64_t a, int64_t b, int64_t *res);
+int expr_fx_atan2(int64_t y, int64_t x, int64_t *res);
+
+/*
+ * Returns non-zero if the program consists only of operations that can be
+ * evaluated in integers, see expr_eval_int().
+ */
+int expr_int_check(const struct expr *self);
+
+/*
+ * Names of the zero parameter random functions, NULL terminated and indexed
+ * by enum expr_rand_fn.
+ */
+extern const char *const expr_rand_names[];
+
+int expr_rand_by_name(const char *name, unsigned int len);
+
+/*
+ * Returns random number for the seed, row and stream.
+ */
+double expr_rand(unsigned int fn, uint64_t seed, uint64_t row, uint64_t stream);
+
+/*
+ * Mixes value of a parameter or a bound variable into the stream.
+ */
+uint64_t expr_rand_mix(uint64_t stream, double val);
+
+/*
+ * Stream for EXPR_RAND at pos, mixes in the parameters and the bound
+ * variables.
+ */
+uint64_t expr_rand_stream(unsigned int pos, const double *args,
+                          unsigned int arg_cnt, const double *bound,
+                          unsigned int depth);
+
+/*
+ * Returns non-zero if the program or any of its functions uses rand().
+ */
+int expr_uses_rand(const struct expr *self);
+
+static inline unsigned int expr_poly_deg(const struct expr *self,
+                                         const struct expr_elem *elem)
+{
+	return self->nums[elem->num];
+}
+
+static inline const double *expr_poly_coefs(const struct expr *self,
+                                            const struct expr_elem *elem)
+{
+	return &self->nums[elem->num + 1];
+}
+
+static inline double expr_poly_eval(const double *coefs, unsigned int deg,
+                                    double x)
+{
+	double res = coefs[0];
+	unsigned int i;
+
+	for (i = 1; i <= deg; i++)
+		res = fma(res, x, coefs[i]);
+
+	return res;
+}
+
+static inline unsigned int expr_solve_max_evals(const struct expr_ctx *ctx)
+{
+	return ctx->solve_max_evals ? ctx->solve_max_evals : EXPR_SOLVE_MAX_EVALS;
+}
+
+static inline int expr_cancelled(const struct expr_ctx *ctx)
+{
+	return ctx->cancel && __atomic_load_n(ctx->cancel, __ATOMIC_RELAXED);
+}
+
+/* platforms without floating point exceptions report nothing */
+#ifndef FE_INVALID
+# define FE_INVALID 0
+#endif
+#ifndef FE_DIVBYZERO
+# define FE_DIVBYZERO 0
+#endif
+#ifndef FE_OVERFLOW
+# define FE_OVERFLOW 0
+#endif
+#ifndef FE_UNDERFLOW
+# define FE_UNDERFLOW 0
+#endif
+
+#define EXPR_FE_MASK (FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_UNDERFLOW)
+
+static inline void expr_fp_begin(const struct expr_ctx *ctx)
+{
+	if (ctx->fp_check)
+		feclearexcept(EXPR_FE_MASK);
+}
+
+/*
+ * Adds exceptions raised since expr_fp_begin() to ctx->fp_flags.
+ *
+ * Returns non-zero if there were any.
+ */
+static inline unsigned int expr_fp_end(struct expr_ctx *ctx)
+{
+	unsigned int ret = 0;
+	int fe;
+
+	if (!ctx->fp_check)
+		return 0;
+
+	fe = fetestexcept(EXPR_FE_MASK);
+
+	if (fe & FE_INVALID)
+		ret |= EXPR_FP_INVALID;
+	if (fe & FE_DIVBYZERO)
+		ret |= EXPR_FP_DIVBYZERO;
+	if (fe & FE_OVERFLOW)
+		ret |= EXPR_FP_OVERFLOW;
+	if (fe & FE_UNDERFLOW)
+		ret |= EXPR_FP_UNDERFLOW;
+
+	ctx->fp_flags |= ret;
+
+	return ret;
+}
+
+/*
+ * Cached subexpression, the elements from start to root are skipped when the
+ * value is valid.
+ */
+struct expr_memo_point {
+	unsigned int root;
+	/* next point + 1 that starts at the same element, an inner one */
+	unsigned int next;
+	/* the variables the value depends on in the deps array */
+	unsigned int dep_off;
+	unsigned int dep_cnt;
+	/* value of the clock the value was computed at, 0 if not computed */
+	uint64_t stamp;
+	double val;
+};
+
+struct expr_memo {
+	/* the clock at the start of the evaluation */
+	uint64_t now;
+	enum expr_angle_unit angle_unit;
+	unsigned int solve_max_evals;
+	/* point + 1 per element, the outermost point that starts there */
+	uint32_t *first;
+	/* point + 1 per element, the point that has its root there */
+	uint32_t *last;
+	struct expr_memo_point *points;
+	unsigned int point_cnt;
+	const struct expr_var **deps;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/*
+ * Checks the cached values that start at the element i, the value is stored
+ * into the res.
+ *
+ * Returns the root of the cached subexpression or 0 if there is none.
+ */
+static inline unsigned int expr_memo_hit(struct expr_memo *self,
+                                         unsigned int i, double *res)
+{
+	unsigned int p, j;
+
+	for (p = self->first[i]; p; p = self->points[p - 1].next) {
+		const struct expr_memo_point *pt = &self->points[p - 1];
+
+		if (!pt->stamp)
+			continue;
+
+		for (j = 0; j < pt->dep_cnt; j++) {
+			if (self->deps[pt->dep_off + j]->version > pt->stamp)
+				break;
+		}
+
+		if (j < pt->dep_cnt)
+			continue;
+
+		self->hits++;
+		*res = pt->val;
+		return pt->root;
+	}
+
+	return 0;
+}
+
+/*
+ * Stores the value computed by the element i, top[-1], if it's a root of a
+ * cached subexpression.
+ */
+static inline void expr_memo_store(struct expr_memo *self, unsigned int i,
+                                   const double *top)
+{
+	struct expr_memo_point *pt;
+
+	if (!self->last[i])
+		return;
+
+	pt = &self->points[self->last[i] - 1];
+	pt->val = top[-1];
+	pt->stamp = self->now;
+	self->misses++;
+}
+
+/*
+ * Called before and after the evaluation that uses the cache.
+ */
+void expr_memo_begin(struct expr_memo *self, const struct expr_ctx *ctx);
+void expr_memo_end(struct expr_memo *self, const struct expr_ctx *ctx);
+
+void expr_memo_free(struct expr_memo *self);
+
+struct expr_ufn *expr_ufn_by_ident(const char *name, unsigned int len);
+
+static inline struct expr_ufn *expr_ufn_by_name(const char *name)
+{
+	return expr_ufn_by_ident(name, strlen(name));
+}
+
+static inline void expr_ufn_ref(struct expr_ufn *self)
+{
+	self->refs++;
+}
+
+void expr_ufn_unref(struct expr_ufn *self);
+
+#endif /* EXPR_PRIV_H__ */
@@ -0,0 +1,296 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Adaptive Gauss-Kronrod quadrature.
+
+   The intervals are refined level by level, all nodes of all intervals on a
+   level are evaluated in a single call so that the integrand is evaluated in
+   batches, large levels are split between threads.
+
+   The difference between the 15 point Kronrod and the embedded 7 point Gauss
+   rule is used as the error estimate, intervals that do not satisfy their
+   share of the tolerance are halved. Intervals that can't be halved anymore,
+   or are left when the evaluation budget runs out, are added as they are
+   unless their errors exceed the whole tolerance, in that case the integral
+   likely diverges, e.g. 1/t over [-1, 1], and the result is NaN.
+
+  */
+
+#include <float.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "expr_priv.h"
+
+/* Kronrod nodes, the odd ones are the Gauss nodes */
+static const double xgk[8] = {
+	0.991455371120812639206854697526329,
+	0.949107912342758524526189684047851,
+	0.864864423359769072789712788640926,
+	0.741531185599394439863864773280788,
+	0.586087235467691130294144845693013,
+	0.405845151377397166906606412076961,
+	0.207784955007898467600689403773245,
+	0.000000000000000000000000000000000,
+};
+
+static const double wgk[8] = {
+	0.022935322010529224963732008058970,
+	0.063092092629978553290700663189204,
+	0.104790010322250183839876322541518,
+	0.140653259715525918745189590510238,
+	0.169004726639267902826583426598550,
+	0.190350578064785409913256402421014,
+	0.204432940075298892414161999234649,
+	0.209482141084727828012999174891714,
+};
+
+static const double wg[4] = {
+	0.129484966168869693270611432679082,
+	0.279705391489276667901467771423780,
+	0.381830050505118944950369775488975,
+	0.417959183673469387755102040816327,
+};
+
+#define NODES 15
+
+/* Relative tolerance */
+#define QUAD_EPS 1e-10
+
+/* Do not start threads for less nodes than this */
+#define QUAD_THREAD_MIN 4096
+
+#define QUAD_THREADS_MAX 64
+
+struct ival {
+	double a, b;
+};
+
+struct quad_job {
+	void (*f)(const double *x, double *fx, size_t n,
+	          void *priv, struct expr_ctx *ctx);
+	void *priv;
+	const double *x;
+	double *fx;
+	size_t n;
+	struct expr_ctx ctx;
+};
+
+static void *quad_thread(void *arg)
+{
+	struct quad_job *job = arg;
+
+	job->f(job->x, job->fx, job->n, job->priv, &job->ctx);
+
+	/* the exception flags are per thread */
+	expr_fp_end(&job->ctx);
+
+	return NULL;
+}
+
+static void eval_nodes(void (*f)(const double *x, double *fx, size_t n,
+                                 void *priv, struct expr_ctx *ctx),
+                       void *priv, const double *x, double *fx, size_t n,
+                       struct expr_ctx *ctx)
+{
+	unsigned int i, threads = ctx->threads;
+
+	if (threads > QUAD_THREADS_MAX)
+		threads = QUAD_THREADS_MAX;
+
+	if (threads < 2 || n < QUAD_THREAD_MIN) {
+		f(x, fx, n, priv, ctx);
+		return;
+	}
+
+	struct quad_job jobs[threads];
+	pthread_t tids[threads];
+	int started[threads];
+	size_t chunk = (n + threads - 1) / threads;
+
+	for (i = 0; i < threads; i++) {
+		size_t off = i * chunk;
+
+		jobs[i].f = f;
+		jobs[i].priv = priv;
+		jobs[i].x = x + off;
+		jobs[i].fx = fx + off;
+		jobs[i].n = off < n ? (n - off < chunk ? n - off : chunk) : 0;
+		jobs[i].ctx = *ctx;
+		jobs[i].ctx.threads = 1;
+		jobs[i].ctx.solve_evals = 0;
+
+		/* the first chunk is evaluated by the calling thread */
+		started[i] = i && jobs[i].n &&
+		             !pthread_create(&tids[i], NULL, quad_thread, &jobs[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (!started[i] && jobs[i].n)
+			quad_thread(&jobs[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+
+		ctx->solve_evals += jobs[i].ctx.solve_evals;
+		ctx->fp_flags |= jobs[i].ctx.fp_flags;
+	}
+}
+
+static void ival_nodes(const struct ival *ival, double *x)
+{
+	double c = 0.5 * (ival->a + ival->b);
+	double h = 0.5 * (ival->b - ival->a);
+	unsigned int j;
+
+	x[0] = c;
+
+	for (j = 0; j < 7; j++) {
+		x[2*j + 1] = c - h * xgk[j];
+		x[2*j + 2] = c + h * xgk[j];
+	}
+}
+
+/*
+ * Computes Kronrod and Gauss estimates and Kronrod estimate of |f|.
+ */
+static double ival_rule(const struct ival *ival, const double *fx,
+                        double *gauss, double *kabs)
+{
+	double h = 0.5 * (ival->b - ival->a);
+	double k = wgk[7] * fx[0];
+	double g = wg[3] * fx[0];
+	double ka = wgk[7] * fabs(fx[0]);
+	unsigned int j;
+
+	for (j = 0; j < 7; j++) {
+		double f1 = fx[2*j + 1];
+		double f2 = fx[2*j + 2];
+
+		k += wgk[j] * (f1 + f2);
+		ka += wgk[j] * (fabs(f1) + fabs(f2));
+
+		if (j % 2)
+			g += wg[j / 2] * (f1 + f2);
+	}
+
+	*gauss = g * h;
+	*kabs = ka * fabs(h);
+
+	return k * h;
+}
+
+static int grow(void **arr, size_t size)
+{
+	void *tmp = realloc(*arr, size);
+
+	if (!tmp)
+		return 1;
+
+	*arr = tmp;
+	return 0;
+}
+
+double expr_quad(double a, double b,
+                 void (*f)(const double *x, double *fx, size_t n,
+                           void *priv, struct expr_ctx *ctx),
+                 void *priv, struct expr_ctx *ctx)
+{
+	struct ival *ivals = NULL, *next = NULL, *tmp;
+	double *x = NULL, *fx = NULL;
+	double res = 0, tol = 0, err = 0, g, kabs, kabs_sum;
+	size_t i, cnt = 1, next_cnt, evals = 0;
+
+	if (grow((void**)&ivals, sizeof(*ivals)))
+		return NAN;
+
+	ivals[0].a = a;
+	ivals[0].b = b;
+
+	while (cnt) {
+		if (expr_cancelled(ctx)) {
+			res = NAN;
+			break;
+		}
+
+		if (grow((void**)&next, 2 * cnt * sizeof(*next)) ||
+		    grow((void**)&x, cnt * NODES * sizeof(*x)) ||
+		    grow((void**)&fx, cnt * NODES * sizeof(*fx))) {
+			res = NAN;
+			break;
+		}
+
+		for (i = 0; i < cnt; i++)
+			ival_nodes(&ivals[i], x + i * NODES);
+
+		eval_nodes(f, priv, x, fx, cnt * NODES, ctx);
+		evals += cnt * NODES;
+
+		/*
+		 * Tolerance relative to the first finite estimate of integral
+		 * of |f|, a node may hit a pole, e.g. 1/t over [-1, 1].
+		 */
+		if (!tol) {
+			kabs_sum = 0;
+
+			for (i = 0; i < cnt; i++) {
+				ival_rule(&ivals[i], fx + i * NODES, &g, &kabs);
+				kabs_sum += kabs;
+			}
+
+			if (isfinite(kabs_sum))
+				tol = fmax(QUAD_EPS * kabs_sum, DBL_MIN);
+		}
+
+		next_cnt = 0;
+
+		for (i = 0; i < cnt; i++) {
+			const struct ival *ival = &ivals[i];
+			double k = ival_rule(ival, fx + i * NODES, &g, &kabs);
+			double mid = 0.5 * (ival->a + ival->b);
+
+			/* the symmetric nodes of [a, b] cancel for odd integrands */
+			if ((evals > NODES &&
+			     fabs(k - g) <= tol * fabs((ival->b - ival->a) / (b - a))) ||
+			    isnan(k)) {
+				res += k;
+				continue;
+			}
+
+			if (mid == ival->a || mid == ival->b ||
+			    evals + (next_cnt + 2) * NODES > EXPR_QUAD_MAX_EVALS) {
+				res += k;
+				err += fabs(k - g);
+				continue;
+			}
+
+			next[next_cnt].a = ival->a;
+			next[next_cnt++].b = mid;
+			next[next_cnt].a = mid;
+			next[next_cnt++].b = ival->b;
+		}
+
+		tmp = ivals;
+		ivals = next;
+		next = tmp;
+		cnt = next_cnt;
+	}
+
+	free(ivals);
+	free(next);
+	free(x);
+	free(fx);
+
+	if (err > tol)
+		return NAN;
+
+	return res;
+}
@@ -0,0 +1,147 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Random numbers for rand() and randn().
+
+   The numbers come from the Philox4x32-10 counter based generator, i.e.
+   each number is a hash of a counter and a key rather than the next value in
+   a sequence. The key is the seed from the context, the counter is the row
+   index and a stream. The stream identifies the rand() in the program and
+   includes the values of the bound variables and function parameters, so
+   that e.g. each term of sum(i, 1, n, rand()) differs.
+
+   There is no state, batches and threads produce the same numbers as the
+   evaluation row by row.
+
+  */
+
+#include <string.h>
+
+#include "expr_priv.h"
+
+const char *const expr_rand_names[] = {
+	[EXPR_RAND_UNIFORM] = "rand",
+	[EXPR_RAND_NORMAL] = "randn",
+	NULL
+};
+
+int expr_rand_by_name(const char *name, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; expr_rand_names[i]; i++) {
+		if (expr_ident_is(name, len, expr_rand_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+#define PHILOX_M0 0xd2511f53
+#define PHILOX_M1 0xcd9e8d57
+#define PHILOX_W0 0x9e3779b9
+#define PHILOX_W1 0xbb67ae85
+#define PHILOX_ROUNDS 10
+
+static void philox(uint32_t ctr[4], uint64_t seed)
+{
+	uint32_t k0 = seed, k1 = seed >> 32;
+	unsigned int r;
+
+	for (r = 0; r < PHILOX_ROUNDS; r++) {
+		uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+		uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+
+		ctr[0] = (p1 >> 32) ^ ctr[1] ^ k0;
+		ctr[1] = p1;
+		ctr[2] = (p0 >> 32) ^ ctr[3] ^ k1;
+		ctr[3] = p0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+}
+
+/*
+ * Uniform in [0, 1) with all 53 bits of mantissa.
+ */
+static double unit(uint32_t hi, uint32_t lo)
+{
+	return (((uint64_t)hi << 21) ^ (lo >> 11)) * 0x1p-53;
+}
+
+double expr_rand(unsigned int fn, uint64_t seed, uint64_t row, uint64_t stream)
+{
+	uint32_t ctr[4] = {row, row >> 32, stream, stream >> 32};
+	double r;
+
+	philox(ctr, seed);
+
+	switch (fn) {
+	case EXPR_RAND_NORMAL:
+		/* Box-Muller, 1 - unit() is in (0, 1] */
+		r = sqrt(-2 * log(1 - unit(ctr[0], ctr[1])));
+		return r * cos(2 * M_PI * unit(ctr[2], ctr[3]));
+	default:
+		return unit(ctr[0], ctr[1]);
+	}
+}
+
+/*
+ * The splitmix64 finalizer.
+ */
+static uint64_t fmix(uint64_t h)
+{
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+
+	return h ^ (h >> 31);
+}
+
+uint64_t expr_rand_mix(uint64_t stream, double val)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &val, sizeof(bits));
+
+	return fmix(fmix(stream) ^ bits);
+}
+
+uint64_t expr_rand_stream(unsigned int pos, const double *args,
+                          unsigned int arg_cnt, const double *bound,
+                          unsigned int depth)
+{
+	uint64_t stream = pos;
+	unsigned int i;
+
+	for (i = 0; i < arg_cnt; i++)
+		stream = expr_rand_mix(stream, args[i]);
+
+	for (i = 0; i < depth; i++)
+		stream = expr_rand_mix(stream, bound[i]);
+
+	return stream;
+}
+
+int expr_uses_rand(const struct expr *self)
+{
+	unsigned int i;
+
+	for (i = 0; self->elems[i].type != EXPR_END; i++) {
+		if (self->elems[i].type == EXPR_RAND)
+			return 1;
+	}
+
+	for (i = 0; i < self->ufn_cnt; i++) {
+		if (expr_uses_rand(self->ufns[i]->body))
+			return 1;
+	}
+
+	return 0;
+}
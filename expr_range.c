@@ -0,0 +1,420 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Evaluation over an arithmetic progression x0 + i * dx.
+
+   The program is analysed first and maximal subexpressions that are
+   polynomials of low degree in the swept variable are cut out into separate
+   programs and replaced with parameters in the rest of the program.
+
+   A polynomial of degree d is evaluated directly at d + 1 points only, the
+   rest of the values is computed from a table of backward differences with
+   d additions per row. The table is seeded again after a run of rows so that
+   the rounding errors do not accumulate. Subexpressions that do not depend
+   on the variable are polynomials of degree zero, i.e. are evaluated once
+   per block of rows.
+
+   The rest of the program is evaluated by the batch evaluator with the
+   polynomial values passed as parameter columns.
+
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr_priv.h"
+
+/* Number of rows evaluated at once */
+#define RANGE_BLOCK 64
+
+/* Higher degrees lose too much precision in the differences */
+#define RANGE_DEG_MAX 3
+
+/* Value on the stack while analysing the program */
+struct node {
+	/* degree in the swept variable, -1 if not a polynomial */
+	int deg;
+	/* elements [start, end) that compute the value */
+	unsigned int start, end;
+};
+
+struct range {
+	unsigned int poly_cnt;
+	struct node *polys;
+	struct expr main;
+	struct expr *subs;
+	struct expr_elem *elems;
+	/* polynomial values for a block of rows */
+	double *cols;
+};
+
+static int pow_deg(const struct expr *self, const struct node *base,
+                   const struct node *exp)
+{
+	const struct expr_elem *elem = &self->elems[exp->start];
+	double val;
+
+	if (!base->deg && !exp->deg)
+		return 0;
+
+	if (exp->end - exp->start != 1 || elem->type != EXPR_NUM)
+		return -1;
+
+	val = self->nums[elem->num];
+
+	if (val < 0 || val > RANGE_DEG_MAX || val != (int)val)
+		return -1;
+
+	return base->deg * (int)val;
+}
+
+static int node_deg(const struct expr *self, const struct expr_elem *elem,
+                    const struct node *in, unsigned int in_cnt,
+                    const struct expr_var *var)
+{
+	unsigned int j;
+	int deg = 0;
+
+	switch (elem->type) {
+	case EXPR_NUM:
+		return 0;
+	case EXPR_VAR:
+		return self->slots[elem->var] == var;
+	case EXPR_ARG:
+	case EXPR_BVAR:
+	case EXPR_RAND:
+	case EXPR_SOLVE ... EXPR_PROD:
+		return -1;
+	case EXPR_CALL:
+		if (expr_uses_var(self->ufns[elem->fn]->body, var))
+			return -1;
+	break;
+	}
+
+	for (j = 0; j < in_cnt; j++) {
+		if (in[j].deg < 0)
+			return -1;
+	}
+
+	switch (elem->type) {
+	case EXPR_NEG:
+		deg = in[0].deg;
+	break;
+	case EXPR_ADD:
+	case EXPR_SUB:
+		deg = in[0].deg > in[1].deg ? in[0].deg : in[1].deg;
+	break;
+	case EXPR_MUL:
+		deg = in[0].deg + in[1].deg;
+	break;
+	case EXPR_DIV:
+		deg = in[1].deg ? -1 : in[0].deg;
+	break;
+	case EXPR_POW:
+		deg = pow_deg(self, &in[0], &in[1]);
+	break;
+	case EXPR_POLY:
+		deg = in[0].deg * (int)expr_poly_deg(self, elem);
+	break;
+	default:
+		/* anything else is a polynomial only if constant */
+		for (j = 0; j < in_cnt; j++) {
+			if (in[j].deg)
+				return -1;
+		}
+	}
+
+	return deg > RANGE_DEG_MAX ? -1 : deg;
+}
+
+static void add_poly(struct range *r, const struct node *node)
+{
+	/* single number or variable is loaded directly */
+	if (node->deg < 0 || node->end - node->start < 2)
+		return;
+
+	r->polys[r->poly_cnt++] = *node;
+}
+
+static int poly_cmp(const void *a, const void *b)
+{
+	const struct node *na = a, *nb = b;
+
+	return (na->start > nb->start) - (na->start < nb->start);
+}
+
+/*
+ * Finds maximal polynomial subexpressions, i.e. the ones that are either
+ * the whole program or are consumed by something that is not a polynomial.
+ */
+static int find_polys(const struct expr *self, const struct expr_var *var,
+                      struct range *r)
+{
+	const struct expr_elem *elems = self->elems;
+	struct node *nodes = malloc(self->elem_cnt * sizeof(*nodes));
+	unsigned int binds[EXPR_BIND_MAX];
+	unsigned int i, j, in, out, s = 0, b = 0;
+
+	r->polys = malloc(self->elem_cnt * sizeof(*r->polys));
+	r->poly_cnt = 0;
+
+	if (!nodes || !r->polys) {
+		free(nodes);
+		return 1;
+	}
+
+	for (i = 0; elems[i].type != EXPR_END; i++) {
+		const struct expr_elem *elem = &elems[i];
+		struct node node = {.end = i + 1};
+
+		switch (elem->type) {
+		case EXPR_BIND:
+			binds[b++] = i;
+			continue;
+		case EXPR_RET:
+			/* the body is consumed by the operator as a whole */
+			add_poly(r, &nodes[--s]);
+			node.deg = -1;
+			node.start = binds[--b];
+			nodes[s++] = node;
+			continue;
+		}
+
+		in = expr_elem_stack(self, elem, &out);
+
+		if (!out)
+			continue;
+
+		s -= in;
+
+		node.deg = node_deg(self, elem, &nodes[s], in, var);
+		node.start = in ? nodes[s].start : i;
+
+		if (node.deg < 0) {
+			for (j = 0; j < in; j++)
+				add_poly(r, &nodes[s + j]);
+		}
+
+		nodes[s++] = node;
+	}
+
+	if (s == 1)
+		add_poly(r, &nodes[0]);
+
+	free(nodes);
+
+	qsort(r->polys, r->poly_cnt, sizeof(*r->polys), poly_cmp);
+
+	return 0;
+}
+
+/*
+ * Cuts the polynomials out of the program, the main program loads them as
+ * parameters.
+ */
+static int split_polys(const struct expr *self, struct range *r)
+{
+	unsigned int i, p, j = 0, elem_cnt = self->elem_cnt;
+	struct expr_elem *elems;
+
+	r->main = *self;
+
+	if (!r->poly_cnt)
+		return 0;
+
+	for (p = 0; p < r->poly_cnt; p++)
+		elem_cnt += r->polys[p].end - r->polys[p].start + 1;
+
+	r->subs = malloc(r->poly_cnt * sizeof(*r->subs));
+	r->cols = malloc(r->poly_cnt * RANGE_BLOCK * sizeof(*r->cols));
+	r->elems = elems = malloc(elem_cnt * sizeof(*elems));
+
+	if (!r->subs || !r->cols || !r->elems)
+		return 1;
+
+	r->main.elems = elems;
+	r->main.arg_cnt = r->poly_cnt;
+
+	for (i = 0, p = 0; i < self->elem_cnt; i++) {
+		if (p < r->poly_cnt && i == r->polys[p].start) {
+			elems[j].type = EXPR_ARG;
+			elems[j++].arg = p;
+			i = r->polys[p++].end - 1;
+			continue;
+		}
+
+		elems[j++] = self->elems[i];
+	}
+
+	r->main.elem_cnt = j;
+
+	if (expr_relink(elems, j))
+		return 1;
+
+	r->main.stack = expr_check(&r->main);
+	if (!r->main.stack)
+		return 1;
+
+	for (p = 0; p < r->poly_cnt; p++) {
+		const struct node *poly = &r->polys[p];
+		struct expr *sub = &r->subs[p];
+		unsigned int cnt = poly->end - poly->start;
+
+		memcpy(&elems[j], &self->elems[poly->start], cnt * sizeof(*elems));
+		elems[j + cnt].type = EXPR_END;
+
+		*sub = *self;
+		sub->elems = &elems[j];
+		sub->elem_cnt = cnt + 1;
+		sub->stack = expr_check(sub);
+
+		if (!sub->stack)
+			return 1;
+
+		j += cnt + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Computes the rest of a run of n values from the first deg + 1 values.
+ */
+static void march(double *col, int deg, unsigned int n)
+{
+	double d[RANGE_DEG_MAX + 1];
+	unsigned int k;
+	int i, j;
+
+	for (j = 0; j <= deg; j++)
+		d[j] = col[deg - j];
+
+	/* backward differences at the last seed point */
+	for (j = 1; j <= deg; j++) {
+		for (i = deg; i >= j; i--)
+			d[i] = d[i - 1] - d[i];
+	}
+
+	for (k = deg + 1; k < n; k++) {
+		for (j = deg - 1; j >= 0; j--)
+			d[j] += d[j + 1];
+
+		col[k] = d[0];
+	}
+}
+
+/*
+ * Evaluates polynomial of degree deg for a block of n rows.
+ *
+ * The error of the values computed from the differences grows roughly as
+ * run_len^deg so the runs are shorter for higher degrees. The seeds for all
+ * runs in the block are evaluated at once.
+ */
+static void eval_poly(const struct expr *sub, const struct expr_var *var,
+                      int deg, const double *x, double *col, unsigned int n,
+                      struct expr_ctx *ctx)
+{
+	static const unsigned int run_lens[RANGE_DEG_MAX + 1] = {
+		RANGE_BLOCK, RANGE_BLOCK, 16, 8
+	};
+	unsigned int run_len = run_lens[deg];
+	unsigned int i, k, off, seeds = deg + 1, cnt = 0;
+	const double *vcols[sub->var_cnt + 1];
+	double sx[RANGE_BLOCK], sres[RANGE_BLOCK];
+
+	for (i = 0; i < sub->var_cnt; i++)
+		vcols[i] = sub->slots[i] == var ? sx : NULL;
+
+	for (off = 0; off < n; off += run_len) {
+		for (k = 0; k < seeds && off + k < n; k++)
+			sx[cnt++] = x[off + k];
+	}
+
+	expr_eval_cols(sub, vcols, NULL, sres, cnt, ctx);
+
+	for (k = 0; k < cnt; k++) {
+		if (!isfinite(sres[k])) {
+			/* not exact enough, evaluate all rows */
+			for (i = 0; i < sub->var_cnt; i++)
+				vcols[i] = sub->slots[i] == var ? x : NULL;
+			expr_eval_cols(sub, vcols, NULL, col, n, ctx);
+			return;
+		}
+	}
+
+	for (off = 0, cnt = 0; off < n; off += run_len) {
+		unsigned int len = n - off < run_len ? n - off : run_len;
+
+		for (k = 0; k < seeds && k < len; k++)
+			col[off + k] = sres[cnt++];
+
+		if (len > seeds)
+			march(col + off, deg, len);
+	}
+}
+
+static void range_free(struct range *r)
+{
+	free(r->polys);
+	free(r->subs);
+	free(r->elems);
+	free(r->cols);
+}
+
+void expr_eval_range(struct expr *self, struct expr_ctx *ctx,
+                     const struct expr_var *var, double x0, double dx,
+                     double *res, size_t n)
+{
+	struct range r = {};
+	const double *vcols[self->var_cnt + 1];
+	double x[RANGE_BLOCK];
+	uint64_t row = ctx->row;
+	unsigned int i, p;
+	size_t off;
+
+	if (self->out_cnt) {
+		for (off = 0; off < n; off++)
+			res[off] = NAN;
+		return;
+	}
+
+	/* rand() depends on the position in the program, which would change */
+	if (expr_uses_rand(self) ||
+	    find_polys(self, var, &r) || split_polys(self, &r)) {
+		/* fall back to evaluation of the whole program */
+		r.poly_cnt = 0;
+		r.main = *self;
+	}
+
+	const double *args[r.poly_cnt + 1];
+
+	for (i = 0; i < self->var_cnt; i++)
+		vcols[i] = self->slots[i] == var ? x : NULL;
+
+	for (p = 0; p < r.poly_cnt; p++)
+		args[p] = r.cols + p * RANGE_BLOCK;
+
+	for (off = 0; off < n; off += RANGE_BLOCK) {
+		unsigned int k, cnt = n - off < RANGE_BLOCK ? n - off : RANGE_BLOCK;
+
+		for (k = 0; k < cnt; k++)
+			x[k] = x0 + (off + k) * dx;
+
+		for (p = 0; p < r.poly_cnt; p++) {
+			eval_poly(&r.subs[p], var, r.polys[p].deg, x,
+			          r.cols + p * RANGE_BLOCK, cnt, ctx);
+		}
+
+		ctx->row = row + off;
+		expr_eval_cols(&r.main, vcols, args, res + off, cnt, ctx);
+	}
+
+	ctx->row = row;
+	range_free(&r);
+}
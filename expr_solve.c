@@ -0,0 +1,156 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Brent's root finding method, combines bisection, secant and inverse
+   quadratic interpolation so that it converges superlinearly for smooth
+   functions while never being slower than bisection.
+
+   R. P. Brent, Algorithms for Minimization without Derivatives, 1973.
+
+  */
+
+#include <float.h>
+
+#include "expr_priv.h"
+
+static void brent_bracket(struct expr_brent *self)
+{
+	self->c = self->a;
+	self->fc = self->fa;
+	self->d = self->e = self->b - self->a;
+}
+
+void expr_brent_init(struct expr_brent *self, double lo, double flo,
+                     double hi, double fhi)
+{
+	self->a = lo;
+	self->fa = flo;
+	self->b = hi;
+	self->fb = fhi;
+	self->done = 0;
+	self->tol = DBL_EPSILON * (fabs(lo) + fabs(hi));
+
+	if (flo == 0) {
+		self->b = lo;
+		self->done = 1;
+		return;
+	}
+
+	if (fhi == 0) {
+		self->done = 1;
+		return;
+	}
+
+	if (!(flo < 0 && fhi > 0) && !(flo > 0 && fhi < 0)) {
+		self->b = NAN;
+		self->done = 1;
+		return;
+	}
+
+	brent_bracket(self);
+}
+
+int expr_brent_step(struct expr_brent *self)
+{
+	double tol, m, p, q, r, s;
+
+	if (self->done)
+		return 0;
+
+	if (fabs(self->fc) < fabs(self->fb)) {
+		self->a = self->b;
+		self->b = self->c;
+		self->c = self->a;
+		self->fa = self->fb;
+		self->fb = self->fc;
+		self->fc = self->fa;
+	}
+
+	tol = 2 * DBL_EPSILON * fabs(self->b) + self->tol;
+	m = 0.5 * (self->c - self->b);
+
+	if (fabs(m) <= tol || self->fb == 0) {
+		self->done = 1;
+		return 0;
+	}
+
+	if (fabs(self->e) < tol || fabs(self->fa) <= fabs(self->fb)) {
+		/* bisection */
+		self->d = self->e = m;
+	} else {
+		s = self->fb / self->fa;
+
+		if (self->a == self->c) {
+			/* secant */
+			p = 2 * m * s;
+			q = 1 - s;
+		} else {
+			/* inverse quadratic interpolation */
+			q = self->fa / self->fc;
+			r = self->fb / self->fc;
+			p = s * (2 * m * q * (q - r) - (self->b - self->a) * (r - 1));
+			q = (q - 1) * (r - 1) * (s - 1);
+		}
+
+		if (p > 0)
+			q = -q;
+		else
+			p = -p;
+
+		s = self->e;
+		self->e = self->d;
+
+		if (2 * p < 3 * m * q - fabs(tol * q) && p < fabs(0.5 * s * q)) {
+			self->d = p / q;
+		} else {
+			self->d = self->e = m;
+		}
+	}
+
+	self->a = self->b;
+	self->fa = self->fb;
+
+	if (fabs(self->d) > tol)
+		self->b += self->d;
+	else
+		self->b += m > 0 ? tol : -tol;
+
+	return 1;
+}
+
+void expr_brent_update(struct expr_brent *self, double fb)
+{
+	self->fb = fb;
+
+	if ((fb > 0 && self->fc > 0) || (fb <= 0 && self->fc <= 0))
+		brent_bracket(self);
+}
+
+double expr_brent_solve(double lo, double hi,
+                        double (*f)(double x, void *priv), void *priv,
+                        unsigned int max_evals, unsigned long *evals)
+{
+	struct expr_brent brent;
+	unsigned int cnt = 2;
+
+	expr_brent_init(&brent, lo, f(lo, priv), hi, f(hi, priv));
+
+	while (cnt < max_evals && expr_brent_step(&brent)) {
+		expr_brent_update(&brent, f(brent.b, priv));
+		cnt++;
+	}
+
+	*evals += cnt;
+
+	/* the evaluations ran out before it converged */
+	if (expr_brent_step(&brent))
+		return NAN;
+
+	return brent.b;
+}
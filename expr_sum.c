@@ -0,0 +1,244 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Summation and product over an index range.
+
+   The terms are evaluated in blocks by the batch evaluator and summed with
+   Kahan compensated summation in LANES independent lanes so that the loop
+   can be vectorized, the lanes are combined with Neumaier's variant of the
+   algorithm at the end. The compensation is not updated once a partial sum
+   is not finite, it would be NaN from inf - inf otherwise. Products keep the exponent separately so that long
+   products do not overflow or underflow in the intermediate results. Huge
+   ranges are split between threads.
+
+  */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "expr_priv.h"
+
+/* Number of terms evaluated at once */
+#define SUM_BLOCK 1024
+
+/* Number of independent summation lanes, i.e. SIMD width */
+#define LANES 8
+
+/* Do not start threads for less terms than this */
+#define SUM_THREAD_MIN (64 * SUM_BLOCK)
+
+#define SUM_THREADS_MAX 64
+
+struct acc {
+	/* sum or product mantissa */
+	double val;
+	/* compensation for sum, exponent for product */
+	double c;
+};
+
+struct lanes {
+	double sum[LANES];
+	double c[LANES];
+};
+
+struct sum_job {
+	void (*f)(const double *x, double *fx, size_t n,
+	          void *priv, struct expr_ctx *ctx);
+	void *priv;
+	double from;
+	uint64_t cnt;
+	int prod;
+	struct acc acc;
+	struct expr_ctx ctx;
+};
+
+static void lanes_add(struct lanes *self, const double *x, size_t n)
+{
+	size_t k;
+	unsigned int l;
+
+	for (k = 0; k + LANES <= n; k += LANES) {
+		for (l = 0; l < LANES; l++) {
+			double y = x[k + l] - self->c[l];
+			double t = self->sum[l] + y;
+
+			self->c[l] = isfinite(t) ? (t - self->sum[l]) - y : 0;
+			self->sum[l] = t;
+		}
+	}
+
+	for (l = 0; k < n; k++, l++) {
+		double y = x[k] - self->c[l];
+		double t = self->sum[l] + y;
+
+		self->c[l] = isfinite(t) ? (t - self->sum[l]) - y : 0;
+		self->sum[l] = t;
+	}
+}
+
+static void acc_add(struct acc *acc, double val)
+{
+	double t = acc->val + val;
+
+	/* the compensation would be inf - inf */
+	if (!isfinite(t)) {
+		acc->val = t;
+		return;
+	}
+
+	if (fabs(acc->val) >= fabs(val))
+		acc->c += (acc->val - t) + val;
+	else
+		acc->c += (val - t) + acc->val;
+
+	acc->val = t;
+}
+
+static void acc_mul(struct acc *acc, double val)
+{
+	int exp;
+
+	acc->val = frexp(acc->val * val, &exp);
+	acc->c += exp;
+}
+
+static void acc_init(struct acc *acc, int prod)
+{
+	acc->val = prod ? 1 : 0;
+	acc->c = 0;
+}
+
+static double acc_res(const struct acc *acc, int prod)
+{
+	/* anything out of this range is either zero or infinity anyway */
+	if (prod)
+		return ldexp(acc->val, fmax(fmin(acc->c, 4096), -4096));
+
+	return acc->val + acc->c;
+}
+
+static void *sum_thread(void *arg)
+{
+	struct sum_job *job = arg;
+	struct lanes lanes = {};
+	double x[SUM_BLOCK], fx[SUM_BLOCK];
+	uint64_t off;
+	size_t k, n;
+	unsigned int l;
+
+	acc_init(&job->acc, job->prod);
+
+	for (off = 0; off < job->cnt; off += n) {
+		if (expr_cancelled(&job->ctx))
+			break;
+
+		n = job->cnt - off < SUM_BLOCK ? job->cnt - off : SUM_BLOCK;
+
+		for (k = 0; k < n; k++)
+			x[k] = job->from + (off + k);
+
+		job->f(x, fx, n, job->priv, &job->ctx);
+
+		if (!job->prod) {
+			lanes_add(&lanes, fx, n);
+			continue;
+		}
+
+		for (k = 0; k < n; k++)
+			acc_mul(&job->acc, fx[k]);
+	}
+
+	for (l = 0; l < LANES; l++) {
+		acc_add(&job->acc, lanes.sum[l]);
+		acc_add(&job->acc, -lanes.c[l]);
+	}
+
+	/* the exception flags are per thread */
+	expr_fp_end(&job->ctx);
+
+	return NULL;
+}
+
+double expr_sum(double from, double to, int prod,
+                void (*f)(const double *x, double *fx, size_t n,
+                          void *priv, struct expr_ctx *ctx),
+                void *priv, struct expr_ctx *ctx)
+{
+	unsigned int i, threads = ctx->threads;
+	uint64_t cnt, chunk;
+	struct acc acc;
+
+	acc_init(&acc, prod);
+
+	if (isnan(from) || isnan(to))
+		return NAN;
+
+	if (to < from)
+		return acc_res(&acc, prod);
+
+	if (to - from >= 0x1p53)
+		return NAN;
+
+	cnt = (uint64_t)(to - from) + 1;
+
+	if (threads > SUM_THREADS_MAX)
+		threads = SUM_THREADS_MAX;
+
+	if (threads < 2 || cnt < SUM_THREAD_MIN)
+		threads = 1;
+
+	struct sum_job jobs[threads];
+	pthread_t tids[threads];
+	int started[threads];
+
+	chunk = (cnt + threads - 1) / threads;
+
+	for (i = 0; i < threads; i++) {
+		uint64_t off = i * chunk;
+
+		jobs[i].f = f;
+		jobs[i].priv = priv;
+		jobs[i].from = from + off;
+		jobs[i].cnt = off < cnt ? (cnt - off < chunk ? cnt - off : chunk) : 0;
+		jobs[i].prod = prod;
+		jobs[i].ctx = *ctx;
+		jobs[i].ctx.threads = 1;
+		jobs[i].ctx.solve_evals = 0;
+
+		/* the first chunk is evaluated by the calling thread */
+		started[i] = i && jobs[i].cnt &&
+		             !pthread_create(&tids[i], NULL, sum_thread, &jobs[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (!started[i])
+			sum_thread(&jobs[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+
+		ctx->solve_evals += jobs[i].ctx.solve_evals;
+		ctx->fp_flags |= jobs[i].ctx.fp_flags;
+
+		if (prod) {
+			acc_mul(&acc, jobs[i].acc.val);
+			acc.c += jobs[i].acc.c;
+		} else {
+			acc_add(&acc, jobs[i].acc.val);
+			acc_add(&acc, jobs[i].acc.c);
+		}
+	}
+
+	if (expr_cancelled(ctx))
+		return NAN;
+
+	return acc_res(&acc, prod);
+}
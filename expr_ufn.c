@@ -0,0 +1,196 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   User defined functions registry.
+
+   The functions are reference counted, each compiled expression that calls a
+   function holds a reference so that the function can be redefined or
+   undefined while the expression still exists.
+
+  */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr_priv.h"
+
+static struct expr_ufn *ufns;
+
+struct expr_ufn *expr_ufn_by_ident(const char *name, unsigned int len)
+{
+	struct expr_ufn *i;
+
+	for (i = ufns; i; i = i->next) {
+		if (expr_ident_is(name, len, i->name))
+			return i;
+	}
+
+	return NULL;
+}
+
+void expr_ufn_unref(struct expr_ufn *self)
+{
+	if (--self->refs)
+		return;
+
+	expr_destroy(self->body);
+	free(self);
+}
+
+static void ufn_unlink(struct expr_ufn *self)
+{
+	struct expr_ufn **i;
+
+	for (i = &ufns; *i; i = &(*i)->next) {
+		if (*i == self) {
+			*i = self->next;
+			break;
+		}
+	}
+
+	expr_ufn_unref(self);
+}
+
+static void skip_ws(const char *str, unsigned int *i)
+{
+	*i += expr_space_len(str + *i);
+}
+
+int expr_ufn_define(const char *def, const struct expr_var vars[],
+                    struct expr_err *err)
+{
+	struct expr_ident name;
+	struct expr_ident params[EXPR_UFN_PARAMS_MAX];
+	unsigned int i = 0, param_cnt = 0, j;
+	struct expr_ufn *ufn, *old;
+	struct expr *body;
+
+	skip_ws(def, &i);
+
+	switch (def[i]) {
+	case 'a' ... 'z':
+	case 'A' ... 'Z':
+	break;
+	default:
+		ERR(err, "Function name expected", i);
+		return 1;
+	}
+
+	name.str = def + i;
+	name.len = expr_ident_len(name.str);
+	i += name.len;
+
+	if (expr_fn_by_name(expr_fn1, name.str, name.len) >= 0 ||
+	    expr_fn_by_name(expr_fn2, name.str, name.len) >= 0 ||
+	    expr_is_special(name.str, name.len)) {
+		ERR(err, "Cannot redefine builtin function", 0);
+		return 1;
+	}
+
+	skip_ws(def, &i);
+
+	if (def[i] != '(') {
+		ERR(err, "Expected left parenthesis", i);
+		return 1;
+	}
+
+	for (;;) {
+		i++;
+		skip_ws(def, &i);
+
+		if (param_cnt >= EXPR_UFN_PARAMS_MAX) {
+			ERR(err, "Too many parameters", i);
+			return 1;
+		}
+
+		switch (def[i]) {
+		case 'a' ... 'z':
+		case 'A' ... 'Z':
+		break;
+		default:
+			ERR(err, "Parameter name expected", i);
+			return 1;
+		}
+
+		params[param_cnt].str = def + i;
+		params[param_cnt].len = expr_ident_len(def + i);
+		i += params[param_cnt].len;
+
+		for (j = 0; j < param_cnt; j++) {
+			if (params[j].len == params[param_cnt].len &&
+			    !memcmp(params[j].str, params[param_cnt].str, params[j].len)) {
+				ERR(err, "Duplicate parameter", i);
+				return 1;
+			}
+		}
+
+		param_cnt++;
+
+		skip_ws(def, &i);
+
+		if (def[i] == ')')
+			break;
+
+		if (def[i] != ',') {
+			ERR(err, "Expected comma or right parenthesis", i);
+			return 1;
+		}
+	}
+
+	i++;
+	skip_ws(def, &i);
+
+	if (def[i] != '=') {
+		ERR(err, "Expected =", i);
+		return 1;
+	}
+
+	i++;
+
+	body = expr_compile(def + i, vars, params, param_cnt, NULL, err);
+	if (!body) {
+		if (err)
+			err->pos += i;
+		return 1;
+	}
+
+	ufn = malloc(sizeof(*ufn) + name.len + 1);
+	if (!ufn) {
+		expr_destroy(body);
+		ERR(err, "Malloc failed", 0);
+		return 1;
+	}
+
+	memcpy(ufn->name, name.str, name.len);
+	ufn->name[name.len] = 0;
+	ufn->refs = 1;
+	ufn->argc = param_cnt;
+	ufn->body = body;
+
+	old = expr_ufn_by_name(ufn->name);
+	if (old)
+		ufn_unlink(old);
+
+	ufn->next = ufns;
+	ufns = ufn;
+
+	return 0;
+}
+
+int expr_ufn_undefine(const char *name)
+{
+	struct expr_ufn *ufn = expr_ufn_by_name(name);
+
+	if (!ufn)
+		return 1;
+
+	ufn_unlink(ufn);
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Reports accuracy of the fixed point evaluation against double.
+
+   Each expression is evaluated for x in [from, to] both in fixed point and in
+   double, the maximal absolute and relative errors are printed along with
+   the number of points evaluated in fixed point, i.e. that did not fall back
+   to double.
+
+   fixedcmp [-d] [-f from] [-t to] [-n steps] expr...
+
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "expr.h"
+
+static struct expr_var vars[] = {
+	{.name = "x"},
+	{}
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare(const char *str, double from, double to, unsigned int steps,
+                   struct expr_ctx *ctx)
+{
+	double max_abs = 0, max_rel = 0, abs_x = from, rel_x = from;
+	double t_fixed = 0, t_double = 0, t;
+	unsigned int i, fixed_cnt = 0;
+	struct expr_err err;
+	struct expr *expr;
+
+	expr = expr_create(str, vars, &err);
+	if (!expr) {
+		fprintf(stderr, "%s: %i: %s\n", str, err.pos, err.err);
+		return 1;
+	}
+
+	for (i = 0; i <= steps; i++) {
+		double ref, res, abs_err, rel_err;
+		int fail;
+
+		vars[0].val = steps ? from + (to - from) * i / steps : from;
+
+		t = now_ns();
+		expr_eval_batch(expr, ctx, NULL, &ref, 1);
+		t_double += now_ns() - t;
+
+		t = now_ns();
+		fail = expr_eval_fixed(expr, ctx, &res);
+		t_fixed += now_ns() - t;
+
+		if (fail || !isfinite(ref))
+			continue;
+
+		fixed_cnt++;
+
+		abs_err = fabs(res - ref);
+		rel_err = ref ? abs_err / fabs(ref) : abs_err;
+
+		if (abs_err > max_abs) {
+			max_abs = abs_err;
+			abs_x = vars[0].val;
+		}
+
+		if (rel_err > max_rel) {
+			max_rel = rel_err;
+			rel_x = vars[0].val;
+		}
+	}
+
+	printf("%-32s abs %9.3g (x=%-10g) rel %9.3g (x=%-10g) fixed %u/%u"
+	       " %.0fns/%.0fns\n", str, max_abs, abs_x, max_rel, rel_x,
+	       fixed_cnt, steps + 1, t_fixed / (steps + 1),
+	       t_double / (steps + 1));
+
+	expr_destroy(expr);
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-d] [-f from] [-t to] [-n steps] expr...\n\n", name);
+	printf("-d    angles in degrees\n");
+	printf("-f    start of the x range, default -10\n");
+	printf("-t    end of the x range, default 10\n");
+	printf("-n    number of steps, default 10000\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct expr_ctx ctx = {.angle_unit = EXPR_RADIANS};
+	double from = -10, to = 10;
+	unsigned int steps = 10000;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "df:t:n:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			ctx.angle_unit = EXPR_DEGREES;
+		break;
+		case 'f':
+			from = atof(optarg);
+		break;
+		case 't':
+			to = atof(optarg);
+		break;
+		case 'n':
+			steps = atoi(optarg);
+		break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (; optind < argc; optind++)
+		ret |= compare(argv[optind], from, to, steps, &ctx);
+
+	return ret;
+}
@@ -6,17 +6,43 @@
 
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <widgets/gp_widgets.h>
 #include "expr.h"
+#include "history.h"
+#include "bench.h"
+#include "plot.h"
+#include "gpcalc_layout.h"
 
 static gp_htable *uids;
 
 static gp_widget *edit;
+static gp_widget *status;
 static gp_widget *layout_switch;
 
+/* the current layout_switch page and bitmask of pages built so far */
+static unsigned int layout_page;
+static uint32_t layout_pages_built = 1;
+
 static double last_val;
 
+/*
+ * The recalled history entry, history_cnt() when not browsing, and the prefix
+ * the entries are searched for.
+ */
+static unsigned int hist_pos;
+static char *hist_prefix;
+/* text shown by the last eval(), it's not used as a prefix */
+static char *hist_shown;
+
 static struct expr_var vars[] = {
 	{.name = "A"},
 	{.name = "B"},
@@ -31,10 +57,561 @@ static struct expr_var vars[] = {
 	{}
 };
 
+#define VAR_CNT (sizeof(vars) / sizeof(*vars) - 1)
+
+/*
+ * The plotted expression is compiled with the variables and x, x is not in
+ * the vars array so that it can be used as a function parameter.
+ */
+static struct expr_var plot_vars[VAR_CNT + 2];
+static char *plot_text;
+
+/* the plot is the last layout_switch page */
+#define PLOT_PAGE (LAYOUT_PAGES - 1)
+
 static struct expr_ctx ctx;
 
+static double ms_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void history_save(int ret)
+{
+	static int warned;
+
+	if (ret && !warned) {
+		GP_WARN("Failed to write history");
+		warned = 1;
+	}
+}
+
+static void shown(void)
+{
+	free(hist_shown);
+	hist_shown = strdup(gp_widget_tbox_text(edit));
+}
+
+/*
+ * Memory slots A-H, a slot holds either a value or a formula that may depend
+ * on other slots.
+ */
+#define SLOT_CNT 8
+
+struct slot {
+	struct expr *formula;
+	/* bitmask of slots the formula reads */
+	uint32_t deps;
+};
+
+static struct slot slots[SLOT_CNT];
+
+/* slots that were not recomputed because the recomputation was cancelled */
+static uint32_t slots_stale;
+
+/*
+ * Expressions and the slot formulas are evaluated in a worker thread so that
+ * the UI stays responsive, the result is picked up by a timer in the main
+ * loop.
+ */
+
+/* wait for the result before the UI shows progress */
+#define EVAL_SYNC_MS 5
+/* period of progress updates and polling for the result */
+#define EVAL_POLL_MS 50
+/* the evaluation is cancelled after this */
+#define EVAL_BUDGET_MS 10000
+
+enum job_state {
+	JOB_IDLE,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+static struct job {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	enum job_state state;
+	/* cancellation token polled by the library */
+	int cancel;
+	int timeout;
+	struct expr *expr;
+	char *text;
+	/* slots to recompute instead of the expression and the ones left */
+	uint32_t slots;
+	uint32_t slots_left;
+	struct expr_ctx ctx;
+	struct timespec start;
+	int is_int;
+	expr_int ires;
+	double res;
+} job = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int worker_running;
+
+/*
+ * Recomputes the slots in topological order, a slot is evaluated once all
+ * slots it depends on from the set are done.
+ */
+static void job_run_slots(void)
+{
+	unsigned int i;
+	double val;
+
+	while (job.slots_left) {
+		for (i = 0; i < SLOT_CNT; i++) {
+			if ((job.slots_left & (1u<<i)) &&
+			    !(slots[i].deps & job.slots_left))
+				break;
+		}
+
+		/* cycles are refused in slot_set_formula() */
+		if (i == SLOT_CNT) {
+			GP_WARN("Cyclic dependency in slots");
+			return;
+		}
+
+		val = expr_eval(slots[i].formula, &job.ctx);
+
+		/* the value of cancelled evaluation is undefined */
+		if (__atomic_load_n(&job.cancel, __ATOMIC_RELAXED))
+			return;
+
+		expr_var_set(&vars[i], val);
+		job.slots_left &= ~(1u<<i);
+	}
+}
+
+static void job_run(void)
+{
+	if (job.slots) {
+		job_run_slots();
+		return;
+	}
+
+	/* zero is evaluated in floating point for the sign, as in expr_eval() */
+	job.is_int = !expr_eval_int(job.expr, &job.ctx, &job.ires) && job.ires;
+
+	if (job.is_int) {
+		job.res = job.ires;
+		return;
+	}
+
+	/* the integer evaluation failed or returned zero already */
+	job.ctx.skip_int = 1;
+	job.res = expr_eval(job.expr, &job.ctx);
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&job.lock);
+
+	for (;;) {
+		while (job.state != JOB_RUNNING)
+			pthread_cond_wait(&job.cond, &job.lock);
+
+		pthread_mutex_unlock(&job.lock);
+		job_run();
+		pthread_mutex_lock(&job.lock);
+
+		job.state = JOB_DONE;
+		pthread_cond_broadcast(&job.cond);
+	}
+
+	return NULL;
+}
+
+/*
+ * Waits up to ms milliseconds for the job, returns non-zero if it's done.
+ */
+static int job_wait(unsigned int ms)
+{
+	struct timespec ts;
+	int done;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += ms * 1000000;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&job.lock);
+
+	while (job.state == JOB_RUNNING) {
+		if (pthread_cond_timedwait(&job.cond, &job.lock, &ts))
+			break;
+	}
+
+	done = job.state == JOB_DONE;
+
+	pthread_mutex_unlock(&job.lock);
+
+	return done;
+}
+
+static void plot_update(const char *text);
+
+/*
+ * Slots that were not recomputed are set to NaN and recomputed next time any
+ * slot changes.
+ */
+static void job_finish_slots(void)
+{
+	unsigned int i;
+
+	slots_stale = job.slots_left;
+
+	for (i = 0; i < SLOT_CNT; i++) {
+		if (slots_stale & (1u<<i))
+			expr_var_set(&vars[i], NAN);
+	}
+
+	if (slots_stale)
+		gp_widget_label_set(status, job.timeout ? "Time limit exceeded" : "Cancelled");
+	else
+		gp_widget_label_set(status, "");
+
+	job.slots = 0;
+	plot_update(NULL);
+}
+
+/*
+ * Shows the result of a finished job and puts it into the history.
+ *
+ * The result replaces the text only if it was not edited in the meantime,
+ * otherwise it's shown in the status line.
+ */
+static void job_finish(void)
+{
+	int edited;
+	char buf[64];
+
+	if (job.slots) {
+		job_finish_slots();
+		goto out;
+	}
+
+	edited = strcmp(gp_widget_tbox_text(edit), job.text);
+
+	if (job.cancel) {
+		expr_destroy(job.expr);
+		gp_widget_label_set(status, job.timeout ? "Time limit exceeded" : "Cancelled");
+		goto out;
+	}
+
+	last_val = job.res;
+
+	/* the history takes over the expression */
+	history_save(history_add(job.text, job.res, job.expr));
+
+	if (job.is_int)
+		expr_int_str(job.ires, buf, sizeof(buf));
+	else
+		snprintf(buf, sizeof(buf), "%.16g", job.res);
+
+	if (edited) {
+		gp_widget_label_printf(status, "= %s", buf);
+		goto out;
+	}
+
+	gp_widget_label_set(status, "");
+	gp_widget_tbox_printf(edit, "%s", buf);
+	shown();
+out:
+	free(job.text);
+	job.text = NULL;
+	job.expr = NULL;
+
+	pthread_mutex_lock(&job.lock);
+	job.state = JOB_IDLE;
+	pthread_mutex_unlock(&job.lock);
+}
+
+/*
+ * Expression entered while the slots were recomputed, it's evaluated once
+ * they are done.
+ */
+static char *queued;
+
+static int eval_text(const char *text);
+
+static uint32_t queued_start(gp_timer *self)
+{
+	char *text = queued;
+
+	(void)self;
+
+	if (text) {
+		queued = NULL;
+		eval_text(text);
+		free(text);
+	}
+
+	return 0;
+}
+
+static gp_timer queued_timer = {
+	.callback = queued_start,
+	.id = "Queued evaluation",
+};
+
+static uint32_t job_poll(gp_timer *self)
+{
+	double ms = ms_since(&job.start);
+
+	if (job_wait(0)) {
+		job_finish();
+
+		if (queued)
+			gp_widgets_timer_ins(&queued_timer);
+
+		return 0;
+	}
+
+	if (ms > EVAL_BUDGET_MS && !job.cancel) {
+		job.timeout = 1;
+		__atomic_store_n(&job.cancel, 1, __ATOMIC_RELAXED);
+	}
+
+	if (job.cancel)
+		gp_widget_label_set(status, "Cancelling...");
+	else
+		gp_widget_label_printf(status, "Evaluating %.1fs", ms / 1000);
+
+	return self->period;
+}
+
+static gp_timer job_timer = {
+	.expires = EVAL_POLL_MS,
+	.period = EVAL_POLL_MS,
+	.callback = job_poll,
+	.id = "Evaluation",
+};
+
+static int job_busy(void)
+{
+	return job.state != JOB_IDLE;
+}
+
+/*
+ * Cancels the running job and the queued expression and waits for the job,
+ * has to be called before the variables or the functions are modified.
+ */
+static void job_cancel(void)
+{
+	free(queued);
+	queued = NULL;
+
+	if (!job_busy())
+		return;
+
+	__atomic_store_n(&job.cancel, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&job.lock);
+	while (job.state == JOB_RUNNING)
+		pthread_cond_wait(&job.cond, &job.lock);
+	pthread_mutex_unlock(&job.lock);
+
+	gp_widgets_timer_rem(&job_timer);
+	job_finish();
+}
+
+static void job_submit(void)
+{
+	job.ctx = ctx;
+	job.ctx.cancel = &job.cancel;
+	job.cancel = 0;
+
+	/* each evaluation draws new rand() and randn() values */
+	ctx.row++;
+	job.timeout = 0;
+	clock_gettime(CLOCK_MONOTONIC, &job.start);
+
+	if (!worker_running) {
+		job_run();
+		job.state = JOB_DONE;
+		job_finish();
+		return;
+	}
+
+	pthread_mutex_lock(&job.lock);
+	job.state = JOB_RUNNING;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.lock);
+
+	if (job_wait(EVAL_SYNC_MS)) {
+		job_finish();
+		return;
+	}
+
+	gp_widget_label_set(status, "Evaluating");
+	gp_widgets_timer_ins(&job_timer);
+}
+
+/*
+ * Starts evaluation of the expression, takes over it.
+ */
+static void job_start(const char *text, struct expr *expr)
+{
+	job.text = strdup(text);
+	if (!job.text) {
+		expr_destroy(expr);
+		return;
+	}
+
+	job.expr = expr;
+
+	job_submit();
+}
+
+/*
+ * Starts recomputation of the slots and the stale ones, the plot is updated
+ * once it's done.
+ */
+static void slots_recompute(uint32_t set)
+{
+	set |= slots_stale;
+	slots_stale = 0;
+
+	if (!set) {
+		plot_update(NULL);
+		return;
+	}
+
+	job.slots = set;
+	job.slots_left = set;
+
+	job_submit();
+}
+
+/*
+ * Returns bitmask of slots that depend on the slot directly or indirectly.
+ */
+static uint32_t slot_dependents(unsigned int slot)
+{
+	uint32_t res = 0, todo = 1u<<slot;
+	unsigned int i, j;
+
+	while (todo) {
+		i = __builtin_ctz(todo);
+		todo &= ~(1u<<i);
+
+		for (j = 0; j < SLOT_CNT; j++) {
+			if (!(slots[j].deps & (1u<<i)) || (res & (1u<<j)))
+				continue;
+
+			res |= 1u<<j;
+			todo |= 1u<<j;
+		}
+	}
+
+	return res;
+}
+
+static uint32_t formula_slots(void)
+{
+	uint32_t res = 0;
+	unsigned int i;
+
+	for (i = 0; i < SLOT_CNT; i++) {
+		if (slots[i].formula)
+			res |= 1u<<i;
+	}
+
+	return res;
+}
+
+static void slot_clear_formula(unsigned int slot)
+{
+	if (!slots[slot].formula)
+		return;
+
+	expr_destroy(slots[slot].formula);
+	slots[slot].formula = NULL;
+	slots[slot].deps = 0;
+}
+
+static void slot_set_val(unsigned int slot, double val)
+{
+	slot_clear_formula(slot);
+
+	expr_var_set(&vars[slot], val);
+
+	slots_recompute(slot_dependents(slot));
+}
+
+static int slot_set_formula(unsigned int slot, struct expr *formula, uint32_t deps)
+{
+	if ((deps & (1u<<slot)) || (deps & slot_dependents(slot))) {
+		gp_widget_tbox_printf(edit, "Cyclic reference");
+		gp_widget_tbox_clear_on_input(edit);
+		expr_destroy(formula);
+		return 1;
+	}
+
+	slot_clear_formula(slot);
+
+	/* only the parts that depend on the changed slots are recomputed */
+	if (expr_memo_enable(formula))
+		GP_WARN("Failed to enable memoization");
+
+	slots[slot].formula = formula;
+	slots[slot].deps = deps;
+
+	slots_recompute((1u<<slot) | slot_dependents(slot));
+
+	return 0;
+}
+
+/*
+ * Replaces the plotted expression unless text is NULL and replots it if the
+ * plot page is shown, the variable values are copied at this point.
+ *
+ * The slots being recomputed are not read, the plot is updated once they
+ * are done.
+ */
+static void plot_update(const char *text)
+{
+	unsigned int i;
+
+	if (text) {
+		free(plot_text);
+		plot_text = strdup(text);
+	}
+
+	if (layout_page != PLOT_PAGE || job.slots)
+		return;
+
+	plot_stop();
+
+	for (i = 0; i < VAR_CNT; i++)
+		plot_vars[i] = vars[i];
+
+	plot_vars[VAR_CNT].name = "x";
+
+	plot_set(plot_text ? expr_create(plot_text, plot_vars, NULL) : NULL,
+	         plot_vars, VAR_CNT, &ctx);
+}
+
+/*
+ * Stores the expression as a formula if it references other slots, otherwise
+ * the last value is stored.
+ */
 int var_store(gp_widget_event *ev)
 {
+	struct expr *expr;
+	uint32_t deps = 0;
+	unsigned int i, slot;
+
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
@@ -43,7 +620,27 @@ int var_store(gp_widget_event *ev)
 	if (label[0] < 'A' || label[0] > 'H')
 		return 0;
 
-	vars[label[0]-'A'].val = last_val;
+	slot = label[0] - 'A';
+
+	job_cancel();
+
+	expr = expr_create(gp_widget_tbox_text(edit), vars, NULL);
+	if (expr) {
+		for (i = 0; i < SLOT_CNT; i++) {
+			if (expr_uses_var(expr, &vars[i]))
+				deps |= 1u<<i;
+		}
+	}
+
+	if (deps) {
+		slot_set_formula(slot, expr, deps);
+		return 0;
+	}
+
+	if (expr)
+		expr_destroy(expr);
+
+	slot_set_val(slot, last_val);
 
 	return 0;
 }
@@ -53,6 +650,8 @@ int clear(gp_widget_event *ev)
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
+	job_cancel();
+
 	gp_widget_tbox_clear(edit);
 
 	last_val = 0;
@@ -91,27 +690,156 @@ static void close_parens(void)
 		gp_widget_tbox_append(edit, ")");
 }
 
-static int eval(void)
+static const char *skip_ws(const char *str)
+{
+	while (*str == ' ' || *str == '\t')
+		str++;
+
+	return str;
+}
+
+static const char *skip_ident(const char *str)
+{
+	if (!isalpha(*str))
+		return NULL;
+
+	while (isalnum(*str) || *str == '_')
+		str++;
+
+	return str;
+}
+
+static int is_var(const char *name, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; vars[i].name; i++) {
+		if (!strncmp(vars[i].name, name, len) && !vars[i].name[len])
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Matches function definition head "f(x, y)" where parameters are not
+ * variables, returns pointer after the right parenthesis or NULL.
+ */
+static const char *def_head(const char *str)
+{
+	const char *end;
+
+	if (!(str = skip_ident(skip_ws(str))))
+		return NULL;
+
+	str = skip_ws(str);
+
+	if (*str != '(')
+		return NULL;
+
+	do {
+		str = skip_ws(str + 1);
+
+		if (!(end = skip_ident(str)))
+			return NULL;
+
+		if (is_var(str, end - str))
+			return NULL;
+
+		str = skip_ws(end);
+	} while (*str == ',');
+
+	if (*str != ')')
+		return NULL;
+
+	return str + 1;
+}
+
+static int define(const char *def)
+{
+	struct expr_err err;
+
+	plot_stop();
+
+	if (expr_ufn_define(def, vars, &err)) {
+		gp_widget_tbox_printf(edit, "%i:%s", err.pos, err.err);
+	} else {
+		history_save(history_add_def(def));
+		plot_update(NULL);
+	}
+
+	gp_widget_tbox_clear_on_input(edit);
+	shown();
+
+	return 1;
+}
+
+/*
+ * Returns the compiled expression for the recalled entry, if unchanged.
+ */
+static struct expr *recalled_expr(const char *text)
+{
+	if (hist_pos >= history_cnt() || strcmp(text, history_text(hist_pos)))
+		return NULL;
+
+	return history_take(hist_pos);
+}
+
+static int eval_text(const char *text)
 {
 	struct expr *expr;
 	struct expr_err err;
+	const char *head;
 
-	close_parens();
+	head = def_head(text);
+	if (head && (head = skip_ws(head))[0] == '=' && head[1] != '=')
+		return define(text);
+
+	plot_update(text);
+
+	expr = recalled_expr(text);
+	if (!expr)
+		expr = expr_create(text, vars, &err);
 
-	expr = expr_create(gp_widget_tbox_text(edit), vars, &err);
 	if (!expr) {
 		gp_widget_tbox_printf(edit, "%i:%s", err.pos, err.err);
 		gp_widget_tbox_clear_on_input(edit);
+		shown();
 		return 0;
 	}
 
-	last_val = expr_eval(expr, &ctx);
+	job_start(text, expr);
 
-	gp_widget_tbox_printf(edit, "%.16g", last_val);
+	return 1;
+}
 
-	expr_destroy(expr);
+static int eval(void)
+{
+	const char *text;
 
-	return 1;
+	close_parens();
+
+	text = gp_widget_tbox_text(edit);
+
+	/* the expression is being evaluated already */
+	if (job_busy() && !job.cancel && job.text && !strcmp(text, job.text))
+		return 1;
+
+	/* the expression may read the slots, they are recomputed first */
+	if (job_busy() && job.slots && !job.cancel) {
+		free(queued);
+		queued = strdup(text);
+		return 1;
+	}
+
+	job_cancel();
+
+	return eval_text(text);
+}
+
+static int eval_busy(void)
+{
+	return job_busy() || queued;
 }
 
 int do_eq(gp_widget_event *ev)
@@ -159,6 +887,11 @@ static int is_op_fn(int ch)
 	case '/':
 	case '^':
 	case '(':
+	case '<':
+	case '>':
+	case '=':
+	case '&':
+	case '|':
 		return 1;
 	default:
 		return 0;
@@ -174,13 +907,8 @@ static int op_fn_before_cur_pos(gp_widget *tbox)
 	return is_op_fn(ch);
 }
 
-int do_append(gp_widget_event *ev)
+static void append(const char *label)
 {
-	if (ev->type != GP_WIDGET_EVENT_WIDGET)
-		return 0;
-
-	const char *label = gp_widget_button_label_get(ev->self);
-
 	if (!strcmp(label, "\u00d7"))
 		label = "*";
 
@@ -192,6 +920,14 @@ int do_append(gp_widget_event *ev)
 		ins_whence = GP_SEEK_SET;
 
 	gp_widget_tbox_ins(edit, 0, ins_whence, label);
+}
+
+int do_append(gp_widget_event *ev)
+{
+	if (ev->type != GP_WIDGET_EVENT_WIDGET)
+		return 0;
+
+	append(gp_widget_button_label_get(ev->self));
 
 	return 1;
 }
@@ -214,12 +950,107 @@ int cursor_end(gp_widget_event *ev)
 	return 0;
 }
 
+/*
+ * Recalls the previous or next entry that starts with the text that was in
+ * the edit box when browsing started, past the newest one the text is
+ * restored.
+ */
+static void history_browse(int dir)
+{
+	const char *text = gp_widget_tbox_text(edit);
+	unsigned int cnt = history_cnt();
+	int idx;
+
+	if (hist_pos >= cnt || strcmp(text, history_text(hist_pos))) {
+		if (hist_shown && !strcmp(text, hist_shown))
+			text = "";
+
+		free(hist_prefix);
+		hist_prefix = strdup(text);
+		hist_pos = cnt;
+
+		if (!hist_prefix)
+			return;
+	}
+
+	idx = history_find(hist_pos, dir, hist_prefix);
+	if (idx < 0) {
+		if (dir > 0 && hist_pos < cnt) {
+			hist_pos = cnt;
+			gp_widget_tbox_printf(edit, "%s", hist_prefix);
+		}
+		return;
+	}
+
+	hist_pos = idx;
+	gp_widget_tbox_printf(edit, "%s", history_text(idx));
+	last_val = history_res(idx);
+}
+
+int prev_input(gp_widget_event *ev)
+{
+	if (ev->type != GP_WIDGET_EVENT_WIDGET)
+		return 0;
+
+	history_browse(-1);
+	return 0;
+}
+
+int next_input(gp_widget_event *ev)
+{
+	if (ev->type != GP_WIDGET_EVENT_WIDGET)
+		return 0;
+
+	history_browse(1);
+	return 0;
+}
+
+/*
+ * Only the first page is built at the start, the rest is built from the
+ * embedded layout when shown for the first time.
+ */
+static void layout_move(int where)
+{
+	unsigned int page = (layout_page + LAYOUT_PAGES + where) % LAYOUT_PAGES;
+	struct timespec start;
+
+	if (!(layout_pages_built & (1u<<page))) {
+		gp_widget *widget;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		widget = gp_widget_layout_json(layout_pages[page], NULL);
+		if (!widget) {
+			GP_WARN("Failed to build layout page %u", page);
+			return;
+		}
+
+		gp_widget_layout_switch_put(layout_switch, page, widget);
+		layout_pages_built |= 1u<<page;
+
+		GP_DEBUG(1, "Layout page %u built in %.2fms", page, ms_since(&start));
+	}
+
+	gp_widget_layout_switch_move(layout_switch, where);
+	layout_page = page;
+
+	/* a shown result is not plotted, the evaluated expression is */
+	if (page == PLOT_PAGE) {
+		const char *text = gp_widget_tbox_text(edit);
+
+		if (hist_shown && !strcmp(text, hist_shown))
+			text = NULL;
+
+		plot_update(text);
+	}
+}
+
 int prev_layout(gp_widget_event *ev)
 {
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	gp_widget_layout_switch_move(layout_switch, -1);
+	layout_move(-1);
 	return 0;
 }
 
@@ -228,7 +1059,7 @@ int next_layout(gp_widget_event *ev)
 	if (ev->type != GP_WIDGET_EVENT_WIDGET)
 		return 0;
 
-	gp_widget_layout_switch_move(layout_switch, 1);
+	layout_move(1);
 	return 0;
 }
 
@@ -245,6 +1076,9 @@ int set_angle_unit(gp_widget_event *ev)
 	else
 		GP_WARN("Invalid angle unit '%s'", angle_unit);
 
+	job_cancel();
+	slots_recompute(formula_slots());
+
 	return 0;
 }
 
@@ -255,6 +1089,21 @@ static int app_on_event(gp_widget_event *ev)
 
 	if (ev->input_ev->type == GP_EV_UTF &&
 	    ev->input_ev->utf.ch == '=') {
+		const char *head = def_head(gp_widget_tbox_text(edit));
+
+		/* '=' after "f(x)" starts function definition */
+		if (head && !*skip_ws(head))
+			return gp_widget_input_inject(edit, ev);
+
+		/* second character of <=, >=, == and != */
+		switch (last_chr(gp_widget_tbox_text(edit))) {
+		case '<':
+		case '>':
+		case '=':
+		case '!':
+			return gp_widget_input_inject(edit, ev);
+		}
+
 		eval();
 		return 1;
 	}
@@ -262,6 +1111,30 @@ static int app_on_event(gp_widget_event *ev)
 	return gp_widget_input_inject(edit, ev);
 }
 
+static void bench_reset(void)
+{
+	job_cancel();
+	gp_widget_tbox_clear(edit);
+}
+
+static int bench_input(gp_event *ev)
+{
+	gp_widget_event wev = {
+		.type = GP_WIDGET_EVENT_INPUT,
+		.input_ev = ev,
+		.ctx = gp_widgets_render_ctx(),
+	};
+
+	return app_on_event(&wev);
+}
+
+static const struct bench_ops bench_ops = {
+	.reset = bench_reset,
+	.input = bench_input,
+	.layout_move = layout_move,
+	.busy = eval_busy,
+};
+
 gp_app_info app_info = {
 	.name = "gpcalc",
 	.desc = "A scientific calculator",
@@ -274,16 +1147,77 @@ gp_app_info app_info = {
 	}
 };
 
+/*
+ * Loads $XDG_CONFIG_HOME/gpcalc/history or ~/.config/gpcalc/history.
+ */
+static void history_init(void)
+{
+	const char *cfg = getenv("XDG_CONFIG_HOME");
+	const char *home = getenv("HOME");
+	char path[1024];
+
+	if (cfg && cfg[0])
+		snprintf(path, sizeof(path), "%s", cfg);
+	else if (home)
+		snprintf(path, sizeof(path), "%s/.config", home);
+	else
+		return;
+
+	mkdir(path, 0755);
+	strncat(path, "/gpcalc", sizeof(path) - strlen(path) - 1);
+
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		GP_WARN("Failed to create '%s': %s", path, strerror(errno));
+		return;
+	}
+
+	strncat(path, "/history", sizeof(path) - strlen(path) - 1);
+
+	if (history_load(path, vars))
+		GP_WARN("Failed to load history '%s'", path);
+
+	hist_pos = history_cnt();
+}
+
 int main(int argc, char *argv[])
 {
-	gp_widget *layout = gp_app_layout_load("gpcalc", &uids);
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	gp_widget *layout = gp_widget_layout_json(layout_json, &uids);
+	if (!layout) {
+		GP_WARN("Failed to build layout");
+		return 1;
+	}
+
+	GP_DEBUG(1, "Layout built in %.2fms", ms_since(&start));
 
 	edit = gp_widget_by_uid(uids, "edit", GP_WIDGET_TBOX);
 	layout_switch = gp_widget_by_uid(uids, "layout_switch", GP_WIDGET_SWITCH);
+	status = gp_widget_by_uid(uids, "status", GP_WIDGET_LABEL);
 
 	gp_app_event_unmask(GP_WIDGET_EVENT_INPUT);
 	gp_app_on_event_set(app_on_event);
 
+	ctx.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	ctx.seed = time(NULL);
+
+	/* GPCALC_BENCH=rounds runs the latency benchmark, without history */
+	const char *bench = getenv("GPCALC_BENCH");
+
+	if (bench)
+		bench_start(&bench_ops, atoi(bench));
+	else
+		history_init();
+
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, worker, NULL))
+		GP_WARN("Failed to start worker, evaluating synchronously");
+	else
+		worker_running = 1;
+
 	gp_widgets_main_loop(layout, NULL, argc, argv);
 
 	return 0;
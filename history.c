@@ -0,0 +1,464 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Expression history and its file.
+
+   The file is a header followed by records, each record is the record header,
+   the '\0' terminated text and the serialized program, all padded to 8 bytes
+   so that the programs in the mapped file are used as they are.
+
+   Entries are only appended, a torn record at the end is cut off at the load
+   and the file is compacted at the load once it grows too much.
+
+   Programs stored before a function definition are ignored, they may call or
+   inline the old definition, such entries are compiled from the text.
+
+  */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+#define HISTORY_MAGIC "GPCH"
+#define HISTORY_VERSION 1
+#define HISTORY_BYTE_ORDER 0x0102
+
+/* number of dropped records that triggers compaction */
+#define HISTORY_COMPACT (4 * HISTORY_MAX)
+
+#define HISTORY_DEF 0x01
+
+#define PAD8(len) (((len) + 7) & ~(size_t)7)
+
+struct history_hdr {
+	char magic[4];
+	uint16_t version;
+	/* HISTORY_BYTE_ORDER in the native byte order */
+	uint16_t byte_order;
+};
+
+struct history_rec {
+	/* size of the record including the text and the program */
+	uint32_t size;
+	uint32_t flags;
+	/* length of the text including the '\0' */
+	uint32_t text_len;
+	/* size of the serialized program, zero if not stored */
+	uint32_t prog_size;
+	double res;
+};
+
+_Static_assert(sizeof(struct history_hdr) == 8, "Wrong header size");
+_Static_assert(sizeof(struct history_rec) == 24, "Wrong record size");
+
+struct entry {
+	char *text;
+	double res;
+	int is_def;
+	struct expr *expr;
+	/* the program in the mapped file */
+	const void *prog;
+	size_t prog_size;
+};
+
+static struct entry ring[HISTORY_MAX];
+static unsigned int head, cnt;
+
+static const struct expr_var *hist_vars;
+
+static int fd = -1;
+static void *map;
+static size_t map_size;
+
+static struct entry *entry(unsigned int idx)
+{
+	return &ring[(head + idx) % HISTORY_MAX];
+}
+
+static void entry_free(struct entry *e)
+{
+	free(e->text);
+
+	if (e->expr)
+		expr_destroy(e->expr);
+
+	memset(e, 0, sizeof(*e));
+}
+
+static struct entry *entry_new(const char *text)
+{
+	struct entry *e;
+	char *dup = strdup(text);
+
+	if (!dup)
+		return NULL;
+
+	if (cnt == HISTORY_MAX) {
+		entry_free(entry(0));
+		head = (head + 1) % HISTORY_MAX;
+		cnt--;
+	}
+
+	e = entry(cnt++);
+	e->text = dup;
+
+	return e;
+}
+
+/*
+ * Returns the record at offset off or NULL if it's not valid.
+ */
+static const struct history_rec *rec_at(size_t off)
+{
+	const struct history_rec *rec = (const void*)((char*)map + off);
+	const char *text = (const char*)(rec + 1);
+
+	if (off + sizeof(*rec) > map_size)
+		return NULL;
+
+	if (rec->size % 8 || rec->size > map_size - off || !rec->text_len)
+		return NULL;
+
+	if (sizeof(*rec) + PAD8((size_t)rec->text_len) + rec->prog_size > rec->size)
+		return NULL;
+
+	if (text[rec->text_len - 1])
+		return NULL;
+
+	return rec;
+}
+
+static const void *rec_prog(const struct history_rec *rec)
+{
+	if (!rec->prog_size)
+		return NULL;
+
+	return (const char*)(rec + 1) + PAD8((size_t)rec->text_len);
+}
+
+static int write_all(int wfd, const void *buf, size_t size)
+{
+	const char *ptr = buf;
+	ssize_t ret;
+
+	while (size) {
+		ret = write(wfd, ptr, size);
+		if (ret <= 0)
+			return 1;
+
+		ptr += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int write_hdr(int wfd)
+{
+	struct history_hdr hdr = {
+		.magic = HISTORY_MAGIC,
+		.version = HISTORY_VERSION,
+		.byte_order = HISTORY_BYTE_ORDER,
+	};
+
+	return write_all(wfd, &hdr, sizeof(hdr));
+}
+
+/*
+ * Rewrites the file with the definitions and the last HISTORY_MAX records.
+ */
+static int compact(const char *path, size_t end, unsigned int rec_cnt)
+{
+	char tmp[strlen(path) + 5];
+	const struct history_rec *rec;
+	unsigned int i = 0;
+	size_t off;
+	int wfd, ret;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+	wfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (wfd < 0)
+		return 1;
+
+	ret = write_hdr(wfd);
+
+	for (off = sizeof(struct history_hdr); off < end; off += rec->size, i++) {
+		rec = rec_at(off);
+
+		if (i + HISTORY_MAX < rec_cnt && !(rec->flags & HISTORY_DEF))
+			continue;
+
+		ret |= write_all(wfd, rec, rec->size);
+	}
+
+	ret |= close(wfd);
+
+	if (ret || rename(tmp, path)) {
+		unlink(tmp);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void unload(void)
+{
+	if (map)
+		munmap(map, map_size);
+
+	if (fd >= 0)
+		close(fd);
+
+	map = NULL;
+	map_size = 0;
+	fd = -1;
+}
+
+static int load(const char *path, int may_compact)
+{
+	const struct history_hdr *hdr;
+	const struct history_rec *rec;
+	unsigned int rec_cnt = 0, dropped = 0, last_def = 0, i;
+	struct stat st;
+	size_t off;
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &st))
+		goto err;
+
+	if (!st.st_size) {
+		if (write_hdr(fd))
+			goto err;
+		return 0;
+	}
+
+	map_size = st.st_size;
+	map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		goto err;
+	}
+
+	hdr = map;
+
+	if (map_size < sizeof(*hdr) || memcmp(hdr->magic, HISTORY_MAGIC, 4) ||
+	    hdr->byte_order != HISTORY_BYTE_ORDER ||
+	    hdr->version != HISTORY_VERSION)
+		goto err;
+
+	for (off = sizeof(*hdr); (rec = rec_at(off)); off += rec->size) {
+		if (rec->flags & HISTORY_DEF)
+			last_def = rec_cnt + 1;
+		rec_cnt++;
+	}
+
+	/* torn write at the end, new records are appended after the valid ones */
+	if (off < map_size && ftruncate(fd, off))
+		goto err;
+
+	for (i = 0, off = sizeof(*hdr); i < rec_cnt; i++, off += rec->size) {
+		rec = rec_at(off);
+
+		if (i + HISTORY_MAX < rec_cnt && !(rec->flags & HISTORY_DEF))
+			dropped++;
+	}
+
+	if (may_compact && dropped > HISTORY_COMPACT) {
+		if (!compact(path, off, rec_cnt)) {
+			unload();
+			return load(path, 0);
+		}
+	}
+
+	for (i = 0, off = sizeof(*hdr); i < rec_cnt; i++, off += rec->size) {
+		const char *text;
+		struct entry *e;
+
+		rec = rec_at(off);
+		text = (const char*)(rec + 1);
+
+		if (rec->flags & HISTORY_DEF)
+			expr_ufn_define(text, hist_vars, NULL);
+
+		if (i + HISTORY_MAX < rec_cnt)
+			continue;
+
+		e = entry_new(text);
+		if (!e)
+			break;
+
+		e->res = rec->res;
+		e->is_def = !!(rec->flags & HISTORY_DEF);
+
+		if (i >= last_def) {
+			e->prog = rec_prog(rec);
+			e->prog_size = rec->prog_size;
+		}
+	}
+
+	return 0;
+err:
+	unload();
+	return 1;
+}
+
+int history_load(const char *path, const struct expr_var vars[])
+{
+	hist_vars = vars;
+
+	return load(path, 1);
+}
+
+static int append(const char *text, double res, struct expr *expr, int flags)
+{
+	size_t text_len = strlen(text) + 1;
+	size_t prog_size = expr ? expr_serialize(expr, NULL, 0) : 0;
+	size_t size = sizeof(struct history_rec) + PAD8(text_len) + PAD8(prog_size);
+	struct history_rec *rec;
+	int ret;
+
+	/* the history is kept only in memory */
+	if (fd < 0)
+		return 0;
+
+	rec = calloc(1, size);
+	if (!rec)
+		return 1;
+
+	rec->size = size;
+	rec->flags = flags;
+	rec->text_len = text_len;
+	rec->prog_size = prog_size;
+	rec->res = res;
+
+	memcpy(rec + 1, text, text_len);
+
+	if (expr)
+		expr_serialize(expr, (char*)(rec + 1) + PAD8(text_len), prog_size);
+
+	ret = write_all(fd, rec, size);
+
+	free(rec);
+
+	/* do not append after a torn record, the map is still in use */
+	if (ret) {
+		close(fd);
+		fd = -1;
+	}
+
+	return ret;
+}
+
+int history_add(const char *text, double res, struct expr *expr)
+{
+	struct entry *e;
+
+	/* repeated expression updates the newest entry */
+	if (cnt && !strcmp(entry(cnt - 1)->text, text) && !entry(cnt - 1)->is_def) {
+		e = entry(cnt - 1);
+		e->res = res;
+
+		if (e->expr)
+			expr_destroy(e->expr);
+
+		e->expr = expr;
+
+		return 0;
+	}
+
+	e = entry_new(text);
+	if (!e) {
+		expr_destroy(expr);
+		return 1;
+	}
+
+	e->res = res;
+	e->expr = expr;
+
+	return append(text, res, expr, 0);
+}
+
+int history_add_def(const char *text)
+{
+	struct entry *e;
+	unsigned int i;
+
+	for (i = 0; i < cnt; i++) {
+		e = entry(i);
+
+		if (e->expr)
+			expr_destroy(e->expr);
+
+		e->expr = NULL;
+		e->prog = NULL;
+	}
+
+	e = entry_new(text);
+	if (!e)
+		return 1;
+
+	e->is_def = 1;
+
+	return append(text, 0, NULL, HISTORY_DEF);
+}
+
+unsigned int history_cnt(void)
+{
+	return cnt;
+}
+
+const char *history_text(unsigned int idx)
+{
+	return entry(idx)->text;
+}
+
+double history_res(unsigned int idx)
+{
+	return entry(idx)->res;
+}
+
+struct expr *history_take(unsigned int idx)
+{
+	struct entry *e = entry(idx);
+	struct expr *expr = e->expr;
+
+	if (expr) {
+		e->expr = NULL;
+		return expr;
+	}
+
+	/* the map is never unmapped once the entries point into it */
+	if (e->prog)
+		return expr_load_buf(e->prog, e->prog_size, hist_vars, NULL);
+
+	return NULL;
+}
+
+int history_find(unsigned int idx, int dir, const char *prefix)
+{
+	size_t len = strlen(prefix);
+	int i;
+
+	for (i = (int)idx + dir; i >= 0 && i < (int)cnt; i += dir) {
+		if (!strncmp(entry(i)->text, prefix, len))
+			return i;
+	}
+
+	return -1;
+}
@@ -0,0 +1,72 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Expression history.
+
+   The last HISTORY_MAX entries are kept in a ring along with their results
+   and compiled programs. Entries are indexed from 0, the oldest one, to
+   history_cnt() - 1, the newest one.
+
+   The history is persisted in an append-only file that stores the compiled
+   programs as well, so that recalled expressions are not parsed again.
+
+  */
+
+#ifndef HISTORY_H__
+#define HISTORY_H__
+
+#include "expr.h"
+
+#define HISTORY_MAX 64
+
+/*
+ * Opens or creates the history file, fills the ring with the last entries
+ * and defines the functions defined in the history.
+ *
+ * Returns zero on success, the history then works only in memory on failure.
+ */
+int history_load(const char *path, const struct expr_var vars[]);
+
+/*
+ * Adds expression to the history and appends it to the file, the history
+ * takes over the compiled expression.
+ *
+ * Returns non-zero if the file could not be written.
+ */
+int history_add(const char *text, double res, struct expr *expr);
+
+/*
+ * Adds function definition to the history.
+ *
+ * The compiled programs in the history are dropped, they may call or inline
+ * the old definition.
+ */
+int history_add_def(const char *text);
+
+unsigned int history_cnt(void);
+
+const char *history_text(unsigned int idx);
+
+double history_res(unsigned int idx);
+
+/*
+ * Returns the compiled expression, loaded from the file if needed, the caller
+ * takes over it. Returns NULL if there is none, e.g. for definitions.
+ */
+struct expr *history_take(unsigned int idx);
+
+/*
+ * Searches from the entry idx, exclusive, in direction dir for an entry that
+ * starts with the prefix. Pass history_cnt() to start from the newest one.
+ *
+ * Returns the entry index or -1 if there is none.
+ */
+int history_find(unsigned int idx, int dir, const char *prefix);
+
+#endif /* HISTORY_H__ */
@@ -0,0 +1,269 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Converts the gpcalc layout into a C header so that the layout is compiled
+   into the binary rather than read from a file at each start.
+
+   Whitespaces are stripped from the JSON and the layout_switch pages, but
+   the first one, are cut out into separate layouts and replaced with null
+   in the main layout. These are loaded when shown for the first time.
+
+   layout2c layout.json > gpcalc_layout.h
+
+   Runs on the build host, needs nothing but libc.
+
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SWITCH_UID "\"uid\":\"layout_switch\""
+#define PAGES_MAX 32
+#define PAGE_HEAD "{\"info\":{\"version\":1},\"layout\":"
+
+static char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	for (;;) {
+		if (len + 1 >= size) {
+			size = size ? 2 * size : 4096;
+			buf = realloc(buf, size);
+			if (!buf) {
+				fprintf(stderr, "Malloc failed\n");
+				fclose(f);
+				return NULL;
+			}
+		}
+
+		size_t ret = fread(buf + len, 1, size - len - 1, f);
+
+		if (!ret)
+			break;
+
+		len += ret;
+	}
+
+	fclose(f);
+	buf[len] = 0;
+
+	return buf;
+}
+
+/*
+ * Strips whitespaces outside of strings, in place.
+ */
+static void minify(char *json)
+{
+	char *out = json;
+	int in_str = 0;
+
+	for (; *json; json++) {
+		if (in_str) {
+			*out++ = *json;
+
+			if (*json == '\\' && json[1])
+				*out++ = *++json;
+			else if (*json == '"')
+				in_str = 0;
+
+			continue;
+		}
+
+		switch (*json) {
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+		break;
+		case '"':
+			in_str = 1;
+			/* fallthrough */
+		default:
+			*out++ = *json;
+		}
+	}
+
+	*out = 0;
+}
+
+/*
+ * Returns pointer after the value that starts at json, NULL if unterminated.
+ */
+static const char *skip_value(const char *json)
+{
+	int depth = 0, in_str = 0;
+
+	for (; *json; json++) {
+		if (in_str) {
+			if (*json == '\\')
+				json++;
+			else if (*json == '"')
+				in_str = 0;
+
+			if (!in_str && !depth)
+				return json + 1;
+
+			continue;
+		}
+
+		switch (*json) {
+		case '"':
+			in_str = 1;
+		break;
+		case '{':
+		case '[':
+			depth++;
+		break;
+		case '}':
+		case ']':
+			if (--depth < 0)
+				return json;
+			if (!depth)
+				return json + 1;
+		break;
+		case ',':
+			if (!depth)
+				return json;
+		break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns pointer to the array with the pages, i.e. the value of "widgets"
+ * in the object with the layout_switch uid.
+ */
+static const char *find_pages(const char *json)
+{
+	const char *key = "\"widgets\":";
+	const char *obj = strstr(json, SWITCH_UID);
+
+	if (!obj)
+		return NULL;
+
+	/* the remaining keys of the object */
+	for (obj += strlen(SWITCH_UID); obj && *obj == ','; obj = skip_value(obj)) {
+		obj++;
+
+		if (!strncmp(obj, key, strlen(key)))
+			return obj + strlen(key);
+
+		/* skip the key and the colon */
+		if (!(obj = skip_value(obj)) || *obj++ != ':')
+			return NULL;
+	}
+
+	return NULL;
+}
+
+static void put_str(const char *name, const char *str, size_t len)
+{
+	size_t i;
+
+	printf("%s\"", name);
+
+	for (i = 0; i < len; i++) {
+		if (i && !(i % 64))
+			printf("\"\n\t\"");
+
+		if (str[i] == '"' || str[i] == '\\')
+			putchar('\\');
+
+		putchar(str[i]);
+	}
+
+	printf("\"");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *start[PAGES_MAX], *end[PAGES_MAX];
+	const char *pages, *json;
+	unsigned int i, page_cnt = 0;
+	char *buf;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s layout.json\n", argv[0]);
+		return 1;
+	}
+
+	buf = read_file(argv[1]);
+	if (!buf)
+		return 1;
+
+	minify(buf);
+
+	pages = find_pages(buf);
+	if (!pages || *pages != '[') {
+		fprintf(stderr, "%s: layout_switch widgets not found\n", argv[1]);
+		return 1;
+	}
+
+	for (json = pages + 1; *json != ']'; json++) {
+		if (page_cnt >= PAGES_MAX) {
+			fprintf(stderr, "%s: too many pages\n", argv[1]);
+			return 1;
+		}
+
+		start[page_cnt] = json;
+		json = skip_value(json);
+
+		if (!json || (*json != ',' && *json != ']')) {
+			fprintf(stderr, "%s: invalid layout_switch widgets\n", argv[1]);
+			return 1;
+		}
+
+		end[page_cnt++] = json;
+
+		if (*json == ']')
+			break;
+	}
+
+	if (!page_cnt) {
+		fprintf(stderr, "%s: no pages in layout_switch\n", argv[1]);
+		return 1;
+	}
+
+	printf("/* Generated by layout2c from %s, do not edit */\n\n", argv[1]);
+	printf("#define LAYOUT_PAGES %u\n\n", page_cnt);
+
+	/* the main layout with the first page, the rest is null */
+	put_str("static const char layout_json[] =\n\t", buf, end[0] - buf);
+	for (i = 1; i < page_cnt; i++)
+		put_str("\n\t", ",null", 5);
+	put_str("\n\t", end[page_cnt - 1], strlen(end[page_cnt - 1]));
+	printf(";\n\n");
+
+	printf("static const char *const layout_pages[LAYOUT_PAGES] = {\n");
+	printf("\tNULL,\n");
+
+	for (i = 1; i < page_cnt; i++) {
+		put_str("\t", PAGE_HEAD, strlen(PAGE_HEAD));
+		put_str("\n\t", start[i], end[i] - start[i]);
+		put_str("\n\t", "}", 1);
+		printf(",\n");
+	}
+
+	printf("};\n");
+
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,719 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Plot of an expression in a single variable.
+
+   The values at the column edges are evaluated by expr_eval_range(), the
+   curve in a column is drawn as vertical lines between the values. Columns
+   where the curve moves by more than a few pixels, or where it ends, are
+   sampled more densely, the samples for all such columns are evaluated by
+   a single expr_eval_batch() call.
+
+   The edge values are kept while the x axis does not change, i.e. panning
+   in y does not evaluate them, panning in x evaluates only the columns that
+   were scrolled in.
+
+   The evaluation runs in a worker thread, the edges are evaluated in blocks
+   and the plot is redrawn by a timer as they are done. Change of the x axis
+   or of the expression cancels the evaluation and so does the time limit,
+   the columns that were not evaluated before the time limit are left empty.
+
+  */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <widgets/gp_widgets.h>
+
+#include "plot.h"
+
+/* initial range of x */
+#define PLOT_RANGE 20.0
+/* columns where the curve moves by more pixels are refined */
+#define PLOT_REFINE_PX 2
+/* samples added into a refined column */
+#define PLOT_REFINE 8
+/* minimal spacing of the grid lines */
+#define PLOT_GRID_PX 40
+/* the fit ignores this fraction of the lowest and the highest values */
+#define PLOT_FIT_CUT 0.02
+/* edges evaluated between the checks for cancellation */
+#define PLOT_BLOCK 64
+/* wait for the evaluation before the plot is drawn incompletely */
+#define PLOT_SYNC_MS 20
+/* period of the incremental redraw */
+#define PLOT_POLL_MS 50
+/* the evaluation is cancelled after this */
+#define PLOT_BUDGET_MS 10000
+
+enum plot_state {
+	PLOT_IDLE,
+	PLOT_RUNNING,
+	PLOT_DONE,
+};
+
+static struct plot {
+	gp_widget *widget;
+	struct expr *expr;
+	const struct expr_var *vars;
+	unsigned int x;
+	unsigned int var_cnt;
+	struct expr_ctx ctx;
+	/* the view center and units per pixel */
+	double cx, cy;
+	double sx, sy;
+	/* height of the last rendered pixmap */
+	gp_size h;
+	/* values at the column edges for x = edge_x0 + i * edge_dx */
+	double *edge;
+	size_t edge_size;
+	size_t edge_cnt;
+	double edge_x0;
+	double edge_dx;
+	/* samples in the refined columns, valid if sub_sy == sy */
+	double *sub_x;
+	double *sub_y;
+	size_t sub_x_size;
+	size_t sub_y_size;
+	size_t sub_cnt;
+	double sub_sy;
+	/* the worker evaluates edges [job_from, job_to) and refines for job_sy */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	enum plot_state state;
+	/* 1 if the worker runs, -1 if it failed to start */
+	int worker_running;
+	/* cancellation token polled by the library */
+	int cancel;
+	int timeout;
+	struct timespec start;
+	size_t job_from;
+	size_t job_to;
+	/* number of the edges evaluated so far */
+	size_t job_done;
+	size_t job_sub_cnt;
+	double job_sy;
+} plot = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int buf_grow(double **buf, size_t *size, size_t cnt)
+{
+	double *tmp;
+
+	if (cnt <= *size)
+		return 0;
+
+	tmp = realloc(*buf, cnt * sizeof(double));
+	if (!tmp)
+		return 1;
+
+	*buf = tmp;
+	*size = cnt;
+
+	return 0;
+}
+
+static void redraw(void)
+{
+	if (plot.widget)
+		gp_widget_pixmap_redraw_all(plot.widget);
+}
+
+static double ms_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int cancelled(void)
+{
+	return __atomic_load_n(&plot.cancel, __ATOMIC_RELAXED);
+}
+
+static int is_refined(size_t i, double sy)
+{
+	double a = plot.edge[i], b = plot.edge[i+1];
+
+	if (isfinite(a) != isfinite(b))
+		return 1;
+
+	return isfinite(a) && fabs(a - b) > PLOT_REFINE_PX * sy;
+}
+
+/*
+ * Evaluates the samples in the refined columns, returns their count.
+ */
+static size_t eval_refined(size_t cols, double sy)
+{
+	const double *vcols[plot.var_cnt];
+	double dx = plot.edge_dx / (PLOT_REFINE + 1);
+	size_t i, cnt = 0;
+	unsigned int k;
+
+	if (buf_grow(&plot.sub_x, &plot.sub_x_size, cols * PLOT_REFINE) ||
+	    buf_grow(&plot.sub_y, &plot.sub_y_size, cols * PLOT_REFINE))
+		return 0;
+
+	for (i = 0; i < cols; i++) {
+		double x = plot.edge_x0 + i * plot.edge_dx;
+
+		if (!is_refined(i, sy))
+			continue;
+
+		for (k = 1; k <= PLOT_REFINE; k++)
+			plot.sub_x[cnt++] = x + k * dx;
+	}
+
+	if (!cnt)
+		return 0;
+
+	memset(vcols, 0, sizeof(vcols));
+	vcols[plot.x] = plot.sub_x;
+
+	expr_eval_batch(plot.expr, &plot.ctx, vcols, plot.sub_y, cnt);
+
+	return cnt;
+}
+
+/*
+ * Evaluates the edges in blocks, the main loop draws the ones that are done,
+ * then the refined samples.
+ */
+static void job_run(void)
+{
+	const struct expr_var *var = &plot.vars[plot.x];
+	size_t i, n;
+
+	for (i = plot.job_from; i < plot.job_to; i += n) {
+		n = plot.job_to - i < PLOT_BLOCK ? plot.job_to - i : PLOT_BLOCK;
+
+		expr_eval_range(plot.expr, &plot.ctx, var, plot.edge_x0 + i * plot.edge_dx,
+		                plot.edge_dx, plot.edge + i, n);
+
+		/* the values of cancelled evaluation are undefined */
+		if (cancelled())
+			return;
+
+		__atomic_store_n(&plot.job_done, i + n - plot.job_from, __ATOMIC_RELEASE);
+	}
+
+	plot.job_sub_cnt = eval_refined(plot.edge_cnt - 1, plot.job_sy);
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&plot.lock);
+
+	for (;;) {
+		while (plot.state != PLOT_RUNNING)
+			pthread_cond_wait(&plot.cond, &plot.lock);
+
+		pthread_mutex_unlock(&plot.lock);
+		job_run();
+		pthread_mutex_lock(&plot.lock);
+
+		plot.state = PLOT_DONE;
+		pthread_cond_broadcast(&plot.cond);
+	}
+
+	return NULL;
+}
+
+/*
+ * Waits up to ms milliseconds for the job, returns non-zero if it's done.
+ */
+static int job_wait(unsigned int ms)
+{
+	struct timespec ts;
+	int done;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += ms * 1000000;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&plot.lock);
+
+	while (plot.state == PLOT_RUNNING) {
+		if (pthread_cond_timedwait(&plot.cond, &plot.lock, &ts))
+			break;
+	}
+
+	done = plot.state == PLOT_DONE;
+
+	pthread_mutex_unlock(&plot.lock);
+
+	return done;
+}
+
+/*
+ * Edges that were not evaluated before the time limit are left empty, on
+ * other cancellation the edges are evaluated again on the next redraw.
+ */
+static void job_finish(void)
+{
+	size_t i;
+
+	if (plot.cancel && plot.job_done < plot.job_to - plot.job_from) {
+		if (plot.timeout) {
+			for (i = plot.job_from + plot.job_done; i < plot.job_to; i++)
+				plot.edge[i] = NAN;
+		} else {
+			plot.edge_cnt = 0;
+		}
+	}
+
+	/* refinement is not retried after the time limit either */
+	plot.sub_sy = plot.job_sy;
+	plot.sub_cnt = plot.cancel ? 0 : plot.job_sub_cnt;
+	plot.job_from = 0;
+	plot.job_to = 0;
+
+	pthread_mutex_lock(&plot.lock);
+	plot.state = PLOT_IDLE;
+	pthread_mutex_unlock(&plot.lock);
+}
+
+static uint32_t job_poll(gp_timer *self)
+{
+	if (job_wait(0)) {
+		job_finish();
+		redraw();
+		return 0;
+	}
+
+	if (ms_since(&plot.start) > PLOT_BUDGET_MS && !plot.cancel) {
+		plot.timeout = 1;
+		__atomic_store_n(&plot.cancel, 1, __ATOMIC_RELAXED);
+	}
+
+	redraw();
+
+	return self->period;
+}
+
+static gp_timer job_timer = {
+	.expires = PLOT_POLL_MS,
+	.period = PLOT_POLL_MS,
+	.callback = job_poll,
+	.id = "Plot evaluation",
+};
+
+void plot_stop(void)
+{
+	if (plot.state == PLOT_IDLE)
+		return;
+
+	__atomic_store_n(&plot.cancel, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&plot.lock);
+	while (plot.state == PLOT_RUNNING)
+		pthread_cond_wait(&plot.cond, &plot.lock);
+	pthread_mutex_unlock(&plot.lock);
+
+	gp_widgets_timer_rem(&job_timer);
+	job_finish();
+}
+
+/*
+ * Starts evaluation of edges [from, to) and of the refined samples, the
+ * plot is drawn incompletely only if it does not finish in PLOT_SYNC_MS.
+ */
+static void job_start(size_t from, size_t to)
+{
+	pthread_t tid;
+
+	plot.job_from = from;
+	plot.job_to = to;
+	plot.job_done = 0;
+	plot.job_sub_cnt = 0;
+	plot.job_sy = plot.sy;
+	plot.sub_sy = 0;
+	plot.cancel = 0;
+	plot.timeout = 0;
+	clock_gettime(CLOCK_MONOTONIC, &plot.start);
+
+	if (!plot.worker_running) {
+		if (pthread_create(&tid, NULL, worker, NULL)) {
+			GP_WARN("Failed to start plot worker, evaluating synchronously");
+			plot.worker_running = -1;
+		} else {
+			plot.worker_running = 1;
+		}
+	}
+
+	if (plot.worker_running < 0) {
+		job_run();
+		plot.job_done = to - from;
+		job_finish();
+		return;
+	}
+
+	pthread_mutex_lock(&plot.lock);
+	plot.state = PLOT_RUNNING;
+	pthread_cond_broadcast(&plot.cond);
+	pthread_mutex_unlock(&plot.lock);
+
+	if (job_wait(PLOT_SYNC_MS)) {
+		job_finish();
+		return;
+	}
+
+	gp_widgets_timer_ins(&job_timer);
+}
+
+void plot_set(struct expr *expr, const struct expr_var vars[], unsigned int x,
+              const struct expr_ctx *ctx)
+{
+	plot_stop();
+
+	if (plot.expr)
+		expr_destroy(plot.expr);
+
+	plot.expr = expr;
+	plot.vars = vars;
+	plot.x = x;
+	plot.ctx = *ctx;
+	plot.ctx.cancel = &plot.cancel;
+	plot.edge_cnt = 0;
+
+	for (plot.var_cnt = 0; vars[plot.var_cnt].name; plot.var_cnt++);
+
+	redraw();
+}
+
+/*
+ * Returns non-zero if the edges can be reused shifted by s columns.
+ */
+static int edges_shift(double x0, double dx, size_t cnt, long *s)
+{
+	double shift;
+
+	if (plot.edge_cnt != cnt || plot.edge_dx != dx)
+		return 0;
+
+	shift = (x0 - plot.edge_x0) / dx;
+	*s = lround(shift);
+
+	return fabs(shift - *s) < 1e-6 && labs(*s) < (long)cnt;
+}
+
+/*
+ * Starts evaluation of the values at the column edges, the values that were
+ * evaluated for the same edges already are reused. The refined samples are
+ * evaluated again once the vertical scale changes.
+ */
+static int eval_edges(double x0, double dx, size_t cnt)
+{
+	long s;
+
+	if (edges_shift(x0, dx, cnt, &s) && !s) {
+		if (plot.state == PLOT_IDLE && plot.sub_sy != plot.sy)
+			job_start(0, 0);
+		return 0;
+	}
+
+	/* cancelled evaluation may have dropped the edges */
+	plot_stop();
+
+	if (edges_shift(x0, dx, cnt, &s)) {
+		plot.edge_x0 += s * dx;
+
+		if (s > 0) {
+			memmove(plot.edge, plot.edge + s, (cnt - s) * sizeof(double));
+			job_start(cnt - s, cnt);
+		} else {
+			memmove(plot.edge - s, plot.edge, (cnt + s) * sizeof(double));
+			job_start(0, -s);
+		}
+
+		return 0;
+	}
+
+	if (buf_grow(&plot.edge, &plot.edge_size, cnt))
+		return 1;
+
+	plot.edge_cnt = cnt;
+	plot.edge_x0 = x0;
+	plot.edge_dx = dx;
+
+	job_start(0, cnt);
+
+	return 0;
+}
+
+static int edge_valid(size_t i)
+{
+	if (i < plot.job_from || i >= plot.job_to)
+		return 1;
+
+	return i - plot.job_from < __atomic_load_n(&plot.job_done, __ATOMIC_ACQUIRE);
+}
+
+static double to_py(double y, gp_size h)
+{
+	return h / 2.0 - (y - plot.cy) / plot.sy;
+}
+
+static gp_coord clamp_py(double py, gp_size h)
+{
+	if (py < 0)
+		return 0;
+
+	if (py > h - 1)
+		return h - 1;
+
+	return py;
+}
+
+/*
+ * Draws the curve between two values, a jump over half of the height that
+ * remains after the refinement is a discontinuity.
+ */
+static void segment(gp_pixmap *p, gp_coord x, double a, double b, gp_pixel color)
+{
+	double pa, pb;
+
+	if (!isfinite(a) || !isfinite(b))
+		return;
+
+	pa = to_py(a, p->h);
+	pb = to_py(b, p->h);
+
+	if (fabs(pa - pb) > p->h / 2.0)
+		return;
+
+	if (pa > pb) {
+		double tmp = pa;
+		pa = pb;
+		pb = tmp;
+	}
+
+	if (pb < 0 || pa >= p->h)
+		return;
+
+	gp_vline_xyy(p, x, clamp_py(pa, p->h), clamp_py(pb, p->h), color);
+}
+
+/*
+ * Draws the edges evaluated so far, the refined samples are used once they
+ * are evaluated for the current vertical scale.
+ */
+static void draw_curve(gp_pixmap *p, gp_pixel color)
+{
+	size_t i, j = 0, cnt = plot.sub_sy == plot.sy ? plot.sub_cnt : 0;
+	unsigned int k;
+	double prev;
+
+	for (i = 0; i < p->w; i++) {
+		if (!edge_valid(i) || !edge_valid(i+1))
+			continue;
+
+		prev = plot.edge[i];
+
+		/* the refined samples are missing if allocation failed */
+		if (j < cnt && is_refined(i, plot.sy)) {
+			for (k = 0; k < PLOT_REFINE; k++, j++) {
+				segment(p, i, prev, plot.sub_y[j], color);
+				prev = plot.sub_y[j];
+			}
+		}
+
+		segment(p, i, prev, plot.edge[i+1], color);
+	}
+}
+
+static double grid_step(double scale)
+{
+	return pow(10, ceil(log10(PLOT_GRID_PX * scale)));
+}
+
+static void draw_grid(gp_pixmap *p, const gp_widget_render_ctx *ctx)
+{
+	double x0 = plot.cx - p->w / 2.0 * plot.sx;
+	double y0 = plot.cy - p->h / 2.0 * plot.sy;
+	double step, k;
+	unsigned int n;
+
+	/* k does not change once it's too big, the number of lines is bound */
+	step = grid_step(plot.sx);
+
+	for (n = 0, k = ceil(x0 / step); n <= p->w / PLOT_GRID_PX + 1; n++, k++) {
+		double x = (k * step - x0) / plot.sx;
+
+		if (x >= p->w)
+			break;
+
+		gp_vline_xyy(p, x, 0, p->h - 1, k != 0 ? ctx->bg_color : ctx->text_color);
+	}
+
+	step = grid_step(plot.sy);
+
+	for (n = 0, k = ceil(y0 / step); n <= p->h / PLOT_GRID_PX + 1; n++, k++) {
+		double y = to_py(k * step, p->h);
+
+		if (y < 0)
+			break;
+
+		if (y >= p->h)
+			continue;
+
+		gp_hline_xxy(p, 0, p->w - 1, y, k != 0 ? ctx->bg_color : ctx->text_color);
+	}
+}
+
+static void render(gp_pixmap *p, const gp_widget_render_ctx *ctx)
+{
+	if (!p->w || !p->h)
+		return;
+
+	if (!plot.sx)
+		plot.sx = plot.sy = PLOT_RANGE / p->w;
+
+	plot.h = p->h;
+
+	gp_fill(p, ctx->fg_color);
+	draw_grid(p, ctx);
+
+	if (!plot.expr)
+		return;
+
+	if (eval_edges(plot.cx - p->w / 2.0 * plot.sx, plot.sx, p->w + 1))
+		return;
+
+	draw_curve(p, ctx->alert_color);
+}
+
+static void zoom(double f)
+{
+	plot.sx *= f;
+	plot.sy *= f;
+
+	redraw();
+}
+
+static int input(gp_event *ev)
+{
+	switch (ev->type) {
+	case GP_EV_REL:
+		if (ev->code == GP_EV_REL_WHEEL) {
+			zoom(ev->val > 0 ? 0.5 : 2);
+			return 1;
+		}
+
+		if (ev->code != GP_EV_REL_POS)
+			return 0;
+
+		if (!gp_ev_key_pressed(ev, GP_BTN_LEFT) &&
+		    !gp_ev_key_pressed(ev, GP_BTN_TOUCH))
+			return 0;
+
+		plot.cx -= ev->rel.rx * plot.sx;
+		plot.cy += ev->rel.ry * plot.sy;
+		redraw();
+		return 1;
+	}
+
+	return 0;
+}
+
+int plot_event(gp_widget_event *ev)
+{
+	switch (ev->type) {
+	case GP_WIDGET_EVENT_NEW:
+		plot.widget = ev->self;
+		gp_widget_event_unmask(ev->self, GP_WIDGET_EVENT_REDRAW);
+		gp_widget_event_unmask(ev->self, GP_WIDGET_EVENT_INPUT);
+		return 0;
+	case GP_WIDGET_EVENT_REDRAW:
+		render(ev->self->pixmap->pixmap, ev->ctx);
+		return 1;
+	case GP_WIDGET_EVENT_INPUT:
+		return input(ev->input_ev);
+	}
+
+	return 0;
+}
+
+int plot_zoom_in(gp_widget_event *ev)
+{
+	if (ev->type != GP_WIDGET_EVENT_WIDGET)
+		return 0;
+
+	zoom(0.5);
+	return 0;
+}
+
+int plot_zoom_out(gp_widget_event *ev)
+{
+	if (ev->type != GP_WIDGET_EVENT_WIDGET)
+		return 0;
+
+	zoom(2);
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double*)a, db = *(const double*)b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Scales y so that the values at the column edges fit, the outliers, e.g.
+ * near poles, are cut off.
+ */
+int plot_fit(gp_widget_event *ev)
+{
+	double *vals, lo, hi;
+	size_t i, cnt = 0;
+
+	if (ev->type != GP_WIDGET_EVENT_WIDGET)
+		return 0;
+
+	if (!plot.expr || !plot.edge_cnt || !plot.h)
+		return 0;
+
+	vals = malloc(plot.edge_cnt * sizeof(double));
+	if (!vals)
+		return 0;
+
+	for (i = 0; i < plot.edge_cnt; i++) {
+		if (edge_valid(i) && isfinite(plot.edge[i]))
+			vals[cnt++] = plot.edge[i];
+	}
+
+	if (cnt) {
+		qsort(vals, cnt, sizeof(double), cmp_double);
+
+		lo = vals[(size_t)(cnt * PLOT_FIT_CUT)];
+		hi = vals[cnt - 1 - (size_t)(cnt * PLOT_FIT_CUT)];
+
+		plot.cy = (lo + hi) / 2;
+
+		if (hi > lo)
+			plot.sy = (hi - lo) / (0.9 * plot.h);
+
+		redraw();
+	}
+
+	free(vals);
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+/*
+
+   Copyright (C) 2007-2022 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+ /*
+
+   Plot of an expression in a single variable.
+
+   The plot is drawn into a pixmap widget that calls plot_event(), the view
+   is panned by dragging, zoomed by the wheel and by the plot_zoom_in(),
+   plot_zoom_out() and plot_fit() buttons.
+
+  */
+
+#ifndef PLOT_H__
+#define PLOT_H__
+
+#include "expr.h"
+
+/*
+ * Sets the expression to plot as a function of vars[x] and redraws the plot,
+ * the plot takes over the expression, NULL clears the plot.
+ *
+ * The vars array has to be the one the expression was compiled with.
+ */
+void plot_set(struct expr *expr, const struct expr_var vars[], unsigned int x,
+              const struct expr_ctx *ctx);
+
+/*
+ * Stops the evaluation of the plot, has to be called before the variables
+ * or the functions the expression was compiled with are modified.
+ */
+void plot_stop(void);
+
+#endif /* PLOT_H__ */